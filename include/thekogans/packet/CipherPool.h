@@ -0,0 +1,190 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_CipherPool_h)
+#define __thekogans_packet_CipherPool_h
+
+#include <cstddef>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/crypto/SymmetricKey.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct CipherPool CipherPool.h thekogans/packet/CipherPool.h
+        ///
+        /// \brief
+        /// A \see{crypto::Cipher} holds per operation (OpenSSL) context, so one
+        /// instance can't be used by more than one thread at a time. CipherPool
+        /// keeps a free list of \see{crypto::Cipher} instances that share one
+        /// \see{crypto::SymmetricKey}. Every thread that needs to encrypt or
+        /// decrypt checks one out for the duration of the call (see \see{Lease}),
+        /// so many threads can work under the same key at once. Contexts are
+        /// created on demand, and at most maxIdleCount are kept around between
+        /// uses. Checkout and return are a spin lock protected vector pop/push.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// packet::CipherPool::SharedPtr cipherPool (new packet::CipherPool (key));
+        /// ...
+        /// // On any thread.
+        /// util::Buffer::SharedPtr frame;
+        /// {
+        ///     packet::CipherPool::Lease cipher (*cipherPool);
+        ///     frame = packet->Serialize (*cipher, session);
+        /// }
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL CipherPool : public util::RefCounted {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (CipherPool)
+
+            enum {
+                /// \brief
+                /// Default maximum number of idle contexts kept in the pool.
+                DEFAULT_MAX_IDLE_COUNT = 64
+            };
+
+        private:
+            /// \brief
+            /// Key shared by all contexts.
+            crypto::SymmetricKey::SharedPtr key;
+            /// \brief
+            /// OpenSSL cipher.
+            const EVP_CIPHER *cipher;
+            /// \brief
+            /// OpenSSL message digest.
+            const EVP_MD *md;
+            /// \brief
+            /// Maximum number of idle contexts kept in the pool.
+            const std::size_t maxIdleCount;
+            /// \brief
+            /// Idle contexts.
+            std::vector<crypto::Cipher::SharedPtr> idle;
+            /// \brief
+            /// Number of contexts created so far.
+            std::size_t createdCount;
+            /// \brief
+            /// Synchronization lock.
+            util::SpinLock spinLock;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] key_ Key shared by all contexts.
+            /// \param[in] cipher_ OpenSSL cipher.
+            /// \param[in] md_ OpenSSL message digest.
+            /// \param[in] maxIdleCount_ Maximum number of idle contexts kept in the pool.
+            CipherPool (
+                crypto::SymmetricKey::SharedPtr key_,
+                const EVP_CIPHER *cipher_ = THEKOGANS_CRYPTO_DEFAULT_CIPHER,
+                const EVP_MD *md_ = THEKOGANS_CRYPTO_DEFAULT_MD,
+                std::size_t maxIdleCount_ = DEFAULT_MAX_IDLE_COUNT);
+
+            /// \brief
+            /// Return the key shared by all contexts.
+            /// \return Key shared by all contexts.
+            inline crypto::SymmetricKey::SharedPtr GetKey () const {
+                return key;
+            }
+
+            /// \brief
+            /// Release below would otherwise hide the reference count one
+            /// (used by \see{util::RefCounted::SharedPtr}).
+            using util::RefCounted::Release;
+
+            /// \brief
+            /// Check out a context for exclusive use. Creates one if the pool is empty.
+            /// Prefer \see{Lease}, which returns it automatically.
+            /// \return \see{crypto::Cipher} for exclusive use by the caller.
+            crypto::Cipher::SharedPtr Acquire ();
+            /// \brief
+            /// Return a context checked out with Acquire.
+            /// \param[in] context \see{crypto::Cipher} to return.
+            void Release (crypto::Cipher::SharedPtr context);
+
+            /// \brief
+            /// Return the number of idle contexts.
+            /// \return Number of idle contexts.
+            std::size_t GetIdleCount ();
+            /// \brief
+            /// Return the number of contexts created so far. Approximates
+            /// the peak number of threads using the key at the same time.
+            /// \return Number of contexts created so far.
+            std::size_t GetCreatedCount ();
+
+            /// \struct CipherPool::Lease CipherPool.h thekogans/packet/CipherPool.h
+            ///
+            /// \brief
+            /// Checks a context out in ctor, and returns it in dtor.
+            struct _LIB_THEKOGANS_PACKET_DECL Lease {
+            private:
+                /// \brief
+                /// Pool the context came from.
+                CipherPool &pool;
+                /// \brief
+                /// Leased context.
+                crypto::Cipher::SharedPtr context;
+
+            public:
+                /// \brief
+                /// ctor.
+                /// \param[in] pool_ Pool to lease a context from.
+                explicit Lease (CipherPool &pool_) :
+                    pool (pool_),
+                    context (pool.Acquire ()) {}
+                /// \brief
+                /// dtor.
+                ~Lease () {
+                    pool.Release (context);
+                }
+
+                /// \brief
+                /// Return the leased context.
+                /// \return Leased context.
+                inline crypto::Cipher &operator * () const {
+                    return *context;
+                }
+                /// \brief
+                /// Return the leased context.
+                /// \return Leased context.
+                inline crypto::Cipher *operator -> () const {
+                    return context.Get ();
+                }
+
+                /// \brief
+                /// Lease is neither copy constructable nor assignable.
+                THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (Lease)
+            };
+
+            /// \brief
+            /// CipherPool is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (CipherPool)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_CipherPool_h)
@@ -47,7 +47,7 @@ namespace thekogans {
         struct _LIB_THEKOGANS_PACKET_DECL ClientKeyExchangePacket : public Packet {
             /// \brief
             /// Pull in \see{Packet} dynamic creation machinery.
-            THEKOGANS_UTIL_DECLARE_SERIALIZABLE (ClientKeyExchangePacket)
+            THEKOGANS_PACKET_DECLARE_PACKET (ClientKeyExchangePacket)
 
             /// \brief
             /// \see{CipherSuite} used to generate the \see{KeyExchange::Params}.
@@ -66,7 +66,10 @@ namespace thekogans {
                 crypto::KeyExchange::Params::SharedPtr params_ =
                     crypto::KeyExchange::Params::SharedPtr ()) :
                 cipherSuite (cipherSuite_),
-                params (params_) {}
+                params (params_) {
+                // Key rotation must not wait behind queued data.
+                priority = PRIORITY_CONTROL;
+            }
 
         protected:
             /// \brief
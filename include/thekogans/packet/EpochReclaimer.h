@@ -0,0 +1,106 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_EpochReclaimer_h)
+#define __thekogans_packet_EpochReclaimer_h
+
+#include "thekogans/util/Types.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct EpochReclaimer EpochReclaimer.h thekogans/packet/EpochReclaimer.h
+        ///
+        /// \brief
+        /// EpochReclaimer implements process wide epoch based reclamation (the
+        /// memory management half of RCU). Readers bracket their access to a
+        /// shared, immutable structure with a ReadGuard. Entering a read side
+        /// section costs a thread local lookup, a load of the global epoch and
+        /// a store to the thread's own (cache line sized) slot. There are no
+        /// locks and no shared writes on the read side. Writers publish a new
+        /// version of the structure (an atomic pointer exchange) and Retire the
+        /// old one. Retired objects are deleted once every reader that could
+        /// have seen them has left it's read side section.
+        ///
+        /// Read side sections nest, and must not block for long, as they hold
+        /// up reclamation of everything retired while they are active.
+        ///
+        /// See \see{PacketFilterChain} for an example.
+
+        struct _LIB_THEKOGANS_PACKET_DECL EpochReclaimer {
+            /// \struct EpochReclaimer::Retirable EpochReclaimer.h thekogans/packet/EpochReclaimer.h
+            ///
+            /// \brief
+            /// Base for objects that can be passed to Retire.
+            struct _LIB_THEKOGANS_PACKET_DECL Retirable {
+                /// \brief
+                /// dtor.
+                virtual ~Retirable () {}
+            };
+
+            /// \struct EpochReclaimer::ReadGuard EpochReclaimer.h thekogans/packet/EpochReclaimer.h
+            ///
+            /// \brief
+            /// Enters a read side section in ctor, and leaves it in dtor.
+            struct _LIB_THEKOGANS_PACKET_DECL ReadGuard {
+                /// \brief
+                /// ctor.
+                ReadGuard () {
+                    EnterReadSection ();
+                }
+                /// \brief
+                /// dtor.
+                ~ReadGuard () {
+                    LeaveReadSection ();
+                }
+
+                /// \brief
+                /// ReadGuard is neither copy constructable nor assignable.
+                THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (ReadGuard)
+            };
+
+            /// \brief
+            /// Enter a read side section on the calling thread.
+            static void EnterReadSection ();
+            /// \brief
+            /// Leave a read side section on the calling thread.
+            static void LeaveReadSection ();
+
+            /// \brief
+            /// Hand an object that was unpublished (is no longer reachable by new
+            /// readers) over for deletion. It will be deleted once all current
+            /// readers leave their read side sections. Opportunistically deletes
+            /// previously retired objects whose readers are gone.
+            /// \param[in] retirable Object to delete.
+            static void Retire (Retirable *retirable);
+
+            /// \brief
+            /// Delete all retired objects whose readers are gone.
+            /// \return Number of retired objects still waiting for readers.
+            static std::size_t Reclaim ();
+
+            /// \brief
+            /// Wait for all read side sections active at the time of the call
+            /// to end, and delete everything retired before the call.
+            /// NOTE: Calling this from inside a read side section will deadlock.
+            static void Synchronize ();
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_EpochReclaimer_h)
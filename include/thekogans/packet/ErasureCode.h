@@ -0,0 +1,116 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_ErasureCode_h)
+#define __thekogans_packet_ErasureCode_h
+
+#include <cstddef>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct ErasureCode ErasureCode.h thekogans/packet/ErasureCode.h
+        ///
+        /// \brief
+        /// ErasureCode is a systematic Reed-Solomon erasure code over GF(2^8).
+        /// Given dataShardCount equal length data shards, Encode produces
+        /// parityShardCount parity shards. Any dataShardCount shards (data or
+        /// parity) out of the dataShardCount + parityShardCount total are
+        /// sufficient for Decode to rebuild the missing data shards.
+        ///
+        /// The parity rows are a column normalized Cauchy matrix. Normalization
+        /// makes the first parity row all ones, so the first parity shard is a
+        /// plain XOR of the data shards. This means that the common case of a
+        /// single parity shard per group costs no more than XOR parity would,
+        /// while more parity shards give true Reed-Solomon recovery.
+
+        struct _LIB_THEKOGANS_PACKET_DECL ErasureCode {
+            enum {
+                /// \brief
+                /// Maximum number of (data + parity) shards in a group.
+                MAX_SHARD_COUNT = 256
+            };
+
+        private:
+            /// \brief
+            /// Number of data shards in a group.
+            std::size_t dataShardCount;
+            /// \brief
+            /// Number of parity shards in a group.
+            std::size_t parityShardCount;
+            /// \brief
+            /// parityShardCount x dataShardCount encoding matrix.
+            std::vector<util::ui8> parityMatrix;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] dataShardCount_ Number of data shards in a group.
+            /// \param[in] parityShardCount_ Number of parity shards in a group.
+            ErasureCode (
+                std::size_t dataShardCount_,
+                std::size_t parityShardCount_);
+
+            /// \brief
+            /// Return the number of data shards in a group.
+            /// \return Number of data shards in a group.
+            inline std::size_t GetDataShardCount () const {
+                return dataShardCount;
+            }
+            /// \brief
+            /// Return the number of parity shards in a group.
+            /// \return Number of parity shards in a group.
+            inline std::size_t GetParityShardCount () const {
+                return parityShardCount;
+            }
+
+            /// \brief
+            /// Compute the parity shards for the given data shards.
+            /// \param[in] dataShards dataShardCount data shards.
+            /// \param[out] parityShards parityShardCount parity shards.
+            /// \param[in] shardLength Length of every shard.
+            void Encode (
+                const util::ui8 * const *dataShards,
+                util::ui8 * const *parityShards,
+                std::size_t shardLength) const;
+
+            /// \brief
+            /// Rebuild the missing data shards in place.
+            /// \param[in, out] shards dataShardCount + parityShardCount shards.
+            /// Data shards come first, followed by parity shards. Missing data
+            /// shards must point to shardLength bytes of writable storage.
+            /// \param[in] present For each shard, true == the shard was received.
+            /// \param[in] shardLength Length of every shard.
+            /// \return true == all missing data shards were rebuilt,
+            /// false == fewer than dataShardCount shards are present.
+            bool Decode (
+                util::ui8 * const *shards,
+                const bool *present,
+                std::size_t shardLength) const;
+
+            /// \brief
+            /// ErasureCode is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (ErasureCode)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_ErasureCode_h)
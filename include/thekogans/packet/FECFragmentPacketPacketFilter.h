@@ -0,0 +1,111 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_FECFragmentPacketPacketFilter_h)
+#define __thekogans_packet_FECFragmentPacketPacketFilter_h
+
+#include "thekogans/util/Types.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/PaddingPolicy.h"
+
+namespace thekogans {
+    namespace packet {
+
+        struct Tunnel;
+
+        /// \struct FECFragmentPacketPacketFilter FECFragmentPacketPacketFilter.h
+        /// thekogans/packet/FECFragmentPacketPacketFilter.h
+        ///
+        /// \brief
+        /// FECFragmentPacketPacketFilter is a forward error correcting alternative to
+        /// \see{FragmentPacketPacketFilter}. It fragments a single big packet in to multiple
+        /// \see{FECPacketFragmentPacket} data shards, and follows every group of groupSize
+        /// data shards with parityShardCount parity shards. The peer's
+        /// \see{FECReassemblePacketFragmentsPacketFilter} can then rebuild up to
+        /// parityShardCount lost shards per group without a retransmit round trip.
+        /// Insert it in to your \see{Tunnel} outgoing filter chain on lossy (UDP) links.
+        /// With the default group size of 8 and 1 parity shard the overhead is 12.5%.
+
+        struct _LIB_THEKOGANS_PACKET_DECL FECFragmentPacketPacketFilter : public PacketFilter {
+            enum {
+                /// \brief
+                /// Default number of data shards in a group.
+                DEFAULT_GROUP_SIZE = 8,
+                /// \brief
+                /// Default number of parity shards following each group.
+                DEFAULT_PARITY_SHARD_COUNT = 1
+            };
+
+        private:
+            /// \brief
+            /// \see{Tunnel} to which this filter belongs.
+            Tunnel &tunnel;
+            /// \brief
+            /// Maximum fragment size.
+            std::size_t maxCiphertextLength;
+            /// \brief
+            /// Number of data shards in a group.
+            std::size_t groupSize;
+            /// \brief
+            /// Number of parity shards following each group.
+            std::size_t parityShardCount;
+            /// \brief
+            /// Id of the next fragmented packet.
+            util::ui32 nextPacketId;
+            /// \brief
+            /// \see{PaddingPolicy} the \see{Tunnel} serializes packets with
+            /// (null == PaddingPolicy::GetDefault ()).
+            PaddingPolicy::SharedPtr paddingPolicy;
+            /// \brief
+            /// true == the \see{Tunnel} serializes packets with a \see{Session}.
+            bool session;
+            /// \brief
+            /// Length of every shard.
+            std::size_t shardLength;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] tunnel_ \see{Tunnel} to which this filter belongs.
+            /// \param[in] maxCiphertextLength_ Maximum fragment size.
+            /// \param[in] groupSize_ Number of data shards in a group.
+            /// \param[in] parityShardCount_ Number of parity shards following each group.
+            /// \param[in] paddingPolicy_ \see{PaddingPolicy} the \see{Tunnel} serializes
+            /// packets with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] session_ true == the \see{Tunnel} serializes packets with a \see{Session}.
+            FECFragmentPacketPacketFilter (
+                Tunnel &tunnel_,
+                std::size_t maxCiphertextLength_,
+                std::size_t groupSize_ = DEFAULT_GROUP_SIZE,
+                std::size_t parityShardCount_ = DEFAULT_PARITY_SHARD_COUNT,
+                PaddingPolicy::SharedPtr paddingPolicy_ = PaddingPolicy::SharedPtr (),
+                bool session_ = true);
+
+            /// \brief
+            /// Called by \see{Tunnel}::SendPacket to fragment a large packet in to multiple
+            /// \see{FECPacketFragmentPacket} data and parity shards.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return If the given packet is too big, fragment it in to multiple
+            /// \see{FECPacketFragmentPacket} packets, otherwise call CallNextPacketFilter.
+            virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet) override;
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_FECFragmentPacketPacketFilter_h)
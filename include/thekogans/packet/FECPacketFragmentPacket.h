@@ -0,0 +1,207 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_FECPacketFragmentPacket_h)
+#define __thekogans_packet_FECPacketFragmentPacket_h
+
+#include <algorithm>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/SizeT.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Serializer.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct FECPacketFragmentPacket FECPacketFragmentPacket.h thekogans/packet/FECPacketFragmentPacket.h
+        ///
+        /// \brief
+        /// FECPacketFragmentPacket packets carry one shard of a \see{Packet} that was
+        /// fragmented by \see{FECFragmentPacketPacketFilter}. The serialized packet is cut
+        /// in to dataShardCount equal length data shards. Data shards are grouped in to
+        /// groups of (at most) groupSize shards, and every group is followed by
+        /// parityShardCount parity shards (see \see{ErasureCode}). The receiver
+        /// (\see{FECReassemblePacketFragmentsPacketFilter}) can rebuild up to
+        /// parityShardCount lost shards per group without a retransmit.
+
+        struct _LIB_THEKOGANS_PACKET_DECL FECPacketFragmentPacket : public Packet {
+            /// \brief
+            /// Pull in Packet dynamic creation machinery.
+            THEKOGANS_PACKET_DECLARE_PACKET (FECPacketFragmentPacket)
+
+            /// \brief
+            /// Id of the fragmented \see{Packet}. Ties all shards together.
+            util::ui32 packetId;
+            /// \brief
+            /// Serialized length of the fragmented \see{Packet}.
+            util::SizeT packetLength;
+            /// \brief
+            /// Total number of data shards.
+            util::SizeT dataShardCount;
+            /// \brief
+            /// Maximum number of data shards in a group.
+            util::SizeT groupSize;
+            /// \brief
+            /// Number of parity shards following each group.
+            util::SizeT parityShardCount;
+            /// \brief
+            /// Group this shard belongs to.
+            util::SizeT groupNumber;
+            /// \brief
+            /// Shard index within the group. Indices >= group data shard
+            /// count are parity shards.
+            util::SizeT shardIndex;
+            /// \brief
+            /// Shard contents.
+            util::Buffer::SharedPtr shard;
+
+            /// \brief
+            /// ctor.
+            /// \param[in] packetId_ Id of the fragmented \see{Packet}.
+            /// \param[in] packetLength_ Serialized length of the fragmented \see{Packet}.
+            /// \param[in] dataShardCount_ Total number of data shards.
+            /// \param[in] groupSize_ Maximum number of data shards in a group.
+            /// \param[in] parityShardCount_ Number of parity shards following each group.
+            /// \param[in] groupNumber_ Group this shard belongs to.
+            /// \param[in] shardIndex_ Shard index within the group.
+            /// \param[in] shard_ Shard contents.
+            FECPacketFragmentPacket (
+                util::ui32 packetId_ = 0,
+                std::size_t packetLength_ = 0,
+                std::size_t dataShardCount_ = 0,
+                std::size_t groupSize_ = 0,
+                std::size_t parityShardCount_ = 0,
+                std::size_t groupNumber_ = 0,
+                std::size_t shardIndex_ = 0,
+                util::Buffer::SharedPtr shard_ = util::Buffer::SharedPtr ()) :
+                packetId (packetId_),
+                packetLength (packetLength_),
+                dataShardCount (dataShardCount_),
+                groupSize (groupSize_),
+                parityShardCount (parityShardCount_),
+                groupNumber (groupNumber_),
+                shardIndex (shardIndex_),
+                shard (shard_) {}
+
+            /// \brief
+            /// Return the maximum number of bytes (not counting the shard
+            /// contents) that a serialized FECPacketFragmentPacket needs.
+            /// Used by \see{FECFragmentPacketPacketFilter} to size shards.
+            /// \return Maximum serialized size of the FECPacketFragmentPacket fields.
+            static std::size_t GetMaxFieldsSize ();
+
+            /// \brief
+            /// Return the number of data shards in the given group.
+            /// \param[in] groupNumber Group number.
+            /// \return Number of data shards in the given group.
+            inline std::size_t GetGroupDataShardCount (std::size_t groupNumber) const {
+                std::size_t first = groupNumber * groupSize;
+                return first < dataShardCount ?
+                    std::min<std::size_t> (groupSize, dataShardCount - first) : 0;
+            }
+
+            /// \brief
+            /// Return the number of groups.
+            /// \return Number of groups.
+            inline std::size_t GetGroupCount () const {
+                return groupSize > 0 ? (dataShardCount + groupSize - 1) / groupSize : 0;
+            }
+
+        protected:
+            /// \brief
+            /// Return serialized packet size.
+            /// \return Serialized packet size.
+            virtual std::size_t Size () const override {
+                return
+                    util::Serializer::Size (packetId) +
+                    util::Serializer::Size (packetLength) +
+                    util::Serializer::Size (dataShardCount) +
+                    util::Serializer::Size (groupSize) +
+                    util::Serializer::Size (parityShardCount) +
+                    util::Serializer::Size (groupNumber) +
+                    util::Serializer::Size (shardIndex) +
+                    util::Serializer::Size (*shard);
+            }
+
+            /// \brief
+            /// De-serialize the packet.
+            /// \param[in] header Packet header.
+            /// \param[in] serializer Packet contents.
+            virtual void Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) override;
+            /// \brief
+            /// Serialize the packet.
+            /// \param[out] serializer Packet contents.
+            virtual void Write (util::Serializer &serializer) const override;
+
+            /// \brief
+            /// "PacketId"
+            static const char * const ATTR_PACKET_ID;
+            /// \brief
+            /// "PacketLength"
+            static const char * const ATTR_PACKET_LENGTH;
+            /// \brief
+            /// "DataShardCount"
+            static const char * const ATTR_DATA_SHARD_COUNT;
+            /// \brief
+            /// "GroupSize"
+            static const char * const ATTR_GROUP_SIZE;
+            /// \brief
+            /// "ParityShardCount"
+            static const char * const ATTR_PARITY_SHARD_COUNT;
+            /// \brief
+            /// "GroupNumber"
+            static const char * const ATTR_GROUP_NUMBER;
+            /// \brief
+            /// "ShardIndex"
+            static const char * const ATTR_SHARD_INDEX;
+
+            /// \brief
+            /// Read a Serializable from an XML DOM.
+            /// \param[in] node XML DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) override;
+            /// \brief
+            /// Write a Serializable to the XML DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (pugi::xml_node &node) const override;
+
+            /// \brief
+            /// Read a Serializable from an JSON DOM.
+            /// \param[in] node JSON DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object &object) override;
+            /// \brief
+            /// Write a Serializable to the JSON DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (util::JSON::Object &object) const override;
+
+            /// \brief
+            /// FECPacketFragmentPacket is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (FECPacketFragmentPacket)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_FECPacketFragmentPacket_h)
@@ -0,0 +1,188 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_FECReassemblePacketFragmentsPacketFilter_h)
+#define __thekogans_packet_FECReassemblePacketFragmentsPacketFilter_h
+
+#include <vector>
+#include <list>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/ByteSwap.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/FECPacketFragmentPacket.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct FECReassemblePacketFragmentsPacketFilter FECReassemblePacketFragmentsPacketFilter.h
+        /// thekogans/packet/FECReassemblePacketFragmentsPacketFilter.h
+        ///
+        /// \brief
+        /// FECReassemblePacketFragmentsPacketFilter is a \see{FECPacketFragmentPacket} reassembly
+        /// filter. Insert it in to your \see{Tunnel} incoming filter chain if the peer uses
+        /// \see{FECFragmentPacketPacketFilter}. Unlike \see{ReassemblePacketFragmentsPacketFilter},
+        /// shards can arrive out of order, and up to parityShardCount lost shards per group
+        /// are rebuilt from parity. Shards from several packets can be in flight at the same
+        /// time. If more than maxPendingPackets packets are incomplete, the oldest is dropped.
+        /// The shard parameters come from the peer, so shards shorter than minShardLength,
+        /// and packets whose data and parity shards add up to more than twice
+        /// maxPacketLength, are dropped before any reassembly state is allocated.
+
+        struct _LIB_THEKOGANS_PACKET_DECL FECReassemblePacketFragmentsPacketFilter : public PacketFilter {
+            enum {
+                /// \brief
+                /// Default maximum number of incomplete packets.
+                DEFAULT_MAX_PENDING_PACKETS = 16,
+                /// \brief
+                /// Default maximum reassembled packet length.
+                DEFAULT_MAX_PACKET_LENGTH = 64 * 1024 * 1024,
+                /// \brief
+                /// Default minimum shard length.
+                DEFAULT_MIN_SHARD_LENGTH = 256
+            };
+
+        private:
+            /// \brief
+            /// Maximum number of incomplete packets.
+            std::size_t maxPendingPackets;
+            /// \brief
+            /// Maximum reassembled packet length. Protects
+            /// us from malicious actors.
+            std::size_t maxPacketLength;
+            /// \brief
+            /// Minimum shard length (the last shard of a packet is
+            /// zero padded to full length, so all of them qualify).
+            std::size_t minShardLength;
+            /// \brief
+            /// Packet frame endianness.
+            util::Endianness endianness;
+            /// \struct FECReassemblePacketFragmentsPacketFilter::PendingPacket
+            /// FECReassemblePacketFragmentsPacketFilter.h
+            /// thekogans/packet/FECReassemblePacketFragmentsPacketFilter.h
+            ///
+            /// \brief
+            /// Reassembly state of an incomplete packet.
+            struct PendingPacket {
+                /// \brief
+                /// Id of the fragmented \see{Packet}.
+                util::ui32 packetId;
+                /// \brief
+                /// Serialized length of the fragmented \see{Packet}.
+                std::size_t packetLength;
+                /// \brief
+                /// Total number of data shards.
+                std::size_t dataShardCount;
+                /// \brief
+                /// Maximum number of data shards in a group.
+                std::size_t groupSize;
+                /// \brief
+                /// Number of parity shards following each group.
+                std::size_t parityShardCount;
+                /// \brief
+                /// Length of every shard.
+                std::size_t shardLength;
+                /// \brief
+                /// Received shards, (groupSize + parityShardCount) per group.
+                std::vector<util::Buffer::SharedPtr> shards;
+                /// \brief
+                /// Number of shards received per group.
+                std::vector<std::size_t> receivedShardCounts;
+                /// \brief
+                /// Number of groups whose data shards are all present.
+                std::size_t completeGroupCount;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] shard First \see{FECPacketFragmentPacket} received.
+                explicit PendingPacket (const FECPacketFragmentPacket &shard);
+
+                /// \brief
+                /// Return true if the given shard belongs to this packet and has
+                /// parameters consistent with the ones already received.
+                /// \param[in] shard \see{FECPacketFragmentPacket} to check.
+                /// \return true == shard is consistent with this packet.
+                bool IsConsistent (const FECPacketFragmentPacket &shard) const;
+                /// \brief
+                /// Add a shard. If its group can now be completed, rebuild
+                /// the missing data shards.
+                /// \param[in] shard \see{FECPacketFragmentPacket} to add.
+                void AddShard (const FECPacketFragmentPacket &shard);
+                /// \brief
+                /// Return true if all data shards are present.
+                /// \return true if all data shards are present.
+                inline bool IsComplete () const {
+                    return completeGroupCount == receivedShardCounts.size ();
+                }
+                /// \brief
+                /// Concatenate the data shards and extract the packet.
+                /// \param[in] endianness Packet frame endianness.
+                /// \return Reassembled \see{Packet}.
+                Packet::SharedPtr Reassemble (util::Endianness endianness) const;
+            };
+            /// \brief
+            /// Incomplete packets, oldest first.
+            std::list<PendingPacket> pendingPackets;
+            /// \brief
+            /// Ids of recently reassembled packets. Used to drop
+            /// the redundant shards that arrive after the packet
+            /// was already rebuilt.
+            std::list<util::ui32> completedPacketIds;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] maxPendingPackets_ Maximum number of incomplete packets.
+            /// \param[in] maxPacketLength_ Maximum reassembled packet length.
+            /// \param[in] minShardLength_ Minimum shard length. Must not exceed
+            /// the shard length of the peer's \see{FECFragmentPacketPacketFilter}.
+            /// \param[in] endianness_ Packet frame endianness.
+            FECReassemblePacketFragmentsPacketFilter (
+                std::size_t maxPendingPackets_ = DEFAULT_MAX_PENDING_PACKETS,
+                std::size_t maxPacketLength_ = DEFAULT_MAX_PACKET_LENGTH,
+                std::size_t minShardLength_ = DEFAULT_MIN_SHARD_LENGTH,
+                util::Endianness endianness_ = util::NetworkEndian) :
+                maxPendingPackets (maxPendingPackets_),
+                maxPacketLength (maxPacketLength_),
+                minShardLength (minShardLength_ > 0 ? minShardLength_ : 1),
+                endianness (endianness_) {}
+
+            /// \brief
+            /// Called by \see{Tunnel}::HandlePacket to reassemble \see{FECPacketFragmentPacket}.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return If the given packet is \see{FECPacketFragmentPacket}, reassemble
+            /// (and possibly return) the packet it contains, otherwise call CallNextPacketFilter.
+            virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet) override;
+
+        private:
+            /// \brief
+            /// Return true if the given shard parameters are sane.
+            /// \param[in] shard \see{FECPacketFragmentPacket} to validate.
+            /// \return true == shard parameters are sane.
+            bool IsValid (const FECPacketFragmentPacket &shard) const;
+            /// \brief
+            /// Return true if the given packet id was recently reassembled.
+            /// \param[in] packetId Packet id to check.
+            /// \return true == the given packet id was recently reassembled.
+            bool IsCompleted (util::ui32 packetId) const;
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_FECReassemblePacketFragmentsPacketFilter_h)
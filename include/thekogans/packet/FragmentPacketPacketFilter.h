@@ -18,8 +18,14 @@
 #if !defined (__thekogans_packet_FragmentPacketPacketFilter_h)
 #define __thekogans_packet_FragmentPacketPacketFilter_h
 
+#include <map>
+#include <deque>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Mutex.h"
 #include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
 #include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/PaddingPolicy.h"
 
 namespace thekogans {
     namespace packet {
@@ -33,6 +39,17 @@ namespace thekogans {
         /// FragmentPacketPacketFilter is used to fragment a single big packet in to multiple
         /// \see{PacketFragmentPacket} packets. Insert it in to your \see{Tunnel} outgoing
         /// filter chain if you constrain wire frame sizes.
+        ///
+        /// Fragments are not handed to the tunnel all at once. They wait in per stream
+        /// (see \see{Packet::streamId}) queues, and are released in weighted round robin
+        /// order (weight fragments per stream per turn, see SetStreamWeight) for as long
+        /// as the transport takes them without backpressure. Once it pushes back, the rest
+        /// wait for \see{Tunnel::HandleBackpressure} (..., false). This bounds the amount
+        /// of bulk data queued in the transport, so packets on other streams (which
+        /// bypass the queues) don't wait behind all the fragments of a big packet. Small
+        /// packets on a stream with queued fragments are queued (as a single fragment)
+        /// behind them to preserve the stream's order. The exception is small
+        /// \see{Packet::PRIORITY_CONTROL} packets, which always bypass the queues.
 
         struct _LIB_THEKOGANS_PACKET_DECL FragmentPacketPacketFilter : public PacketFilter {
         private:
@@ -42,17 +59,76 @@ namespace thekogans {
             /// \brief
             /// Maximum fragment size.
             std::size_t maxCiphertextLength;
+            /// \brief
+            /// \see{PaddingPolicy} the \see{Tunnel} serializes packets with
+            /// (null == PaddingPolicy::GetDefault ()).
+            PaddingPolicy::SharedPtr paddingPolicy;
+            /// \brief
+            /// true == the \see{Tunnel} serializes packets with a \see{Session}.
+            bool session;
+            /// \brief
+            /// Convenient typedef for std::map<util::ui32, std::deque<Packet::SharedPtr>>.
+            typedef std::map<util::ui32, std::deque<Packet::SharedPtr>> PendingFragmentsMap;
+            /// \brief
+            /// Fragments waiting to be released, per stream.
+            PendingFragmentsMap pendingFragments;
+            /// \brief
+            /// Round robin order of the streams in pendingFragments.
+            std::deque<util::ui32> schedule;
+            /// \brief
+            /// Fragments released per turn, per stream (missing == 1).
+            std::map<util::ui32, std::size_t> streamWeights;
+            /// \brief
+            /// Fragments released so far in the current stream's turn.
+            std::size_t turnCount;
+            /// \brief
+            /// true == the transport pushed back, wait for HandleBackpressure (false).
+            bool backpressure;
+            /// \brief
+            /// true == a thread is releasing fragments. Only one thread
+            /// at a time does, to keep every stream's fragments in order.
+            bool releasing;
+            /// \brief
+            /// Synchronizes the above. Never held while calling
+            /// \see{Tunnel::SendPacket}, as it can call us back
+            /// (ex: a key rotation sending it's key exchange).
+            util::Mutex mutex;
 
         public:
             /// \brief
             /// ctor.
             /// \param[in] tunnel_ \see{Tunnel} to which this filter belongs.
             /// \param[in] maxCiphertextLength_ Maximum fragment size.
+            /// \param[in] paddingPolicy_ \see{PaddingPolicy} the \see{Tunnel} serializes
+            /// packets with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] session_ true == the \see{Tunnel} serializes packets with a \see{Session}.
             FragmentPacketPacketFilter (
                 Tunnel &tunnel_,
-                std::size_t maxCiphertextLength_) :
+                std::size_t maxCiphertextLength_,
+                PaddingPolicy::SharedPtr paddingPolicy_ = PaddingPolicy::SharedPtr (),
+                bool session_ = true) :
                 tunnel (tunnel_),
-                maxCiphertextLength (maxCiphertextLength_) {}
+                maxCiphertextLength (maxCiphertextLength_),
+                paddingPolicy (paddingPolicy_),
+                session (session_),
+                turnCount (0),
+                backpressure (false),
+                releasing (false) {}
+
+            /// \brief
+            /// Set the number of fragments released per round robin turn
+            /// for the given stream. Give bulk streams a weight of 1, and
+            /// streams that should get more of the bandwidth a higher one.
+            /// \param[in] streamId Stream whose weight to set.
+            /// \param[in] weight Fragments per turn (> 0).
+            void SetStreamWeight (
+                util::ui32 streamId,
+                std::size_t weight);
+
+            /// \brief
+            /// Return the number of fragments waiting to be released.
+            /// \return Number of fragments waiting to be released.
+            std::size_t GetPendingFragmentCount ();
 
             /// \brief
             /// Called by \see{Tunnel}::SendPacket to fragment a large packet in to multiple
@@ -61,6 +137,31 @@ namespace thekogans {
             /// \return If the given packet is too big, fragment it in to multiple
             /// \see{PacketFragmentPacket} packets, otherwise call CallNextPacketFilter.
             virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet) override;
+
+            /// \brief
+            /// Release the waiting fragments when the backpressure is off.
+            /// \param[in] on true == backpressure on, false == off.
+            virtual void HandleBackpressure (bool on) override;
+
+        private:
+            /// \brief
+            /// Cut the given packet in to \see{PacketFragmentPacket}s.
+            /// \param[in] packet \see{Packet} to fragment.
+            /// \param[in] packetSize Serialized size of packet.
+            /// \param[out] fragments Where to put the fragments.
+            void FragmentPacket (
+                const Packet &packet,
+                std::size_t packetSize,
+                std::deque<Packet::SharedPtr> &fragments) const;
+            /// \brief
+            /// Return the next fragment due in weighted round robin order.
+            /// Must be called with the mutex held.
+            /// \return Next fragment (null == none, or the transport pushed back).
+            Packet::SharedPtr GetNextFragment ();
+            /// \brief
+            /// Release waiting fragments, in weighted round robin
+            /// order, until they run out or the transport pushes back.
+            void ReleaseFragments ();
         };
 
     } // namespace packet
@@ -0,0 +1,228 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_HandshakeExecutor_h)
+#define __thekogans_packet_HandshakeExecutor_h
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Thread.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/util/Condition.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/PacketDispatcher.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct HandshakeExecutor HandshakeExecutor.h thekogans/packet/HandshakeExecutor.h
+        ///
+        /// \brief
+        /// HandshakeExecutor moves key exchange processing (\see{ClientKeyExchangePacket},
+        /// \see{ServerKeyExchangePacket}) off the threads that parse and dispatch packets.
+        /// A fixed number of low priority worker threads drain a bounded queue. When the
+        /// queue is full, new handshakes are shed (dropped and counted) instead of
+        /// queued, so that a connection storm costs established tunnels no more than
+        /// workerCount threads worth of CPU. A shed handshake looks like a lost packet
+        /// to the peer, which will retry.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// packet::HandshakeExecutor handshakeExecutor (2, 128);
+        /// dispatcher.RegisterHandler<packet::ClientKeyExchangePacket> (
+        ///     handshakeExecutor.CreateHandler (
+        ///         packet::PacketDispatcher::Handler::SharedPtr (
+        ///             new packet::PacketDispatcher::MemberHandler<
+        ///                 packet::ClientKeyExchangePacket, Server> (
+        ///                     server, &Server::HandleClientKeyExchangePacket))));
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL HandshakeExecutor {
+            enum {
+                /// \brief
+                /// Default number of worker threads.
+                DEFAULT_WORKER_COUNT = 1,
+                /// \brief
+                /// Default maximum number of queued handshakes.
+                DEFAULT_MAX_QUEUE_LENGTH = 256
+            };
+
+            /// \struct HandshakeExecutor::Stats HandshakeExecutor.h thekogans/packet/HandshakeExecutor.h
+            ///
+            /// \brief
+            /// Executor statistics. Kept separate from the data path.
+            struct Stats {
+                /// \brief
+                /// Number of handshakes accepted in to the queue.
+                util::ui64 accepted;
+                /// \brief
+                /// Number of handshakes shed because the queue was full
+                /// (or the executor was stopped).
+                util::ui64 shed;
+                /// \brief
+                /// Number of handshakes processed.
+                util::ui64 completed;
+                /// \brief
+                /// Number of handshakes whose handler threw.
+                util::ui64 failed;
+                /// \brief
+                /// Current queue length.
+                std::size_t queueLength;
+                /// \brief
+                /// Longest the queue has been.
+                std::size_t maxQueueLength;
+                /// \brief
+                /// Total nanoseconds processed handshakes spent waiting in the queue.
+                util::ui64 waitTime;
+                /// \brief
+                /// Total nanoseconds spent in handlers.
+                util::ui64 runTime;
+
+                /// \brief
+                /// ctor.
+                Stats () :
+                    accepted (0),
+                    shed (0),
+                    completed (0),
+                    failed (0),
+                    queueLength (0),
+                    maxQueueLength (0),
+                    waitTime (0),
+                    runTime (0) {}
+            };
+
+        private:
+            /// \struct HandshakeExecutor::Job HandshakeExecutor.h thekogans/packet/HandshakeExecutor.h
+            ///
+            /// \brief
+            /// A queued handshake.
+            struct Job {
+                /// \brief
+                /// Handler to call.
+                PacketDispatcher::Handler::SharedPtr handler;
+                /// \brief
+                /// Key exchange \see{Packet}.
+                Packet::SharedPtr packet;
+                /// \brief
+                /// \see{crypto::Cipher} that was used to decrypt the packet.
+                crypto::Cipher::SharedPtr cipher;
+                /// \brief
+                /// When the job was queued (steady clock nanoseconds).
+                util::ui64 queueTime;
+            };
+            /// \struct HandshakeExecutor::Worker HandshakeExecutor.h thekogans/packet/HandshakeExecutor.h
+            ///
+            /// \brief
+            /// Worker thread.
+            struct Worker : public util::Thread {
+                /// \brief
+                /// Executor this worker belongs to.
+                HandshakeExecutor &executor;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] executor_ Executor this worker belongs to.
+                explicit Worker (HandshakeExecutor &executor_) :
+                    util::Thread ("HandshakeExecutor"),
+                    executor (executor_) {}
+
+                // util::Thread
+                /// \brief
+                /// Drain the executor queue.
+                virtual void Run () throw () override;
+            };
+            /// \brief
+            /// Maximum number of queued handshakes.
+            const std::size_t maxQueueLength;
+            /// \brief
+            /// Queued handshakes.
+            std::deque<Job> jobs;
+            /// \brief
+            /// Worker threads.
+            std::vector<Worker *> workers;
+            /// \brief
+            /// true == the workers should exit.
+            bool done;
+            /// \brief
+            /// Statistics.
+            Stats stats;
+            /// \brief
+            /// Synchronization mutex.
+            util::Mutex mutex;
+            /// \brief
+            /// Signaled when a job is queued or the executor is stopped.
+            util::Condition condition;
+
+        public:
+            /// \brief
+            /// ctor. Start the worker threads.
+            /// \param[in] workerCount Number of worker threads.
+            /// \param[in] maxQueueLength_ Maximum number of queued handshakes.
+            /// \param[in] priority Worker thread priority.
+            HandshakeExecutor (
+                std::size_t workerCount = DEFAULT_WORKER_COUNT,
+                std::size_t maxQueueLength_ = DEFAULT_MAX_QUEUE_LENGTH,
+                util::i32 priority = THEKOGANS_UTIL_LOW_THREAD_PRIORITY);
+            /// \brief
+            /// dtor. Stop the worker threads.
+            ~HandshakeExecutor ();
+
+            /// \brief
+            /// Queue a handshake for processing. Never blocks.
+            /// \param[in] handler Handler to call on a worker thread.
+            /// \param[in] packet Key exchange \see{Packet}.
+            /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt the packet.
+            /// \return true == queued, false == shed (queue full or executor stopped).
+            bool Enqueue (
+                PacketDispatcher::Handler::SharedPtr handler,
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher);
+
+            /// \brief
+            /// Wrap the given handler so that \see{PacketDispatcher} queues the
+            /// packets it's registered for on this executor instead of calling
+            /// it inline. Shed packets are silently dropped.
+            /// \param[in] handler Handler to wrap.
+            /// \return Wrapping handler to register with \see{PacketDispatcher}.
+            PacketDispatcher::Handler::SharedPtr CreateHandler (
+                PacketDispatcher::Handler::SharedPtr handler);
+
+            /// \brief
+            /// Return the executor statistics.
+            /// \return Executor statistics.
+            Stats GetStats ();
+
+            /// \brief
+            /// Stop and join the worker threads. Queued handshakes are
+            /// discarded (counted as shed).
+            void Stop ();
+
+            /// \brief
+            /// HandshakeExecutor is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (HandshakeExecutor)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_HandshakeExecutor_h)
@@ -0,0 +1,249 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_IOURing_h)
+#define __thekogans_packet_IOURing_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <atomic>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct IOURing IOURing.h thekogans/packet/IOURing.h
+        ///
+        /// \brief
+        /// IOURing is a minimal io_uring instance (talking to the kernel through
+        /// the raw system calls, no liburing needed) and the completion loop
+        /// driving any number of io_uring transports (see \see{IOURingTunnel}).
+        /// It's the io_uring counterpart of \see{TunnelEventLoop}.
+        ///
+        /// Any thread can queue submissions (Enqueue) and push them to the kernel
+        /// (Submit). Queued submissions are also pushed by every Poll, so a handler
+        /// queueing many operations from inside HandleCompletion pays for one
+        /// system call for all of them. One thread runs the loop (Run or Poll),
+        /// and completions are dispatched on it. Stop can be called from any thread.
+        ///
+        /// NOTE: A handler must stay alive until all it's operations have
+        /// completed (see \see{IOURingTunnel::Close}).
+        ///
+        /// Linux only. Requires kernel 5.11 or newer (5.19 or newer for
+        /// provided buffer rings).
+
+        struct _LIB_THEKOGANS_PACKET_DECL IOURing {
+            /// \struct IOURing::Handler IOURing.h thekogans/packet/IOURing.h
+            ///
+            /// \brief
+            /// Inherit from this class to receive completions.
+            struct _LIB_THEKOGANS_PACKET_DECL Handler {
+                /// \brief
+                /// dtor.
+                virtual ~Handler () {}
+
+                /// \brief
+                /// Called when an operation queued by this handler completes.
+                /// \param[in] op Handler defined operation tag passed to Enqueue.
+                /// \param[in] result Operation result (-errno on failure).
+                /// \param[in] flags IORING_CQE_F_* flags.
+                virtual void HandleCompletion (
+                    util::ui32 op,
+                    util::i32 result,
+                    util::ui32 flags) throw () = 0;
+            };
+
+            enum {
+                /// \brief
+                /// Default submission queue length.
+                DEFAULT_ENTRY_COUNT = 256,
+                /// \brief
+                /// Completion queue length is this many times the submission
+                /// queue length (multishot operations complete many times).
+                COMPLETION_QUEUE_FACTOR = 4,
+                /// \brief
+                /// Operation tags are packed in to the low bits of the
+                /// handler pointer and must be less than this.
+                MAX_OP = 8
+            };
+
+        private:
+            /// \brief
+            /// io_uring instance.
+            THEKOGANS_UTIL_HANDLE handle;
+            /// \brief
+            /// Mapped submission queue ring.
+            void *sqRing;
+            /// \brief
+            /// sqRing length.
+            std::size_t sqRingLength;
+            /// \brief
+            /// Mapped completion queue ring (== sqRing if the
+            /// kernel maps them together).
+            void *cqRing;
+            /// \brief
+            /// cqRing length.
+            std::size_t cqRingLength;
+            /// \brief
+            /// Mapped submission queue entries.
+            io_uring_sqe *sqes;
+            /// \brief
+            /// sqes length.
+            std::size_t sqesLength;
+            /// \brief
+            /// Submission queue head (advanced by the kernel).
+            util::ui32 *sqHead;
+            /// \brief
+            /// Submission queue tail (advanced by us).
+            util::ui32 *sqTail;
+            /// \brief
+            /// Submission queue index mask.
+            util::ui32 sqMask;
+            /// \brief
+            /// Submission queue length.
+            util::ui32 sqEntryCount;
+            /// \brief
+            /// Submission queue index array.
+            util::ui32 *sqArray;
+            /// \brief
+            /// Completion queue head (advanced by us).
+            util::ui32 *cqHead;
+            /// \brief
+            /// Completion queue tail (advanced by the kernel).
+            util::ui32 *cqTail;
+            /// \brief
+            /// Completion queue index mask.
+            util::ui32 cqMask;
+            /// \brief
+            /// Completion queue entries.
+            io_uring_cqe *cqes;
+            /// \brief
+            /// eventfd used to wake the loop up in Stop.
+            THEKOGANS_UTIL_HANDLE eventHandle;
+            /// \brief
+            /// eventfd read target.
+            util::ui64 eventValue;
+            /// \brief
+            /// true == Run should return.
+            std::atomic<bool> done;
+            /// \brief
+            /// Next provided buffer group id.
+            std::atomic<util::ui32> nextBufferGroupId;
+            /// \brief
+            /// Serializes submission queue producers.
+            util::Mutex submitMutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] entryCount Submission queue length.
+            explicit IOURing (std::size_t entryCount = DEFAULT_ENTRY_COUNT);
+            /// \brief
+            /// dtor.
+            ~IOURing ();
+
+            /// \brief
+            /// Return the io_uring instance.
+            /// \return io_uring instance.
+            inline THEKOGANS_UTIL_HANDLE GetHandle () const {
+                return handle;
+            }
+
+            /// \brief
+            /// Queue a submission. If the submission queue is full, the queued
+            /// submissions are pushed to the kernel first. Thread safe.
+            /// \param[in] sqe Prepared submission (user_data is overwritten).
+            /// \param[in] handler Handler to call when the operation completes.
+            /// \param[in] op Operation tag (< MAX_OP) passed back to the handler.
+            void Enqueue (
+                const io_uring_sqe &sqe,
+                Handler &handler,
+                util::ui32 op);
+            /// \brief
+            /// Push queued submissions to the kernel. Thread safe.
+            void Submit ();
+
+            /// \brief
+            /// Push queued submissions, wait for completions and dispatch them.
+            /// \param[in] timeout Milliseconds to wait (-1 == forever).
+            /// \return Number of handler completions dispatched.
+            std::size_t Poll (int timeout = -1);
+            /// \brief
+            /// Poll until Stop is called.
+            void Run ();
+            /// \brief
+            /// Make Run return. Thread safe.
+            void Stop ();
+
+            /// \brief
+            /// Register fixed buffers (IORING_OP_READ_FIXED/WRITE_FIXED).
+            /// Only one set can be registered per instance
+            /// (see \see{IOURingBufferPool}).
+            /// \param[in] iov Buffers to register.
+            /// \param[in] count Number of buffers.
+            void RegisterBuffers (
+                const iovec *iov,
+                std::size_t count);
+            /// \brief
+            /// Register a provided buffer ring (IOSQE_BUFFER_SELECT).
+            /// \param[in] bufferRing Page aligned io_uring_buf_ring.
+            /// \param[in] entryCount Number of ring entries (power of 2).
+            /// \return Buffer group id to select buffers from.
+            util::ui16 RegisterBufferRing (
+                io_uring_buf_ring *bufferRing,
+                util::ui32 entryCount);
+            /// \brief
+            /// Unregister a provided buffer ring.
+            /// \param[in] bufferGroupId Buffer group id returned by RegisterBufferRing.
+            void UnregisterBufferRing (util::ui16 bufferGroupId);
+
+        private:
+            /// \brief
+            /// Push queued submissions to the kernel and optionally wait.
+            /// \param[in] waitCount Number of completions to wait for.
+            /// \param[in] timeout Milliseconds to wait (-1 == forever).
+            void Enter (
+                util::ui32 waitCount,
+                int timeout);
+            /// \brief
+            /// Queue a read on the eventfd (woken up by Stop).
+            /// Must be called with submitMutex held.
+            void ArmEventHandle ();
+            /// \brief
+            /// Copy a submission in to the submission queue.
+            /// Must be called with submitMutex held.
+            /// \param[in] sqe Submission to copy.
+            /// \param[in] userData Submission user data.
+            void Push (
+                const io_uring_sqe &sqe,
+                util::ui64 userData);
+
+            /// \brief
+            /// IOURing is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (IOURing)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_IOURing_h)
@@ -0,0 +1,145 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_IOURingBufferPool_h)
+#define __thekogans_packet_IOURingBufferPool_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <cstddef>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/IOURing.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct IOURingBufferPool IOURingBufferPool.h thekogans/packet/IOURingBufferPool.h
+        ///
+        /// \brief
+        /// IOURingBufferPool carves one page aligned region in to bufferCount equal
+        /// length buffers and registers them with an \see{IOURing} as fixed buffers.
+        /// The kernel pins them once, instead of on every IORING_OP_WRITE_FIXED.
+        /// Transports (see \see{IOURingTunnel}) encrypt frames straight in to them
+        /// (see \see{Packet::Serialize}), so a frame is written once, by the cipher,
+        /// and read once, by the kernel. An io_uring instance can only have one set
+        /// of fixed buffers, so create one pool per \see{IOURing} and share it
+        /// between all it's transports. Buffers are identified by their index (the
+        /// fixed buffer index). Acquire and Release are thread safe.
+        ///
+        /// Linux only.
+
+        struct _LIB_THEKOGANS_PACKET_DECL IOURingBufferPool {
+            enum {
+                /// \brief
+                /// Acquire returns this when the pool is exhausted.
+                NO_BUFFER = -1,
+                /// \brief
+                /// Default number of buffers.
+                DEFAULT_BUFFER_COUNT = 1024,
+                /// \brief
+                /// Default buffer length.
+                DEFAULT_BUFFER_LENGTH = 64 * 1024
+            };
+
+        private:
+            /// \brief
+            /// Registered region.
+            util::ui8 *data;
+            /// \brief
+            /// Number of buffers.
+            const std::size_t bufferCount;
+            /// \brief
+            /// Length of every buffer.
+            const std::size_t bufferLength;
+            /// \brief
+            /// Indices of free buffers.
+            std::vector<util::i32> freeList;
+            /// \brief
+            /// Protects freeList.
+            util::SpinLock spinLock;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] ring \see{IOURing} to register the buffers with.
+            /// \param[in] bufferCount_ Number of buffers.
+            /// \param[in] bufferLength_ Length of every buffer.
+            IOURingBufferPool (
+                IOURing &ring,
+                std::size_t bufferCount_ = DEFAULT_BUFFER_COUNT,
+                std::size_t bufferLength_ = DEFAULT_BUFFER_LENGTH);
+            /// \brief
+            /// dtor. The buffers stay registered (and pinned) until
+            /// the \see{IOURing} is destroyed, so destroy the ring first.
+            ~IOURingBufferPool ();
+
+            /// \brief
+            /// Return the number of buffers.
+            /// \return Number of buffers.
+            inline std::size_t GetBufferCount () const {
+                return bufferCount;
+            }
+            /// \brief
+            /// Return the length of every buffer.
+            /// \return Length of every buffer.
+            inline std::size_t GetBufferLength () const {
+                return bufferLength;
+            }
+            /// \brief
+            /// Return the given buffer's memory.
+            /// \param[in] index Buffer index.
+            /// \return Buffer memory.
+            inline util::ui8 *GetBufferData (util::i32 index) const {
+                return data + index * bufferLength;
+            }
+
+            /// \brief
+            /// Take a buffer out of the pool.
+            /// \return Buffer index (NO_BUFFER if the pool is exhausted).
+            util::i32 Acquire ();
+            /// \brief
+            /// Return a buffer to the pool.
+            /// \param[in] index Buffer index returned by Acquire.
+            void Release (util::i32 index);
+
+            /// \brief
+            /// Return a \see{util::Buffer} over the given buffer's memory (no copy,
+            /// the util::Buffer does not own it). Use it to serialize in to, or
+            /// parse out of, the buffer.
+            /// \param[in] index Buffer index.
+            /// \param[in] readOffset Offset of the first byte to read.
+            /// \param[in] writeOffset Offset of the first byte to write.
+            /// \return util::Buffer over the buffer's memory.
+            util::Buffer::SharedPtr GetBuffer (
+                util::i32 index,
+                std::size_t readOffset = 0,
+                std::size_t writeOffset = 0) const;
+
+            /// \brief
+            /// IOURingBufferPool is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (IOURingBufferPool)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_IOURingBufferPool_h)
@@ -0,0 +1,351 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_IOURingTunnel_h)
+#define __thekogans_packet_IOURingTunnel_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/PaddingPolicy.h"
+#include "thekogans/packet/FrameParser.h"
+#include "thekogans/packet/KeyRing.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/IOURing.h"
+#include "thekogans/packet/IOURingBufferPool.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct IOURingTunnel IOURingTunnel.h thekogans/packet/IOURingTunnel.h
+        ///
+        /// \brief
+        /// IOURingTunnel is a \see{Tunnel} over a connected TCP socket, driven by an
+        /// \see{IOURing}. It's the io_uring counterpart of \see{TCPTunnel}, and trades
+        /// the per packet read/write system calls and copies for completions.
+        ///
+        /// Sending: frames are encrypted straight in to registered buffers from the
+        /// \see{IOURingBufferPool} (see \see{Packet::Serialize}), back to back, so a
+        /// buffer carries as many frames as fit. Only one write is in flight at a
+        /// time (the stream must stay in order). Frames queued while it's in flight
+        /// go out together when it completes: one queued buffer as an
+        /// IORING_OP_WRITE_FIXED, many (up to MAX_GATHER_BUFFER_COUNT) as one
+        /// IORING_OP_SENDMSG. Frames longer than a pool buffer (or sent while the
+        /// pool is exhausted) are serialized in to their own buffer. Backpressure
+        /// works like in \see{TCPTunnel}.
+        ///
+        /// Receiving: one multishot IORING_OP_RECV selects buffers from a provided
+        /// buffer ring owned by the tunnel, and keeps completing until the peer
+        /// closes the connection. Every completion is fed to the \see{FrameParser}
+        /// straight out of the ring buffer, which is then handed back to the kernel.
+        /// On kernels without multishot receive, the tunnel falls back to re-arming
+        /// a single shot receive after every completion.
+        ///
+        /// NOTE: IORING_OP_WRITE_FIXED can't pass MSG_NOSIGNAL. Like any write(2)
+        /// based socket code, the process must ignore SIGPIPE.
+        ///
+        /// NOTE: The tunnel must stay alive until EventSink::HandleTunnelClosed is
+        /// called (Close, or the peer, closed it and all it's operations completed).
+        ///
+        /// Linux only. Requires kernel 5.19 or newer (6.0 or newer for multishot
+        /// receive).
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// packet::IOURing ring;
+        /// packet::IOURingBufferPool bufferPool (ring);
+        /// packet::IOURingTunnel tunnel (ring, bufferPool, socket, keyRing, eventSink, &session);
+        /// tunnel.Start ();
+        /// ring.Run ();
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL IOURingTunnel :
+                public Tunnel,
+                public IOURing::Handler {
+            enum {
+                /// \brief
+                /// Default max incoming frame length.
+                DEFAULT_MAX_CIPHERTEXT_LENGTH = 2 * 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns on.
+                DEFAULT_HIGH_WATER_MARK = 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns off.
+                DEFAULT_LOW_WATER_MARK = 256 * 1024,
+                /// \brief
+                /// Default number of receive buffers (power of 2).
+                DEFAULT_RECEIVE_BUFFER_COUNT = 64,
+                /// \brief
+                /// Default receive buffer length.
+                DEFAULT_RECEIVE_BUFFER_LENGTH = 16 * 1024,
+                /// \brief
+                /// Maximum number of queued buffers sent by one IORING_OP_SENDMSG.
+                MAX_GATHER_BUFFER_COUNT = 64
+            };
+
+        private:
+            /// \enum
+            /// Operation tags.
+            enum {
+                /// \brief
+                /// Receive completion.
+                OP_RECEIVE,
+                /// \brief
+                /// Write completion.
+                OP_WRITE
+            };
+            /// \struct IOURingTunnel::Chunk IOURingTunnel.h thekogans/packet/IOURingTunnel.h
+            ///
+            /// \brief
+            /// Queued frames. Unsent bytes are between buffer's read and write offsets.
+            struct Chunk {
+                /// \brief
+                /// \see{IOURingBufferPool} buffer index (NO_BUFFER == buffer
+                /// is a frame of it's own).
+                util::i32 index;
+                /// \brief
+                /// Frames.
+                util::Buffer::SharedPtr buffer;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] index_ \see{IOURingBufferPool} buffer index.
+                /// \param[in] buffer_ Frames.
+                Chunk (
+                    util::i32 index_,
+                    util::Buffer::SharedPtr buffer_) :
+                    index (index_),
+                    buffer (buffer_) {}
+            };
+
+            /// \brief
+            /// Ring driving the tunnel.
+            IOURing &ring;
+            /// \brief
+            /// Registered buffers frames are serialized in to.
+            IOURingBufferPool &bufferPool;
+            /// \brief
+            /// Connected TCP socket (owned).
+            THEKOGANS_UTIL_HANDLE handle;
+            /// \brief
+            /// Parses incoming frames.
+            FrameParser frameParser;
+            /// \brief
+            /// Provided buffer ring (receive buffers handed to the kernel).
+            io_uring_buf_ring *receiveRing;
+            /// \brief
+            /// Number of receive buffers.
+            const std::size_t receiveBufferCount;
+            /// \brief
+            /// Length of every receive buffer.
+            const std::size_t receiveBufferLength;
+            /// \brief
+            /// Receive buffers.
+            std::vector<util::ui8> receiveData;
+            /// \brief
+            /// Provided buffer ring tail.
+            util::ui16 receiveRingTail;
+            /// \brief
+            /// Buffer group id of receiveRing.
+            util::ui16 bufferGroupId;
+            /// \brief
+            /// false == the kernel doesn't support multishot receive.
+            bool multishot;
+            /// \brief
+            /// true == a receive is armed.
+            bool receiving;
+            /// \brief
+            /// Send queue length at which backpressure turns on.
+            const std::size_t highWaterMark;
+            /// \brief
+            /// Send queue length at which backpressure turns off.
+            const std::size_t lowWaterMark;
+            /// \brief
+            /// Queued frames. The first writeChunkCount are in flight.
+            std::deque<Chunk> sendQueue;
+            /// \brief
+            /// Number of unsent bytes in sendQueue.
+            std::size_t queuedBytes;
+            /// \brief
+            /// Number of chunks the in flight write covers (0 == none in flight).
+            std::size_t writeChunkCount;
+            /// \brief
+            /// IORING_OP_SENDMSG gather list (must outlive the operation).
+            iovec writeIov[MAX_GATHER_BUFFER_COUNT];
+            /// \brief
+            /// IORING_OP_SENDMSG message (must outlive the operation).
+            msghdr writeMessage;
+            /// \brief
+            /// true == backpressure is on.
+            bool backpressure;
+            /// \brief
+            /// true == the tunnel was closed.
+            std::atomic<bool> closed;
+            /// \brief
+            /// true == HandleTunnelClosed was called.
+            bool finished;
+            /// \brief
+            /// Serializes packet encryption, send queue and operation state.
+            util::Mutex sendMutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] ring_ \see{IOURing} driving the tunnel.
+            /// \param[in] bufferPool_ Registered buffers to serialize frames in to
+            /// (registered with ring_).
+            /// \param[in] handle_ Connected TCP socket. The tunnel takes ownership.
+            /// \param[in] keyRing Keys used to encrypt and decrypt packets.
+            /// \param[in] eventSink Receives tunnel events.
+            /// \param[in] session Optional \see{Session} baked in to every packet.
+            /// \param[in] maxCiphertextLength Max incoming frame length.
+            /// \param[in] highWaterMark_ Send queue length at which backpressure turns on.
+            /// \param[in] lowWaterMark_ Send queue length at which backpressure turns off.
+            /// \param[in] receiveBufferCount_ Number of receive buffers (power of 2).
+            /// \param[in] receiveBufferLength_ Length of every receive buffer.
+            /// \param[in] paddingPolicy \see{PaddingPolicy} outgoing packets are
+            /// serialized with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] compress true == compress outgoing packets.
+            IOURingTunnel (
+                IOURing &ring_,
+                IOURingBufferPool &bufferPool_,
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session = 0,
+                std::size_t maxCiphertextLength = DEFAULT_MAX_CIPHERTEXT_LENGTH,
+                std::size_t highWaterMark_ = DEFAULT_HIGH_WATER_MARK,
+                std::size_t lowWaterMark_ = DEFAULT_LOW_WATER_MARK,
+                std::size_t receiveBufferCount_ = DEFAULT_RECEIVE_BUFFER_COUNT,
+                std::size_t receiveBufferLength_ = DEFAULT_RECEIVE_BUFFER_LENGTH,
+                PaddingPolicy::SharedPtr paddingPolicy = PaddingPolicy::SharedPtr (),
+                bool compress = false);
+            /// \brief
+            /// dtor.
+            virtual ~IOURingTunnel ();
+
+            /// \brief
+            /// Arm the receive. Call once, after the tunnel is constructed.
+            void Start ();
+
+            /// \brief
+            /// Return the number of unsent bytes.
+            /// \return Number of unsent bytes.
+            std::size_t GetQueuedBytes ();
+            /// \brief
+            /// Return true if backpressure is on.
+            /// \return true == backpressure is on.
+            virtual bool IsBackpressured () override;
+
+            /// \brief
+            /// Shut the socket down. Outstanding operations complete (with
+            /// errors), after which the socket is closed, unsent frames are
+            /// dropped and EventSink::HandleTunnelClosed is called.
+            void Close ();
+
+            // IOURing::Handler
+            /// \brief
+            /// Dispatch a receive or write completion.
+            /// \param[in] op OP_RECEIVE or OP_WRITE.
+            /// \param[in] result Operation result (-errno on failure).
+            /// \param[in] flags IORING_CQE_F_* flags.
+            virtual void HandleCompletion (
+                util::ui32 op,
+                util::i32 result,
+                util::ui32 flags) throw () override;
+
+        protected:
+            // Tunnel
+            /// \brief
+            /// Serialize the packet in to the send queue and, unless
+            /// a write is already in flight, start one.
+            /// \param[in] packet \see{Packet} to send.
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) override;
+
+        private:
+            /// \brief
+            /// Parse received bytes and hand the buffer back to the kernel.
+            /// \param[in] result Receive result.
+            /// \param[in] flags IORING_CQE_F_* flags.
+            void HandleReceive (
+                util::i32 result,
+                util::ui32 flags);
+            /// \brief
+            /// Retire written bytes and start the next write.
+            /// \param[in] result Write result.
+            void HandleWrite (util::i32 result);
+            /// \brief
+            /// Queue a receive. Must be called with sendMutex held.
+            void ArmReceive ();
+            /// \brief
+            /// Hand a receive buffer back to the kernel.
+            /// \param[in] bufferId Receive buffer id.
+            void RecycleReceiveBuffer (util::ui16 bufferId);
+            /// \brief
+            /// Serialize a frame in to the tail of the send queue.
+            /// Must be called with sendMutex held.
+            /// \param[in] packet \see{Packet} to serialize.
+            /// \param[in] cipher \see{crypto::Cipher} to encrypt it with.
+            void WriteFrame (
+                const Packet &packet,
+                crypto::Cipher &cipher);
+            /// \brief
+            /// Queue a write covering the head of the send queue.
+            /// Must be called with sendMutex held.
+            void StartWrite ();
+            /// \brief
+            /// Report an error and close the tunnel.
+            /// \param[in] errorCode Error to report.
+            void HandleError (THEKOGANS_UTIL_ERROR_CODE errorCode);
+            /// \brief
+            /// If closed and nothing is in flight, mark the tunnel finished.
+            /// Must be called with sendMutex held.
+            /// \return true == call Finish.
+            bool IsFinished ();
+            /// \brief
+            /// Close the socket, drop unsent frames and
+            /// call EventSink::HandleTunnelClosed.
+            void Finish ();
+
+            /// \brief
+            /// IOURingTunnel is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (IOURingTunnel)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_IOURingTunnel_h)
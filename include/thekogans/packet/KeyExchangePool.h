@@ -0,0 +1,214 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_KeyExchangePool_h)
+#define __thekogans_packet_KeyExchangePool_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/util/Thread.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/util/Condition.h"
+#include "thekogans/crypto/KeyExchange.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct KeyExchangePool KeyExchangePool.h thekogans/packet/KeyExchangePool.h
+        ///
+        /// \brief
+        /// KeyExchangePool moves ephemeral keypair generation off the handshake
+        /// path. A background thread keeps a bounded pool of ready
+        /// \see{crypto::KeyExchange} instances for every configured
+        /// \see{crypto::CipherSuite}. Building a \see{ClientKeyExchangePacket} or
+        /// \see{ServerKeyExchangePacket} (handshake or key rotation) becomes a
+        /// pool lookup followed by \see{crypto::KeyExchange::GetParams}. Every
+        /// pooled keypair is handed out exactly once. If a pool runs dry, the
+        /// keypair is generated inline (same cost as without the pool) and the
+        /// miss is counted so that poolSize can be tuned.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// struct DHEFactory : public packet::KeyExchangePool::Factory {
+        ///     virtual crypto::KeyExchange::SharedPtr CreateKeyExchange (
+        ///             const std::string &cipherSuite) override {
+        ///         ...
+        ///     }
+        /// };
+        ///
+        /// std::vector<std::string> cipherSuites;
+        /// cipherSuites.push_back (crypto::CipherSuite::Strongest.ToString ());
+        /// packet::KeyExchangePool keyExchangePool (new DHEFactory, cipherSuites);
+        /// ...
+        /// crypto::KeyExchange::SharedPtr keyExchange =
+        ///     keyExchangePool.GetKeyExchange (cipherSuite);
+        /// packet::Packet::SharedPtr packet (
+        ///     new packet::ClientKeyExchangePacket (
+        ///         cipherSuite, keyExchange->GetParams ()));
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL KeyExchangePool : public util::Thread {
+            /// \struct KeyExchangePool::Factory KeyExchangePool.h thekogans/packet/KeyExchangePool.h
+            ///
+            /// \brief
+            /// Creates fresh \see{crypto::KeyExchange} instances (ephemeral keypairs)
+            /// for a given \see{crypto::CipherSuite}. Called from the pool thread
+            /// (refill) and from \see{GetKeyExchange} (pool miss), so it must be
+            /// thread safe.
+            struct _LIB_THEKOGANS_PACKET_DECL Factory : public util::RefCounted {
+                /// \brief
+                /// Declare \see{RefCounted} pointers.
+                THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (Factory)
+
+                /// \brief
+                /// dtor.
+                virtual ~Factory () {}
+
+                /// \brief
+                /// Create a new \see{crypto::KeyExchange}.
+                /// \param[in] cipherSuite \see{crypto::CipherSuite} to create it for.
+                /// \return A new \see{crypto::KeyExchange}.
+                virtual crypto::KeyExchange::SharedPtr CreateKeyExchange (
+                    const std::string &cipherSuite) = 0;
+            };
+
+            enum {
+                /// \brief
+                /// Default number of ready keypairs kept per cipher suite.
+                DEFAULT_POOL_SIZE = 16
+            };
+
+            /// \struct KeyExchangePool::Stats KeyExchangePool.h thekogans/packet/KeyExchangePool.h
+            ///
+            /// \brief
+            /// Pool statistics for one cipher suite.
+            struct Stats {
+                /// \brief
+                /// Number of ready keypairs.
+                std::size_t size;
+                /// \brief
+                /// Number of requests served from the pool.
+                util::ui64 hits;
+                /// \brief
+                /// Number of requests that had to generate inline.
+                util::ui64 misses;
+                /// \brief
+                /// Number of background generation failures.
+                util::ui64 failures;
+
+                /// \brief
+                /// ctor.
+                Stats () :
+                    size (0),
+                    hits (0),
+                    misses (0),
+                    failures (0) {}
+            };
+
+        private:
+            /// \brief
+            /// Creates the keypairs.
+            Factory::SharedPtr factory;
+            /// \brief
+            /// Maximum number of ready keypairs per cipher suite.
+            const std::size_t poolSize;
+            /// \struct KeyExchangePool::Pool KeyExchangePool.h thekogans/packet/KeyExchangePool.h
+            ///
+            /// \brief
+            /// Ready keypairs and statistics for one cipher suite.
+            struct Pool {
+                /// \brief
+                /// Ready keypairs (oldest first).
+                std::deque<crypto::KeyExchange::SharedPtr> keyExchanges;
+                /// \brief
+                /// Pool statistics.
+                Stats stats;
+            };
+            /// \brief
+            /// Convenient typedef for std::map<std::string, Pool>.
+            typedef std::map<std::string, Pool> PoolMap;
+            /// \brief
+            /// Pools keyed by cipher suite. The set of keys is fixed at
+            /// construction, only the pools themselves change.
+            PoolMap pools;
+            /// \brief
+            /// true == the pool thread should exit.
+            bool done;
+            /// \brief
+            /// Synchronization mutex.
+            util::Mutex mutex;
+            /// \brief
+            /// Signaled when a keypair is taken or the pool is stopped.
+            util::Condition condition;
+
+        public:
+            /// \brief
+            /// ctor. Start the pool thread.
+            /// \param[in] factory_ Creates the keypairs.
+            /// \param[in] cipherSuites \see{crypto::CipherSuite}s to keep keypairs for.
+            /// \param[in] poolSize_ Maximum number of ready keypairs per cipher suite.
+            /// \param[in] priority Pool thread priority.
+            KeyExchangePool (
+                Factory::SharedPtr factory_,
+                const std::vector<std::string> &cipherSuites,
+                std::size_t poolSize_ = DEFAULT_POOL_SIZE,
+                util::i32 priority = THEKOGANS_UTIL_LOW_THREAD_PRIORITY);
+            /// \brief
+            /// dtor. Stop the pool thread.
+            virtual ~KeyExchangePool ();
+
+            /// \brief
+            /// Take a ready keypair for the given cipher suite. If the pool is
+            /// empty (or the cipher suite is not pooled), one is generated inline.
+            /// \param[in] cipherSuite \see{crypto::CipherSuite} to get a keypair for.
+            /// \return A \see{crypto::KeyExchange} that has not been handed out before.
+            crypto::KeyExchange::SharedPtr GetKeyExchange (const std::string &cipherSuite);
+
+            /// \brief
+            /// Return the statistics for the given cipher suite.
+            /// \param[in] cipherSuite \see{crypto::CipherSuite} to get the statistics for.
+            /// \return Pool statistics (all zeros if the cipher suite is not pooled).
+            Stats GetStats (const std::string &cipherSuite);
+
+            /// \brief
+            /// Stop the pool thread and drop all ready keypairs.
+            /// Subsequent \see{GetKeyExchange} calls generate inline.
+            void Stop ();
+
+        protected:
+            // util::Thread
+            /// \brief
+            /// Pool thread. Refills the emptiest pool first.
+            virtual void Run () throw () override;
+
+            /// \brief
+            /// KeyExchangePool is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (KeyExchangePool)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_KeyExchangePool_h)
@@ -0,0 +1,345 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_KeyRing_h)
+#define __thekogans_packet_KeyRing_h
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/crypto/ID.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/EpochReclaimer.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct KeyRing KeyRing.h thekogans/packet/KeyRing.h
+        ///
+        /// \brief
+        /// KeyRing maps \see{crypto::ID} to \see{crypto::Cipher} for a tunnel, and tracks
+        /// how much every key has been used. Lookups are lock free: the ring is an
+        /// immutable snapshot (an array sorted by key id) read inside an
+        /// \see{EpochReclaimer} read side section. Writers (AddCipher, DropCipher...)
+        /// serialize on a mutex, publish a new snapshot and retire the old one.
+        ///
+        /// Every GetCipher/GetActiveCipher call counts the given number of packets
+        /// (one by default) and bytes against the key, using relaxed atomic adds.
+        /// When a key crosses one of the rotation thresholds, the RotationHandler
+        /// is called, exactly once for that key, on the thread that crossed it.
+        /// The handler should only schedule the key exchange (ex: build a
+        /// \see{ClientKeyExchangePacket} from a \see{KeyExchangePool} keypair and
+        /// send it), and AddCipher/DropCipher the keys when it completes. The key
+        /// stays usable until it's dropped. Callers must not hold locks the
+        /// handler needs. \see{Tunnel} charges the key before handing packets to
+        /// the transport, so the handler is free to Tunnel::SendPacket.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// struct Rotator : public packet::KeyRing::RotationHandler {
+        ///     packet::KeyExchangePool &keyExchangePool;
+        ///     packet::Tunnel *tunnel;
+        ///
+        ///     Rotator (packet::KeyExchangePool &keyExchangePool_) :
+        ///         keyExchangePool (keyExchangePool_),
+        ///         tunnel (0) {}
+        ///
+        ///     // packet::KeyRing::RotationHandler
+        ///     virtual void RotateKey (
+        ///             packet::KeyRing &keyRing,
+        ///             crypto::Cipher::SharedPtr cipher) throw () override {
+        ///         THEKOGANS_UTIL_TRY {
+        ///             std::string cipherSuite = crypto::CipherSuite::Strongest.ToString ();
+        ///             crypto::KeyExchange::SharedPtr keyExchange =
+        ///                 keyExchangePool.GetKeyExchange (cipherSuite);
+        ///             // Remember keyExchange, to finish the exchange when
+        ///             // the ServerKeyExchangePacket comes back. Sending here
+        ///             // is safe, the tunnel holds no locks when it calls us.
+        ///             tunnel->SendPacket (
+        ///                 packet::Packet::SharedPtr (
+        ///                     new packet::ClientKeyExchangePacket (
+        ///                         cipherSuite, keyExchange->GetParams ())));
+        ///         }
+        ///         THEKOGANS_UTIL_CATCH_AND_LOG
+        ///     }
+        /// };
+        ///
+        /// packet::KeyRing keyRing (packet::KeyRing::Thresholds (1000000, 1ull << 32));
+        /// keyRing.AddCipher (masterCipher);
+        /// Rotator rotator (keyExchangePool);
+        /// keyRing.SetRotationHandler (&rotator);
+        /// packet::TCPTunnel tunnel (handle, keyRing, eventSink);
+        /// rotator.tunnel = &tunnel;
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL KeyRing {
+            /// \struct KeyRing::RotationHandler KeyRing.h thekogans/packet/KeyRing.h
+            ///
+            /// \brief
+            /// Inherit from this class to be notified when a key needs rotating.
+            struct _LIB_THEKOGANS_PACKET_DECL RotationHandler {
+                /// \brief
+                /// dtor.
+                virtual ~RotationHandler () {}
+
+                /// \brief
+                /// Called once per key when it crosses a rotation threshold.
+                /// Called on the packet path, so it must not block. It is called
+                /// with no \see{Tunnel} locks held, so it may send packets.
+                /// \param[in] keyRing KeyRing the key belongs to.
+                /// \param[in] cipher \see{crypto::Cipher} whose key needs rotating.
+                virtual void RotateKey (
+                    KeyRing & /*keyRing*/,
+                    crypto::Cipher::SharedPtr /*cipher*/) throw () = 0;
+            };
+
+            /// \struct KeyRing::Thresholds KeyRing.h thekogans/packet/KeyRing.h
+            ///
+            /// \brief
+            /// Usage at which a key is rotated, and past which it's refused
+            /// (0 == no limit).
+            struct Thresholds {
+                /// \brief
+                /// Maximum number of packets.
+                util::ui64 maxPackets;
+                /// \brief
+                /// Maximum number of bytes.
+                util::ui64 maxBytes;
+                /// \brief
+                /// Number of packets past which GetCipher/GetActiveCipher refuse
+                /// the key (return null), whether or not it was rotated. Must be
+                /// greater than maxPackets, so that the rotation starts first.
+                /// Required with compact session headers (see
+                /// \see{Session::COMPACT_HEADER_KEY_PACKET_LIMIT}).
+                util::ui64 packetLimit;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] maxPackets_ Maximum number of packets.
+                /// \param[in] maxBytes_ Maximum number of bytes.
+                /// \param[in] packetLimit_ Number of packets past which the key is refused.
+                Thresholds (
+                    util::ui64 maxPackets_ = 0,
+                    util::ui64 maxBytes_ = 0,
+                    util::ui64 packetLimit_ = 0) :
+                    maxPackets (maxPackets_),
+                    maxBytes (maxBytes_),
+                    packetLimit (packetLimit_) {}
+            };
+
+            /// \struct KeyRing::Usage KeyRing.h thekogans/packet/KeyRing.h
+            ///
+            /// \brief
+            /// Key usage counters.
+            struct Usage {
+                /// \brief
+                /// Number of packets.
+                util::ui64 packets;
+                /// \brief
+                /// Number of bytes.
+                util::ui64 bytes;
+
+                /// \brief
+                /// ctor.
+                Usage () :
+                    packets (0),
+                    bytes (0) {}
+            };
+
+        private:
+            /// \struct KeyRing::Key KeyRing.h thekogans/packet/KeyRing.h
+            ///
+            /// \brief
+            /// A key and it's usage counters. Shared by all snapshots the
+            /// key appears in, so that the counters survive republishing.
+            struct Key : public util::RefCounted {
+                /// \brief
+                /// Declare \see{RefCounted} pointers.
+                THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (Key)
+
+                /// \brief
+                /// Key cipher.
+                crypto::Cipher::SharedPtr cipher;
+                /// \brief
+                /// Number of packets.
+                std::atomic<util::ui64> packets;
+                /// \brief
+                /// Number of bytes.
+                std::atomic<util::ui64> bytes;
+                /// \brief
+                /// true == the RotationHandler was called for this key.
+                std::atomic<bool> rotationRequested;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] cipher_ Key cipher.
+                explicit Key (crypto::Cipher::SharedPtr cipher_) :
+                    cipher (cipher_),
+                    packets (0),
+                    bytes (0),
+                    rotationRequested (false) {}
+            };
+            /// \brief
+            /// Convenient typedef for std::pair<crypto::ID, Key::SharedPtr>.
+            typedef std::pair<crypto::ID, Key::SharedPtr> Entry;
+            /// \struct KeyRing::Snapshot KeyRing.h thekogans/packet/KeyRing.h
+            ///
+            /// \brief
+            /// Immutable published version of the ring.
+            struct Snapshot : public EpochReclaimer::Retirable {
+                /// \brief
+                /// Keys sorted by id.
+                std::vector<Entry> entries;
+                /// \brief
+                /// Key used for outbound packets (0 == none).
+                Key *activeKey;
+
+                /// \brief
+                /// ctor.
+                Snapshot () :
+                    activeKey (0) {}
+
+                /// \brief
+                /// Binary search for the given key id.
+                /// \param[in] keyId Key id to look for.
+                /// \return Key with the given id (0 == not found).
+                Key *Find (const crypto::ID &keyId) const;
+            };
+            /// \brief
+            /// Rotation thresholds.
+            const Thresholds thresholds;
+            /// \brief
+            /// Called when a key crosses a threshold.
+            std::atomic<RotationHandler *> rotationHandler;
+            /// \brief
+            /// Current snapshot (never null).
+            std::atomic<Snapshot *> snapshot;
+            /// \brief
+            /// Serializes writers.
+            util::Mutex mutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] thresholds_ Rotation thresholds.
+            explicit KeyRing (const Thresholds &thresholds_ = Thresholds ());
+            /// \brief
+            /// dtor. The ring must not be in use.
+            ~KeyRing ();
+
+            /// \brief
+            /// Return the rotation thresholds.
+            /// \return Rotation thresholds.
+            inline const Thresholds &GetThresholds () const {
+                return thresholds;
+            }
+
+            /// \brief
+            /// Set the rotation handler.
+            /// \param[in] rotationHandler_ Rotation handler (0 == none).
+            inline void SetRotationHandler (RotationHandler *rotationHandler_) {
+                rotationHandler.store (rotationHandler_, std::memory_order_release);
+            }
+
+            /// \brief
+            /// Add a cipher to the ring.
+            /// \param[in] cipher \see{crypto::Cipher} to add.
+            /// \param[in] activate true == make it the cipher used for outbound packets.
+            /// \return true == added, false == a cipher with the same key id is
+            /// already in the ring.
+            bool AddCipher (
+                crypto::Cipher::SharedPtr cipher,
+                bool activate = true);
+            /// \brief
+            /// Make the given key the one used for outbound packets.
+            /// \param[in] keyId Key id.
+            /// \return true == activated, false == key is not in the ring.
+            bool SetActiveCipher (const crypto::ID &keyId);
+            /// \brief
+            /// Drop a key from the ring. If it's the active key, there
+            /// will be no active key until SetActiveCipher/AddCipher.
+            /// \param[in] keyId Key id.
+            /// \return true == dropped, false == key is not in the ring.
+            bool DropCipher (const crypto::ID &keyId);
+
+            /// \brief
+            /// Lock free lookup. Counts as one use of the key.
+            /// \param[in] keyId Key id.
+            /// \param[in] byteCount Number of bytes to count against the key.
+            /// \return \see{crypto::Cipher} for the key (null if not in the ring,
+            /// or past it's Thresholds::packetLimit).
+            crypto::Cipher::SharedPtr GetCipher (
+                const crypto::ID &keyId,
+                std::size_t byteCount = 0) throw ();
+            /// \brief
+            /// Lock free lookup of the active cipher.
+            /// \param[in] byteCount Number of bytes to count against the key.
+            /// \param[in] packetCount Number of packets to count against the key
+            /// (ex: the size of a batch about to be encrypted).
+            /// \return Active \see{crypto::Cipher} (null if none, or if it's
+            /// past it's Thresholds::packetLimit).
+            crypto::Cipher::SharedPtr GetActiveCipher (
+                std::size_t byteCount = 0,
+                std::size_t packetCount = 1) throw ();
+
+            /// \brief
+            /// Return the usage counters for the given key.
+            /// \param[in] keyId Key id.
+            /// \param[out] usage Usage counters.
+            /// \return true == found, false == key is not in the ring.
+            bool GetUsage (
+                const crypto::ID &keyId,
+                Usage &usage) const;
+            /// \brief
+            /// Return the number of keys in the ring.
+            /// \return Number of keys in the ring.
+            std::size_t GetSize () const;
+
+        private:
+            /// \brief
+            /// Count the use of the key and call the RotationHandler
+            /// if the key just crossed a threshold.
+            /// \param[in] key Key that was used.
+            /// \param[in] byteCount Number of bytes to count against the key.
+            /// \param[in] packetCount Number of packets to count against the key.
+            /// \return true == key is usable, false == key is past it's packetLimit.
+            bool RecordUsage (
+                Key &key,
+                std::size_t byteCount,
+                std::size_t packetCount = 1) throw ();
+            /// \brief
+            /// Publish a new snapshot and retire the old one.
+            /// Must be called with mutex held.
+            /// \param[in] newSnapshot Snapshot to publish.
+            void Publish (Snapshot *newSnapshot);
+
+            /// \brief
+            /// KeyRing is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (KeyRing)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_KeyRing_h)
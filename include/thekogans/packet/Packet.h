@@ -18,6 +18,7 @@
 #if !defined (__thekogans_packet_Packet_h)
 #define __thekogans_packet_Packet_h
 
+#include <vector>
 #include "thekogans/util/Types.h"
 #include "thekogans/util/Serializable.h"
 #include "thekogans/util/Buffer.h"
@@ -25,10 +26,35 @@
 #include "thekogans/packet/Config.h"
 #include "thekogans/packet/Session.h"
 #include "thekogans/packet/PlaintextHeader.h"
+#include "thekogans/packet/PaddingPolicy.h"
 
 namespace thekogans {
     namespace packet {
 
+        /// \brief
+        /// Forward declaration of SessionTable.
+        struct SessionTable;
+
+        /// \def THEKOGANS_PACKET_DECLARE_PACKET(type)
+        /// Use in place of THEKOGANS_UTIL_DECLARE_SERIALIZABLE in \see{Packet}
+        /// derivatives to give them a dense \see{Packet::TypeId} (see
+        /// \see{PacketDispatcher}).
+        #define THEKOGANS_PACKET_DECLARE_PACKET(type)\
+            THEKOGANS_UTIL_DECLARE_SERIALIZABLE (type)\
+        public:\
+            static const thekogans::packet::Packet::TypeId TYPE_ID;\
+            virtual thekogans::packet::Packet::TypeId GetTypeId () const override {\
+                return TYPE_ID;\
+            }
+
+        /// \def THEKOGANS_PACKET_IMPLEMENT_PACKET(type, version)
+        /// Use in place of THEKOGANS_UTIL_IMPLEMENT_SERIALIZABLE in \see{Packet}
+        /// derivatives. Registers the type and assigns it's \see{Packet::TypeId}.
+        #define THEKOGANS_PACKET_IMPLEMENT_PACKET(type, version)\
+            THEKOGANS_UTIL_IMPLEMENT_SERIALIZABLE (type, version)\
+            const thekogans::packet::Packet::TypeId type::TYPE_ID =\
+                thekogans::packet::Packet::RegisterType (type::TYPE);
+
         /// \struct Packet Packet.h thekogans/packet/Packet.h
         ///
         /// \brief
@@ -41,17 +67,157 @@ namespace thekogans {
             /// Declare \see{RefCounted} pointers.
             THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (Packet)
 
+            /// \brief
+            /// Logical stream the packet belongs to (0 == default stream). Not
+            /// part of the packet's serialized form (\see{PacketFragmentPacket}
+            /// being the exception). \see{FragmentPacketPacketFilter}
+            /// interleaves the fragments of packets on different streams, and
+            /// carries the stream id in every \see{PacketFragmentPacket}, so that
+            /// \see{ReassemblePacketFragmentsPacketFilter} can reassemble the
+            /// streams independently (and restore the stream id). Packets on
+            /// the same stream are delivered in the order they were sent.
+            util::ui32 streamId;
+
+            /// \brief
+            /// Send priority classes (see \see{Tunnel}). PRIORITY_CONTROL packets
+            /// leave before all others. The rest share the link according to their
+            /// class weights (see \see{Tunnel::SetPriorityWeight}).
+            enum Priority {
+                /// \brief
+                /// Bulk transfers.
+                PRIORITY_BULK,
+                /// \brief
+                /// Default priority.
+                PRIORITY_NORMAL,
+                /// \brief
+                /// Latency sensitive traffic.
+                PRIORITY_INTERACTIVE,
+                /// \brief
+                /// Tunnel control (ex: key exchange). Always sent first.
+                PRIORITY_CONTROL,
+                /// \brief
+                /// Number of priority classes.
+                PRIORITY_COUNT
+            };
+            /// \brief
+            /// Send priority hint (one of the Priority values above). Not part
+            /// of the packet's serialized form. \see{FragmentPacketPacketFilter}
+            /// gives fragments the priority of the fragmented packet. Out of
+            /// range values are sent as PRIORITY_NORMAL.
+            util::ui8 priority;
+
+            /// \brief
+            /// ctor.
+            Packet () :
+                streamId (0),
+                priority (PRIORITY_NORMAL) {}
+
+            /// \brief
+            /// Dense, process local packet type id. Ids are assigned in registration
+            /// order (0, 1, 2...) when the packet type's translation unit is initialized
+            /// (call \see{Packets::StaticInit} in static builds). They are not stable
+            /// across processes and must never be put on the wire. Use them to index
+            /// tables (see \see{PacketDispatcher}).
+            typedef util::ui32 TypeId;
+
+            /// \brief
+            /// Register the given packet type and return it's id. Registering
+            /// the same type again returns the same id.
+            /// \param[in] type \see{Packet} type (Packet::Type ()).
+            /// \return Packet type id.
+            static TypeId RegisterType (const char *type);
+            /// \brief
+            /// Return the number of registered packet types. All
+            /// \see{TypeId}s are less than this number.
+            /// \return Number of registered packet types.
+            static std::size_t GetTypeCount ();
+
+            /// \brief
+            /// Return the packet type id. Packets declared with
+            /// THEKOGANS_PACKET_DECLARE_PACKET return a constant. The
+            /// default implementation (for packets declared with
+            /// THEKOGANS_UTIL_DECLARE_SERIALIZABLE) looks it up by name.
+            /// \return Packet type id.
+            virtual TypeId GetTypeId () const {
+                return RegisterType (Type ());
+            }
+
             /// \brief
             /// See \see{FrameParser} to learn about the wire structure created
             /// by this method.
             /// \param[in] cipher \see{crypto::Cipher} used to encrypt the packet payload.
             /// \param[in] session Optional \see{Session} whose header will be baked in
-            /// to the serialized packet to help prevent replay attacks.
+            /// to the serialized packet to help prevent replay attacks. Many threads
+            /// can serialize with the same session concurrently (see \see{Session}
+            /// for what that means for the receiver's replay window).
             /// \param[in] compress true == Compress the packet contents before encrypting.
+            /// \param[in] paddingPolicy Optional \see{PaddingPolicy} deciding how much
+            /// random data to prepend (0 == PaddingPolicy::GetDefault ()).
             util::Buffer::SharedPtr Serialize (
                 crypto::Cipher &cipher,
                 Session *session,
-                bool compress = false) const;
+                bool compress = false,
+                const PaddingPolicy *paddingPolicy = 0) const;
+            /// \brief
+            /// Same as above, but encrypts the frame straight in to the caller's
+            /// buffer (ex: a registered \see{IOURingBufferPool} buffer) instead of
+            /// allocating one. Many frames can be written back to back.
+            /// \param[in, out] frame Buffer to write the frame to. On success it's
+            /// write offset is advanced past the frame.
+            /// \param[in] cipher \see{crypto::Cipher} used to encrypt the packet payload.
+            /// \param[in] session Optional \see{Session} whose header will be baked in.
+            /// \param[in] compress true == Compress the packet contents before encrypting.
+            /// \param[in] paddingPolicy Optional \see{PaddingPolicy} deciding how much
+            /// random data to prepend (0 == PaddingPolicy::GetDefault ()).
+            /// \return true == the frame was written, false == the frame might not
+            /// fit in frame's available space (frame and session are left untouched).
+            bool Serialize (
+                util::Buffer &frame,
+                crypto::Cipher &cipher,
+                Session *session,
+                bool compress = false,
+                const PaddingPolicy *paddingPolicy = 0) const;
+            /// \brief
+            /// Build the plaintext Serialize above encrypts, for callers that pick
+            /// the frame's destination once they know it's length. Encrypt it with
+            /// \see{crypto::Cipher::EncryptAndFrame}; it's frame is no longer than
+            /// crypto::FrameHeader::SIZE + crypto::Cipher::GetMaxBufferLength
+            /// (plaintext length). Every call compresses the packet (if asked),
+            /// and takes a new session sequence number.
+            /// \param[out] plaintext Where to build the plaintext.
+            /// \param[in] session Optional \see{Session} whose header will be baked in.
+            /// \param[in] compress true == Compress the packet contents before encrypting.
+            /// \param[in] paddingPolicy Optional \see{PaddingPolicy} deciding how much
+            /// random data to prepend (0 == PaddingPolicy::GetDefault ()).
+            void SerializePlaintext (
+                util::Buffer &plaintext,
+                Session *session,
+                bool compress = false,
+                const PaddingPolicy *paddingPolicy = 0) const;
+            /// \brief
+            /// Serialize a batch of packets with the same cipher. Produces the same
+            /// frames as calling Serialize above on every packet in order, but
+            /// back to back in a single buffer (ready for a stream write), with one
+            /// output allocation, one reused plaintext scratch buffer and one
+            /// random draw for all the padding.
+            /// \param[in] packets \see{Packet}s to serialize.
+            /// \param[in] cipher \see{crypto::Cipher} used to encrypt the packet payloads.
+            /// \param[in] session Optional \see{Session} whose headers will be baked in.
+            /// Packets are given increasing sequence numbers, in order (other threads
+            /// sending on the same session can take numbers in between).
+            /// \param[in] compress true == Compress the packet contents before encrypting.
+            /// \param[in] paddingPolicy Optional \see{PaddingPolicy} deciding how much
+            /// random data to prepend (0 == PaddingPolicy::GetDefault ()).
+            /// \param[out] frameLengths Optional, if not 0, receives the length of
+            /// every frame (for datagram transports that send one frame per datagram).
+            /// \return Frames for all packets, in order.
+            static util::Buffer::SharedPtr SerializeBatch (
+                const std::vector<SharedPtr> &packets,
+                crypto::Cipher &cipher,
+                Session *session,
+                bool compress = false,
+                const PaddingPolicy *paddingPolicy = 0,
+                std::vector<std::size_t> *frameLengths = 0);
 
             /// \brief
             /// This method is not quite a mirror image of Serialize above. That is
@@ -66,20 +232,73 @@ namespace thekogans {
                 util::Buffer &ciphertext,
                 crypto::Cipher &cipher,
                 Session *session);
+            /// \brief
+            /// Same as above, but the \see{Session::Header} is validated against
+            /// the session (in the given \see{SessionTable}) it names. Use it on
+            /// servers where one socket carries packets from many sessions.
+            /// \param[in] ciphertext Serialized packet minus the leading \see{FrameHeader}.
+            /// \param[in] cipher \see{crypto::Cipher} corresponding to the \see{FrameHeader::keyId}
+            /// used to encrypt the payload.
+            /// \param[in] sessionTable \see{SessionTable} to validate the baked in
+            /// \see{Session::Header} against.
+            static SharedPtr Deserialize (
+                util::Buffer &ciphertext,
+                crypto::Cipher &cipher,
+                SessionTable &sessionTable);
 
             /// \brief
             /// Return the maximum framing overhead needed by Serialize above.
+            /// NOTE: This is the worst case (default padding and a \see{Session}).
+            /// Use GetFramingOverhead and GetMaxPacketSize below if you know how the
+            /// packet will be framed.
             /// \param[in] type \see{Packet} type being framed.
+            /// \param[in] maxPacketSize Maximum packet size.
             /// \return Maximum framing overhead needed by Serialize above.
             static std::size_t GetMaxFramingOverhead (
                     const char *type,
                     std::size_t maxPacketSize) {
+                return GetFramingOverhead (
+                    true,
+                    PaddingPolicy::GetDefault ().GetMaxPaddingLength ()) +
+                    util::Serializable::BinHeader (type, 0, maxPacketSize).Size ();
+            }
+
+            /// \brief
+            /// Return the framing overhead Serialize above adds to a serialized
+            /// packet (packet header + packet data). The plaintext part
+            /// (\see{PlaintextHeader}, padding and \see{Session::Header}) is exact
+            /// for full session headers, and an upper bound for compact ones
+            /// (\see{Session::compactHeader}).
+            /// The ciphertext part is crypto::Cipher::MAX_FRAMING_OVERHEAD_LENGTH.
+            /// \param[in] session true == packet will carry a \see{Session::Header}.
+            /// \param[in] paddingLength Padding length (see \see{PaddingPolicy}).
+            /// \return Framing overhead added by Serialize above.
+            static std::size_t GetFramingOverhead (
+                    bool session,
+                    std::size_t paddingLength) {
                 return crypto::Cipher::MAX_FRAMING_OVERHEAD_LENGTH +
                     PlaintextHeader::SIZE +
-                    PlaintextHeader::MAX_RANDOM_LENGTH +
-                    Session::Header::SIZE +
-                    util::Serializable::BinHeader (type, 0, maxPacketSize).Size ();
+                    paddingLength +
+                    (session ? Session::Header::SIZE : 0);
             }
+
+            /// \brief
+            /// Return the largest packet data size (not counting the packet header)
+            /// for which Serialize above will produce a frame no longer than
+            /// maxCiphertextLength. Used by fragmenting filters to fill every
+            /// fragment to the byte.
+            /// \param[in] type \see{Packet} type being framed.
+            /// \param[in] maxCiphertextLength Maximum frame length.
+            /// \param[in] session true == packet will carry a \see{Session::Header}.
+            /// \param[in] paddingPolicy \see{PaddingPolicy} that will be used
+            /// (0 == PaddingPolicy::GetDefault ()).
+            /// \return Largest packet data size that fits in maxCiphertextLength
+            /// (0 if none does).
+            static std::size_t GetMaxPacketSize (
+                const char *type,
+                std::size_t maxCiphertextLength,
+                bool session,
+                const PaddingPolicy *paddingPolicy = 0);
         };
 
         /// \brief
@@ -0,0 +1,227 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_PacketDispatcher_h)
+#define __thekogans_packet_PacketDispatcher_h
+
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct PacketDispatcher PacketDispatcher.h thekogans/packet/PacketDispatcher.h
+        ///
+        /// \brief
+        /// PacketDispatcher replaces the chain of packet->Type () compares in
+        /// \see{FrameParser::PacketHandler::HandlePacket} with a single table
+        /// lookup. Handlers are registered per \see{Packet} type and stored in
+        /// a dense table indexed by \see{Packet::TypeId}. Packets declared with
+        /// THEKOGANS_PACKET_DECLARE_PACKET get their id with one virtual call.
+        ///
+        /// Register all handlers before dispatching. Registration is not
+        /// synchronized with DispatchPacket.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// struct Server : public packet::FrameParser::PacketHandler {
+        ///     packet::PacketDispatcher dispatcher;
+        ///
+        ///     Server () {
+        ///         dispatcher.RegisterHandler (*this, &Server::HandleClientKeyExchangePacket);
+        ///         dispatcher.RegisterHandler (*this, &Server::HandlePacketFragmentPacket);
+        ///         ...
+        ///     }
+        ///
+        ///     void HandleClientKeyExchangePacket (
+        ///         packet::ClientKeyExchangePacket &packet,
+        ///         crypto::Cipher::SharedPtr cipher);
+        ///     void HandlePacketFragmentPacket (
+        ///         packet::PacketFragmentPacket &packet,
+        ///         crypto::Cipher::SharedPtr cipher);
+        ///
+        ///     // packet::FrameParser::PacketHandler
+        ///     virtual void HandlePacket (
+        ///             packet::Packet::SharedPtr packet,
+        ///             crypto::Cipher::SharedPtr cipher) throw () override {
+        ///         THEKOGANS_UTIL_TRY {
+        ///             if (!dispatcher.DispatchPacket (packet, cipher)) {
+        ///                 // Unknown packet.
+        ///             }
+        ///         }
+        ///         THEKOGANS_UTIL_CATCH_AND_LOG
+        ///     }
+        /// };
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL PacketDispatcher {
+            /// \struct PacketDispatcher::Handler PacketDispatcher.h thekogans/packet/PacketDispatcher.h
+            ///
+            /// \brief
+            /// Handler for one packet type.
+            struct _LIB_THEKOGANS_PACKET_DECL Handler : public util::RefCounted {
+                /// \brief
+                /// Declare \see{RefCounted} pointers.
+                THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (Handler)
+
+                /// \brief
+                /// dtor.
+                virtual ~Handler () {}
+
+                /// \brief
+                /// Handle the packet.
+                /// \param[in] packet \see{Packet} to handle.
+                /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt the packet.
+                virtual void HandlePacket (
+                    Packet::SharedPtr packet,
+                    crypto::Cipher::SharedPtr cipher) = 0;
+            };
+
+            /// \struct PacketDispatcher::MemberHandler PacketDispatcher.h thekogans/packet/PacketDispatcher.h
+            ///
+            /// \brief
+            /// Calls a Target member function with the packet downcast to T.
+            /// The downcast is static, as the table guarantees the type.
+            template<
+                typename T,
+                typename Target>
+            struct MemberHandler : public Handler {
+                /// \brief
+                /// Member function signature.
+                typedef void (Target::*Method) (
+                    T &packet,
+                    crypto::Cipher::SharedPtr cipher);
+
+                /// \brief
+                /// Object whose method to call.
+                Target &target;
+                /// \brief
+                /// Method to call.
+                Method method;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] target_ Object whose method to call.
+                /// \param[in] method_ Method to call.
+                MemberHandler (
+                    Target &target_,
+                    Method method_) :
+                    target (target_),
+                    method (method_) {}
+
+                /// \brief
+                /// Call the method.
+                /// \param[in] packet \see{Packet} to handle.
+                /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt the packet.
+                virtual void HandlePacket (
+                        Packet::SharedPtr packet,
+                        crypto::Cipher::SharedPtr cipher) override {
+                    (target.*method) (*static_cast<T *> (packet.Get ()), cipher);
+                }
+            };
+
+        private:
+            /// \brief
+            /// Handlers indexed by \see{Packet::TypeId}.
+            std::vector<Handler::SharedPtr> handlers;
+            /// \brief
+            /// Called for packets without a registered handler.
+            Handler::SharedPtr defaultHandler;
+
+        public:
+            /// \brief
+            /// ctor. Sizes the table to the number of packet types registered so far.
+            PacketDispatcher () :
+                handlers (Packet::GetTypeCount ()) {}
+
+            /// \brief
+            /// Register a handler for the given packet type id.
+            /// \param[in] typeId \see{Packet::TypeId} to register the handler for.
+            /// \param[in] handler Handler to call for packets of that type
+            /// (null == unregister).
+            void RegisterHandler (
+                Packet::TypeId typeId,
+                Handler::SharedPtr handler);
+            /// \brief
+            /// Register a handler for packets of type T. T must be declared
+            /// with THEKOGANS_PACKET_DECLARE_PACKET.
+            /// \param[in] handler Handler to call for packets of type T.
+            template<typename T>
+            inline void RegisterHandler (Handler::SharedPtr handler) {
+                RegisterHandler (T::TYPE_ID, handler);
+            }
+            /// \brief
+            /// Register a Target member function to handle packets of type T.
+            /// T must be declared with THEKOGANS_PACKET_DECLARE_PACKET.
+            /// \param[in] target Object whose method to call.
+            /// \param[in] method Method to call.
+            template<
+                typename T,
+                typename Target>
+            inline void RegisterHandler (
+                    Target &target,
+                    void (Target::*method) (T &, crypto::Cipher::SharedPtr)) {
+                RegisterHandler (T::TYPE_ID,
+                    Handler::SharedPtr (new MemberHandler<T, Target> (target, method)));
+            }
+
+            /// \brief
+            /// Set the handler called for packets without a registered handler.
+            /// \param[in] defaultHandler_ Default handler (null == none).
+            inline void SetDefaultHandler (Handler::SharedPtr defaultHandler_) {
+                defaultHandler = defaultHandler_;
+            }
+
+            /// \brief
+            /// Call the handler registered for the packet's type (or the default handler).
+            /// \param[in] packet \see{Packet} to dispatch.
+            /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt the packet.
+            /// \return true == packet was handled, false == no handler.
+            inline bool DispatchPacket (
+                    Packet::SharedPtr packet,
+                    crypto::Cipher::SharedPtr cipher) const {
+                if (packet.Get () != 0) {
+                    Packet::TypeId typeId = packet->GetTypeId ();
+                    Handler *handler = typeId < handlers.size () ?
+                        handlers[typeId].Get () : 0;
+                    if (handler == 0) {
+                        handler = defaultHandler.Get ();
+                    }
+                    if (handler != 0) {
+                        handler->HandlePacket (packet, cipher);
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            /// \brief
+            /// PacketDispatcher is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (PacketDispatcher)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_PacketDispatcher_h)
@@ -18,10 +18,13 @@
 #if !defined (__thekogans_packet_PacketFilter_h)
 #define __thekogans_packet_PacketFilter_h
 
+#include <utility>
+#include <vector>
 #include "thekogans/util/Types.h"
 #include "thekogans/util/RefCounted.h"
 #include "thekogans/packet/Config.h"
 #include "thekogans/packet/Packet.h"
+#include "thekogans/packet/PacketFilterStats.h"
 
 namespace thekogans {
     namespace packet {
@@ -40,6 +43,11 @@ namespace thekogans {
         /// Convenient typedef for util::IntrusiveList<PacketFilter, PACKET_FILTER_LIST_ID>.
         typedef util::IntrusiveList<PacketFilter, PACKET_FILTER_LIST_ID> PacketFilterList;
 
+        /// \brief
+        /// Convenient typedef for std::vector<Packet::SharedPtr>.
+        /// Used to pass batches of packets through filter chains.
+        typedef std::vector<Packet::SharedPtr> PacketBatch;
+
     #if defined (_MSC_VER)
         #pragma warning (push)
         #pragma warning (disable : 4275)
@@ -50,6 +58,7 @@ namespace thekogans {
         /// \brief
         /// PacketFilter is the base for all incoming and outgoing packet filters. You
         /// install packet filters in to \see{Tunnel} incoming and outging filter chains.
+        /// Use a \see{PacketFilterChain} for chains that change while packets are flowing.
 
         struct _LIB_THEKOGANS_PACKET_DECL PacketFilter :
                 public virtual util::RefCounted,
@@ -58,6 +67,12 @@ namespace thekogans {
             /// Declare \see{RefCounted} pointers.
             THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (PacketFilter)
 
+        protected:
+            /// \brief
+            /// Optional instrumentation (see \see{PacketFilterStats}).
+            PacketFilterStats::SharedPtr stats;
+
+        public:
             /// \brief
             /// dtor.
             virtual ~PacketFilter () {}
@@ -76,15 +91,108 @@ namespace thekogans {
             /// \return A filtered packet.
             virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr /*packet*/) = 0;
 
+            /// \brief
+            /// Filter a batch of packets (all the packets from one recvmmsg,
+            /// or all the frames parsed from one buffer). On return, packets
+            /// contains the filtered packets, in order, with consumed packets
+            /// removed. The default implementation calls FilterPacket on every
+            /// packet, so every filter supports batches. Override it to amortize
+            /// per call costs over the batch. An override should pass the packets
+            /// it doesn't handle on to CallNextPacketFilters.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            virtual void FilterPackets (PacketBatch &packets) {
+                std::size_t count = 0;
+                for (std::size_t i = 0, size = packets.size (); i < size; ++i) {
+                    Packet::SharedPtr packet = FilterPacket (std::move (packets[i]));
+                    if (packet.Get () != 0) {
+                        packets[count++] = std::move (packet);
+                    }
+                }
+                packets.resize (count);
+            }
+
+            /// \brief
+            /// Called on the filters in a \see{Tunnel}'s outgoing chain when the
+            /// transport's send queue crosses a water mark (see
+            /// \see{Tunnel::EventSink::HandleTunnelBackpressure}). Filters that hold
+            /// packets back (ex: \see{FragmentPacketPacketFilter}) resume sending
+            /// them when on == false. Not called with any tunnel locks held.
+            /// \param[in] on true == backpressure on, false == off.
+            virtual void HandleBackpressure (bool /*on*/) {}
+
+            /// \brief
+            /// Return the filter's instrumentation.
+            /// \return \see{PacketFilterStats} (null if not instrumented).
+            inline PacketFilterStats::SharedPtr GetStats () const {
+                return stats;
+            }
+            /// \brief
+            /// Attach (or detach) instrumentation. Set it before installing the
+            /// filter in a chain, as it's not synchronized with FilterPacket.
+            /// \param[in] stats_ \see{PacketFilterStats} (null == not instrumented).
+            inline void SetStats (PacketFilterStats::SharedPtr stats_) {
+                stats = stats_;
+            }
+
+            /// \brief
+            /// Call filter.FilterPacket, recording it in filter's stats (if any).
+            /// Use this (instead of calling FilterPacket directly) to feed the
+            /// first filter in a chain.
+            /// \param[in] filter \see{PacketFilter} to call.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return A filtered packet.
+            static inline Packet::SharedPtr CallFilterPacket (
+                    PacketFilter &filter,
+                    Packet::SharedPtr packet) {
+                return filter.stats.Get () == 0 ?
+                    filter.FilterPacket (std::move (packet)) :
+                    filter.stats->FilterPacket (filter, std::move (packet));
+            }
+            /// \brief
+            /// Call filter.FilterPackets, recording it in filter's stats (if any).
+            /// \param[in] filter \see{PacketFilter} to call.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            static inline void CallFilterPackets (
+                    PacketFilter &filter,
+                    PacketBatch &packets) {
+                if (filter.stats.Get () == 0) {
+                    filter.FilterPackets (packets);
+                }
+                else {
+                    filter.stats->FilterPackets (filter, packets);
+                }
+            }
+
         protected:
             /// \brief
             /// If there's a next packet filter, pass the packet to it,
             /// otherwise just return it unchanged.
+            /// NOTE: The packet is moved (not copied) in to the next filter
+            /// to avoid reference count traffic on every hop.
             /// \param[in] packet \see{Packet} to pass to the next filter.
             /// \return Either the results of next packet filter (if there is one),
             /// or an unchanged packet.
             inline Packet::SharedPtr CallNextPacketFilter (Packet::SharedPtr packet) const {
-                return next != 0 ? next->FilterPacket (packet) : packet;
+                if (next != 0) {
+                    if (stats.Get () != 0) {
+                        stats->RecordForwarded (1);
+                    }
+                    return CallFilterPacket (*next, std::move (packet));
+                }
+                return packet;
+            }
+
+            /// \brief
+            /// If there's a next packet filter, pass the batch to it,
+            /// otherwise leave it unchanged.
+            /// \param[in, out] packets \see{Packet}s to pass to the next filter.
+            inline void CallNextPacketFilters (PacketBatch &packets) const {
+                if (next != 0 && !packets.empty ()) {
+                    if (stats.Get () != 0) {
+                        stats->RecordForwarded (packets.size ());
+                    }
+                    CallFilterPackets (*next, packets);
+                }
             }
         };
 
@@ -0,0 +1,148 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_PacketFilterChain_h)
+#define __thekogans_packet_PacketFilterChain_h
+
+#include <atomic>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/EpochReclaimer.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct PacketFilterChain PacketFilterChain.h thekogans/packet/PacketFilterChain.h
+        ///
+        /// \brief
+        /// PacketFilterChain is a \see{PacketFilter} chain that can be modified while
+        /// packets are flowing through it. Unlike a \see{PacketFilterList}, where the
+        /// chain is threaded through the filters themselves, PacketFilterChain keeps an
+        /// immutable snapshot (an array) of the filters. FilterPacket walks the current
+        /// snapshot inside an \see{EpochReclaimer} read side section, so the per packet
+        /// cost is an epoch store and an atomic pointer load. There are no locks on the
+        /// packet path. Writers (AddFilter, RemoveFilter...) serialize on a mutex, copy the
+        /// snapshot, modify the copy and publish it. The old snapshot (and with it the last
+        /// reference to a removed filter) is retired, and deleted once all packets that
+        /// were walking it are done.
+        ///
+        /// Filters are called in snapshot order. Each filter in a chain is stand alone
+        /// (it must not be linked in to a \see{PacketFilterList}), so it's CallNextPacketFilter
+        /// returns the packet to the chain, which then passes it on to the next filter.
+        /// As with \see{PacketFilterList}, a filter returning Packet::SharedPtr () stops
+        /// all further processing of the packet.
+        ///
+        /// NOTE: A packet that is in flight while a filter is removed may still be passed
+        /// to that filter. Filters must therefore tolerate being called (concurrently)
+        /// after their removal, until the chain's next grace period.
+
+        struct _LIB_THEKOGANS_PACKET_DECL PacketFilterChain {
+        private:
+            /// \struct PacketFilterChain::Snapshot PacketFilterChain.h thekogans/packet/PacketFilterChain.h
+            ///
+            /// \brief
+            /// Immutable published version of the chain.
+            struct Snapshot : public EpochReclaimer::Retirable {
+                /// \brief
+                /// Filters in call order.
+                std::vector<PacketFilter::SharedPtr> filters;
+            };
+            /// \brief
+            /// Current snapshot (never null).
+            std::atomic<Snapshot *> snapshot;
+            /// \brief
+            /// Serializes writers.
+            util::Mutex mutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            PacketFilterChain () :
+                snapshot (new Snapshot) {}
+            /// \brief
+            /// dtor. The chain must not be in use.
+            ~PacketFilterChain ();
+
+            /// \brief
+            /// Add the given filter at the given position.
+            /// \param[in] filter \see{PacketFilter} to add.
+            /// \param[in] index Position (clamped to the chain length;
+            /// -1 == end of chain).
+            void AddFilter (
+                PacketFilter::SharedPtr filter,
+                std::size_t index = (std::size_t)-1);
+            /// \brief
+            /// Remove the given filter.
+            /// \param[in] filter \see{PacketFilter} to remove.
+            /// \return true == removed, false == filter was not in the chain.
+            bool RemoveFilter (const PacketFilter &filter);
+            /// \brief
+            /// Atomically replace one filter with another (ex: hot swap
+            /// a rate limit filter with a reconfigured one). Every packet
+            /// sees either the old filter or the new, never both or neither.
+            /// \param[in] oldFilter \see{PacketFilter} to replace.
+            /// \param[in] newFilter \see{PacketFilter} to replace it with.
+            /// \return true == replaced, false == oldFilter was not in the chain.
+            bool ReplaceFilter (
+                const PacketFilter &oldFilter,
+                PacketFilter::SharedPtr newFilter);
+            /// \brief
+            /// Remove all filters.
+            void Clear ();
+
+            /// \brief
+            /// Return a copy of the current list of filters.
+            /// \return Current list of filters.
+            std::vector<PacketFilter::SharedPtr> GetFilters () const;
+
+            /// \brief
+            /// Run the packet through the current chain. Lock free.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return A filtered packet (Packet::SharedPtr () if consumed).
+            Packet::SharedPtr FilterPacket (Packet::SharedPtr packet);
+            /// \brief
+            /// Run the batch through the current chain. Lock free. The whole
+            /// batch sees the same snapshot.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            void FilterPackets (PacketBatch &packets);
+
+            /// \brief
+            /// Call HandleBackpressure on every filter in the current chain.
+            /// Filters are called outside of the read side section, as they
+            /// can send (and block on) packets of their own.
+            /// \param[in] on true == backpressure on, false == off.
+            void HandleBackpressure (bool on);
+
+        private:
+            /// \brief
+            /// Publish a new snapshot and retire the old one.
+            /// Must be called with mutex held.
+            /// \param[in] newSnapshot Snapshot to publish.
+            void Publish (Snapshot *newSnapshot);
+
+            /// \brief
+            /// PacketFilterChain is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (PacketFilterChain)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_PacketFilterChain_h)
@@ -0,0 +1,216 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_PacketFilterStats_h)
+#define __thekogans_packet_PacketFilterStats_h
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \brief
+        /// Forward declaration of PacketFilter.
+        struct PacketFilter;
+
+        /// \struct PacketFilterStats PacketFilterStats.h thekogans/packet/PacketFilterStats.h
+        ///
+        /// \brief
+        /// PacketFilterStats collects call counts, packet outcomes and a latency
+        /// histogram for one \see{PacketFilter}. Attach it with PacketFilter::SetStats.
+        /// Filters without stats pay a single null check per call.
+        ///
+        /// Latency is measured both inclusive (the whole FilterPacket call) and
+        /// exclusive (minus the time spent in downstream filters called through
+        /// CallNextPacketFilter), so that a slow filter at the tail of a chain isn't
+        /// blamed on the ones in front of it. The histogram is of exclusive latency.
+        ///
+        /// Counters are sharded. Each thread updates it's own (cache line sized)
+        /// shard with relaxed atomic adds, so instrumented filters called from many
+        /// threads don't contend on a shared cache line. GetSnapshot sums the shards.
+
+        struct _LIB_THEKOGANS_PACKET_DECL PacketFilterStats : public util::RefCounted {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (PacketFilterStats)
+
+            enum {
+                /// \brief
+                /// Number of counter shards.
+                SHARD_COUNT = 16,
+                /// \brief
+                /// Number of latency histogram buckets. Bucket 0 counts calls
+                /// that took less than 2ns. Bucket i (i > 0) counts calls that
+                /// took [2^i, 2^(i + 1)) ns. The last bucket is open ended.
+                HISTOGRAM_BUCKET_COUNT = 32
+            };
+
+            /// \struct PacketFilterStats::Snapshot PacketFilterStats.h thekogans/packet/PacketFilterStats.h
+            ///
+            /// \brief
+            /// Point in time sum of all shards.
+            struct _LIB_THEKOGANS_PACKET_DECL Snapshot {
+                /// \brief
+                /// Number of FilterPacket calls.
+                util::ui64 calls;
+                /// \brief
+                /// Number of FilterPackets (batch) calls.
+                util::ui64 batchCalls;
+                /// \brief
+                /// Number of packets passed to the filter (single and batched).
+                util::ui64 packets;
+                /// \brief
+                /// Number of packets passed on to the next filter.
+                util::ui64 forwarded;
+                /// \brief
+                /// Number of packets dropped (consumed) by the filter or it's
+                /// downstream filters.
+                util::ui64 dropped;
+                /// \brief
+                /// Number of times the filter returned a packet other than the
+                /// one it was given.
+                util::ui64 replaced;
+                /// \brief
+                /// Number of calls that ended with an exception.
+                util::ui64 exceptions;
+                /// \brief
+                /// Total inclusive time (ns).
+                util::ui64 inclusiveTime;
+                /// \brief
+                /// Total exclusive time (ns).
+                util::ui64 exclusiveTime;
+                /// \brief
+                /// Exclusive latency histogram (see HISTOGRAM_BUCKET_COUNT).
+                util::ui64 histogram[HISTOGRAM_BUCKET_COUNT];
+
+                /// \brief
+                /// ctor.
+                Snapshot ();
+
+                /// \brief
+                /// Return the upper bound (ns) of the histogram bucket
+                /// containing the given percentile of calls.
+                /// \param[in] percentile [0.0, 1.0].
+                /// \return Upper bound (ns) of the percentile's bucket.
+                util::ui64 GetPercentile (util::f64 percentile) const;
+            };
+
+        private:
+            /// \struct PacketFilterStats::Shard PacketFilterStats.h thekogans/packet/PacketFilterStats.h
+            ///
+            /// \brief
+            /// Counters updated by a subset of threads.
+            struct Shard {
+                std::atomic<util::ui64> calls;
+                std::atomic<util::ui64> batchCalls;
+                std::atomic<util::ui64> packets;
+                std::atomic<util::ui64> forwarded;
+                std::atomic<util::ui64> dropped;
+                std::atomic<util::ui64> replaced;
+                std::atomic<util::ui64> exceptions;
+                std::atomic<util::ui64> inclusiveTime;
+                std::atomic<util::ui64> exclusiveTime;
+                std::atomic<util::ui64> histogram[HISTOGRAM_BUCKET_COUNT];
+                /// \brief
+                /// Keep shards from sharing cache lines.
+                util::ui8 padding[64];
+
+                /// \brief
+                /// ctor.
+                Shard ();
+            };
+            /// \brief
+            /// Name (for reporting).
+            std::string name;
+            /// \brief
+            /// Counter shards.
+            Shard shards[SHARD_COUNT];
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] name_ Name (for reporting).
+            explicit PacketFilterStats (const std::string &name_ = std::string ()) :
+                name (name_) {}
+
+            /// \brief
+            /// Return the name.
+            /// \return Name.
+            inline const std::string &GetName () const {
+                return name;
+            }
+
+            /// \brief
+            /// Return the sum of all shards.
+            /// \return Sum of all shards.
+            Snapshot GetSnapshot () const;
+            /// \brief
+            /// Zero all counters.
+            void Reset ();
+
+            /// \brief
+            /// Call filter.FilterPacket and record the outcome.
+            /// \param[in] filter \see{PacketFilter} to call.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return A filtered packet.
+            Packet::SharedPtr FilterPacket (
+                PacketFilter &filter,
+                Packet::SharedPtr packet);
+            /// \brief
+            /// Call filter.FilterPackets and record the outcome.
+            /// \param[in] filter \see{PacketFilter} to call.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            void FilterPackets (
+                PacketFilter &filter,
+                std::vector<Packet::SharedPtr> &packets);
+
+            /// \brief
+            /// Record packets passed on to the next filter.
+            /// \param[in] count Number of packets passed on.
+            inline void RecordForwarded (std::size_t count) {
+                GetShard ().forwarded.fetch_add (count, std::memory_order_relaxed);
+            }
+
+        private:
+            /// \brief
+            /// Return the calling thread's shard.
+            /// \return The calling thread's shard.
+            Shard &GetShard ();
+            /// \brief
+            /// Record a call's latency.
+            /// \param[in] shard Shard to update.
+            /// \param[in] inclusiveTime Inclusive time (ns).
+            /// \param[in] exclusiveTime Exclusive time (ns).
+            static void RecordTime (
+                Shard &shard,
+                util::ui64 inclusiveTime,
+                util::ui64 exclusiveTime);
+
+            /// \brief
+            /// PacketFilterStats is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (PacketFilterStats)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_PacketFilterStats_h)
@@ -33,12 +33,13 @@ namespace thekogans {
         ///
         /// \brief
         /// PacketFragmentPacket packets are used to transport \see{Packet}s that are too big to
-        /// fit in to a single frame.
+        /// fit in to a single frame. Version 2 serializes the \see{Packet::streamId}
+        /// (the stream of the fragmented packet). Version 1 fragments belong to stream 0.
 
         struct _LIB_THEKOGANS_PACKET_DECL PacketFragmentPacket : public Packet {
             /// \brief
             /// Pull in Packet dynamic creation machinery.
-            THEKOGANS_UTIL_DECLARE_SERIALIZABLE (PacketFragmentPacket)
+            THEKOGANS_PACKET_DECLARE_PACKET (PacketFragmentPacket)
 
             /// \brief
             /// \see{Packet} fragment number.
@@ -55,13 +56,17 @@ namespace thekogans {
             /// \param[in] fragmentNumber_ \see{Packet} fragment number.
             /// \param[in] fragmentCount_ Total \see{Packet} fragment count.
             /// \param[in] fragment_ \see{Packet} fragment.
+            /// \param[in] streamId_ Stream of the fragmented \see{Packet}.
             PacketFragmentPacket (
                 std::size_t fragmentNumber_ = 0,
                 std::size_t fragmentCount_ = 0,
-                util::Buffer::SharedPtr fragment_ = util::Buffer::SharedPtr ()) :
+                util::Buffer::SharedPtr fragment_ = util::Buffer::SharedPtr (),
+                util::ui32 streamId_ = 0) :
                 fragmentNumber (fragmentNumber_),
                 fragmentCount (fragmentCount_),
-                fragment (fragment_) {}
+                fragment (fragment_) {
+                streamId = streamId_;
+            }
 
         protected:
             /// \brief
@@ -69,6 +74,7 @@ namespace thekogans {
             /// \return Serialized packet size.
             virtual std::size_t Size () const override {
                 return
+                    util::Serializer::Size (streamId) +
                     util::Serializer::Size (fragmentNumber) +
                     util::Serializer::Size (fragmentCount) +
                     util::Serializer::Size (*fragment);
@@ -86,6 +92,9 @@ namespace thekogans {
             /// \param[out] serializer Packet contents.
             virtual void Write (util::Serializer &serializer) const override;
 
+            /// \brief
+            /// "StreamId"
+            static const char * const ATTR_STREAM_ID;
             /// \brief
             /// "FragmentNumber"
             static const char * const ATTR_FRAGMENT_NUMBER;
@@ -33,7 +33,7 @@ namespace thekogans {
             /// \brief
             /// Because the thekogans_packet library uses dynamic initialization, when
             /// using it in static builds call this method to have the library explicitly
-            /// include all internal packet types.
+            /// include all internal packet types (and assign their \see{Packet::TypeId}s).
             static void StaticInit ();
         #endif // defined (THEKOGANS_PACKET_TYPE_Static)
         };
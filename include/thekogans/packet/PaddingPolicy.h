@@ -0,0 +1,183 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_PaddingPolicy_h)
+#define __thekogans_packet_PaddingPolicy_h
+
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/PlaintextHeader.h"
+
+namespace thekogans {
+    namespace packet {
+
+    #if defined (_MSC_VER)
+        #pragma warning (push)
+        #pragma warning (disable : 4275)
+    #endif // defined (_MSC_VER)
+
+        /// \struct PaddingPolicy PaddingPolicy.h thekogans/packet/PaddingPolicy.h
+        ///
+        /// \brief
+        /// PaddingPolicy decides how much random data \see{Packet::Serialize} places
+        /// between the \see{PlaintextHeader} and the packet (see \see{FrameParser}).
+        /// Padding thwarts histogram analysis and known plaintext attacks, but it is
+        /// paid for on every packet. Pick the policy that fits your traffic:
+        /// - \see{UniformRandomPaddingPolicy} (default): 1 - maxLength random bytes.
+        /// - \see{BucketPaddingPolicy}: pad the plaintext up to a multiple of the bucket
+        ///   size so that only the size class of a packet is observable.
+        /// - \see{MinimalPaddingPolicy}: no padding. Use when the payload already has
+        ///   enough entropy (or size hiding is not a concern) and every byte counts.
+
+        struct _LIB_THEKOGANS_PACKET_DECL PaddingPolicy : public virtual util::RefCounted {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (PaddingPolicy)
+
+            /// \brief
+            /// dtor.
+            virtual ~PaddingPolicy () {}
+
+            /// \brief
+            /// Return the policy used by \see{Packet::Serialize} when none is given
+            /// (\see{UniformRandomPaddingPolicy} with PlaintextHeader::MAX_RANDOM_LENGTH).
+            /// \return Default padding policy.
+            static const PaddingPolicy &GetDefault ();
+
+            /// \brief
+            /// Return the padding length for a plaintext of the given length.
+            /// \param[in] plaintextLength Plaintext length (without padding).
+            /// \return Padding length.
+            virtual util::ui8 GetPaddingLength (std::size_t plaintextLength) const = 0;
+            /// \brief
+            /// Return the largest padding length GetPaddingLength will ever return.
+            /// Used to compute the framing overhead.
+            /// \return Largest padding length.
+            virtual util::ui8 GetMaxPaddingLength () const = 0;
+        };
+
+        /// \struct UniformRandomPaddingPolicy PaddingPolicy.h thekogans/packet/PaddingPolicy.h
+        ///
+        /// \brief
+        /// Pad every plaintext with a uniformly distributed random
+        /// length in the range [1, maxLength].
+
+        struct _LIB_THEKOGANS_PACKET_DECL UniformRandomPaddingPolicy : public PaddingPolicy {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (UniformRandomPaddingPolicy)
+
+        private:
+            /// \brief
+            /// Maximum padding length.
+            util::ui8 maxLength;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] maxLength_ Maximum padding length (must be > 0).
+            explicit UniformRandomPaddingPolicy (
+                util::ui8 maxLength_ = PlaintextHeader::MAX_RANDOM_LENGTH);
+
+            /// \brief
+            /// Return a random padding length in the range [1, maxLength].
+            /// \param[in] plaintextLength Plaintext length (without padding).
+            /// \return Padding length.
+            virtual util::ui8 GetPaddingLength (
+                std::size_t /*plaintextLength*/) const override;
+            /// \brief
+            /// Return maxLength.
+            /// \return maxLength.
+            virtual util::ui8 GetMaxPaddingLength () const override {
+                return maxLength;
+            }
+        };
+
+        /// \struct BucketPaddingPolicy PaddingPolicy.h thekogans/packet/PaddingPolicy.h
+        ///
+        /// \brief
+        /// Pad every plaintext up to the next multiple of bucketSize. An
+        /// observer only learns which size class a packet belongs to.
+        /// Since the padding length is a ui8, bucketSize is limited to 256.
+
+        struct _LIB_THEKOGANS_PACKET_DECL BucketPaddingPolicy : public PaddingPolicy {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (BucketPaddingPolicy)
+
+        private:
+            /// \brief
+            /// Size class granularity.
+            std::size_t bucketSize;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] bucketSize_ Size class granularity (1 - 256).
+            explicit BucketPaddingPolicy (std::size_t bucketSize_ = 64);
+
+            /// \brief
+            /// Return the padding needed to round plaintextLength
+            /// up to the next multiple of bucketSize.
+            /// \param[in] plaintextLength Plaintext length (without padding).
+            /// \return Padding length.
+            virtual util::ui8 GetPaddingLength (std::size_t plaintextLength) const override {
+                return (util::ui8)((bucketSize - plaintextLength % bucketSize) % bucketSize);
+            }
+            /// \brief
+            /// Return bucketSize - 1.
+            /// \return bucketSize - 1.
+            virtual util::ui8 GetMaxPaddingLength () const override {
+                return (util::ui8)(bucketSize - 1);
+            }
+        };
+
+        /// \struct MinimalPaddingPolicy PaddingPolicy.h thekogans/packet/PaddingPolicy.h
+        ///
+        /// \brief
+        /// Don't pad at all.
+
+        struct _LIB_THEKOGANS_PACKET_DECL MinimalPaddingPolicy : public PaddingPolicy {
+            /// \brief
+            /// Declare \see{RefCounted} pointers.
+            THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (MinimalPaddingPolicy)
+
+            /// \brief
+            /// Return 0.
+            /// \param[in] plaintextLength Plaintext length (without padding).
+            /// \return 0.
+            virtual util::ui8 GetPaddingLength (
+                    std::size_t /*plaintextLength*/) const override {
+                return 0;
+            }
+            /// \brief
+            /// Return 0.
+            /// \return 0.
+            virtual util::ui8 GetMaxPaddingLength () const override {
+                return 0;
+            }
+        };
+
+    #if defined (_MSC_VER)
+        #pragma warning (pop)
+    #endif // defined (_MSC_VER)
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_PaddingPolicy_h)
@@ -49,7 +49,12 @@ namespace thekogans {
                 FLAGS_SESSION_HEADER = 1,
                 /// \brief
                 /// \see{Packet} payload is compressed.
-                FLAGS_COMPRESSED = 2
+                FLAGS_COMPRESSED = 2,
+                /// \brief
+                /// A compact session header (the low 32 bits of the sequence
+                /// number) follows the random vector. The session is implied
+                /// by the key (see \see{Session::compactHeader}).
+                FLAGS_COMPACT_SESSION_HEADER = 4
             };
             /// \brief
             /// \see{Packet} flags.
@@ -18,11 +18,13 @@
 #if !defined (__thekogans_packet_ReassemblePacketFragmentsPacketFilter_h)
 #define __thekogans_packet_ReassemblePacketFragmentsPacketFilter_h
 
+#include <list>
 #include "thekogans/util/Types.h"
 #include "thekogans/util/ByteSwap.h"
 #include "thekogans/util/Buffer.h"
 #include "thekogans/packet/Config.h"
 #include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/PacketFragmentPacket.h"
 
 namespace thekogans {
     namespace packet {
@@ -33,34 +35,115 @@ namespace thekogans {
         /// \brief
         /// ReassemblePacketFragmentsPacketFilter is a \see{PacketFragmentPacket} reassembly filter.
         /// Insert it in to your \see{Tunnel} incoming filter chain if you allow fragmented packets
-        /// from peers.
+        /// from peers. Fragments of packets on different streams (see \see{Packet::streamId})
+        /// can be interleaved. Each stream is reassembled on it's own, and the reassembled
+        /// packet gets it's stream id back. Stream ids and fragment counts are chosen by
+        /// the peer, so at most maxPendingPackets packets are reassembled at the same time
+        /// (if a new stream needs room, the oldest incomplete packet is dropped), and
+        /// packets whose fragments could add up to more than maxPacketLength (0 == no
+        /// limit) are refused. Reassembly buffers grow as fragments arrive, so memory
+        /// tracks what the peer actually sent, not the fragment count it claims.
 
         struct _LIB_THEKOGANS_PACKET_DECL ReassemblePacketFragmentsPacketFilter : public PacketFilter {
+            enum {
+                /// \brief
+                /// Default maximum number of incomplete packets.
+                DEFAULT_MAX_PENDING_PACKETS = 16,
+                /// \brief
+                /// Default maximum reassembled packet length.
+                DEFAULT_MAX_PACKET_LENGTH = 1024 * 1024 * 1024
+            };
+
         private:
             /// \brief
             /// Maximum fragment size.
             std::size_t maxCiphertextLength;
             /// \brief
+            /// Maximum number of incomplete packets.
+            std::size_t maxPendingPackets;
+            /// \brief
+            /// Maximum reassembled packet length (0 == no limit).
+            /// Protects us from malicious actors.
+            std::size_t maxPacketLength;
+            /// \brief
             /// Packet frame endianness.
-            util::Buffer::SharedPtr packetFragmentBuffer;
+            util::Endianness endianness;
+            /// \struct ReassemblePacketFragmentsPacketFilter::PendingPacket
+            /// ReassemblePacketFragmentsPacketFilter.h
+            /// thekogans/packet/ReassemblePacketFragmentsPacketFilter.h
+            ///
+            /// \brief
+            /// Reassembly state of an incomplete packet.
+            struct PendingPacket {
+                /// \brief
+                /// Stream the packet was sent on.
+                util::ui32 streamId;
+                /// \brief
+                /// Total number of fragments.
+                std::size_t fragmentCount;
+                /// \brief
+                /// Number of the next expected fragment.
+                std::size_t nextFragmentNumber;
+                /// \brief
+                /// Fragments received so far.
+                util::Buffer::SharedPtr buffer;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] streamId_ Stream the packet was sent on.
+                /// \param[in] fragmentCount_ Total number of fragments.
+                /// \param[in] buffer_ Buffer to hold the fragments.
+                PendingPacket (
+                    util::ui32 streamId_,
+                    std::size_t fragmentCount_,
+                    util::Buffer::SharedPtr buffer_) :
+                    streamId (streamId_),
+                    fragmentCount (fragmentCount_),
+                    nextFragmentNumber (1),
+                    buffer (buffer_) {}
+            };
+            /// \brief
+            /// Packets being reassembled (one per stream), oldest first.
+            std::list<PendingPacket> pendingPackets;
 
         public:
             /// \brief
             /// ctor.
             /// \param[in] maxCiphertextLength_ Maximum fragment size.
-            /// \param[in] endianness Packet frame endianness.
+            /// \param[in] maxPendingPackets_ Maximum number of incomplete packets.
+            /// \param[in] maxPacketLength_ Maximum reassembled packet length (0 == no limit).
+            /// \param[in] endianness_ Packet frame endianness.
             ReassemblePacketFragmentsPacketFilter (
                 std::size_t maxCiphertextLength_,
-                util::Endianness endianness = util::NetworkEndian) :
+                std::size_t maxPendingPackets_ = DEFAULT_MAX_PENDING_PACKETS,
+                std::size_t maxPacketLength_ = DEFAULT_MAX_PACKET_LENGTH,
+                util::Endianness endianness_ = util::NetworkEndian) :
                 maxCiphertextLength (maxCiphertextLength_),
-                packetFragmentBuffer (new util::Buffer (endianness)) {}
+                maxPendingPackets (maxPendingPackets_),
+                maxPacketLength (maxPacketLength_),
+                endianness (endianness_) {}
 
             /// \brief
             /// Called by \see{Tunnel}::HandlePacket to reassemble \see{PacketFragmentPacket}.
             /// \param[in] packet \see{Packet} to filter.
             /// \return If the given packet is \see{PacketFragmentPacket}, reassemble
             /// (and possibly return) the packet it contains, otherwise call CallNextPacketFilter.
-            virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet);
+            virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet) override;
+
+            /// \brief
+            /// Batch version of FilterPacket. Fragments are reassembled in a tight
+            /// loop, and runs of other packets are passed down the chain as batches.
+            /// The relative order of packets is preserved.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            virtual void FilterPackets (PacketBatch &packets) override;
+
+        private:
+            /// \brief
+            /// Add the given fragment to the packet being reassembled.
+            /// \param[in] packetFragment \see{PacketFragmentPacket} to add.
+            /// \return The reassembled packet if packetFragment was the last
+            /// fragment, Packet::SharedPtr () otherwise.
+            Packet::SharedPtr ReassemblePacketFragment (PacketFragmentPacket &packetFragment);
         };
 
     } // namespace packet
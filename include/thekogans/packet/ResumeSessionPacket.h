@@ -0,0 +1,128 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_ResumeSessionPacket_h)
+#define __thekogans_packet_ResumeSessionPacket_h
+
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Serializer.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/Packet.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct ResumeSessionPacket ResumeSessionPacket.h thekogans/packet/ResumeSessionPacket.h
+        ///
+        /// \brief
+        /// ResumeSessionPacket packets are sent by a reconnecting client in place of a
+        /// \see{ClientKeyExchangePacket} (and are encrypted the same way). They return the
+        /// sealed \see{SessionTicket} the server issued (see \see{SessionTicketPacket}),
+        /// and propose a fresh \see{Session} for the resumed connection. If the server
+        /// redeems the ticket (\see{SessionTicketManager::RedeemTicket}), it switches to
+        /// the ticket's key and the proposed session, and it's first reply completes the
+        /// resumption (one round trip, no public key operations). Otherwise it answers
+        /// as if it received a \see{ClientKeyExchangePacket} it couldn't use, and the
+        /// client falls back to a full key exchange.
+
+        struct _LIB_THEKOGANS_PACKET_DECL ResumeSessionPacket : public Packet {
+            /// \brief
+            /// Pull in Packet dynamic creation machinery.
+            THEKOGANS_PACKET_DECLARE_PACKET (ResumeSessionPacket)
+
+            /// \brief
+            /// Sealed \see{SessionTicket}.
+            util::Buffer::SharedPtr ticket;
+            /// \brief
+            /// Proposed \see{Session}, from the server's point of view
+            /// (the client sends it's session's GetPeerSession ()).
+            Session session;
+
+            /// \brief
+            /// ctor.
+            /// \param[in] ticket_ Sealed \see{SessionTicket}.
+            /// \param[in] session_ Proposed \see{Session} (server's point of view).
+            ResumeSessionPacket (
+                util::Buffer::SharedPtr ticket_ = util::Buffer::SharedPtr (),
+                const Session &session_ = Session ()) :
+                ticket (ticket_),
+                session (session_) {}
+
+        protected:
+            /// \brief
+            /// Return serialized packet size.
+            /// \return Serialized packet size.
+            virtual std::size_t Size () const override {
+                return
+                    util::Serializer::Size (*ticket) +
+                    session.Size ();
+            }
+
+            /// \brief
+            /// De-serialize the packet.
+            /// \param[in] header Packet header.
+            /// \param[in] serializer Packet contents.
+            virtual void Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) override;
+            /// \brief
+            /// Serialize the packet.
+            /// \param[out] serializer Packet contents.
+            virtual void Write (util::Serializer &serializer) const override;
+
+            /// \brief
+            /// "SessionId"
+            static const char * const ATTR_SESSION_ID;
+            /// \brief
+            /// "InboundSequenceNumber"
+            static const char * const ATTR_INBOUND_SEQUENCE_NUMBER;
+            /// \brief
+            /// "OutboundSequenceNumber"
+            static const char * const ATTR_OUTBOUND_SEQUENCE_NUMBER;
+
+            /// \brief
+            /// Read a Serializable from an XML DOM.
+            /// \param[in] node XML DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) override;
+            /// \brief
+            /// Write a Serializable to the XML DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (pugi::xml_node &node) const override;
+
+            /// \brief
+            /// Read a Serializable from an JSON DOM.
+            /// \param[in] node JSON DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object &object) override;
+            /// \brief
+            /// Write a Serializable to the JSON DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (util::JSON::Object &object) const override;
+
+            /// \brief
+            /// ResumeSessionPacket is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (ResumeSessionPacket)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_ResumeSessionPacket_h)
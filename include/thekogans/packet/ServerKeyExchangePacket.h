@@ -48,7 +48,7 @@ namespace thekogans {
         struct _LIB_THEKOGANS_PACKET_DECL ServerKeyExchangePacket : public Packet {
             /// \brief
             /// Pull in Packet dynamic creation machinery.
-            THEKOGANS_UTIL_DECLARE_SERIALIZABLE (ServerKeyExchangePacket)
+            THEKOGANS_PACKET_DECLARE_PACKET (ServerKeyExchangePacket)
 
             /// \brief
             /// \see{CipherSuite} used to generate the \see{KeyExchange::Params}.
@@ -67,7 +67,10 @@ namespace thekogans {
                 crypto::KeyExchange::Params::SharedPtr params_ =
                     crypto::KeyExchange::Params::SharedPtr ()) :
                 cipherSuite (cipherSuite_),
-                params (params_) {}
+                params (params_) {
+                // Key rotation must not wait behind queued data.
+                priority = PRIORITY_CONTROL;
+            }
 
         protected:
             /// \brief
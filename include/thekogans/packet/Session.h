@@ -18,6 +18,7 @@
 #if !defined (__thekogans_packet_Session_h)
 #define __thekogans_packet_Session_h
 
+#include <atomic>
 #include "thekogans/util/Types.h"
 #include "thekogans/util/GUID.h"
 #include "thekogans/util/Serializer.h"
@@ -36,6 +37,31 @@ namespace thekogans {
         /// 1 in 2^128 (340,282,366,920,938,463,463,374,607,431,768,211,456).
         /// NOTE: Session sequence numbers start at random also to
         /// protect against known plaintext attacks.
+        ///
+        /// By default (replayWindowSize == 0) the inbound sequence is strict:
+        /// only the next expected sequence number is accepted. This is right for
+        /// reliable, ordered transports (TCP), but on unreliable transports (UDP)
+        /// a single lost or reordered datagram would make every subsequent packet
+        /// fail verification. Set replayWindowSize to enable an RFC 4303 style
+        /// sliding window: any sequence number newer than the newest seen so far
+        /// is accepted (and advances the window), older ones are accepted once
+        /// if they are within replayWindowSize of the newest, and duplicates and
+        /// packets that fall behind the window are rejected. The window bitmap
+        /// is a ring of 64 bit words (RFC 6479), so advancing it costs a word
+        /// clear per 64 sequence numbers instead of a bitmap shift.
+        ///
+        /// Thread safety: the outbound side is thread safe. Any number of
+        /// threads can call GetOutboundHeader (and therefore \see{Packet::Serialize})
+        /// on the same Session concurrently. Each frame gets a unique sequence
+        /// number, but sequence numbers are handed out when a frame is serialized,
+        /// not when it's sent, so frames serialized concurrently can reach the
+        /// wire (even a TCP stream) in a different order than they were numbered.
+        /// The reordering is bounded by the number of frames serialized but not
+        /// yet sent. A peer receiving from a Session that is used by more than one
+        /// sending thread must therefore use a replay window at least that large
+        /// (strict mode would reject the first out of order frame). The inbound
+        /// side (VerifyInboundHeader) is not thread safe (see \see{SessionTable}
+        /// for concurrent inbound verification).
 
         struct _LIB_THEKOGANS_PACKET_DECL Session {
             /// \struct Session::Header Session.h thekogans/packet/Session.h
@@ -56,7 +82,10 @@ namespace thekogans {
                 /// Header size.
                 enum {
                     SIZE = util::GUID_SIZE +
-                        util::UI64_SIZE
+                        util::UI64_SIZE,
+                    /// \brief
+                    /// Compact header (see \see{Session::compactHeader}) size.
+                    COMPACT_SIZE = util::UI32_SIZE
                 };
 
                 /// \brief
@@ -82,15 +111,64 @@ namespace thekogans {
                 }
             };
 
+            enum {
+                /// \brief
+                /// Maximum replayWindowSize.
+                MAX_REPLAY_WINDOW_SIZE = 960,
+                /// \brief
+                /// A reasonable window for UDP (see RFC 4303, 3.4.3).
+                DEFAULT_REPLAY_WINDOW_SIZE = 64,
+                /// \brief
+                /// Number of 64 bit words in the largest replay window ring.
+                MAX_REPLAY_WINDOW_WORD_COUNT = 16
+            };
+
+            enum {
+                /// \brief
+                /// Maximum number of packets a key can protect when compactHeader
+                /// is set. Half the truncated sequence number space, so that every
+                /// legitimate frame is within the range where the high bits are
+                /// inferred unambiguously.
+                COMPACT_HEADER_KEY_PACKET_LIMIT = 0x80000000
+            };
+
             /// \brief
             /// Session id.
             util::GUID id;
             /// \brief
-            /// Inbound \see{Packet} sequence number.
+            /// Inbound \see{Packet} sequence number. Next expected (strict
+            /// mode), or one past the newest accepted (window mode).
             util::ui64 inboundSequenceNumber;
             /// \brief
-            /// Outbound \see{Packet} sequence number.
-            util::ui64 outboundSequenceNumber;
+            /// Outbound \see{Packet} sequence number. Atomic so that
+            /// many threads can serialize packets on the same session.
+            std::atomic<util::ui64> outboundSequenceNumber;
+            /// \brief
+            /// Replay window size (0 == strict, accept only the next
+            /// expected sequence number). This is local policy and is
+            /// not serialized.
+            util::ui32 replayWindowSize;
+            /// \brief
+            /// true == \see{Packet::Serialize} will use a compact (4 byte)
+            /// session header instead of the full \see{Header}. The session id
+            /// is implied by the key, and the receiver reconstructs the full
+            /// sequence number. Both peers must agree to use it (and the receiver
+            /// must deserialize with this Session, not a \see{SessionTable}).
+            /// This is local policy and is not serialized.
+            /// NOTE: The inferred high 32 bits are not authenticated (the
+            /// truncated sequence number travels inside the ciphertext, so
+            /// it can't be part of the associated data). A key must therefore
+            /// never protect more than COMPACT_HEADER_KEY_PACKET_LIMIT packets,
+            /// or an old frame could be replayed once the sequence number
+            /// wraps it's low 32 bits. Use a \see{KeyRing} whose
+            /// Thresholds::packetLimit enforces it (\see{Tunnel} refuses
+            /// a compact header session otherwise), and drop retired keys
+            /// once the rotation completes.
+            bool compactHeader;
+            /// \brief
+            /// Replay window ring. Bit (sequenceNumber % ring bits) is set
+            /// if sequenceNumber was received.
+            util::ui64 replayWindow[MAX_REPLAY_WINDOW_WORD_COUNT];
 
             /// \enum
             /// Session size.
@@ -102,7 +180,11 @@ namespace thekogans {
 
             /// \brief
             /// ctor.
-            Session () {
+            /// \param[in] replayWindowSize_ Replay window size (0 == strict).
+            explicit Session (util::ui32 replayWindowSize_ = 0) :
+                    replayWindowSize (0),
+                    compactHeader (false) {
+                SetReplayWindowSize (replayWindowSize_);
                 Reset ();
             }
             /// \brief
@@ -110,13 +192,29 @@ namespace thekogans {
             /// \param[in] id_ Session id.
             /// \param[in] inboundSequenceNumber_ Inbound \see{Packet} sequence number.
             /// \param[in] outboundSequenceNumber_ Outbound \see{Packet} sequence number.
+            /// \param[in] replayWindowSize_ Replay window size (0 == strict).
             Session (
-                const util::GUID &id_,
-                util::ui64 inboundSequenceNumber_,
-                util::ui64 outboundSequenceNumber_) :
-                id (id_),
-                inboundSequenceNumber (inboundSequenceNumber_),
-                outboundSequenceNumber (outboundSequenceNumber_) {}
+                    const util::GUID &id_,
+                    util::ui64 inboundSequenceNumber_,
+                    util::ui64 outboundSequenceNumber_,
+                    util::ui32 replayWindowSize_ = 0) :
+                    id (id_),
+                    inboundSequenceNumber (inboundSequenceNumber_),
+                    outboundSequenceNumber (outboundSequenceNumber_),
+                    replayWindowSize (0),
+                    compactHeader (false) {
+                SetReplayWindowSize (replayWindowSize_);
+            }
+            /// \brief
+            /// Copy ctor.
+            /// \param[in] session Session to copy.
+            Session (const Session &session);
+
+            /// \brief
+            /// Assignment operator.
+            /// \param[in] session Session to copy.
+            /// \return *this.
+            Session &operator = (const Session &session);
 
             /// \brief
             /// Return the session size.
@@ -130,22 +228,53 @@ namespace thekogans {
             /// swap inbound and outbound sequence numbers.
             /// \return Session to send to the communicating peer.
             inline Session GetPeerSession () const {
-                return Session (id, outboundSequenceNumber, inboundSequenceNumber);
+                Session session (
+                    id,
+                    outboundSequenceNumber.load (std::memory_order_relaxed),
+                    inboundSequenceNumber,
+                    replayWindowSize);
+                session.compactHeader = compactHeader;
+                return session;
             }
 
+            /// \brief
+            /// Set the replay window size, and reset the window to treat every
+            /// sequence number before inboundSequenceNumber as already received.
+            /// \param[in] replayWindowSize_ Replay window size
+            /// (0 == strict, <= MAX_REPLAY_WINDOW_SIZE).
+            void SetReplayWindowSize (util::ui32 replayWindowSize_);
+            /// \brief
+            /// Reset the replay window to treat every sequence number before
+            /// inboundSequenceNumber as already received. Call it after
+            /// changing inboundSequenceNumber directly.
+            void ResetReplayWindow ();
+
             /// \brief
             /// Verify an incoming Header to make sure it contains the
-            /// inboundSequenceNumber we expect.
+            /// inboundSequenceNumber we expect (strict), or a sequence number
+            /// that is new and within the replay window (window mode).
             /// \param[in] header Incoming Header.
-            /// \return true == Header contain the correct id and
-            /// inboundSequenceNumber.
+            /// \return true == Header contain the correct id and an
+            /// acceptable sequence number.
             bool VerifyInboundHeader (const Header &header);
+            /// \brief
+            /// Reconstruct the full inbound Header from a compact header. The high
+            /// 32 bits of the sequence number are inferred from inboundSequenceNumber
+            /// and the replay window (RFC 4303, Appendix A). Pass the result to
+            /// VerifyInboundHeader.
+            /// \param[in] truncatedSequenceNumber Low 32 bits of the sequence number.
+            /// \return Header with the reconstructed sequence number.
+            Header GetInboundHeader (util::ui32 truncatedSequenceNumber) const;
 
             /// \brief
             /// Return Header containing the next outboundSequenceNumber.
+            /// Thread safe (see the thread safety note above).
             /// \return Header containing the next outboundSequenceNumber.
             inline Header GetOutboundHeader () {
-                return Header (id, outboundSequenceNumber++);
+                // Relaxed is enough. The counter only needs to hand out
+                // unique values; it doesn't order any other memory.
+                return Header (id,
+                    outboundSequenceNumber.fetch_add (1, std::memory_order_relaxed));
             }
 
             /// \brief
@@ -216,7 +345,7 @@ namespace thekogans {
             serializer <<
                 session.id <<
                 session.inboundSequenceNumber <<
-                session.outboundSequenceNumber;
+                session.outboundSequenceNumber.load (std::memory_order_relaxed);
             return serializer;
         }
 
@@ -228,10 +357,14 @@ namespace thekogans {
         inline util::Serializer &operator >> (
                 util::Serializer &serializer,
                 Session &session) {
+            util::ui64 outboundSequenceNumber;
             serializer >>
                 session.id >>
                 session.inboundSequenceNumber >>
-                session.outboundSequenceNumber;
+                outboundSequenceNumber;
+            session.outboundSequenceNumber.store (
+                outboundSequenceNumber, std::memory_order_relaxed);
+            session.ResetReplayWindow ();
             return serializer;
         }
 
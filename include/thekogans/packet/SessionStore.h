@@ -0,0 +1,175 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_SessionStore_h)
+#define __thekogans_packet_SessionStore_h
+
+#include "thekogans/util/Environment.h"
+
+#if !defined (TOOLCHAIN_OS_Windows)
+
+#include <string>
+#include <vector>
+#include <map>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/GUID.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Session.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct SessionStore SessionStore.h thekogans/packet/SessionStore.h
+        ///
+        /// \brief
+        /// SessionStore keeps a copy of live \see{Session}s in a memory mapped file, so
+        /// that a server restarted for a deployment can pick up where it left off
+        /// instead of having every peer re-handshake at once. Saving a session is a
+        /// memory copy in to it's fixed size slot (the kernel writes dirty pages back
+        /// on it's own schedule, or on Sync). A restarted process opens the same file
+        /// and calls Load.
+        ///
+        /// Outbound sequence numbers are leased: Save records
+        /// outboundSequenceNumber + outboundLeaseMargin, so a session restored from a
+        /// store that was saved at least every outboundLeaseMargin packets never reuses
+        /// a sequence number the peer has already seen. A zero margin only holds if
+        /// the session is saved after every packet it sends, so the ctor refuses it
+        /// unless the caller says so (allowZeroLeaseMargin).
+        ///
+        /// Inbound sequence numbers can't be leased (the replay check needs the exact
+        /// value). Close (or the dtor) marks the store as cleanly shut down after saving.
+        /// If the previous process did not shut down cleanly (WasCleanShutdown returns
+        /// false), packets received after the last Save could be replayed against the
+        /// restored sessions, and the sessions should be discarded.
+        ///
+        /// NOTE: The file layout is host endian and meant for restarts on the same
+        /// machine. It is not a portable serialization format (use the \see{Session}
+        /// serializer for that). POSIX only.
+
+        struct _LIB_THEKOGANS_PACKET_DECL SessionStore {
+            enum {
+                /// \brief
+                /// Default outbound sequence number lease margin.
+                DEFAULT_OUTBOUND_LEASE_MARGIN = 65536
+            };
+
+        private:
+            /// \brief
+            /// Store file path.
+            const std::string path;
+            /// \brief
+            /// Store file descriptor.
+            int handle;
+            /// \brief
+            /// Mapped file.
+            util::ui8 *data;
+            /// \brief
+            /// Mapped file size.
+            std::size_t size;
+            /// \brief
+            /// Number of slots.
+            std::size_t capacity;
+            /// \brief
+            /// Outbound sequence number lease margin.
+            const util::ui64 outboundLeaseMargin;
+            /// \brief
+            /// true == the store was closed cleanly by the previous process.
+            bool cleanShutdown;
+            /// \brief
+            /// Maps session id to slot index.
+            std::map<util::GUID, std::size_t> slots;
+            /// \brief
+            /// Free slot indices.
+            std::vector<std::size_t> freeSlots;
+            /// \brief
+            /// Synchronization lock.
+            util::SpinLock spinLock;
+
+        public:
+            /// \brief
+            /// ctor. Create the store, or open an existing one.
+            /// \param[in] path_ Store file path.
+            /// \param[in] capacity_ Maximum number of sessions (ignored if
+            /// the store exists, as it keeps it's original capacity).
+            /// \param[in] outboundLeaseMargin_ Outbound sequence number lease margin.
+            /// \param[in] allowZeroLeaseMargin true == the caller saves sessions after
+            /// every packet they send, and outboundLeaseMargin_ can be 0.
+            SessionStore (
+                const std::string &path_,
+                std::size_t capacity_,
+                util::ui64 outboundLeaseMargin_ = DEFAULT_OUTBOUND_LEASE_MARGIN,
+                bool allowZeroLeaseMargin = false);
+            /// \brief
+            /// dtor. Close the store.
+            ~SessionStore ();
+
+            /// \brief
+            /// Return true if the previous process closed the store cleanly.
+            /// \return true == the previous process closed the store cleanly.
+            inline bool WasCleanShutdown () const {
+                return cleanShutdown;
+            }
+            /// \brief
+            /// Return the number of slots.
+            /// \return Number of slots.
+            inline std::size_t GetCapacity () const {
+                return capacity;
+            }
+
+            /// \brief
+            /// Save (insert or update) a session.
+            /// \param[in] session \see{Session} to save.
+            /// \return true == saved, false == store is full.
+            bool Save (const Session &session);
+            /// \brief
+            /// Remove a session.
+            /// \param[in] id Id of session to remove.
+            /// \return true == removed, false == not found.
+            bool Erase (const util::GUID &id);
+            /// \brief
+            /// Return all saved sessions.
+            /// \param[out] sessions Where to put the sessions.
+            void Load (std::vector<Session> &sessions) const;
+
+            /// \brief
+            /// Flush dirty pages to the file.
+            /// \param[in] wait true == wait for the write to complete.
+            void Sync (bool wait = true);
+            /// \brief
+            /// Flush, mark the store clean, and unmap it.
+            void Close ();
+
+        private:
+            /// \brief
+            /// Write a session in to the given slot.
+            /// \param[in] index Slot index.
+            /// \param[in] session \see{Session} to write.
+            void WriteSlot (
+                std::size_t index,
+                const Session &session);
+
+            /// \brief
+            /// SessionStore is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (SessionStore)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (TOOLCHAIN_OS_Windows)
+
+#endif // !defined (__thekogans_packet_SessionStore_h)
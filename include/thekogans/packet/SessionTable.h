@@ -0,0 +1,240 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_SessionTable_h)
+#define __thekogans_packet_SessionTable_h
+
+#include <cstddef>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/GUID.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Session.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct SessionTable SessionTable.h thekogans/packet/SessionTable.h
+        ///
+        /// \brief
+        /// SessionTable holds the \see{Session}s of a server's peers, keyed by
+        /// session id. It's meant for servers with many (100k+) peers, and is
+        /// designed around three goals:
+        ///
+        /// 1. O(1) lookup straight from the \see{Session::Header} in an incoming
+        ///    packet (see Packet::Deserialize (..., SessionTable &)).
+        /// 2. No global lock. The table is split in to shards, each protected by
+        ///    it's own spin lock. Session ids are random, so sessions (and lock
+        ///    traffic) spread evenly across shards.
+        /// 3. Known memory cost. Capacity is fixed at construction and all
+        ///    memory is allocated up front. Each shard is an open addressing
+        ///    (linear probing) array of cache line aligned entries, so a lookup
+        ///    typically touches one or two cache lines. Erase uses backward shift
+        ///    deletion, so there are no tombstones and lookups don't degrade
+        ///    under session churn. GetMemorySize returns the total cost.
+
+        struct _LIB_THEKOGANS_PACKET_DECL SessionTable {
+            enum {
+                /// \brief
+                /// Default number of shards.
+                DEFAULT_SHARD_COUNT = 64,
+                /// \brief
+                /// Cache line size used to align entries.
+                CACHE_LINE_SIZE = 64
+            };
+
+        private:
+            /// \struct SessionTable::Entry SessionTable.h thekogans/packet/SessionTable.h
+            ///
+            /// \brief
+            /// Slot in a shard.
+            struct Entry {
+                /// \brief
+                /// true == slot holds a session.
+                bool occupied;
+                /// \brief
+                /// The session.
+                Session session;
+
+                /// \brief
+                /// ctor.
+                Entry () :
+                    occupied (false) {}
+            };
+            /// \brief
+            /// Entry size rounded up to a multiple of CACHE_LINE_SIZE.
+            enum {
+                ENTRY_SIZE = (sizeof (Entry) + CACHE_LINE_SIZE - 1) &
+                    ~(std::size_t)(CACHE_LINE_SIZE - 1)
+            };
+            /// \struct SessionTable::Shard SessionTable.h thekogans/packet/SessionTable.h
+            ///
+            /// \brief
+            /// Independently locked part of the table.
+            struct Shard {
+                /// \brief
+                /// Protects the shard.
+                util::SpinLock spinLock;
+                /// \brief
+                /// First entry (CACHE_LINE_SIZE aligned).
+                util::ui8 *entries;
+                /// \brief
+                /// Entry count - 1 (entry count is a power of 2).
+                std::size_t mask;
+                /// \brief
+                /// Number of occupied entries.
+                std::size_t count;
+                /// \brief
+                /// Keep shard locks from sharing cache lines.
+                util::ui8 padding[CACHE_LINE_SIZE];
+
+                /// \brief
+                /// ctor.
+                Shard () :
+                    entries (0),
+                    mask (0),
+                    count (0) {}
+
+                /// \brief
+                /// Return the entry at the given index.
+                /// \param[in] index Entry index.
+                /// \return Entry at the given index.
+                inline Entry &GetEntry (std::size_t index) const {
+                    return *reinterpret_cast<Entry *> (entries + index * ENTRY_SIZE);
+                }
+            };
+            /// \brief
+            /// Random hash seed (keeps session id distribution
+            /// from being exploited to cluster entries).
+            util::ui64 seed;
+            /// \brief
+            /// Maximum number of sessions per shard.
+            std::size_t maxShardSessionCount;
+            /// \brief
+            /// Shards.
+            std::vector<Shard> shards;
+            /// \brief
+            /// Entry storage for all shards.
+            std::vector<util::ui8> storage;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] maxSessionCount Maximum number of sessions the table will hold.
+            /// \param[in] shardCount Number of shards (rounded up to a power of 2).
+            explicit SessionTable (
+                std::size_t maxSessionCount,
+                std::size_t shardCount = DEFAULT_SHARD_COUNT);
+            /// \brief
+            /// dtor.
+            ~SessionTable ();
+
+            /// \brief
+            /// Return the total number of bytes used by the table.
+            /// \return Total number of bytes used by the table.
+            std::size_t GetMemorySize () const;
+            /// \brief
+            /// Return the number of sessions in the table.
+            /// \return Number of sessions in the table.
+            std::size_t GetSize () const;
+
+            /// \brief
+            /// Add a session.
+            /// \param[in] session \see{Session} to add.
+            /// \return true == added, false == a session with the
+            /// same id already exists, or the session's shard is full.
+            bool Insert (const Session &session);
+            /// \brief
+            /// Replace an existing session.
+            /// \param[in] session \see{Session} to replace.
+            /// \return true == replaced, false == not found.
+            bool Update (const Session &session);
+            /// \brief
+            /// Remove a session.
+            /// \param[in] id Id of session to remove.
+            /// \return true == removed, false == not found.
+            bool Erase (const util::GUID &id);
+            /// \brief
+            /// Return a copy of a session.
+            /// \param[in] id Id of session to find.
+            /// \param[out] session Where to copy the session.
+            /// \return true == found, false == not found.
+            bool Find (
+                const util::GUID &id,
+                Session &session) const;
+
+            /// \brief
+            /// Find the session the header belongs to, and verify the header
+            /// against it (see \see{Session::VerifyInboundHeader}).
+            /// \param[in] header Incoming \see{Session::Header}.
+            /// \return true == header belongs to a session in the table and
+            /// carries an acceptable sequence number.
+            bool VerifyInboundHeader (const Session::Header &header);
+            /// \brief
+            /// Return the next outbound header for the given session.
+            /// \param[in] id Session id.
+            /// \param[out] header Next outbound \see{Session::Header}.
+            /// \return true == found, false == not found.
+            bool GetOutboundHeader (
+                const util::GUID &id,
+                Session::Header &header);
+
+        private:
+            /// \brief
+            /// Hash a session id.
+            /// \param[in] id Session id to hash.
+            /// \return Hash.
+            util::ui64 Hash (const util::GUID &id) const;
+            /// \brief
+            /// Return the shard a hash belongs to.
+            /// \param[in] hash Session id hash.
+            /// \return Shard.
+            inline Shard &GetShard (util::ui64 hash) const {
+                // Low bits pick the shard, high bits the slot.
+                return const_cast<Shard &> (shards[hash & (shards.size () - 1)]);
+            }
+            /// \brief
+            /// Return the slot a hash starts probing at.
+            /// \param[in] shard Shard the hash belongs to.
+            /// \param[in] hash Session id hash.
+            /// \return Home slot.
+            static inline std::size_t GetHomeIndex (
+                    const Shard &shard,
+                    util::ui64 hash) {
+                return (std::size_t)(hash >> 32) & shard.mask;
+            }
+            /// \brief
+            /// Find the entry holding the given session.
+            /// Must be called with shard.spinLock held.
+            /// \param[in] shard Shard to search.
+            /// \param[in] hash Session id hash.
+            /// \param[in] id Session id.
+            /// \return Entry (0 if not found).
+            static Entry *FindEntry (
+                const Shard &shard,
+                util::ui64 hash,
+                const util::GUID &id);
+
+            /// \brief
+            /// SessionTable is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (SessionTable)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_SessionTable_h)
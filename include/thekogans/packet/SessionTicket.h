@@ -0,0 +1,268 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_SessionTicket_h)
+#define __thekogans_packet_SessionTicket_h
+
+#include <string>
+#include <set>
+#include <map>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/GUID.h"
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Serializer.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/crypto/SymmetricKey.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/CipherPool.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct SessionTicket SessionTicket.h thekogans/packet/SessionTicket.h
+        ///
+        /// \brief
+        /// SessionTicket holds everything a server needs to resume a session without
+        /// a key exchange: the negotiated cipher suite, the \see{crypto::SymmetricKey}
+        /// and the \see{Session} the ticket was issued for. The server seals the ticket
+        /// with a ticket key only it knows, and hands the sealed (opaque) ticket to the
+        /// client (\see{SessionTicketPacket}). A reconnecting client returns the sealed
+        /// ticket in a \see{ResumeSessionPacket}, and the server recovers the key
+        /// (\see{SessionTicketManager::RedeemTicket}) with one symmetric decryption
+        /// instead of a public key operation. The server keeps no per ticket state until
+        /// the ticket is redeemed.
+
+        struct _LIB_THEKOGANS_PACKET_DECL SessionTicket {
+            enum {
+                /// \brief
+                /// Serialized ticket format version.
+                VERSION = 1
+            };
+
+            /// \brief
+            /// Unique ticket id (used to enforce single use).
+            util::GUID id;
+            /// \brief
+            /// Expiration time (seconds since the epoch, UTC).
+            util::ui64 expiration;
+            /// \brief
+            /// \see{crypto::CipherSuite} the key was negotiated with.
+            std::string cipherSuite;
+            /// \brief
+            /// Session key.
+            crypto::SymmetricKey::SharedPtr key;
+            /// \brief
+            /// \see{Session} (server side) the ticket was issued for.
+            Session session;
+
+            /// \brief
+            /// ctor.
+            SessionTicket () :
+                id (util::GUID::Empty),
+                expiration (0) {}
+            /// \brief
+            /// ctor.
+            /// \param[in] id_ Unique ticket id.
+            /// \param[in] expiration_ Expiration time (seconds since the epoch, UTC).
+            /// \param[in] cipherSuite_ \see{crypto::CipherSuite} the key was negotiated with.
+            /// \param[in] key_ Session key.
+            /// \param[in] session_ \see{Session} the ticket was issued for.
+            SessionTicket (
+                const util::GUID &id_,
+                util::ui64 expiration_,
+                const std::string &cipherSuite_,
+                crypto::SymmetricKey::SharedPtr key_,
+                const Session &session_) :
+                id (id_),
+                expiration (expiration_),
+                cipherSuite (cipherSuite_),
+                key (key_),
+                session (session_) {}
+
+            /// \brief
+            /// Return the serialized ticket size.
+            /// \return Serialized ticket size.
+            std::size_t Size () const;
+
+            /// \brief
+            /// Serialize and encrypt the ticket.
+            /// \param[in] ticketCipher Ticket \see{crypto::Cipher}.
+            /// \return Sealed ticket (framed ciphertext; the frame header
+            /// names the ticket key).
+            util::Buffer::SharedPtr Seal (crypto::Cipher &ticketCipher) const;
+            /// \brief
+            /// Decrypt and deserialize a sealed ticket. Throws if the
+            /// ticket was tampered with.
+            /// \param[in] ciphertext Sealed ticket minus the leading \see{crypto::FrameHeader}.
+            /// \param[in] ticketCipher Ticket \see{crypto::Cipher} named by the frame header.
+            void Unseal (
+                util::Buffer &ciphertext,
+                crypto::Cipher &ticketCipher);
+        };
+
+        /// \brief
+        /// SessionTicket serializer.
+        /// \param[in] serializer Where to serialize the session ticket.
+        /// \param[in] sessionTicket SessionTicket to serialize.
+        /// \return serializer.
+        _LIB_THEKOGANS_PACKET_DECL util::Serializer & _LIB_THEKOGANS_PACKET_API operator << (
+            util::Serializer &serializer,
+            const SessionTicket &sessionTicket);
+
+        /// \brief
+        /// SessionTicket deserializer.
+        /// \param[in] serializer Where to deserialize the session ticket.
+        /// \param[in] sessionTicket SessionTicket to deserialize.
+        /// \return serializer.
+        _LIB_THEKOGANS_PACKET_DECL util::Serializer & _LIB_THEKOGANS_PACKET_API operator >> (
+            util::Serializer &serializer,
+            SessionTicket &sessionTicket);
+
+        /// \struct SessionTicketManager SessionTicket.h thekogans/packet/SessionTicket.h
+        ///
+        /// \brief
+        /// SessionTicketManager issues and redeems \see{SessionTicket}s on the server.
+        /// It owns the ticket cipher (rotate it periodically with RotateTicketCipher;
+        /// tickets sealed with the previous cipher stay redeemable until the next
+        /// rotation). Ticket ciphers are \see{CipherPool}s, so that many threads
+        /// can issue and redeem tickets at once. It also remembers redeemed tickets
+        /// until they expire so that a captured \see{ResumeSessionPacket} can't be
+        /// replayed.
+        ///
+        /// NOTE: A resumed session reuses the key from the original key exchange (no
+        /// forward secrecy between the two). The client must propose a fresh
+        /// \see{Session} (see \see{ResumeSessionPacket}) so that frames from the old
+        /// session can't be replayed in to the new one. Keep ticket lifetimes short,
+        /// and do a full key exchange periodically.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// // After a successful key exchange:
+        /// tunnel.SendPacket (
+        ///     packet::Packet::SharedPtr (
+        ///         new packet::SessionTicketPacket (
+        ///             ticketManager.IssueTicket (cipherSuite, key, session),
+        ///             ticketManager.GetTicketLifetime ())));
+        ///
+        /// // In HandlePacket:
+        /// if (packet->Type () == packet::ResumeSessionPacket::TYPE) {
+        ///     packet::ResumeSessionPacket &resumeSessionPacket =
+        ///         static_cast<packet::ResumeSessionPacket &> (*packet);
+        ///     packet::SessionTicket ticket;
+        ///     if (ticketManager.RedeemTicket (*resumeSessionPacket.ticket, ticket)) {
+        ///         // Install ticket.key, and resumeSessionPacket.session.
+        ///     }
+        ///     else {
+        ///         // Fall back to a full key exchange.
+        ///     }
+        /// }
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL SessionTicketManager {
+            enum {
+                /// \brief
+                /// Default ticket lifetime (seconds).
+                DEFAULT_TICKET_LIFETIME = 24 * 60 * 60,
+                /// \brief
+                /// Default maximum number of redeemed (unexpired) tickets to remember.
+                DEFAULT_MAX_REDEEMED_TICKETS = 100000
+            };
+
+        private:
+            /// \brief
+            /// Cipher used to seal new tickets.
+            CipherPool::SharedPtr ticketCipher;
+            /// \brief
+            /// Cipher that sealed tickets before the last rotation.
+            CipherPool::SharedPtr previousTicketCipher;
+            /// \brief
+            /// Ticket lifetime (seconds).
+            const util::ui32 ticketLifetime;
+            /// \brief
+            /// Maximum number of redeemed tickets to remember.
+            const std::size_t maxRedeemedTickets;
+            /// \brief
+            /// Ids of redeemed, unexpired tickets.
+            std::set<util::GUID> redeemedTickets;
+            /// \brief
+            /// Redeemed tickets ordered by expiration.
+            std::multimap<util::ui64, util::GUID> redeemedTicketExpirations;
+            /// \brief
+            /// Synchronization lock.
+            util::SpinLock spinLock;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] ticketCipher_ Cipher used to seal tickets.
+            /// \param[in] ticketLifetime_ Ticket lifetime (seconds).
+            /// \param[in] maxRedeemedTickets_ Maximum number of redeemed tickets to
+            /// remember. When full, redemption fails (the client falls back to a
+            /// full key exchange) rather than forget an unexpired ticket.
+            SessionTicketManager (
+                CipherPool::SharedPtr ticketCipher_,
+                util::ui32 ticketLifetime_ = DEFAULT_TICKET_LIFETIME,
+                std::size_t maxRedeemedTickets_ = DEFAULT_MAX_REDEEMED_TICKETS);
+
+            /// \brief
+            /// Return the ticket lifetime.
+            /// \return Ticket lifetime (seconds).
+            inline util::ui32 GetTicketLifetime () const {
+                return ticketLifetime;
+            }
+
+            /// \brief
+            /// Start sealing tickets with a new cipher. Tickets sealed with the
+            /// current cipher remain redeemable until the next rotation.
+            /// \param[in] ticketCipher_ New ticket cipher.
+            void RotateTicketCipher (CipherPool::SharedPtr ticketCipher_);
+
+            /// \brief
+            /// Issue a sealed ticket.
+            /// \param[in] cipherSuite \see{crypto::CipherSuite} the key was negotiated with.
+            /// \param[in] key Session key.
+            /// \param[in] session \see{Session} (server side) the ticket is issued for.
+            /// \return Sealed ticket.
+            util::Buffer::SharedPtr IssueTicket (
+                const std::string &cipherSuite,
+                crypto::SymmetricKey::SharedPtr key,
+                const Session &session);
+
+            /// \brief
+            /// Unseal and validate a ticket. A ticket can only be redeemed once.
+            /// Throws if the ticket was tampered with.
+            /// \param[in] sealedTicket Sealed ticket (as returned by IssueTicket).
+            /// \param[out] ticket Redeemed ticket.
+            /// \return true == ticket is valid, false == unknown ticket key,
+            /// expired, already redeemed, or too many redeemed tickets to track.
+            bool RedeemTicket (
+                const util::Buffer &sealedTicket,
+                SessionTicket &ticket);
+
+            /// \brief
+            /// SessionTicketManager is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (SessionTicketManager)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_SessionTicket_h)
@@ -0,0 +1,117 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_SessionTicketPacket_h)
+#define __thekogans_packet_SessionTicketPacket_h
+
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Serializer.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct SessionTicketPacket SessionTicketPacket.h thekogans/packet/SessionTicketPacket.h
+        ///
+        /// \brief
+        /// SessionTicketPacket packets are sent by the server (encrypted with the session
+        /// key) after a successful key exchange. They carry a sealed \see{SessionTicket}
+        /// (see \see{SessionTicketManager::IssueTicket}) that is opaque to the client.
+        /// The client keeps the ticket, together with it's own copy of the key, and
+        /// returns it in a \see{ResumeSessionPacket} to resume without a key exchange.
+
+        struct _LIB_THEKOGANS_PACKET_DECL SessionTicketPacket : public Packet {
+            /// \brief
+            /// Pull in Packet dynamic creation machinery.
+            THEKOGANS_PACKET_DECLARE_PACKET (SessionTicketPacket)
+
+            /// \brief
+            /// Sealed \see{SessionTicket}.
+            util::Buffer::SharedPtr ticket;
+            /// \brief
+            /// Ticket lifetime (seconds). The client should discard the
+            /// ticket after this long.
+            util::ui32 lifetime;
+
+            /// \brief
+            /// ctor.
+            /// \param[in] ticket_ Sealed \see{SessionTicket}.
+            /// \param[in] lifetime_ Ticket lifetime (seconds).
+            SessionTicketPacket (
+                util::Buffer::SharedPtr ticket_ = util::Buffer::SharedPtr (),
+                util::ui32 lifetime_ = 0) :
+                ticket (ticket_),
+                lifetime (lifetime_) {}
+
+        protected:
+            /// \brief
+            /// Return serialized packet size.
+            /// \return Serialized packet size.
+            virtual std::size_t Size () const override {
+                return
+                    util::Serializer::Size (*ticket) +
+                    util::Serializer::Size (lifetime);
+            }
+
+            /// \brief
+            /// De-serialize the packet.
+            /// \param[in] header Packet header.
+            /// \param[in] serializer Packet contents.
+            virtual void Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) override;
+            /// \brief
+            /// Serialize the packet.
+            /// \param[out] serializer Packet contents.
+            virtual void Write (util::Serializer &serializer) const override;
+
+            /// \brief
+            /// "Lifetime"
+            static const char * const ATTR_LIFETIME;
+
+            /// \brief
+            /// Read a Serializable from an XML DOM.
+            /// \param[in] node XML DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) override;
+            /// \brief
+            /// Write a Serializable to the XML DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (pugi::xml_node &node) const override;
+
+            /// \brief
+            /// Read a Serializable from an JSON DOM.
+            /// \param[in] node JSON DOM representation of a Serializable.
+            virtual void Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object &object) override;
+            /// \brief
+            /// Write a Serializable to the JSON DOM.
+            /// \param[out] node Parent node.
+            virtual void Write (util::JSON::Object &object) const override;
+
+            /// \brief
+            /// SessionTicketPacket is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (SessionTicketPacket)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_SessionTicketPacket_h)
@@ -0,0 +1,353 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_SharedMemoryTunnel_h)
+#define __thekogans_packet_SharedMemoryTunnel_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/PaddingPolicy.h"
+#include "thekogans/packet/FrameParser.h"
+#include "thekogans/packet/KeyRing.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/TunnelEventLoop.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct SharedMemoryTunnel SharedMemoryTunnel.h thekogans/packet/SharedMemoryTunnel.h
+        ///
+        /// \brief
+        /// SharedMemoryTunnel is a \see{Tunnel} between two processes (or threads) on
+        /// the same host that bypasses the kernel network stack. A \see{Channel} is a
+        /// memfd holding two single producer, single consumer byte rings (one per
+        /// direction), and an eventfd per end. Frames are the same as on a stream
+        /// socket, so the \see{FrameParser} and all filters work unchanged.
+        ///
+        /// Sending: frames are encrypted straight in to the outgoing ring when it has
+        /// room (see \see{Packet::Serialize}). Otherwise they are queued, and copied in
+        /// as the peer makes room. Backpressure works like in \see{TCPTunnel}.
+        ///
+        /// Receiving: the incoming ring is parsed in place.
+        ///
+        /// Wakeups: an end only signals the peer's eventfd if the peer said it was
+        /// about to wait (for data, or for room), so a busy pair exchanges frames
+        /// without any system calls.
+        ///
+        /// The tunnel registers itself with it's \see{TunnelEventLoop} in Start, and
+        /// removes itself in Close (before closing it's eventfds, as the peer keeps
+        /// the same eventfds open, and would otherwise keep waking a dead tunnel up).
+        /// The dtor calls Close. As with any \see{TunnelEventLoop::Handler}, destroy
+        /// the tunnel on the loop's thread, or after the loop's current Poll returns.
+        ///
+        /// NOTE: The rings don't detect a peer that dies without calling Close.
+        /// Watch the peer process (ex: the unix socket the channel was sent over,
+        /// or a pidfd) for that.
+        ///
+        /// Linux only.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// // Process A
+        /// packet::SharedMemoryTunnel::Channel channel (1024 * 1024);
+        /// channel.Send (unixSocket);
+        /// packet::SharedMemoryTunnel tunnel (channel, 0, eventLoop, keyRing, eventSink, &session);
+        /// tunnel.Start ();
+        ///
+        /// // Process B
+        /// packet::SharedMemoryTunnel::Channel channel;
+        /// channel.Receive (unixSocket);
+        /// packet::SharedMemoryTunnel tunnel (channel, 1, eventLoop, keyRing, eventSink, &session);
+        /// tunnel.Start ();
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL SharedMemoryTunnel :
+                public Tunnel,
+                public TunnelEventLoop::Handler {
+            enum {
+                /// \brief
+                /// Default ring capacity (per direction).
+                DEFAULT_CAPACITY = 1024 * 1024,
+                /// \brief
+                /// Default max incoming frame length.
+                DEFAULT_MAX_CIPHERTEXT_LENGTH = 2 * 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns on.
+                DEFAULT_HIGH_WATER_MARK = 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns off.
+                DEFAULT_LOW_WATER_MARK = 256 * 1024
+            };
+
+            /// \struct SharedMemoryTunnel::Channel SharedMemoryTunnel.h
+            /// thekogans/packet/SharedMemoryTunnel.h
+            ///
+            /// \brief
+            /// The shared memory and eventfds connecting two \see{SharedMemoryTunnel}s.
+            /// One end creates it and sends it to the other over a unix socket.
+            struct _LIB_THEKOGANS_PACKET_DECL Channel {
+                /// \brief
+                /// memfd holding the rings.
+                THEKOGANS_UTIL_HANDLE memoryHandle;
+                /// \brief
+                /// Per end eventfds (end i waits on eventHandles[i]).
+                THEKOGANS_UTIL_HANDLE eventHandles[2];
+
+                /// \brief
+                /// ctor. Create an empty channel (see Receive).
+                Channel ();
+                /// \brief
+                /// ctor. Create a new channel.
+                /// \param[in] capacity Ring capacity (per direction, power of 2).
+                explicit Channel (std::size_t capacity);
+                /// \brief
+                /// dtor. Closes the handles (tunnels have their own).
+                ~Channel ();
+
+                /// \brief
+                /// Send the handles over a connected unix socket (SCM_RIGHTS).
+                /// \param[in] socket Connected unix socket.
+                void Send (THEKOGANS_UTIL_HANDLE socket) const;
+                /// \brief
+                /// Receive the handles sent by Send.
+                /// \param[in] socket Connected unix socket.
+                void Receive (THEKOGANS_UTIL_HANDLE socket);
+
+            private:
+                /// \brief
+                /// Close the handles.
+                void Close ();
+
+                /// \brief
+                /// Channel is neither copy constructable nor assignable.
+                THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (Channel)
+            };
+
+        private:
+            /// \struct SharedMemoryTunnel::Ring SharedMemoryTunnel.h
+            /// thekogans/packet/SharedMemoryTunnel.h
+            ///
+            /// \brief
+            /// Shared ring header, followed by capacity bytes of data. Each
+            /// side writes only to it's own cache line.
+            struct Ring {
+                /// \brief
+                /// Bytes consumed (written by the consumer).
+                util::ui64 head;
+                /// \brief
+                /// 1 == the consumer is about to wait for data.
+                util::ui32 readerWaiting;
+                /// \brief
+                /// 1 == the consumer closed.
+                util::ui32 readerClosed;
+                /// \brief
+                /// Pad to a cache line.
+                util::ui8 pad0[48];
+                /// \brief
+                /// Bytes produced (written by the producer).
+                util::ui64 tail;
+                /// \brief
+                /// 1 == the producer is about to wait for room.
+                util::ui32 writerWaiting;
+                /// \brief
+                /// 1 == the producer closed.
+                util::ui32 writerClosed;
+                /// \brief
+                /// Pad to a cache line.
+                util::ui8 pad1[48];
+            };
+
+            /// \brief
+            /// \see{TunnelEventLoop} driving the tunnel.
+            TunnelEventLoop &eventLoop;
+            /// \brief
+            /// true == the tunnel is registered with eventLoop.
+            bool started;
+            /// \brief
+            /// eventfd we wait on (owned).
+            THEKOGANS_UTIL_HANDLE localEventHandle;
+            /// \brief
+            /// eventfd the peer waits on (owned).
+            THEKOGANS_UTIL_HANDLE remoteEventHandle;
+            /// \brief
+            /// Mapped memfd (the mapping outlives Close, as
+            /// the event loop might still be parsing it).
+            util::ui8 *memory;
+            /// \brief
+            /// Length of memory.
+            std::size_t memoryLength;
+            /// \brief
+            /// Ring capacity (per direction).
+            std::size_t capacity;
+            /// \brief
+            /// Ring we consume.
+            Ring *incoming;
+            /// \brief
+            /// incoming data.
+            util::ui8 *incomingData;
+            /// \brief
+            /// Ring we produce.
+            Ring *outgoing;
+            /// \brief
+            /// outgoing data.
+            util::ui8 *outgoingData;
+            /// \brief
+            /// Parses incoming frames.
+            FrameParser frameParser;
+            /// \brief
+            /// Send queue length at which backpressure turns on.
+            const std::size_t highWaterMark;
+            /// \brief
+            /// Send queue length at which backpressure turns off.
+            const std::size_t lowWaterMark;
+            /// \brief
+            /// Frames waiting for room in the outgoing ring.
+            /// The first one may be partially copied.
+            std::deque<util::Buffer::SharedPtr> sendQueue;
+            /// \brief
+            /// Number of uncopied bytes in sendQueue.
+            std::size_t queuedBytes;
+            /// \brief
+            /// true == backpressure is on.
+            bool backpressure;
+            /// \brief
+            /// true == the tunnel was closed (the eventfds
+            /// are closed later, see CloseHandles).
+            std::atomic<bool> closed;
+            /// \brief
+            /// Serializes packet encryption and outgoing ring access.
+            util::Mutex sendMutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] channel Channel connecting the two ends. The
+            /// tunnel duplicates the handles it needs.
+            /// \param[in] end This tunnel's end of the channel (0 or 1).
+            /// \param[in] eventLoop_ \see{TunnelEventLoop} that will drive the tunnel.
+            /// \param[in] keyRing Keys used to encrypt and decrypt packets.
+            /// \param[in] eventSink Receives tunnel events.
+            /// \param[in] session Optional \see{Session} baked in to every packet.
+            /// \param[in] maxCiphertextLength Max incoming frame length.
+            /// \param[in] highWaterMark_ Send queue length at which backpressure turns on.
+            /// \param[in] lowWaterMark_ Send queue length at which backpressure turns off.
+            /// \param[in] paddingPolicy \see{PaddingPolicy} outgoing packets are
+            /// serialized with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] compress true == compress outgoing packets.
+            SharedMemoryTunnel (
+                const Channel &channel,
+                std::size_t end,
+                TunnelEventLoop &eventLoop_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session = 0,
+                std::size_t maxCiphertextLength = DEFAULT_MAX_CIPHERTEXT_LENGTH,
+                std::size_t highWaterMark_ = DEFAULT_HIGH_WATER_MARK,
+                std::size_t lowWaterMark_ = DEFAULT_LOW_WATER_MARK,
+                PaddingPolicy::SharedPtr paddingPolicy = PaddingPolicy::SharedPtr (),
+                bool compress = false);
+            /// \brief
+            /// dtor. Closes the tunnel.
+            virtual ~SharedMemoryTunnel ();
+
+            /// \brief
+            /// Start receiving (register with the \see{TunnelEventLoop}).
+            /// Call once, after the tunnel is constructed.
+            void Start ();
+
+            /// \brief
+            /// Return the number of bytes waiting for room in the outgoing ring.
+            /// \return Number of bytes waiting for room in the outgoing ring.
+            std::size_t GetQueuedBytes ();
+            /// \brief
+            /// Return true if backpressure is on.
+            /// \return true == backpressure is on.
+            virtual bool IsBackpressured () override;
+
+            /// \brief
+            /// Remove the tunnel from the \see{TunnelEventLoop}, tell the
+            /// peer we're gone, and drop unsent frames.
+            void Close ();
+
+            // TunnelEventLoop::Handler
+            /// \brief
+            /// Return the eventfd we wait on.
+            /// \return The eventfd we wait on.
+            virtual THEKOGANS_UTIL_HANDLE GetHandle () const override {
+                return localEventHandle;
+            }
+            /// \brief
+            /// Drain the incoming ring and refill the outgoing one.
+            /// \param[in] events epoll events that fired.
+            virtual void HandleEvents (util::ui32 events) throw () override;
+
+        protected:
+            // Tunnel
+            /// \brief
+            /// Serialize the packet in to the outgoing ring (or the send queue).
+            /// \param[in] packet \see{Packet} to send.
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) override;
+
+        private:
+            /// \brief
+            /// Close the eventfds. Must be called on the event loop thread
+            /// (or from the dtor), after Close, as HandleEvents reads the
+            /// local eventfd and parses the incoming ring without holding
+            /// sendMutex.
+            void CloseHandles ();
+            /// \brief
+            /// Parse the incoming ring until it's empty.
+            /// \return true == the peer closed.
+            bool HandleReadable ();
+            /// \brief
+            /// Copy as much of the send queue in to the outgoing ring as fits.
+            /// Must be called with sendMutex held.
+            void Flush ();
+            /// \brief
+            /// Publish produced bytes and wake the peer if it's waiting for them.
+            /// Must be called with sendMutex held.
+            /// \param[in] tail New outgoing tail.
+            void Produce (util::ui64 tail);
+            /// \brief
+            /// Wake the peer.
+            void Signal ();
+
+            /// \brief
+            /// SharedMemoryTunnel is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (SharedMemoryTunnel)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_SharedMemoryTunnel_h)
@@ -0,0 +1,298 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#if !defined (__thekogans_packet_StaticPacketFilterPipeline_h)
+#define __thekogans_packet_StaticPacketFilterPipeline_h
+
+#include <cstddef>
+#include <utility>
+#include "thekogans/util/Types.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/PacketFilter.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct StaticPacketFilterPipeline StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// StaticPacketFilterPipeline is the compile time counterpart of a
+        /// \see{PacketFilterList}. The stages are fixed at compile time, so the
+        /// whole chain is a sequence of non-virtual (and mostly inlined) calls,
+        /// and the packet is passed down by reference instead of by value
+        /// (no reference count traffic per stage). Use it for fixed chains on
+        /// the hot path, and the runtime list for chains that change.
+        ///
+        /// A stage is any type with the following method:
+        ///
+        /// \code{.cpp}
+        /// bool FilterPacket (Packet::SharedPtr &packet);
+        /// \endcode
+        ///
+        /// The stage can modify or replace the packet in place. It returns true
+        /// to pass the packet on to the next stage, or false to stop processing.
+        /// When processing stops, whatever is left in packet is the result of the
+        /// pipeline (set it to Packet::SharedPtr () to consume the packet). This
+        /// mirrors a \see{PacketFilter} that returns without calling
+        /// CallNextPacketFilter. Processing also stops if a stage leaves a null
+        /// packet. Use \see{PacketFilterStage} to run an existing \see{PacketFilter}
+        /// as a stage.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// struct DropEmptyStage {
+        ///     bool FilterPacket (packet::Packet::SharedPtr &packet) {
+        ///         ...
+        ///     }
+        /// };
+        ///
+        /// typedef packet::StaticPacketFilterPipeline<
+        ///     packet::PacketFilterStage<packet::ReassemblePacketFragmentsPacketFilter>,
+        ///     DropEmptyStage> InboundPipeline;
+        ///
+        /// InboundPipeline pipeline (
+        ///     packet::PacketFilterStage<packet::ReassemblePacketFragmentsPacketFilter> (
+        ///         new packet::ReassemblePacketFragmentsPacketFilter (maxCiphertextLength)),
+        ///     DropEmptyStage ());
+        /// ...
+        /// packet::Packet::SharedPtr packet = ...;
+        /// pipeline.FilterPacket (packet);
+        /// if (packet.Get () != 0) {
+        ///     ...
+        /// }
+        /// \endcode
+
+        template<typename... Stages>
+        struct StaticPacketFilterPipeline;
+
+        /// \struct StaticPacketFilterPipeline StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// Empty pipeline (recursion terminator). Passes every packet through.
+
+        template<>
+        struct StaticPacketFilterPipeline<> {
+            /// \brief
+            /// Pass the packet through unchanged.
+            /// \param[in, out] packet \see{Packet} to filter.
+            /// \return true.
+            inline bool FilterPacket (Packet::SharedPtr & /*packet*/) {
+                return true;
+            }
+        };
+
+        /// \struct StaticPacketFilterPipeline StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// A pipeline is it's first stage followed by the pipeline of the rest.
+
+        template<
+            typename Head,
+            typename... Tail>
+        struct StaticPacketFilterPipeline<Head, Tail...> {
+            /// \brief
+            /// First stage.
+            Head head;
+            /// \brief
+            /// Remaining stages.
+            StaticPacketFilterPipeline<Tail...> tail;
+
+            /// \brief
+            /// ctor. Default construct all stages.
+            StaticPacketFilterPipeline () {}
+            /// \brief
+            /// ctor.
+            /// \param[in] head_ First stage.
+            /// \param[in] tail_ Remaining stages.
+            StaticPacketFilterPipeline (
+                const Head &head_,
+                const Tail &... tail_) :
+                head (head_),
+                tail (tail_...) {}
+
+            /// \brief
+            /// Run the packet through every stage.
+            /// \param[in, out] packet \see{Packet} to filter. On return
+            /// contains the filtered packet (null if consumed).
+            /// \return true == the packet made it through every stage,
+            /// false == a stage stopped processing.
+            inline bool FilterPacket (Packet::SharedPtr &packet) {
+                return head.FilterPacket (packet) &&
+                    packet.Get () != 0 &&
+                    tail.FilterPacket (packet);
+            }
+        };
+
+        /// \struct StaticPacketFilterPipelineStage StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// Compile time access to the I'th stage of a pipeline.
+        ///
+        /// \code{.cpp}
+        /// StaticPacketFilterPipelineStage<1, InboundPipeline>::Get (pipeline)
+        /// \endcode
+
+        template<
+            std::size_t I,
+            typename Pipeline>
+        struct StaticPacketFilterPipelineStage;
+
+        template<
+            typename Head,
+            typename... Tail>
+        struct StaticPacketFilterPipelineStage<0, StaticPacketFilterPipeline<Head, Tail...>> {
+            /// \brief
+            /// Stage type.
+            typedef Head Type;
+            /// \brief
+            /// Return the stage.
+            /// \param[in] pipeline Pipeline containing the stage.
+            /// \return The stage.
+            static inline Type &Get (StaticPacketFilterPipeline<Head, Tail...> &pipeline) {
+                return pipeline.head;
+            }
+        };
+
+        template<
+            std::size_t I,
+            typename Head,
+            typename... Tail>
+        struct StaticPacketFilterPipelineStage<I, StaticPacketFilterPipeline<Head, Tail...>> {
+            /// \brief
+            /// Stage type.
+            typedef typename StaticPacketFilterPipelineStage<
+                I - 1, StaticPacketFilterPipeline<Tail...>>::Type Type;
+            /// \brief
+            /// Return the stage.
+            /// \param[in] pipeline Pipeline containing the stage.
+            /// \return The stage.
+            static inline Type &Get (StaticPacketFilterPipeline<Head, Tail...> &pipeline) {
+                return StaticPacketFilterPipelineStage<
+                    I - 1, StaticPacketFilterPipeline<Tail...>>::Get (pipeline.tail);
+            }
+        };
+
+        /// \struct PacketFilterStage StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// Adapts a \see{PacketFilter} derivative for use as a \see{StaticPacketFilterPipeline}
+        /// stage. The filter is called non-virtually (T::FilterPacket) and the packet is moved
+        /// in to and out of it. The filter must not be part of a \see{PacketFilterList} (it
+        /// would pass the packet on to it's next filter). As a \see{PacketFilter} can't tell
+        /// it's caller to stop without consuming the packet, a non-null result always
+        /// continues down the pipeline.
+
+        template<typename T>
+        struct PacketFilterStage {
+            /// \brief
+            /// Adapted filter.
+            util::RefCounted::SharedPtr<T> filter;
+
+            /// \brief
+            /// ctor.
+            /// \param[in] filter_ Filter to adapt.
+            PacketFilterStage (T *filter_ = 0) :
+                filter (filter_) {}
+
+            /// \brief
+            /// Run the packet through the adapted filter.
+            /// \param[in, out] packet \see{Packet} to filter.
+            /// \return true == continue down the pipeline.
+            inline bool FilterPacket (Packet::SharedPtr &packet) {
+                packet = filter->T::FilterPacket (std::move (packet));
+                return packet.Get () != 0;
+            }
+        };
+
+        /// \struct StaticPacketFilterPipelinePacketFilter StaticPacketFilterPipeline.h
+        /// thekogans/packet/StaticPacketFilterPipeline.h
+        ///
+        /// \brief
+        /// Wraps a \see{StaticPacketFilterPipeline} in a \see{PacketFilter} so that a fixed
+        /// chain can be installed in to a runtime \see{PacketFilterList} as a single node.
+        /// The list pays one virtual call for the whole fixed chain.
+
+        template<typename... Stages>
+        struct StaticPacketFilterPipelinePacketFilter : public PacketFilter {
+            /// \brief
+            /// Wrapped pipeline.
+            StaticPacketFilterPipeline<Stages...> pipeline;
+
+            /// \brief
+            /// ctor. Default construct all stages.
+            StaticPacketFilterPipelinePacketFilter () {}
+            /// \brief
+            /// ctor.
+            /// \param[in] stages Pipeline stages.
+            explicit StaticPacketFilterPipelinePacketFilter (const Stages &... stages) :
+                pipeline (stages...) {}
+
+            /// \brief
+            /// Run the packet through the pipeline, and if it makes it
+            /// through every stage, on to the next filter in the list.
+            /// \param[in] packet \see{Packet} to filter.
+            /// \return A filtered packet.
+            virtual Packet::SharedPtr FilterPacket (Packet::SharedPtr packet) override {
+                return pipeline.FilterPacket (packet) ?
+                    CallNextPacketFilter (std::move (packet)) : packet;
+            }
+
+            /// \brief
+            /// Run every packet in the batch through the pipeline in a tight loop.
+            /// Runs of packets that make it through every stage are passed on to the
+            /// next filter in the list as batches. The relative order of packets
+            /// is preserved.
+            /// \param[in, out] packets \see{Packet}s to filter.
+            virtual void FilterPackets (PacketBatch &packets) override {
+                PacketBatch results;
+                results.reserve (packets.size ());
+                PacketBatch run;
+                for (std::size_t i = 0, count = packets.size (); i < count; ++i) {
+                    Packet::SharedPtr &packet = packets[i];
+                    if (pipeline.FilterPacket (packet)) {
+                        run.push_back (std::move (packet));
+                    }
+                    else if (packet.Get () != 0) {
+                        if (!run.empty ()) {
+                            CallNextPacketFilters (run);
+                            results.insert (results.end (), run.begin (), run.end ());
+                            run.clear ();
+                        }
+                        results.push_back (std::move (packet));
+                    }
+                }
+                if (!run.empty ()) {
+                    CallNextPacketFilters (run);
+                    results.insert (results.end (), run.begin (), run.end ());
+                }
+                packets.swap (results);
+            }
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_StaticPacketFilterPipeline_h)
@@ -0,0 +1,231 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_TCPTunnel_h)
+#define __thekogans_packet_TCPTunnel_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/PaddingPolicy.h"
+#include "thekogans/packet/FrameParser.h"
+#include "thekogans/packet/KeyRing.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/TunnelEventLoop.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct TCPTunnel TCPTunnel.h thekogans/packet/TCPTunnel.h
+        ///
+        /// \brief
+        /// TCPTunnel is a \see{Tunnel} over a connected, non-blocking TCP socket,
+        /// driven by a \see{TunnelEventLoop}.
+        ///
+        /// Sending: SendPacket serializes the packet under the send lock and
+        /// appends the frame to the send queue. If the socket is writable the queue
+        /// is flushed right away, gathering up to MAX_GATHER_FRAME_COUNT ready frames
+        /// in to every sendmsg call, so many small packets cost one system call.
+        /// Whatever the kernel doesn't take stays queued until the next EPOLLOUT edge.
+        /// SendPacket never blocks on the network. Instead, when the queue grows past
+        /// highWaterMark bytes, SendPacket starts returning false and the
+        /// \see{Tunnel::EventSink} is told backpressure is on. Once the queue drains
+        /// below lowWaterMark bytes, it's told backpressure is off.
+        ///
+        /// Receiving: on every EPOLLIN edge the socket is read until EAGAIN in to a
+        /// reused buffer and fed to the \see{FrameParser}. Packets are delivered on
+        /// the event loop thread. When the peer closes the connection, the tunnel
+        /// closes the socket and calls EventSink::HandleTunnelClosed.
+        ///
+        /// Linux only.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// packet::TunnelEventLoop eventLoop;
+        /// packet::TCPTunnel tunnel (socket, keyRing, eventSink, &session);
+        /// tunnel.incomingFilters.AddFilter (
+        ///     packet::PacketFilter::SharedPtr (
+        ///         new packet::ReassemblePacketFragmentsPacketFilter (...)));
+        /// tunnel.outgoingFilters.AddFilter (
+        ///     packet::PacketFilter::SharedPtr (
+        ///         new packet::FragmentPacketPacketFilter (tunnel, 64 * 1024)));
+        /// eventLoop.AddHandler (tunnel);
+        /// eventLoop.Run ();
+        /// \endcode
+
+        struct _LIB_THEKOGANS_PACKET_DECL TCPTunnel :
+                public Tunnel,
+                public TunnelEventLoop::Handler {
+            enum {
+                /// \brief
+                /// Default max incoming frame length.
+                DEFAULT_MAX_CIPHERTEXT_LENGTH = 2 * 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns on.
+                DEFAULT_HIGH_WATER_MARK = 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns off.
+                DEFAULT_LOW_WATER_MARK = 256 * 1024,
+                /// \brief
+                /// Default read buffer length.
+                DEFAULT_READ_BUFFER_LENGTH = 64 * 1024,
+                /// \brief
+                /// Maximum number of frames gathered in to one sendmsg call.
+                MAX_GATHER_FRAME_COUNT = 64
+            };
+
+        private:
+            /// \brief
+            /// Connected TCP socket (owned).
+            THEKOGANS_UTIL_HANDLE handle;
+            /// \brief
+            /// Parses incoming frames.
+            FrameParser frameParser;
+            /// \brief
+            /// Reused read buffer.
+            util::Buffer::SharedPtr readBuffer;
+            /// \brief
+            /// Send queue length at which backpressure turns on.
+            const std::size_t highWaterMark;
+            /// \brief
+            /// Send queue length at which backpressure turns off.
+            const std::size_t lowWaterMark;
+            /// \brief
+            /// Frames waiting to be sent. The first one may be partially sent.
+            std::deque<util::Buffer::SharedPtr> sendQueue;
+            /// \brief
+            /// Number of unsent bytes in sendQueue.
+            std::size_t queuedBytes;
+            /// \brief
+            /// true == backpressure is on.
+            bool backpressure;
+            /// \brief
+            /// true == Close was called (the socket is shut down,
+            /// see CloseHandle).
+            std::atomic<bool> closed;
+            /// \brief
+            /// Serializes packet encryption and send queue access.
+            util::Mutex sendMutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] handle_ Connected TCP socket. The tunnel takes ownership
+            /// and puts it in non-blocking mode.
+            /// \param[in] keyRing Keys used to encrypt and decrypt packets.
+            /// \param[in] eventSink Receives tunnel events.
+            /// \param[in] session Optional \see{Session} baked in to every packet.
+            /// \param[in] maxCiphertextLength Max incoming frame length.
+            /// \param[in] highWaterMark_ Send queue length at which backpressure turns on.
+            /// \param[in] lowWaterMark_ Send queue length at which backpressure turns off.
+            /// \param[in] readBufferLength Read buffer length.
+            /// \param[in] paddingPolicy \see{PaddingPolicy} outgoing packets are
+            /// serialized with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] compress true == compress outgoing packets.
+            TCPTunnel (
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session = 0,
+                std::size_t maxCiphertextLength = DEFAULT_MAX_CIPHERTEXT_LENGTH,
+                std::size_t highWaterMark_ = DEFAULT_HIGH_WATER_MARK,
+                std::size_t lowWaterMark_ = DEFAULT_LOW_WATER_MARK,
+                std::size_t readBufferLength = DEFAULT_READ_BUFFER_LENGTH,
+                PaddingPolicy::SharedPtr paddingPolicy = PaddingPolicy::SharedPtr (),
+                bool compress = false);
+            /// \brief
+            /// dtor. Closes the socket.
+            virtual ~TCPTunnel ();
+
+            /// \brief
+            /// Return the number of unsent bytes.
+            /// \return Number of unsent bytes.
+            std::size_t GetQueuedBytes ();
+            /// \brief
+            /// Return true if backpressure is on.
+            /// \return true == backpressure is on.
+            virtual bool IsBackpressured () override;
+
+            /// \brief
+            /// Shut the socket down and drop unsent frames. Close can be called
+            /// from any thread, so it leaves closing the socket (which also
+            /// removes it from the \see{TunnelEventLoop}) to the event loop
+            /// thread, that the shutdown wakes up. If the tunnel is not in an
+            /// event loop, the dtor closes it.
+            void Close ();
+
+            // TunnelEventLoop::Handler
+            /// \brief
+            /// Return the socket.
+            /// \return The socket.
+            virtual THEKOGANS_UTIL_HANDLE GetHandle () const override {
+                return handle;
+            }
+            /// \brief
+            /// Read until EAGAIN and/or flush the send queue.
+            /// \param[in] events epoll events that fired.
+            virtual void HandleEvents (util::ui32 events) throw () override;
+
+        protected:
+            // Tunnel
+            /// \brief
+            /// Serialize the packet, queue it and try to send it.
+            /// \param[in] packet \see{Packet} to send.
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) override;
+
+        private:
+            /// \brief
+            /// Close the socket. Must be called on the event loop thread
+            /// (or from the dtor), after Close, as HandleEvents uses the
+            /// socket without holding sendMutex.
+            void CloseHandle ();
+            /// \brief
+            /// Read until EAGAIN and feed the frame parser.
+            void HandleReadable ();
+            /// \brief
+            /// Flush the send queue and turn backpressure
+            /// off if it drained below the low water mark.
+            void HandleWritable ();
+            /// \brief
+            /// Send as much of the queue as the socket will take.
+            /// Must be called with sendMutex held.
+            void Flush ();
+
+            /// \brief
+            /// TCPTunnel is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (TCPTunnel)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_TCPTunnel_h)
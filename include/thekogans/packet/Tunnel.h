@@ -0,0 +1,383 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_Tunnel_h)
+#define __thekogans_packet_Tunnel_h
+
+#include <vector>
+#include <deque>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/crypto/ID.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/PaddingPolicy.h"
+#include "thekogans/packet/FrameParser.h"
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/PacketFilterChain.h"
+#include "thekogans/packet/KeyRing.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct Tunnel Tunnel.h thekogans/packet/Tunnel.h
+        ///
+        /// \brief
+        /// Tunnel is the transport independent half of a secure packet tunnel.
+        /// Outgoing packets run through the outgoingFilters chain (ex:
+        /// \see{FragmentPacketPacketFilter}), are serialized with the \see{KeyRing}'s
+        /// active cipher and handed to the transport (see \see{TCPTunnel}).
+        /// Incoming frames are parsed by the transport's \see{FrameParser}, decrypted
+        /// with the \see{KeyRing} cipher named in the frame, run through the
+        /// incomingFilters chain (ex: \see{ReassemblePacketFragmentsPacketFilter})
+        /// and delivered to the \see{EventSink}.
+        ///
+        /// SendPacket can be called from any thread. Transports serialize the
+        /// encryption of outgoing packets, so the frames go out in
+        /// \see{Session} sequence number order. Incoming packets are decrypted
+        /// and delivered on the transport's event thread. A \see{crypto::Cipher}
+        /// keeps separate encrypt and decrypt contexts, so the two sides can use
+        /// the same key at the same time.
+        ///
+        /// Filtered packets are handed to the transport in priority order (see
+        /// \see{Packet::priority}). While the transport is under it's high water mark,
+        /// and nothing is waiting, packets go straight through. Once it pushes back,
+        /// packets wait (unserialized, as frames have to leave in \see{Session}
+        /// sequence number order) in per priority class queues, and are released as
+        /// the transport drains. PRIORITY_CONTROL packets (ex: key exchange) are
+        /// always released first. The other classes share the link by deficit round
+        /// robin, in proportion to their weights (see SetPriorityWeight). That way a
+        /// control packet waits behind at most a high water mark's worth of frames,
+        /// no matter how much data is queued.
+
+        struct _LIB_THEKOGANS_PACKET_DECL Tunnel : public FrameParser::PacketHandler {
+            /// \struct Tunnel::EventSink Tunnel.h thekogans/packet/Tunnel.h
+            ///
+            /// \brief
+            /// Inherit from this class to receive tunnel events.
+            struct _LIB_THEKOGANS_PACKET_DECL EventSink {
+                /// \brief
+                /// dtor.
+                virtual ~EventSink () {}
+
+                /// \brief
+                /// Called when a packet makes it through the incoming filter chain.
+                /// \param[in] tunnel Tunnel that received the packet.
+                /// \param[in] packet Received \see{Packet}.
+                /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt the packet.
+                virtual void HandleTunnelPacket (
+                    Tunnel & /*tunnel*/,
+                    Packet::SharedPtr /*packet*/,
+                    crypto::Cipher::SharedPtr /*cipher*/) throw () {}
+                /// \brief
+                /// Called when the transport's send queue crosses it's high water
+                /// mark (on == true, stop sending), and again when it drains below
+                /// it's low water mark (on == false, resume sending). Not called
+                /// with any tunnel locks held.
+                /// \param[in] tunnel Tunnel whose send queue crossed a water mark.
+                /// \param[in] on true == backpressure on, false == off.
+                virtual void HandleTunnelBackpressure (
+                    Tunnel & /*tunnel*/,
+                    bool /*on*/) throw () {}
+                /// \brief
+                /// Called when the tunnel encounters an error.
+                /// \param[in] tunnel Tunnel that encountered the error.
+                /// \param[in] exception Error.
+                virtual void HandleTunnelError (
+                    Tunnel & /*tunnel*/,
+                    const util::Exception & /*exception*/) throw () {}
+                /// \brief
+                /// Called when the peer closes the tunnel.
+                /// \param[in] tunnel Tunnel that was closed.
+                virtual void HandleTunnelClosed (Tunnel & /*tunnel*/) throw () {}
+            };
+
+            enum {
+                /// \brief
+                /// Bytes a priority class of weight 1 gets per round robin turn.
+                PRIORITY_QUANTUM = 16384,
+                /// \brief
+                /// Default PRIORITY_BULK weight.
+                DEFAULT_BULK_WEIGHT = 1,
+                /// \brief
+                /// Default PRIORITY_NORMAL weight.
+                DEFAULT_NORMAL_WEIGHT = 4,
+                /// \brief
+                /// Default PRIORITY_INTERACTIVE weight.
+                DEFAULT_INTERACTIVE_WEIGHT = 16
+            };
+
+        protected:
+            /// \brief
+            /// Keys used to encrypt and decrypt packets.
+            KeyRing &keyRing;
+            /// \brief
+            /// Receives tunnel events.
+            EventSink &eventSink;
+            /// \brief
+            /// Optional \see{Session} baked in to every packet (0 == none).
+            Session *session;
+            /// \brief
+            /// \see{PaddingPolicy} outgoing packets are serialized with
+            /// (null == PaddingPolicy::GetDefault ()).
+            PaddingPolicy::SharedPtr paddingPolicy;
+            /// \brief
+            /// true == compress outgoing packets.
+            bool compress;
+
+        private:
+            /// \struct Tunnel::PriorityQueue Tunnel.h thekogans/packet/Tunnel.h
+            ///
+            /// \brief
+            /// Packets of one priority class waiting for the transport.
+            struct PriorityQueue {
+                /// \brief
+                /// Waiting packets.
+                std::deque<Packet::SharedPtr> packets;
+                /// \brief
+                /// Round robin weight.
+                std::size_t weight;
+                /// \brief
+                /// Bytes the class can still send this turn.
+                std::size_t deficit;
+
+                /// \brief
+                /// ctor.
+                PriorityQueue () :
+                    weight (1),
+                    deficit (0) {}
+            };
+            /// \brief
+            /// One queue per \see{Packet::Priority}.
+            PriorityQueue priorityQueues[Packet::PRIORITY_COUNT];
+            /// \brief
+            /// Number of packets in priorityQueues.
+            std::size_t pendingPacketCount;
+            /// \brief
+            /// Weighted class whose round robin turn it is.
+            std::size_t currentPriority;
+            /// \brief
+            /// true == a thread is handing packets to the transport. Only
+            /// one thread at a time does, to keep the packets in order.
+            bool releasing;
+            /// \brief
+            /// Backpressure state last reported to the \see{EventSink}.
+            bool backpressureReported;
+            /// \brief
+            /// Synchronizes the above.
+            util::Mutex scheduleMutex;
+
+        public:
+            /// \brief
+            /// Filters outgoing packets go through before being serialized.
+            PacketFilterChain outgoingFilters;
+            /// \brief
+            /// Filters incoming packets go through before being delivered.
+            PacketFilterChain incomingFilters;
+
+            /// \brief
+            /// ctor.
+            /// \param[in] keyRing_ Keys used to encrypt and decrypt packets.
+            /// \param[in] eventSink_ Receives tunnel events.
+            /// \param[in] session_ Optional \see{Session} baked in to every packet.
+            /// If it uses compact headers, keyRing_ must have a Thresholds::packetLimit
+            /// no greater than \see{Session::COMPACT_HEADER_KEY_PACKET_LIMIT}.
+            /// \param[in] paddingPolicy_ \see{PaddingPolicy} outgoing packets are
+            /// serialized with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] compress_ true == compress outgoing packets.
+            Tunnel (
+                KeyRing &keyRing_,
+                EventSink &eventSink_,
+                Session *session_ = 0,
+                PaddingPolicy::SharedPtr paddingPolicy_ = PaddingPolicy::SharedPtr (),
+                bool compress_ = false);
+            /// \brief
+            /// dtor.
+            virtual ~Tunnel () {}
+
+            /// \brief
+            /// Return the tunnel's \see{KeyRing}.
+            /// \return The tunnel's \see{KeyRing}.
+            inline KeyRing &GetKeyRing () const {
+                return keyRing;
+            }
+
+            /// \brief
+            /// Set the round robin weight of the given priority class. A class
+            /// gets weight * PRIORITY_QUANTUM bytes per turn while the transport
+            /// is pushing back. PRIORITY_CONTROL is not weighted (it always goes first).
+            /// \param[in] priority PRIORITY_BULK, PRIORITY_NORMAL or PRIORITY_INTERACTIVE.
+            /// \param[in] weight Class weight (> 0).
+            void SetPriorityWeight (
+                Packet::Priority priority,
+                std::size_t weight);
+            /// \brief
+            /// Return the number of packets waiting in the priority queues.
+            /// \return Number of packets waiting in the priority queues.
+            std::size_t GetPendingPacketCount ();
+
+            /// \brief
+            /// Return true if the transport's send queue is over it's high water mark.
+            /// \return true == backpressure is on.
+            virtual bool IsBackpressured () = 0;
+
+            /// \brief
+            /// Run the packet through the outgoing filter chain and queue
+            /// whatever comes out of it for sending. Never blocks on the network.
+            /// \param[in] packet \see{Packet} to send.
+            /// \return true == keep sending, false == the transport is over it's
+            /// high water mark (the packet was still queued). Wait for
+            /// EventSink::HandleTunnelBackpressure (..., false) before sending more.
+            bool SendPacket (Packet::SharedPtr packet);
+            /// \brief
+            /// Run the batch through the outgoing filter chain and queue
+            /// whatever comes out of it for sending. Transports that can
+            /// (see \see{UDPTunnel}) encrypt and send the batch as a whole.
+            /// \param[in, out] packets \see{Packet}s to send. On return
+            /// contains the packets that made it through the filters.
+            /// \return true == keep sending, false == backpressure.
+            bool SendPackets (PacketBatch &packets);
+
+        protected:
+            /// \brief
+            /// Queue a filtered packet for sending. Transports serialize it
+            /// (see SerializePacket) under their send lock.
+            /// \param[in] packet \see{Packet} to send.
+            /// \param[in] cipher \see{KeyRing} active \see{crypto::Cipher}
+            /// to encrypt it with (already charged for the packet).
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) = 0;
+            /// \brief
+            /// Queue a batch of filtered packets for sending. The default
+            /// implementation calls EnqueuePacket on every packet.
+            /// \param[in] packets \see{Packet}s to send.
+            /// \param[in] cipher \see{KeyRing} active \see{crypto::Cipher}
+            /// to encrypt them with (already charged for the batch).
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePackets (
+                const PacketBatch &packets,
+                crypto::Cipher::SharedPtr cipher);
+
+            /// \brief
+            /// Serialize the packet with the given cipher.
+            /// \param[in] packet \see{Packet} to serialize.
+            /// \param[in] cipher \see{crypto::Cipher} passed to EnqueuePacket.
+            /// \return Frame ready to go on the wire.
+            util::Buffer::SharedPtr SerializePacket (
+                const Packet &packet,
+                crypto::Cipher &cipher);
+            /// \brief
+            /// Serialize the batch with the given cipher
+            /// (see \see{Packet::SerializeBatch}).
+            /// \param[in] packets \see{Packet}s to serialize.
+            /// \param[in] cipher \see{crypto::Cipher} passed to EnqueuePackets.
+            /// \param[out] frameLengths Length of every frame.
+            /// \return Frames ready to go on the wire, back to back.
+            util::Buffer::SharedPtr SerializePackets (
+                const PacketBatch &packets,
+                crypto::Cipher &cipher,
+                std::vector<std::size_t> &frameLengths);
+
+            /// \brief
+            /// Drop the packets waiting in the priority queues.
+            /// Transports call it (with no locks held) when they close.
+            void ClearPendingPackets ();
+            /// \brief
+            /// Transports call this (with no tunnel locks held) when their send
+            /// queue crosses a water mark. When backpressure goes off, the waiting
+            /// packets are released first. If that doesn't turn it back on, the
+            /// \see{EventSink}, and then the outgoing filters (see
+            /// \see{PacketFilter::HandleBackpressure}) are told.
+            /// \param[in] on true == backpressure on, false == off.
+            void HandleBackpressure (bool on) throw ();
+
+            // FrameParser::PacketHandler
+            /// \brief
+            /// Return the \see{KeyRing} cipher for the given key id.
+            /// \param[in] keyId \see{crypto::SymmetricKey} id.
+            /// \return \see{crypto::Cipher} corresponding to the given key id.
+            virtual crypto::Cipher::SharedPtr GetCipherForKeyId (
+                const crypto::ID &keyId) throw () override;
+            /// \brief
+            /// Return the tunnel \see{Session}.
+            /// \return Tunnel \see{Session} (0 if not using sessions).
+            virtual Session *GetCurrentSession () throw () override {
+                return session;
+            }
+            /// \brief
+            /// Run the packet through the incoming filter chain
+            /// and deliver it to the \see{EventSink}.
+            /// \param[in] packet New \see{Packet}.
+            /// \param[in] cipher \see{crypto::Cipher} that was used to decrypt this packet.
+            virtual void HandlePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) throw () override;
+
+        private:
+            /// \brief
+            /// Return the \see{KeyRing}'s active cipher, charging it for the packet.
+            /// Called with no locks held, as crossing a rotation threshold calls
+            /// the \see{KeyRing::RotationHandler}, which is free to send packets.
+            /// \param[in] packet \see{Packet} about to be enqueued.
+            /// \return The active \see{crypto::Cipher} (throws if there is none).
+            crypto::Cipher::SharedPtr GetActiveCipher (const Packet &packet);
+            /// \brief
+            /// Return the \see{KeyRing}'s active cipher, charging it for the batch.
+            /// Called with no locks held (see above).
+            /// \param[in] packets \see{Packet}s about to be enqueued.
+            /// \return The active \see{crypto::Cipher} (throws if there is none).
+            crypto::Cipher::SharedPtr GetActiveCipher (const PacketBatch &packets);
+            /// \brief
+            /// Hand the given packet, and then the waiting packets in priority
+            /// order, to the transport, until they run out or the transport pushes
+            /// back. Must be called with releasing set (it clears it on the way out).
+            /// \param[in] packet \see{Packet} to send first (null == none).
+            /// \param[in] enqueued false == the transport just pushed back.
+            /// \return true == keep sending, false == backpressure.
+            bool ReleasePackets (
+                Packet::SharedPtr packet,
+                bool enqueued = true);
+            /// \brief
+            /// Add the given packet to it's priority class queue.
+            /// Must be called with scheduleMutex held.
+            /// \param[in] packet \see{Packet} to queue.
+            void QueuePacket (Packet::SharedPtr packet);
+            /// \brief
+            /// Remove and return the next packet to send.
+            /// Must be called with scheduleMutex held.
+            /// \return Next packet to send (null == none waiting).
+            Packet::SharedPtr DequeuePacket ();
+            /// \brief
+            /// Tell the \see{EventSink} and the outgoing filters about
+            /// a backpressure change (if it is one).
+            /// \param[in] on true == backpressure on, false == off.
+            void ReportBackpressure (bool on);
+
+            /// \brief
+            /// Tunnel is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (Tunnel)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (__thekogans_packet_Tunnel_h)
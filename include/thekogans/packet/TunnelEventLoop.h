@@ -0,0 +1,126 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_TunnelEventLoop_h)
+#define __thekogans_packet_TunnelEventLoop_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <cstddef>
+#include <atomic>
+#include "thekogans/util/Types.h"
+#include "thekogans/packet/Config.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct TunnelEventLoop TunnelEventLoop.h thekogans/packet/TunnelEventLoop.h
+        ///
+        /// \brief
+        /// TunnelEventLoop is an edge triggered epoll loop driving any number of
+        /// tunnel transports (see \see{TCPTunnel}). Handlers are registered once
+        /// for input, output and peer hang up, and are expected to drain their
+        /// socket (read until EAGAIN, write until EAGAIN or empty) every time
+        /// they are called, as the kernel only reports edges. One thread runs
+        /// the loop (Run or Poll). Stop can be called from any thread.
+        ///
+        /// NOTE: Don't destroy a handler from inside HandleEvents. Call
+        /// DeleteHandler, and destroy it after Poll returns.
+        ///
+        /// Linux only.
+
+        struct _LIB_THEKOGANS_PACKET_DECL TunnelEventLoop {
+            /// \struct TunnelEventLoop::Handler TunnelEventLoop.h thekogans/packet/TunnelEventLoop.h
+            ///
+            /// \brief
+            /// Inherit from this class to be driven by the loop.
+            struct _LIB_THEKOGANS_PACKET_DECL Handler {
+                /// \brief
+                /// dtor.
+                virtual ~Handler () {}
+
+                /// \brief
+                /// Return the socket to watch.
+                /// \return Socket to watch.
+                virtual THEKOGANS_UTIL_HANDLE GetHandle () const = 0;
+                /// \brief
+                /// Called with the epoll events that fired.
+                /// \param[in] events EPOLLIN, EPOLLOUT, EPOLLRDHUP, EPOLLHUP, EPOLLERR.
+                virtual void HandleEvents (util::ui32 events) throw () = 0;
+            };
+
+            enum {
+                /// \brief
+                /// Default maximum number of events returned by one epoll_wait.
+                DEFAULT_MAX_EVENTS_PER_WAIT = 64
+            };
+
+        private:
+            /// \brief
+            /// epoll instance.
+            THEKOGANS_UTIL_HANDLE epollHandle;
+            /// \brief
+            /// eventfd used to wake the loop up in Stop.
+            THEKOGANS_UTIL_HANDLE eventHandle;
+            /// \brief
+            /// Maximum number of events returned by one epoll_wait.
+            const std::size_t maxEventsPerWait;
+            /// \brief
+            /// true == Run should return.
+            std::atomic<bool> done;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] maxEventsPerWait_ Maximum number of events returned by one epoll_wait.
+            explicit TunnelEventLoop (
+                std::size_t maxEventsPerWait_ = DEFAULT_MAX_EVENTS_PER_WAIT);
+            /// \brief
+            /// dtor.
+            ~TunnelEventLoop ();
+
+            /// \brief
+            /// Start watching the handler's socket.
+            /// \param[in] handler Handler to add.
+            void AddHandler (Handler &handler);
+            /// \brief
+            /// Stop watching the handler's socket.
+            /// \param[in] handler Handler to delete.
+            void DeleteHandler (Handler &handler);
+
+            /// \brief
+            /// Wait for events once and dispatch them.
+            /// \param[in] timeout Milliseconds to wait (-1 == forever).
+            /// \return Number of handlers called.
+            std::size_t Poll (int timeout = -1);
+            /// \brief
+            /// Poll until Stop is called.
+            void Run ();
+            /// \brief
+            /// Make Run return. Thread safe.
+            void Stop ();
+
+            /// \brief
+            /// TunnelEventLoop is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (TunnelEventLoop)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_TunnelEventLoop_h)
@@ -0,0 +1,361 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_TunnelServer_h)
+#define __thekogans_packet_TunnelServer_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/socket.h>
+#include <cstddef>
+#include <atomic>
+#include <set>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/RefCounted.h"
+#include "thekogans/util/Thread.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/TunnelEventLoop.h"
+#include "thekogans/packet/TCPTunnel.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct TunnelServer TunnelServer.h thekogans/packet/TunnelServer.h
+        ///
+        /// \brief
+        /// TunnelServer is a multi-core \see{TCPTunnel} server. It runs shardCount
+        /// shards, each a thread with it's own \see{TunnelEventLoop}, it's own
+        /// listening socket (all bound to the same address with SO_REUSEPORT), it's
+        /// own \see{ShardContext} (the place for per shard \see{KeyRing}s,
+        /// \see{SessionTable}s, \see{CipherPool}s...) and the tunnels it accepted.
+        /// A tunnel lives it's whole life on the shard that accepted it, so nothing
+        /// on the data path is shared (or locked) between shards.
+        ///
+        /// Affinity: with AFFINITY_KERNEL_HASH the kernel spreads connections over
+        /// the listeners by hashing their addresses. With AFFINITY_INCOMING_CPU a
+        /// classic BPF program steers every connection to the shard whose index
+        /// is the CPU that received it's SYN (modulo shardCount). With pinThreads,
+        /// shard i is pinned to CPU i, so (given RSS/RPS spreading the traffic) a
+        /// connection is processed from the NIC queue to the application on one core.
+        ///
+        /// The following example illustrates it's use:
+        ///
+        /// \code{.cpp}
+        /// using namespace thekogans;
+        ///
+        /// struct Context : public packet::TunnelServer::ShardContext {
+        ///     packet::KeyRing keyRing;
+        ///     EventSink eventSink;
+        ///     ...
+        /// };
+        ///
+        /// struct Server : public packet::TunnelServer::Handler {
+        ///     virtual packet::TunnelServer::ShardContext::SharedPtr CreateShardContext (
+        ///             packet::TunnelServer::Shard &shard) override {
+        ///         return packet::TunnelServer::ShardContext::SharedPtr (new Context);
+        ///     }
+        ///     virtual packet::TCPTunnel *CreateTunnel (
+        ///             packet::TunnelServer::Shard &shard,
+        ///             THEKOGANS_UTIL_HANDLE handle) override {
+        ///         Context *context = static_cast<Context *> (shard.GetContext ().Get ());
+        ///         return new packet::TCPTunnel (handle, context->keyRing, context->eventSink);
+        ///     }
+        /// } server;
+        ///
+        /// packet::TunnelServer tunnelServer (server, address, addressLength);
+        /// tunnelServer.Start ();
+        /// ...
+        /// // From EventSink::HandleTunnelClosed (on the shard's thread):
+        /// packet::TunnelServer::Shard::GetCurrentShard ()->DeleteTunnel (
+        ///     static_cast<packet::TCPTunnel &> (tunnel));
+        /// \endcode
+        ///
+        /// Linux only.
+
+        struct _LIB_THEKOGANS_PACKET_DECL TunnelServer {
+            /// \enum
+            /// Connection to shard affinity.
+            enum Affinity {
+                /// \brief
+                /// The kernel hashes connections over the listeners.
+                AFFINITY_KERNEL_HASH,
+                /// \brief
+                /// Connections go to the shard of the CPU that received them.
+                AFFINITY_INCOMING_CPU
+            };
+
+            enum {
+                /// \brief
+                /// Default listen backlog (per shard).
+                DEFAULT_BACKLOG = 1024
+            };
+
+            /// \struct TunnelServer::ShardContext TunnelServer.h thekogans/packet/TunnelServer.h
+            ///
+            /// \brief
+            /// Derive from this class to hold per shard state.
+            struct _LIB_THEKOGANS_PACKET_DECL ShardContext : public util::RefCounted {
+                /// \brief
+                /// Declare \see{RefCounted} pointers.
+                THEKOGANS_UTIL_DECLARE_REF_COUNTED_POINTERS (ShardContext)
+
+                /// \brief
+                /// dtor.
+                virtual ~ShardContext () {}
+            };
+
+            struct Shard;
+
+            /// \struct TunnelServer::Handler TunnelServer.h thekogans/packet/TunnelServer.h
+            ///
+            /// \brief
+            /// Inherit from this class to create per shard state and tunnels.
+            /// All methods are called on the shard's thread.
+            struct _LIB_THEKOGANS_PACKET_DECL Handler {
+                /// \brief
+                /// dtor.
+                virtual ~Handler () {}
+
+                /// \brief
+                /// Called once when the shard starts, before it accepts connections.
+                /// \param[in] shard Shard that's starting.
+                /// \return Shard's context (can be null).
+                virtual ShardContext::SharedPtr CreateShardContext (
+                        Shard & /*shard*/) {
+                    return ShardContext::SharedPtr ();
+                }
+                /// \brief
+                /// Called for every accepted connection.
+                /// \param[in] shard Shard that accepted the connection.
+                /// \param[in] handle Connected socket.
+                /// \return Tunnel over handle (owned by the shard from here on),
+                /// or 0 to refuse the connection (the socket is closed).
+                virtual TCPTunnel *CreateTunnel (
+                    Shard &shard,
+                    THEKOGANS_UTIL_HANDLE handle) = 0;
+                /// \brief
+                /// Called when a shard runs in to trouble accepting connections.
+                /// \param[in] shard Shard that failed.
+                /// \param[in] exception What went wrong.
+                virtual void HandleShardError (
+                    Shard & /*shard*/,
+                    const util::Exception & /*exception*/) throw () {}
+                /// \brief
+                /// Called once when the shard stops, after all it's tunnels were deleted.
+                /// \param[in] shard Shard that's stopping.
+                virtual void HandleShardStopped (Shard & /*shard*/) throw () {}
+            };
+
+            /// \struct TunnelServer::Shard TunnelServer.h thekogans/packet/TunnelServer.h
+            ///
+            /// \brief
+            /// A shard: a thread running an event loop over a listener and the
+            /// tunnels it accepted.
+            struct _LIB_THEKOGANS_PACKET_DECL Shard :
+                    public util::Thread,
+                    public TunnelEventLoop::Handler {
+            private:
+                /// \brief
+                /// Server this shard belongs to.
+                TunnelServer &server;
+                /// \brief
+                /// Shard index.
+                const std::size_t index;
+                /// \brief
+                /// Listening socket (SO_REUSEPORT).
+                THEKOGANS_UTIL_HANDLE listener;
+                /// \brief
+                /// Shard's event loop.
+                TunnelEventLoop eventLoop;
+                /// \brief
+                /// Shard's context.
+                ShardContext::SharedPtr context;
+                /// \brief
+                /// Live tunnels.
+                std::set<TCPTunnel *> tunnels;
+                /// \brief
+                /// Tunnels deleted during the current Poll.
+                std::vector<TCPTunnel *> deletedTunnels;
+                /// \brief
+                /// true == Run should return.
+                std::atomic<bool> done;
+
+            public:
+                /// \brief
+                /// ctor.
+                /// \param[in] server_ Server this shard belongs to.
+                /// \param[in] index_ Shard index.
+                /// \param[in] listener_ Listening socket (owned).
+                Shard (
+                    TunnelServer &server_,
+                    std::size_t index_,
+                    THEKOGANS_UTIL_HANDLE listener_);
+                /// \brief
+                /// dtor.
+                virtual ~Shard ();
+
+                /// \brief
+                /// Return the shard running on the calling thread.
+                /// \return Shard running on the calling thread (0 if none).
+                static Shard *GetCurrentShard ();
+
+                /// \brief
+                /// Return the shard index.
+                /// \return Shard index.
+                inline std::size_t GetIndex () const {
+                    return index;
+                }
+                /// \brief
+                /// Return the shard's context.
+                /// \return Shard's context.
+                inline ShardContext::SharedPtr GetContext () const {
+                    return context;
+                }
+                /// \brief
+                /// Return the shard's event loop (to add other handlers to it).
+                /// \return Shard's event loop.
+                inline TunnelEventLoop &GetEventLoop () {
+                    return eventLoop;
+                }
+                /// \brief
+                /// Return the number of live tunnels.
+                /// Call on the shard's thread.
+                /// \return Number of live tunnels.
+                inline std::size_t GetTunnelCount () const {
+                    return tunnels.size ();
+                }
+
+                /// \brief
+                /// Close the tunnel and delete it once the current Poll
+                /// returns. Call on the shard's thread (ex: from
+                /// EventSink::HandleTunnelClosed).
+                /// \param[in] tunnel Tunnel created by this shard.
+                void DeleteTunnel (TCPTunnel &tunnel);
+
+                /// \brief
+                /// Make Run return. Thread safe.
+                void Stop ();
+
+                // TunnelEventLoop::Handler
+                /// \brief
+                /// Return the listener.
+                /// \return The listener.
+                virtual THEKOGANS_UTIL_HANDLE GetHandle () const override {
+                    return listener;
+                }
+                /// \brief
+                /// Accept until EAGAIN.
+                /// \param[in] events epoll events that fired.
+                virtual void HandleEvents (util::ui32 events) throw () override;
+
+            protected:
+                // util::Thread
+                /// \brief
+                /// Shard thread.
+                virtual void Run () throw () override;
+
+                /// \brief
+                /// Shard is neither copy constructable nor assignable.
+                THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (Shard)
+            };
+
+        private:
+            /// \brief
+            /// Creates shard state and tunnels.
+            Handler &handler;
+            /// \brief
+            /// Address to listen on.
+            sockaddr_storage address;
+            /// \brief
+            /// Length of address.
+            socklen_t addressLength;
+            /// \brief
+            /// Number of shards.
+            const std::size_t shardCount;
+            /// \brief
+            /// Connection to shard affinity.
+            const Affinity affinity;
+            /// \brief
+            /// true == pin shard i to CPU i.
+            const bool pinThreads;
+            /// \brief
+            /// Listen backlog (per shard).
+            const int backlog;
+            /// \brief
+            /// Shards (empty when stopped).
+            std::vector<Shard *> shards;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] handler_ Creates shard state and tunnels.
+            /// \param[in] address_ Address to listen on.
+            /// \param[in] addressLength_ Length of address_.
+            /// \param[in] shardCount_ Number of shards (0 == one per online CPU).
+            /// \param[in] affinity_ Connection to shard affinity.
+            /// \param[in] pinThreads_ true == pin shard i to CPU i.
+            /// \param[in] backlog_ Listen backlog (per shard).
+            TunnelServer (
+                Handler &handler_,
+                const sockaddr *address_,
+                socklen_t addressLength_,
+                std::size_t shardCount_ = 0,
+                Affinity affinity_ = AFFINITY_INCOMING_CPU,
+                bool pinThreads_ = true,
+                int backlog_ = DEFAULT_BACKLOG);
+            /// \brief
+            /// dtor. Stops the shards.
+            ~TunnelServer ();
+
+            /// \brief
+            /// Return the number of shards.
+            /// \return Number of shards.
+            inline std::size_t GetShardCount () const {
+                return shardCount;
+            }
+
+            /// \brief
+            /// Create the listeners (in shard order, which is what
+            /// AFFINITY_INCOMING_CPU relies on) and start the shards.
+            void Start ();
+            /// \brief
+            /// Stop the shards, and wait for them to delete their
+            /// tunnels and close their listeners.
+            void Stop ();
+
+        private:
+            /// \brief
+            /// Create, bind and listen on a SO_REUSEPORT socket.
+            /// \return Listening socket.
+            THEKOGANS_UTIL_HANDLE CreateListener ();
+            /// \brief
+            /// Steer connections to the shard of the CPU that received them.
+            /// \param[in] listener Any listener in the SO_REUSEPORT group.
+            void AttachIncomingCPUFilter (THEKOGANS_UTIL_HANDLE listener);
+
+            /// \brief
+            /// TunnelServer is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (TunnelServer)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_TunnelServer_h)
@@ -0,0 +1,297 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if !defined (__thekogans_packet_UDPTunnel_h)
+#define __thekogans_packet_UDPTunnel_h
+
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/Mutex.h"
+#include "thekogans/packet/Config.h"
+#include "thekogans/packet/Packet.h"
+#include "thekogans/packet/Session.h"
+#include "thekogans/packet/PaddingPolicy.h"
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/KeyRing.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/TunnelEventLoop.h"
+
+namespace thekogans {
+    namespace packet {
+
+        /// \struct UDPTunnel UDPTunnel.h thekogans/packet/UDPTunnel.h
+        ///
+        /// \brief
+        /// UDPTunnel is a \see{Tunnel} over a connected, non-blocking UDP socket,
+        /// driven by a \see{TunnelEventLoop}. Every datagram carries exactly one
+        /// frame, so outgoing packets must fit in a datagram (install a
+        /// \see{FragmentPacketPacketFilter} or \see{FECFragmentPacketPacketFilter}
+        /// sized to the path MTU in the outgoing chain).
+        ///
+        /// Sending: frames are queued under the send lock and flushed with
+        /// sendmmsg, up to MAX_SEND_MESSAGE_COUNT messages per call. When the kernel
+        /// supports UDP generic segmentation offload (UDP_SEGMENT), runs of
+        /// consecutive equal length frames (fragments are filled to the byte, so
+        /// they usually are) are gathered in to a single GSO message that the stack
+        /// splits in to datagrams, so a large packet costs one trip through the
+        /// stack. Use SendPackets to encrypt and send a whole batch at once.
+        /// Backpressure works as it does for \see{TCPTunnel}.
+        ///
+        /// Receiving: datagrams are read with recvmmsg, up to receiveBatchSize per
+        /// call. With UDP_GRO on, the kernel coalesces datagrams of the same flow
+        /// in to one buffer, which is split back in to frames here. Every frame
+        /// is decrypted straight out of the receive buffer (no copy, no stream
+        /// reassembly). Malformed datagrams are dropped and reported to
+        /// EventSink::HandleTunnelError; they don't affect the datagrams around them.
+        ///
+        /// Linux only. GSO/GRO are used when the kernel has them (4.18+/5.0+).
+
+        struct _LIB_THEKOGANS_PACKET_DECL UDPTunnel :
+                public Tunnel,
+                public TunnelEventLoop::Handler {
+            enum {
+                /// \brief
+                /// Default max datagram (frame) length.
+                DEFAULT_MAX_DATAGRAM_LENGTH = 1472,
+                /// \brief
+                /// Default number of datagrams read by one recvmmsg.
+                DEFAULT_RECEIVE_BATCH_SIZE = 32,
+                /// \brief
+                /// Default send queue length at which backpressure turns on.
+                DEFAULT_HIGH_WATER_MARK = 1024 * 1024,
+                /// \brief
+                /// Default send queue length at which backpressure turns off.
+                DEFAULT_LOW_WATER_MARK = 256 * 1024,
+                /// \brief
+                /// Maximum number of messages in one sendmmsg call.
+                MAX_SEND_MESSAGE_COUNT = 64,
+                /// \brief
+                /// Maximum number of datagrams in one GSO message.
+                MAX_GSO_SEGMENT_COUNT = 64,
+                /// \brief
+                /// Maximum length of one GSO (or GRO) message.
+                MAX_GSO_LENGTH = 65535 - 8 - 40
+            };
+
+        private:
+            /// \struct UDPTunnel::Frame UDPTunnel.h thekogans/packet/UDPTunnel.h
+            ///
+            /// \brief
+            /// A queued frame. Frames serialized together share one buffer.
+            struct Frame {
+                /// \brief
+                /// Buffer holding the frame.
+                util::Buffer::SharedPtr buffer;
+                /// \brief
+                /// Frame start.
+                util::ui8 *data;
+                /// \brief
+                /// Frame length.
+                std::size_t length;
+
+                /// \brief
+                /// ctor.
+                /// \param[in] buffer_ Buffer holding the frame.
+                /// \param[in] data_ Frame start.
+                /// \param[in] length_ Frame length.
+                Frame (
+                    util::Buffer::SharedPtr buffer_,
+                    util::ui8 *data_,
+                    std::size_t length_) :
+                    buffer (buffer_),
+                    data (data_),
+                    length (length_) {}
+            };
+            /// \brief
+            /// Connected UDP socket (owned).
+            THEKOGANS_UTIL_HANDLE handle;
+            /// \brief
+            /// Max datagram (frame) length.
+            const std::size_t maxDatagramLength;
+            /// \brief
+            /// Send queue length at which backpressure turns on.
+            const std::size_t highWaterMark;
+            /// \brief
+            /// Send queue length at which backpressure turns off.
+            const std::size_t lowWaterMark;
+            /// \brief
+            /// true == the kernel supports UDP_SEGMENT.
+            bool gso;
+            /// \brief
+            /// true == UDP_GRO is on.
+            bool gro;
+            /// \brief
+            /// Receive buffers (one per recvmmsg message).
+            std::vector<util::Buffer::SharedPtr> receiveBuffers;
+            /// \brief
+            /// Frames waiting to be sent.
+            std::deque<Frame> sendQueue;
+            /// \brief
+            /// Number of unsent bytes in sendQueue.
+            std::size_t queuedBytes;
+            /// \brief
+            /// true == backpressure is on.
+            bool backpressure;
+            /// \brief
+            /// Last transient (ICMP) error Flush ran in to (0 == none).
+            /// Reported (see ReportTransientError) once sendMutex is released.
+            THEKOGANS_UTIL_ERROR_CODE transientErrorCode;
+            /// \brief
+            /// true == Close was called (the socket is shut down,
+            /// see CloseHandle).
+            std::atomic<bool> closed;
+            /// \brief
+            /// Serializes packet encryption and send queue access.
+            util::Mutex sendMutex;
+
+        public:
+            /// \brief
+            /// ctor.
+            /// \param[in] handle_ Connected UDP socket. The tunnel takes ownership
+            /// and puts it in non-blocking mode.
+            /// \param[in] keyRing Keys used to encrypt and decrypt packets.
+            /// \param[in] eventSink Receives tunnel events.
+            /// \param[in] session Optional \see{Session} baked in to every packet.
+            /// \param[in] maxDatagramLength_ Max datagram (frame) length.
+            /// \param[in] receiveBatchSize Number of datagrams read by one recvmmsg.
+            /// \param[in] highWaterMark_ Send queue length at which backpressure turns on.
+            /// \param[in] lowWaterMark_ Send queue length at which backpressure turns off.
+            /// \param[in] paddingPolicy \see{PaddingPolicy} outgoing packets are
+            /// serialized with (null == PaddingPolicy::GetDefault ()).
+            /// \param[in] compress true == compress outgoing packets.
+            UDPTunnel (
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session = 0,
+                std::size_t maxDatagramLength_ = DEFAULT_MAX_DATAGRAM_LENGTH,
+                std::size_t receiveBatchSize = DEFAULT_RECEIVE_BATCH_SIZE,
+                std::size_t highWaterMark_ = DEFAULT_HIGH_WATER_MARK,
+                std::size_t lowWaterMark_ = DEFAULT_LOW_WATER_MARK,
+                PaddingPolicy::SharedPtr paddingPolicy = PaddingPolicy::SharedPtr (),
+                bool compress = false);
+            /// \brief
+            /// dtor. Closes the socket.
+            virtual ~UDPTunnel ();
+
+            /// \brief
+            /// Return true if the kernel supports UDP GSO.
+            /// \return true == sends use UDP_SEGMENT.
+            inline bool IsGSOEnabled () const {
+                return gso;
+            }
+            /// \brief
+            /// Return true if UDP GRO is on.
+            /// \return true == receives use UDP_GRO.
+            inline bool IsGROEnabled () const {
+                return gro;
+            }
+
+            /// \brief
+            /// Return the number of unsent bytes.
+            /// \return Number of unsent bytes.
+            std::size_t GetQueuedBytes ();
+            /// \brief
+            /// Return true if backpressure is on.
+            /// \return true == backpressure is on.
+            virtual bool IsBackpressured () override;
+
+            /// \brief
+            /// Shut the socket down and drop unsent frames. The socket is closed
+            /// (and removed from the \see{TunnelEventLoop}) on the event loop
+            /// thread, or by the dtor if the tunnel is not in a loop.
+            void Close ();
+
+            // TunnelEventLoop::Handler
+            /// \brief
+            /// Return the socket.
+            /// \return The socket.
+            virtual THEKOGANS_UTIL_HANDLE GetHandle () const override {
+                return handle;
+            }
+            /// \brief
+            /// Read until EAGAIN and/or flush the send queue.
+            /// \param[in] events epoll events that fired.
+            virtual void HandleEvents (util::ui32 events) throw () override;
+
+        protected:
+            // Tunnel
+            /// \brief
+            /// Serialize the packet, queue it and try to send it.
+            /// \param[in] packet \see{Packet} to send.
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) override;
+            /// \brief
+            /// Serialize the batch in one go, queue it and try to send it.
+            /// \param[in] packets \see{Packet}s to send.
+            /// \return true == keep sending, false == backpressure.
+            virtual bool EnqueuePackets (
+                const PacketBatch &packets,
+                crypto::Cipher::SharedPtr cipher) override;
+
+        private:
+            /// \brief
+            /// Close the socket once closed is set. Called
+            /// on the event loop thread and from the dtor.
+            void CloseHandle ();
+            /// \brief
+            /// Queue the frames and flush. Must be called with sendMutex held.
+            /// \param[in] frames Buffer holding the frames back to back.
+            /// \param[in] frameLengths Length of every frame.
+            /// \return true == backpressure just turned on.
+            bool QueueFrames (
+                util::Buffer::SharedPtr frames,
+                const std::vector<std::size_t> &frameLengths);
+            /// \brief
+            /// Read until EAGAIN and deliver the packets.
+            void HandleReadable ();
+            /// \brief
+            /// Decrypt and deliver one frame.
+            /// \param[in] frame Buffer positioned at the frame.
+            void HandleFrame (util::Buffer &frame);
+            /// \brief
+            /// Flush the send queue and turn backpressure
+            /// off if it drained below the low water mark.
+            void HandleWritable ();
+            /// \brief
+            /// Send as much of the queue as the socket will take.
+            /// Must be called with sendMutex held.
+            void Flush ();
+            /// \brief
+            /// Report the transient error Flush ran in to (if any)
+            /// to the \see{EventSink}. Must be called without sendMutex
+            /// held, as the sink is free to send packets.
+            void ReportTransientError ();
+
+            /// \brief
+            /// UDPTunnel is neither copy constructable nor assignable.
+            THEKOGANS_UTIL_DISALLOW_COPY_AND_ASSIGN (UDPTunnel)
+        };
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
+
+#endif // !defined (__thekogans_packet_UDPTunnel_h)
@@ -0,0 +1,80 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/CipherPool.h"
+
+namespace thekogans {
+    namespace packet {
+
+        CipherPool::CipherPool (
+                crypto::SymmetricKey::SharedPtr key_,
+                const EVP_CIPHER *cipher_,
+                const EVP_MD *md_,
+                std::size_t maxIdleCount_) :
+                key (key_),
+                cipher (cipher_),
+                md (md_),
+                maxIdleCount (maxIdleCount_),
+                createdCount (0) {
+            if (key.Get () != 0) {
+                idle.reserve (maxIdleCount);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        crypto::Cipher::SharedPtr CipherPool::Acquire () {
+            {
+                util::LockGuard<util::SpinLock> guard (spinLock);
+                if (!idle.empty ()) {
+                    crypto::Cipher::SharedPtr context = idle.back ();
+                    idle.pop_back ();
+                    return context;
+                }
+                ++createdCount;
+            }
+            // Context setup (key schedule) happens outside the lock.
+            return crypto::Cipher::SharedPtr (new crypto::Cipher (key, cipher, md));
+        }
+
+        void CipherPool::Release (crypto::Cipher::SharedPtr context) {
+            if (context.Get () != 0) {
+                util::LockGuard<util::SpinLock> guard (spinLock);
+                if (idle.size () < maxIdleCount) {
+                    idle.push_back (context);
+                    return;
+                }
+            }
+            // Over the limit. The context is freed when the
+            // last reference goes away (outside the lock).
+        }
+
+        std::size_t CipherPool::GetIdleCount () {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            return idle.size ();
+        }
+
+        std::size_t CipherPool::GetCreatedCount () {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            return createdCount;
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -20,7 +20,7 @@
 namespace thekogans {
     namespace packet {
 
-        THEKOGANS_UTIL_IMPLEMENT_SERIALIZABLE (ClientKeyExchangePacket, 1)
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (ClientKeyExchangePacket, 1)
 
         void ClientKeyExchangePacket::Read (
                 const BinHeader & /*header*/,
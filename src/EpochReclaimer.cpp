@@ -0,0 +1,217 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <vector>
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/EpochReclaimer.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            // Epoch 0 is reserved to mean 'not in a read side section'.
+            std::atomic<util::ui64> globalEpoch (1);
+
+            enum {
+                CACHE_LINE_SIZE = 64
+            };
+
+            // Reader slots are allocated on demand and never freed. When
+            // a thread exits, it's slot is returned for reuse. The slot list
+            // only grows (by pushing on to the head), so writers can walk it
+            // without a lock.
+            struct Slot {
+                std::atomic<util::ui64> epoch;
+                std::atomic<bool> inUse;
+                Slot *next;
+                // Keep slots from sharing cache lines.
+                util::ui8 padding[CACHE_LINE_SIZE];
+
+                Slot () :
+                    epoch (0),
+                    inUse (true),
+                    next (0) {}
+            };
+
+            std::atomic<Slot *> slots (0);
+
+            Slot *AcquireSlot () {
+                for (Slot *slot = slots.load (std::memory_order_acquire);
+                        slot != 0; slot = slot->next) {
+                    bool inUse = false;
+                    if (!slot->inUse.load (std::memory_order_relaxed) &&
+                            slot->inUse.compare_exchange_strong (inUse, true)) {
+                        return slot;
+                    }
+                }
+                Slot *slot = new Slot;
+                Slot *head = slots.load (std::memory_order_relaxed);
+                do {
+                    slot->next = head;
+                } while (!slots.compare_exchange_weak (head, slot));
+                return slot;
+            }
+
+            struct ThreadSlot {
+                Slot *slot;
+                std::size_t depth;
+
+                ThreadSlot () :
+                    slot (0),
+                    depth (0) {}
+                ~ThreadSlot () {
+                    if (slot != 0) {
+                        slot->epoch.store (0, std::memory_order_release);
+                        slot->inUse.store (false, std::memory_order_release);
+                    }
+                }
+
+                inline Slot &GetSlot () {
+                    if (slot == 0) {
+                        slot = AcquireSlot ();
+                    }
+                    return *slot;
+                }
+            };
+
+            thread_local ThreadSlot threadSlot;
+
+            struct Retired {
+                EpochReclaimer::Retirable *retirable;
+                util::ui64 epoch;
+
+                Retired (
+                    EpochReclaimer::Retirable *retirable_,
+                    util::ui64 epoch_) :
+                    retirable (retirable_),
+                    epoch (epoch_) {}
+            };
+
+            struct RetiredList {
+                util::SpinLock spinLock;
+                std::list<Retired> list;
+            };
+
+            // Never destroyed, as threads can retire objects
+            // during static destruction.
+            RetiredList &GetRetiredList () {
+                static RetiredList *retiredList = new RetiredList;
+                return *retiredList;
+            }
+
+            // Return the oldest epoch still being read (0 if none).
+            util::ui64 GetOldestReaderEpoch () {
+                std::atomic_thread_fence (std::memory_order_seq_cst);
+                util::ui64 oldestEpoch = 0;
+                for (Slot *slot = slots.load (std::memory_order_acquire);
+                        slot != 0; slot = slot->next) {
+                    util::ui64 epoch = slot->epoch.load (std::memory_order_acquire);
+                    if (epoch != 0 && (oldestEpoch == 0 || epoch < oldestEpoch)) {
+                        oldestEpoch = epoch;
+                    }
+                }
+                return oldestEpoch;
+            }
+        }
+
+        void EpochReclaimer::EnterReadSection () {
+            if (threadSlot.depth++ == 0) {
+                Slot &slot = threadSlot.GetSlot ();
+                // The acquire pairs with the writer's (seq_cst) epoch
+                // increment, which follows it's unpublish of the retired
+                // object. A reader that sees the new epoch is guaranteed
+                // to see the new version. The fence orders the slot store
+                // before the reader's subsequent loads of shared pointers.
+                slot.epoch.store (
+                    globalEpoch.load (std::memory_order_acquire),
+                    std::memory_order_relaxed);
+                std::atomic_thread_fence (std::memory_order_seq_cst);
+            }
+        }
+
+        void EpochReclaimer::LeaveReadSection () {
+            assert (threadSlot.depth > 0);
+            if (--threadSlot.depth == 0) {
+                threadSlot.GetSlot ().epoch.store (0, std::memory_order_release);
+            }
+        }
+
+        void EpochReclaimer::Retire (Retirable *retirable) {
+            if (retirable != 0) {
+                // Readers that entered at or before this epoch may still hold
+                // retirable. Those that enter later can't reach it.
+                util::ui64 epoch = globalEpoch.fetch_add (1);
+                {
+                    RetiredList &retiredList = GetRetiredList ();
+                    util::LockGuard<util::SpinLock> guard (retiredList.spinLock);
+                    retiredList.list.push_back (Retired (retirable, epoch));
+                }
+                Reclaim ();
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        std::size_t EpochReclaimer::Reclaim () {
+            util::ui64 oldestEpoch = GetOldestReaderEpoch ();
+            std::vector<Retirable *> reclaimed;
+            std::size_t pending = 0;
+            {
+                RetiredList &retiredList = GetRetiredList ();
+                util::LockGuard<util::SpinLock> guard (retiredList.spinLock);
+                for (std::list<Retired>::iterator
+                        it = retiredList.list.begin (),
+                        end = retiredList.list.end (); it != end;) {
+                    if (oldestEpoch == 0 || it->epoch < oldestEpoch) {
+                        reclaimed.push_back (it->retirable);
+                        it = retiredList.list.erase (it);
+                    }
+                    else {
+                        ++it;
+                    }
+                }
+                pending = retiredList.list.size ();
+            }
+            // Delete outside the lock, as dtors can do arbitrary work
+            // (including retiring more objects).
+            for (std::size_t i = 0, count = reclaimed.size (); i < count; ++i) {
+                delete reclaimed[i];
+            }
+            return pending;
+        }
+
+        void EpochReclaimer::Synchronize () {
+            util::ui64 epoch = globalEpoch.fetch_add (1);
+            for (;;) {
+                util::ui64 oldestEpoch = GetOldestReaderEpoch ();
+                if (oldestEpoch == 0 || oldestEpoch > epoch) {
+                    break;
+                }
+                std::this_thread::yield ();
+            }
+            Reclaim ();
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,240 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/ErasureCode.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            // GF(2^8) arithmetic using the 0x11d reduction polynomial.
+            struct GaloisField {
+                util::ui8 exp[512];
+                util::ui8 log[256];
+
+                GaloisField () {
+                    util::ui32 x = 1;
+                    for (std::size_t i = 0; i < 255; ++i) {
+                        exp[i] = (util::ui8)x;
+                        log[x] = (util::ui8)i;
+                        x <<= 1;
+                        if (x & 0x100) {
+                            x ^= 0x11d;
+                        }
+                    }
+                    for (std::size_t i = 255; i < 512; ++i) {
+                        exp[i] = exp[i - 255];
+                    }
+                    log[0] = 0;
+                }
+
+                inline util::ui8 Mul (
+                        util::ui8 a,
+                        util::ui8 b) const {
+                    return a == 0 || b == 0 ? 0 : exp[log[a] + log[b]];
+                }
+
+                inline util::ui8 Inv (util::ui8 a) const {
+                    assert (a != 0);
+                    return exp[255 - log[a]];
+                }
+
+                // dst ^= coefficient * src
+                void MulAdd (
+                        util::ui8 coefficient,
+                        const util::ui8 *src,
+                        util::ui8 *dst,
+                        std::size_t length) const {
+                    if (coefficient == 1) {
+                        for (std::size_t i = 0; i < length; ++i) {
+                            dst[i] ^= src[i];
+                        }
+                    }
+                    else if (coefficient != 0) {
+                        util::ui8 table[256];
+                        table[0] = 0;
+                        util::ui32 logCoefficient = log[coefficient];
+                        for (std::size_t i = 1; i < 256; ++i) {
+                            table[i] = exp[log[i] + logCoefficient];
+                        }
+                        for (std::size_t i = 0; i < length; ++i) {
+                            dst[i] ^= table[src[i]];
+                        }
+                    }
+                }
+            };
+
+            const GaloisField &GetGaloisField () {
+                static const GaloisField galoisField;
+                return galoisField;
+            }
+        }
+
+        ErasureCode::ErasureCode (
+                std::size_t dataShardCount_,
+                std::size_t parityShardCount_) :
+                dataShardCount (dataShardCount_),
+                parityShardCount (parityShardCount_) {
+            if (dataShardCount > 0 && parityShardCount > 0 &&
+                    dataShardCount + parityShardCount <= MAX_SHARD_COUNT) {
+                const GaloisField &gf = GetGaloisField ();
+                // Cauchy matrix: C[i][j] = 1 / (x[i] + y[j]), with
+                // x[i] = dataShardCount + i and y[j] = j. All x and y
+                // are distinct, so every square submatrix is invertible.
+                parityMatrix.resize (parityShardCount * dataShardCount);
+                for (std::size_t i = 0; i < parityShardCount; ++i) {
+                    for (std::size_t j = 0; j < dataShardCount; ++j) {
+                        parityMatrix[i * dataShardCount + j] =
+                            gf.Inv ((util::ui8)((dataShardCount + i) ^ j));
+                    }
+                }
+                // Scaling columns preserves the invertibility of every
+                // square submatrix. Scale so that the first row is all
+                // ones (plain XOR parity).
+                for (std::size_t j = 0; j < dataShardCount; ++j) {
+                    util::ui8 scale = gf.Inv (parityMatrix[j]);
+                    for (std::size_t i = 0; i < parityShardCount; ++i) {
+                        parityMatrix[i * dataShardCount + j] =
+                            gf.Mul (parityMatrix[i * dataShardCount + j], scale);
+                    }
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void ErasureCode::Encode (
+                const util::ui8 * const *dataShards,
+                util::ui8 * const *parityShards,
+                std::size_t shardLength) const {
+            if (dataShards != 0 && parityShards != 0) {
+                const GaloisField &gf = GetGaloisField ();
+                for (std::size_t i = 0; i < parityShardCount; ++i) {
+                    memset (parityShards[i], 0, shardLength);
+                    for (std::size_t j = 0; j < dataShardCount; ++j) {
+                        gf.MulAdd (
+                            parityMatrix[i * dataShardCount + j],
+                            dataShards[j],
+                            parityShards[i],
+                            shardLength);
+                    }
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool ErasureCode::Decode (
+                util::ui8 * const *shards,
+                const bool *present,
+                std::size_t shardLength) const {
+            if (shards != 0 && present != 0) {
+                std::vector<std::size_t> missing;
+                for (std::size_t j = 0; j < dataShardCount; ++j) {
+                    if (!present[j]) {
+                        missing.push_back (j);
+                    }
+                }
+                if (missing.empty ()) {
+                    return true;
+                }
+                // Pick the first dataShardCount present rows of the
+                // generator matrix (identity on top, parity below).
+                std::vector<std::size_t> rows;
+                for (std::size_t r = 0, count = dataShardCount + parityShardCount;
+                        r < count && rows.size () < dataShardCount; ++r) {
+                    if (present[r]) {
+                        rows.push_back (r);
+                    }
+                }
+                if (rows.size () < dataShardCount) {
+                    return false;
+                }
+                const GaloisField &gf = GetGaloisField ();
+                std::size_t k = dataShardCount;
+                std::vector<util::ui8> matrix (k * k, 0);
+                for (std::size_t t = 0; t < k; ++t) {
+                    if (rows[t] < k) {
+                        matrix[t * k + rows[t]] = 1;
+                    }
+                    else {
+                        memcpy (&matrix[t * k], &parityMatrix[(rows[t] - k) * k], k);
+                    }
+                }
+                // Gauss-Jordan inversion.
+                std::vector<util::ui8> inverse (k * k, 0);
+                for (std::size_t i = 0; i < k; ++i) {
+                    inverse[i * k + i] = 1;
+                }
+                for (std::size_t column = 0; column < k; ++column) {
+                    std::size_t pivot = column;
+                    while (pivot < k && matrix[pivot * k + column] == 0) {
+                        ++pivot;
+                    }
+                    if (pivot == k) {
+                        // Can't happen with a Cauchy matrix.
+                        return false;
+                    }
+                    if (pivot != column) {
+                        for (std::size_t j = 0; j < k; ++j) {
+                            std::swap (matrix[pivot * k + j], matrix[column * k + j]);
+                            std::swap (inverse[pivot * k + j], inverse[column * k + j]);
+                        }
+                    }
+                    util::ui8 scale = gf.Inv (matrix[column * k + column]);
+                    for (std::size_t j = 0; j < k; ++j) {
+                        matrix[column * k + j] = gf.Mul (matrix[column * k + j], scale);
+                        inverse[column * k + j] = gf.Mul (inverse[column * k + j], scale);
+                    }
+                    for (std::size_t i = 0; i < k; ++i) {
+                        util::ui8 factor = matrix[i * k + column];
+                        if (i != column && factor != 0) {
+                            for (std::size_t j = 0; j < k; ++j) {
+                                matrix[i * k + j] ^= gf.Mul (factor, matrix[column * k + j]);
+                                inverse[i * k + j] ^= gf.Mul (factor, inverse[column * k + j]);
+                            }
+                        }
+                    }
+                }
+                // data[j] = sum (inverse[j][t] * shards[rows[t]]).
+                // Missing data shards are never among the selected rows,
+                // so they can be written in place.
+                for (std::size_t m = 0, count = missing.size (); m < count; ++m) {
+                    std::size_t j = missing[m];
+                    memset (shards[j], 0, shardLength);
+                    for (std::size_t t = 0; t < k; ++t) {
+                        gf.MulAdd (inverse[j * k + t], shards[rows[t]], shards[j], shardLength);
+                    }
+                }
+                return true;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,148 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/RandomSource.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/ErasureCode.h"
+#include "thekogans/packet/FECPacketFragmentPacket.h"
+#include "thekogans/packet/FECFragmentPacketPacketFilter.h"
+
+namespace thekogans {
+    namespace packet {
+
+        FECFragmentPacketPacketFilter::FECFragmentPacketPacketFilter (
+                Tunnel &tunnel_,
+                std::size_t maxCiphertextLength_,
+                std::size_t groupSize_,
+                std::size_t parityShardCount_,
+                PaddingPolicy::SharedPtr paddingPolicy_,
+                bool session_) :
+                tunnel (tunnel_),
+                maxCiphertextLength (maxCiphertextLength_),
+                groupSize (groupSize_),
+                parityShardCount (parityShardCount_),
+                nextPacketId (util::RandomSource::Instance ()->Getui32 ()),
+                paddingPolicy (paddingPolicy_),
+                session (session_),
+                shardLength (
+                    Packet::GetMaxPacketSize (
+                        FECPacketFragmentPacket::TYPE,
+                        maxCiphertextLength,
+                        session,
+                        paddingPolicy.Get ())) {
+            if (groupSize == 0 || parityShardCount == 0 ||
+                    groupSize + parityShardCount > ErasureCode::MAX_SHARD_COUNT ||
+                    shardLength <= FECPacketFragmentPacket::GetMaxFieldsSize ()) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            shardLength -= FECPacketFragmentPacket::GetMaxFieldsSize ();
+        }
+
+        Packet::SharedPtr FECFragmentPacketPacketFilter::FilterPacket (Packet::SharedPtr packet) {
+            if (packet.Get () != 0) {
+                // Shards are sized to always fit, but check anyway
+                // so that we never fragment our own shards.
+                if (packet->Type () != FECPacketFragmentPacket::TYPE) {
+                    std::size_t packetSize = util::Serializable::Size (*packet);
+                    // If the packet is too big, fragment it.
+                    // It will be reassembled (and repaired) on the other side.
+                    if (packetSize +
+                            Packet::GetFramingOverhead (
+                                session,
+                                (paddingPolicy.Get () != 0 ?
+                                    *paddingPolicy :
+                                    PaddingPolicy::GetDefault ()).GetMaxPaddingLength ()) >
+                            maxCiphertextLength) {
+                        std::size_t dataShardCount = packetSize / shardLength;
+                        if ((packetSize % shardLength) > 0) {
+                            ++dataShardCount;
+                        }
+                        std::size_t groupCount = (dataShardCount + groupSize - 1) / groupSize;
+                        util::ui32 packetId = nextPacketId++;
+                        util::Buffer buffer (util::NetworkEndian, packetSize);
+                        buffer << *packet;
+                        std::vector<util::Buffer::SharedPtr> shards (groupSize + parityShardCount);
+                        std::vector<const util::ui8 *> dataShards (groupSize);
+                        std::vector<util::ui8 *> parityShards (parityShardCount);
+                        for (std::size_t groupNumber = 0; groupNumber < groupCount; ++groupNumber) {
+                            std::size_t groupDataShardCount = std::min (
+                                groupSize, dataShardCount - groupNumber * groupSize);
+                            for (std::size_t i = 0; i < groupDataShardCount; ++i) {
+                                shards[i].Reset (new util::Buffer (util::NetworkEndian, shardLength));
+                                shards[i]->AdvanceWriteOffset (
+                                    buffer.Read (
+                                        shards[i]->GetWritePtr (),
+                                        shards[i]->GetDataAvailableForWriting ()));
+                                // All shards in a group must be the same length.
+                                // Zero pad the last one. The receiver knows
+                                // the packet length and will discard the padding.
+                                std::size_t padding = shards[i]->GetDataAvailableForWriting ();
+                                if (padding > 0) {
+                                    memset (shards[i]->GetWritePtr (), 0, padding);
+                                    shards[i]->AdvanceWriteOffset (padding);
+                                }
+                                dataShards[i] = shards[i]->GetReadPtr ();
+                            }
+                            for (std::size_t i = 0; i < parityShardCount; ++i) {
+                                util::Buffer::SharedPtr &shard = shards[groupDataShardCount + i];
+                                shard.Reset (new util::Buffer (util::NetworkEndian, shardLength));
+                                shard->AdvanceWriteOffset (shardLength);
+                                parityShards[i] = shard->GetReadPtr ();
+                            }
+                            ErasureCode (groupDataShardCount, parityShardCount).Encode (
+                                &dataShards[0], &parityShards[0], shardLength);
+                            for (std::size_t shardIndex = 0,
+                                    shardCount = groupDataShardCount + parityShardCount;
+                                    shardIndex < shardCount; ++shardIndex) {
+                                // NOTE: Injecting new packets in to the SendPacket pipeline
+                                // will eventually call our filter recursively. That's okay
+                                // as the type check above will pass the shard down the
+                                // pipeline (CallNextPacketFilter below).
+                                tunnel.SendPacket (
+                                    Packet::SharedPtr (
+                                        new FECPacketFragmentPacket (
+                                            packetId,
+                                            packetSize,
+                                            dataShardCount,
+                                            groupSize,
+                                            parityShardCount,
+                                            groupNumber,
+                                            shardIndex,
+                                            shards[shardIndex])));
+                                shards[shardIndex].Reset ();
+                            }
+                        }
+                        // Since we've consumed the given packet, discard it.
+                        return Packet::SharedPtr ();
+                    }
+                }
+                return CallNextPacketFilter (packet);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,118 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include <limits>
+#include "thekogans/util/StringUtils.h"
+#include "thekogans/util/Base64.h"
+#include "thekogans/packet/FECPacketFragmentPacket.h"
+
+namespace thekogans {
+    namespace packet {
+
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (FECPacketFragmentPacket, 1)
+
+        std::size_t FECPacketFragmentPacket::GetMaxFieldsSize () {
+            // packetId + 6 SizeT fields + shard length.
+            return util::UI32_SIZE +
+                7 * util::Serializer::Size (
+                    util::SizeT (std::numeric_limits<util::ui64>::max ()));
+        }
+
+        void FECPacketFragmentPacket::Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) {
+            serializer >>
+                packetId >>
+                packetLength >>
+                dataShardCount >>
+                groupSize >>
+                parityShardCount >>
+                groupNumber >>
+                shardIndex;
+            shard.Reset (new util::Buffer (serializer.endianness));
+            serializer >> *shard;
+        }
+
+        void FECPacketFragmentPacket::Write (util::Serializer &serializer) const {
+            serializer <<
+                packetId <<
+                packetLength <<
+                dataShardCount <<
+                groupSize <<
+                parityShardCount <<
+                groupNumber <<
+                shardIndex <<
+                *shard;
+        }
+
+        const char * const FECPacketFragmentPacket::ATTR_PACKET_ID = "PacketId";
+        const char * const FECPacketFragmentPacket::ATTR_PACKET_LENGTH = "PacketLength";
+        const char * const FECPacketFragmentPacket::ATTR_DATA_SHARD_COUNT = "DataShardCount";
+        const char * const FECPacketFragmentPacket::ATTR_GROUP_SIZE = "GroupSize";
+        const char * const FECPacketFragmentPacket::ATTR_PARITY_SHARD_COUNT = "ParityShardCount";
+        const char * const FECPacketFragmentPacket::ATTR_GROUP_NUMBER = "GroupNumber";
+        const char * const FECPacketFragmentPacket::ATTR_SHARD_INDEX = "ShardIndex";
+
+        void FECPacketFragmentPacket::Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) {
+            packetId = (util::ui32)util::stringToui64 (node.attribute (ATTR_PACKET_ID).value ());
+            packetLength = util::stringToui64 (node.attribute (ATTR_PACKET_LENGTH).value ());
+            dataShardCount = util::stringToui64 (node.attribute (ATTR_DATA_SHARD_COUNT).value ());
+            groupSize = util::stringToui64 (node.attribute (ATTR_GROUP_SIZE).value ());
+            parityShardCount = util::stringToui64 (node.attribute (ATTR_PARITY_SHARD_COUNT).value ());
+            groupNumber = util::stringToui64 (node.attribute (ATTR_GROUP_NUMBER).value ());
+            shardIndex = util::stringToui64 (node.attribute (ATTR_SHARD_INDEX).value ());
+            const char *encodedShard = node.text ().get ();
+            shard = util::Base64::Decode (encodedShard, strlen (encodedShard));
+        }
+
+        void FECPacketFragmentPacket::Write (pugi::xml_node &node) const {
+            node.append_attribute (ATTR_PACKET_ID).set_value (
+                util::ui64Tostring (packetId).c_str ());
+            node.append_attribute (ATTR_PACKET_LENGTH).set_value (
+                util::ui64Tostring (packetLength).c_str ());
+            node.append_attribute (ATTR_DATA_SHARD_COUNT).set_value (
+                util::ui64Tostring (dataShardCount).c_str ());
+            node.append_attribute (ATTR_GROUP_SIZE).set_value (
+                util::ui64Tostring (groupSize).c_str ());
+            node.append_attribute (ATTR_PARITY_SHARD_COUNT).set_value (
+                util::ui64Tostring (parityShardCount).c_str ());
+            node.append_attribute (ATTR_GROUP_NUMBER).set_value (
+                util::ui64Tostring (groupNumber).c_str ());
+            node.append_attribute (ATTR_SHARD_INDEX).set_value (
+                util::ui64Tostring (shardIndex).c_str ());
+            node.append_child (pugi::node_pcdata).set_value (
+                util::Base64::Encode (
+                    shard->GetReadPtr (),
+                    shard->GetDataAvailableForReading ())->Tostring ().c_str ());
+        }
+
+        void FECPacketFragmentPacket::Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object & /*object*/) {
+            // FIXME: implement
+            assert (0);
+        }
+
+        void FECPacketFragmentPacket::Write (util::JSON::Object & /*object*/) const {
+            // FIXME: implement
+            assert (0);
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,182 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include <algorithm>
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/ErasureCode.h"
+#include "thekogans/packet/FECReassemblePacketFragmentsPacketFilter.h"
+
+namespace thekogans {
+    namespace packet {
+
+        FECReassemblePacketFragmentsPacketFilter::PendingPacket::PendingPacket (
+                const FECPacketFragmentPacket &shard) :
+                packetId (shard.packetId),
+                packetLength (shard.packetLength),
+                dataShardCount (shard.dataShardCount),
+                groupSize (shard.groupSize),
+                parityShardCount (shard.parityShardCount),
+                shardLength (shard.shard->GetDataAvailableForReading ()),
+                shards (shard.GetGroupCount () * (groupSize + parityShardCount)),
+                receivedShardCounts (shard.GetGroupCount (), 0),
+                completeGroupCount (0) {}
+
+        bool FECReassemblePacketFragmentsPacketFilter::PendingPacket::IsConsistent (
+                const FECPacketFragmentPacket &shard) const {
+            return shard.packetId == packetId &&
+                shard.packetLength == packetLength &&
+                shard.dataShardCount == dataShardCount &&
+                shard.groupSize == groupSize &&
+                shard.parityShardCount == parityShardCount &&
+                shard.shard->GetDataAvailableForReading () == shardLength;
+        }
+
+        void FECReassemblePacketFragmentsPacketFilter::PendingPacket::AddShard (
+                const FECPacketFragmentPacket &shard) {
+            std::size_t groupDataShardCount = shard.GetGroupDataShardCount (shard.groupNumber);
+            std::size_t &receivedShardCount = receivedShardCounts[shard.groupNumber];
+            // Once a group is complete, its remaining shards are redundant.
+            if (receivedShardCount < groupDataShardCount) {
+                util::Buffer::SharedPtr *groupShards =
+                    &shards[shard.groupNumber * (groupSize + parityShardCount)];
+                if (groupShards[shard.shardIndex].Get () == 0) {
+                    groupShards[shard.shardIndex] = shard.shard;
+                    if (++receivedShardCount == groupDataShardCount) {
+                        std::size_t shardCount = groupDataShardCount + parityShardCount;
+                        std::vector<util::ui8 *> groupShardPtrs (shardCount);
+                        bool present[ErasureCode::MAX_SHARD_COUNT];
+                        bool missingData = false;
+                        for (std::size_t i = 0; i < shardCount; ++i) {
+                            present[i] = groupShards[i].Get () != 0;
+                            if (!present[i] && i < groupDataShardCount) {
+                                groupShards[i].Reset (
+                                    new util::Buffer (util::NetworkEndian, shardLength));
+                                groupShards[i]->AdvanceWriteOffset (shardLength);
+                                missingData = true;
+                            }
+                            groupShardPtrs[i] = present[i] || i < groupDataShardCount ?
+                                groupShards[i]->GetReadPtr () : 0;
+                        }
+                        if (missingData) {
+                            ErasureCode (groupDataShardCount, parityShardCount).Decode (
+                                &groupShardPtrs[0], present, shardLength);
+                        }
+                        // Parity is no longer needed.
+                        for (std::size_t i = groupDataShardCount; i < shardCount; ++i) {
+                            groupShards[i].Reset ();
+                        }
+                        ++completeGroupCount;
+                    }
+                }
+            }
+        }
+
+        Packet::SharedPtr FECReassemblePacketFragmentsPacketFilter::PendingPacket::Reassemble (
+                util::Endianness endianness) const {
+            util::Buffer buffer (endianness, packetLength);
+            for (std::size_t groupNumber = 0, groupCount = receivedShardCounts.size ();
+                    groupNumber < groupCount; ++groupNumber) {
+                const util::Buffer::SharedPtr *groupShards =
+                    &shards[groupNumber * (groupSize + parityShardCount)];
+                for (std::size_t i = 0,
+                        groupDataShardCount = std::min (
+                            groupSize, dataShardCount - groupNumber * groupSize);
+                        i < groupDataShardCount; ++i) {
+                    // The last shard is zero padded. Only take what fits.
+                    buffer.AdvanceWriteOffset (
+                        groupShards[i]->Read (
+                            buffer.GetWritePtr (),
+                            std::min (
+                                shardLength,
+                                buffer.GetDataAvailableForWriting ())));
+                }
+            }
+            Packet::SharedPtr packet;
+            buffer >> packet;
+            return packet;
+        }
+
+        Packet::SharedPtr FECReassemblePacketFragmentsPacketFilter::FilterPacket (
+                Packet::SharedPtr packet) {
+            if (packet.Get () != 0) {
+                if (packet->Type () == FECPacketFragmentPacket::TYPE) {
+                    const FECPacketFragmentPacket &shard =
+                        *static_cast<const FECPacketFragmentPacket *> (packet.Get ());
+                    if (IsValid (shard) && !IsCompleted (shard.packetId)) {
+                        std::list<PendingPacket>::iterator it = pendingPackets.begin ();
+                        while (it != pendingPackets.end () && it->packetId != shard.packetId) {
+                            ++it;
+                        }
+                        if (it == pendingPackets.end ()) {
+                            if (pendingPackets.size () >= maxPendingPackets) {
+                                // Too much loss to repair. Give up on the oldest.
+                                pendingPackets.pop_front ();
+                            }
+                            it = pendingPackets.insert (pendingPackets.end (), PendingPacket (shard));
+                        }
+                        if (it->IsConsistent (shard)) {
+                            it->AddShard (shard);
+                            if (it->IsComplete ()) {
+                                Packet::SharedPtr reassembledPacket = it->Reassemble (endianness);
+                                pendingPackets.erase (it);
+                                completedPacketIds.push_back (shard.packetId);
+                                if (completedPacketIds.size () > maxPendingPackets) {
+                                    completedPacketIds.pop_front ();
+                                }
+                                return reassembledPacket;
+                            }
+                        }
+                    }
+                    return Packet::SharedPtr ();
+                }
+                return CallNextPacketFilter (packet);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool FECReassemblePacketFragmentsPacketFilter::IsValid (
+                const FECPacketFragmentPacket &shard) const {
+            if (shard.shard.Get () == 0 ||
+                    shard.groupSize == 0 || shard.parityShardCount == 0 ||
+                    shard.groupSize + shard.parityShardCount > ErasureCode::MAX_SHARD_COUNT ||
+                    shard.packetLength == 0 || shard.packetLength > maxPacketLength) {
+                return false;
+            }
+            std::size_t shardLength = shard.shard->GetDataAvailableForReading ();
+            // PendingPacket allocates a slot for every data and parity shard.
+            // Don't let tiny shards or lopsided parity blow that up.
+            return shardLength >= minShardLength &&
+                shard.dataShardCount == (shard.packetLength + shardLength - 1) / shardLength &&
+                shard.GetGroupCount () * (shard.groupSize + shard.parityShardCount) <=
+                    2 * maxPacketLength / shardLength &&
+                shard.groupNumber < shard.GetGroupCount () &&
+                shard.shardIndex <
+                    shard.GetGroupDataShardCount (shard.groupNumber) + shard.parityShardCount;
+        }
+
+        bool FECReassemblePacketFragmentsPacketFilter::IsCompleted (util::ui32 packetId) const {
+            return std::find (
+                completedPacketIds.begin (),
+                completedPacketIds.end (),
+                packetId) != completedPacketIds.end ();
+        }
+
+    } // namespace packet
+} // namespace thekogans
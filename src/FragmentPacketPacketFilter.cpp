@@ -15,7 +15,9 @@
 // You should have received a copy of the GNU General Public License
 // along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
 #include "thekogans/util/Buffer.h"
+#include "thekogans/util/LockGuard.h"
 #include "thekogans/util/Exception.h"
 #include "thekogans/packet/Tunnel.h"
 #include "thekogans/packet/PacketFragmentPacket.h"
@@ -24,39 +26,82 @@
 namespace thekogans {
     namespace packet {
 
+        void FragmentPacketPacketFilter::SetStreamWeight (
+                util::ui32 streamId,
+                std::size_t weight) {
+            if (weight > 0) {
+                util::LockGuard<util::Mutex> guard (mutex);
+                streamWeights[streamId] = weight;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        std::size_t FragmentPacketPacketFilter::GetPendingFragmentCount () {
+            util::LockGuard<util::Mutex> guard (mutex);
+            std::size_t count = 0;
+            for (PendingFragmentsMap::const_iterator
+                    it = pendingFragments.begin (),
+                    end = pendingFragments.end (); it != end; ++it) {
+                count += it->second.size ();
+            }
+            return count;
+        }
+
         Packet::SharedPtr FragmentPacketPacketFilter::FilterPacket (Packet::SharedPtr packet) {
             if (packet.Get () != 0) {
-                std::size_t packetSize = util::Serializable::Size (*packet);
-                std::size_t fragmentSize =
-                    maxCiphertextLength -
-                    Packet::GetMaxFramingOverhead (packet->GetType (), maxCiphertextLength);
-                // If the packet is too big, fragment it.
-                // It will be reassembled on the other side.
-                if (packetSize > fragmentSize) {
-                    std::size_t fragmentCount = packetSize / fragmentSize;
-                    if ((packetSize % fragmentSize) > 0) {
-                        ++fragmentCount;
+                // NOTE: Fragments released by ReleaseFragments come back
+                // through here (see below). Let them continue down the
+                // pipeline (CallNextPacketFilter below).
+                if (packet->Type () != PacketFragmentPacket::TYPE) {
+                    std::size_t packetSize = util::Serializable::Size (*packet);
+                    // If the packet is too big, fragment it.
+                    // It will be reassembled on the other side.
+                    std::deque<Packet::SharedPtr> fragments;
+                    if (packetSize +
+                            Packet::GetFramingOverhead (
+                                session,
+                                (paddingPolicy.Get () != 0 ?
+                                    *paddingPolicy :
+                                    PaddingPolicy::GetDefault ()).GetMaxPaddingLength ()) >
+                            maxCiphertextLength) {
+                        FragmentPacket (*packet, packetSize, fragments);
+                    }
+                    {
+                        util::LockGuard<util::Mutex> guard (mutex);
+                        PendingFragmentsMap::iterator it =
+                            pendingFragments.find (packet->streamId);
+                        // NOTE: Stream order is kept for everything but small
+                        // PRIORITY_CONTROL packets (ex: key exchange). They
+                        // can't wait behind a big packet's fragments (that
+                        // might be what they are unblocking), so they jump
+                        // ahead of them. Their receiver must not depend on
+                        // their order relative to the rest of the stream.
+                        if ((it != pendingFragments.end () &&
+                                packet->priority != Packet::PRIORITY_CONTROL) ||
+                                !fragments.empty ()) {
+                            // A small packet on a stream with waiting
+                            // fragments has to wait it's turn behind them.
+                            if (fragments.empty ()) {
+                                FragmentPacket (*packet, packetSize, fragments);
+                            }
+                            if (it == pendingFragments.end ()) {
+                                it = pendingFragments.insert (
+                                    PendingFragmentsMap::value_type (
+                                        packet->streamId,
+                                        std::deque<Packet::SharedPtr> ())).first;
+                                schedule.push_back (packet->streamId);
+                            }
+                            it->second.insert (it->second.end (), fragments.begin (), fragments.end ());
+                        }
                     }
-                    util::Buffer buffer = packet->Serialize ();
-                    for (std::size_t fragmentNumber = 1; fragmentNumber <= fragmentCount; ++fragmentNumber) {
-                        util::Buffer fragment (util::NetworkEndian, fragmentSize);
-                        fragment.AdvanceWriteOffset (
-                            buffer.Read (
-                                fragment.GetWritePtr (),
-                                fragment.GetDataAvailableForWriting ()));
-                        // NOTE: Injecting new packets in to the SendPacket pipeline
-                        // will eventually call our filter recursively. That's okay
-                        // as the if above will fail and the new packet will continue
-                        // down the pipeline (CallNextPacketFilter below).
-                        tunnel.SendPacket (
-                            Packet::SharedPtr (
-                                new PacketFragmentPacket (
-                                    fragmentNumber,
-                                    fragmentCount,
-                                    std::move (fragment))));
+                    if (!fragments.empty ()) {
+                        ReleaseFragments ();
+                        // Since we've consumed the given packet, discard it.
+                        return Packet::SharedPtr ();
                     }
-                    // Since we've consumed the given packet, discard it.
-                    return Packet::SharedPtr ();
                 }
                 return CallNextPacketFilter (packet);
             }
@@ -66,5 +111,134 @@ namespace thekogans {
             }
         }
 
+        void FragmentPacketPacketFilter::HandleBackpressure (bool on) {
+            // NOTE: Backpressure comes on while we're releasing fragments.
+            // ReleaseFragments learns about it from SendPacket's return value.
+            if (!on) {
+                {
+                    util::LockGuard<util::Mutex> guard (mutex);
+                    backpressure = false;
+                }
+                ReleaseFragments ();
+            }
+        }
+
+        void FragmentPacketPacketFilter::FragmentPacket (
+                const Packet &packet,
+                std::size_t packetSize,
+                std::deque<Packet::SharedPtr> &fragments) const {
+            // Fill every fragment to the byte. PacketFragmentPacket adds
+            // streamId, fragmentNumber, fragmentCount and the fragment length.
+            std::size_t fragmentSize = Packet::GetMaxPacketSize (
+                PacketFragmentPacket::TYPE,
+                maxCiphertextLength,
+                session,
+                paddingPolicy.Get ());
+            std::size_t fieldsSize =
+                util::Serializer::Size (packet.streamId) +
+                2 * util::Serializer::Size (util::SizeT (packetSize)) +
+                util::Serializer::Size (util::SizeT (fragmentSize));
+            if (fragmentSize <= fieldsSize) {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "maxCiphertextLength (" THEKOGANS_UTIL_SIZE_T_FORMAT
+                    ") is too small to fragment packets.",
+                    maxCiphertextLength);
+            }
+            fragmentSize -= fieldsSize;
+            std::size_t fragmentCount = packetSize / fragmentSize;
+            if ((packetSize % fragmentSize) > 0) {
+                ++fragmentCount;
+            }
+            util::Buffer buffer (util::NetworkEndian, packetSize);
+            buffer << packet;
+            for (std::size_t fragmentNumber = 1; fragmentNumber <= fragmentCount; ++fragmentNumber) {
+                util::Buffer::SharedPtr fragment (
+                    new util::Buffer (
+                        util::NetworkEndian,
+                        std::min (fragmentSize, buffer.GetDataAvailableForReading ())));
+                fragment->AdvanceWriteOffset (
+                    buffer.Read (
+                        fragment->GetWritePtr (),
+                        fragment->GetDataAvailableForWriting ()));
+                Packet::SharedPtr packetFragment (
+                    new PacketFragmentPacket (
+                        fragmentNumber,
+                        fragmentCount,
+                        fragment,
+                        packet.streamId));
+                packetFragment->priority = packet.priority;
+                fragments.push_back (packetFragment);
+            }
+        }
+
+        Packet::SharedPtr FragmentPacketPacketFilter::GetNextFragment () {
+            while (!schedule.empty ()) {
+                util::ui32 streamId = schedule.front ();
+                PendingFragmentsMap::iterator it = pendingFragments.find (streamId);
+                // NOTE: A stream stays in pendingFragments while it's last
+                // fragment is being sent, so that packets sent on it in the
+                // mean time queue up behind it instead of overtaking it.
+                if (it->second.empty ()) {
+                    pendingFragments.erase (it);
+                    schedule.pop_front ();
+                    turnCount = 0;
+                    continue;
+                }
+                if (backpressure) {
+                    break;
+                }
+                std::map<util::ui32, std::size_t>::const_iterator weight =
+                    streamWeights.find (streamId);
+                if (turnCount < (weight != streamWeights.end () ? weight->second : 1)) {
+                    ++turnCount;
+                    Packet::SharedPtr fragment = it->second.front ();
+                    it->second.pop_front ();
+                    return fragment;
+                }
+                schedule.pop_front ();
+                schedule.push_back (streamId);
+                turnCount = 0;
+            }
+            return Packet::SharedPtr ();
+        }
+
+        void FragmentPacketPacketFilter::ReleaseFragments () {
+            {
+                util::LockGuard<util::Mutex> guard (mutex);
+                if (releasing) {
+                    // Whoever is releasing will get to our fragments.
+                    return;
+                }
+                releasing = true;
+            }
+            bool enqueued = true;
+            Packet::SharedPtr fragment;
+            while (1) {
+                {
+                    util::LockGuard<util::Mutex> guard (mutex);
+                    if (!enqueued) {
+                        backpressure = true;
+                    }
+                    fragment = GetNextFragment ();
+                    if (fragment.Get () == 0) {
+                        releasing = false;
+                        return;
+                    }
+                }
+                // NOTE: Injecting new packets in to the SendPacket pipeline
+                // will eventually call our filter recursively. That's okay
+                // as FilterPacket passes fragments straight through. The
+                // packet is queued even if the transport pushes back.
+                THEKOGANS_UTIL_TRY {
+                    enqueued = tunnel.SendPacket (fragment);
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    util::LockGuard<util::Mutex> guard (mutex);
+                    releasing = false;
+                    THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+                }
+            }
+        }
+
     } // namespace packet
 } // namespace thekogans
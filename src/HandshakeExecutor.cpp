@@ -0,0 +1,177 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <chrono>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/HandshakeExecutor.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            inline util::ui64 Now () {
+                return (util::ui64)std::chrono::duration_cast<std::chrono::nanoseconds> (
+                    std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+            }
+
+            struct OffloadHandler : public PacketDispatcher::Handler {
+                HandshakeExecutor &executor;
+                PacketDispatcher::Handler::SharedPtr handler;
+
+                OffloadHandler (
+                    HandshakeExecutor &executor_,
+                    PacketDispatcher::Handler::SharedPtr handler_) :
+                    executor (executor_),
+                    handler (handler_) {}
+
+                virtual void HandlePacket (
+                        Packet::SharedPtr packet,
+                        crypto::Cipher::SharedPtr cipher) override {
+                    executor.Enqueue (handler, packet, cipher);
+                }
+            };
+        }
+
+        HandshakeExecutor::HandshakeExecutor (
+                std::size_t workerCount,
+                std::size_t maxQueueLength_,
+                util::i32 priority) :
+                maxQueueLength (maxQueueLength_),
+                done (false),
+                condition (mutex) {
+            if (workerCount > 0 && maxQueueLength > 0) {
+                THEKOGANS_UTIL_TRY {
+                    for (std::size_t i = 0; i < workerCount; ++i) {
+                        workers.push_back (new Worker (*this));
+                        workers.back ()->Create (priority);
+                    }
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    Stop ();
+                    THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        HandshakeExecutor::~HandshakeExecutor () {
+            Stop ();
+        }
+
+        bool HandshakeExecutor::Enqueue (
+                PacketDispatcher::Handler::SharedPtr handler,
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) {
+            if (handler.Get () != 0 && packet.Get () != 0) {
+                util::LockGuard<util::Mutex> guard (mutex);
+                if (!done && jobs.size () < maxQueueLength) {
+                    Job job;
+                    job.handler = handler;
+                    job.packet = packet;
+                    job.cipher = cipher;
+                    job.queueTime = Now ();
+                    jobs.push_back (job);
+                    ++stats.accepted;
+                    if (stats.maxQueueLength < jobs.size ()) {
+                        stats.maxQueueLength = jobs.size ();
+                    }
+                    condition.Signal ();
+                    return true;
+                }
+                ++stats.shed;
+                return false;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        PacketDispatcher::Handler::SharedPtr HandshakeExecutor::CreateHandler (
+                PacketDispatcher::Handler::SharedPtr handler) {
+            if (handler.Get () != 0) {
+                return PacketDispatcher::Handler::SharedPtr (
+                    new OffloadHandler (*this, handler));
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        HandshakeExecutor::Stats HandshakeExecutor::GetStats () {
+            util::LockGuard<util::Mutex> guard (mutex);
+            Stats snapshot = stats;
+            snapshot.queueLength = jobs.size ();
+            return snapshot;
+        }
+
+        void HandshakeExecutor::Stop () {
+            std::vector<Worker *> stoppedWorkers;
+            {
+                util::LockGuard<util::Mutex> guard (mutex);
+                done = true;
+                stats.shed += jobs.size ();
+                jobs.clear ();
+                stoppedWorkers.swap (workers);
+                condition.SignalAll ();
+            }
+            // Join outside the lock, the workers need it to exit.
+            for (std::size_t i = 0, count = stoppedWorkers.size (); i < count; ++i) {
+                stoppedWorkers[i]->Wait ();
+                delete stoppedWorkers[i];
+            }
+        }
+
+        void HandshakeExecutor::Worker::Run () throw () {
+            while (1) {
+                Job job;
+                {
+                    util::LockGuard<util::Mutex> guard (executor.mutex);
+                    while (!executor.done && executor.jobs.empty ()) {
+                        executor.condition.Wait ();
+                    }
+                    if (executor.done) {
+                        break;
+                    }
+                    job = executor.jobs.front ();
+                    executor.jobs.pop_front ();
+                }
+                util::ui64 start = Now ();
+                bool failed = false;
+                THEKOGANS_UTIL_TRY {
+                    job.handler->HandlePacket (job.packet, job.cipher);
+                }
+                THEKOGANS_UTIL_CATCH_ANY {
+                    failed = true;
+                }
+                util::ui64 end = Now ();
+                util::LockGuard<util::Mutex> guard (executor.mutex);
+                ++executor.stats.completed;
+                if (failed) {
+                    ++executor.stats.failed;
+                }
+                executor.stats.waitTime += start - job.queueTime;
+                executor.stats.runTime += end - start;
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,343 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/IOURing.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            // The C library doesn't wrap the io_uring system calls.
+            inline int io_uring_setup (
+                    util::ui32 entries,
+                    io_uring_params *params) {
+                return (int)syscall (__NR_io_uring_setup, entries, params);
+            }
+
+            inline int io_uring_enter (
+                    int fd,
+                    util::ui32 toSubmit,
+                    util::ui32 minComplete,
+                    util::ui32 flags,
+                    const void *arg,
+                    std::size_t argLength) {
+                return (int)syscall (
+                    __NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argLength);
+            }
+
+            inline int io_uring_register (
+                    int fd,
+                    util::ui32 opcode,
+                    const void *arg,
+                    util::ui32 argCount) {
+                return (int)syscall (__NR_io_uring_register, fd, opcode, arg, argCount);
+            }
+
+            inline util::ui32 LoadAcquire (const util::ui32 *value) {
+                return __atomic_load_n (value, __ATOMIC_ACQUIRE);
+            }
+
+            inline void StoreRelease (
+                    util::ui32 *value,
+                    util::ui32 newValue) {
+                __atomic_store_n (value, newValue, __ATOMIC_RELEASE);
+            }
+
+            // user_data of the eventfd read (handlers are never null).
+            const util::ui64 EVENT_USER_DATA = 0;
+        }
+
+        IOURing::IOURing (std::size_t entryCount) :
+                handle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE),
+                sqRing (MAP_FAILED),
+                sqRingLength (0),
+                cqRing (MAP_FAILED),
+                cqRingLength (0),
+                sqes ((io_uring_sqe *)MAP_FAILED),
+                sqesLength (0),
+                sqHead (0),
+                sqTail (0),
+                sqMask (0),
+                sqEntryCount (0),
+                sqArray (0),
+                cqHead (0),
+                cqTail (0),
+                cqMask (0),
+                cqes (0),
+                eventHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE),
+                eventValue (0),
+                done (false),
+                nextBufferGroupId (0) {
+            if (entryCount == 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            io_uring_params params;
+            memset (&params, 0, sizeof (params));
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = (util::ui32)(entryCount * COMPLETION_QUEUE_FACTOR);
+            handle = io_uring_setup ((util::ui32)entryCount, &params);
+            if (handle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            sqRingLength = params.sq_off.array + params.sq_entries * sizeof (util::ui32);
+            cqRingLength = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+            bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (singleMap) {
+                sqRingLength = cqRingLength = std::max (sqRingLength, cqRingLength);
+            }
+            sqRing = mmap (0, sqRingLength, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_SQ_RING);
+            if (sqRing != MAP_FAILED) {
+                cqRing = singleMap ? sqRing :
+                    mmap (0, cqRingLength, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_CQ_RING);
+            }
+            if (cqRing != MAP_FAILED) {
+                sqesLength = params.sq_entries * sizeof (io_uring_sqe);
+                sqes = (io_uring_sqe *)mmap (0, sqesLength, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, handle, IORING_OFF_SQES);
+            }
+            if (sqes != MAP_FAILED) {
+                eventHandle = eventfd (0, EFD_CLOEXEC);
+            }
+            if (eventHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                if (sqes != MAP_FAILED) {
+                    munmap (sqes, sqesLength);
+                }
+                if (cqRing != MAP_FAILED && cqRing != sqRing) {
+                    munmap (cqRing, cqRingLength);
+                }
+                if (sqRing != MAP_FAILED) {
+                    munmap (sqRing, sqRingLength);
+                }
+                close (handle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            util::ui8 *sq = (util::ui8 *)sqRing;
+            sqHead = (util::ui32 *)(sq + params.sq_off.head);
+            sqTail = (util::ui32 *)(sq + params.sq_off.tail);
+            sqMask = *(util::ui32 *)(sq + params.sq_off.ring_mask);
+            sqEntryCount = *(util::ui32 *)(sq + params.sq_off.ring_entries);
+            sqArray = (util::ui32 *)(sq + params.sq_off.array);
+            util::ui8 *cq = (util::ui8 *)cqRing;
+            cqHead = (util::ui32 *)(cq + params.cq_off.head);
+            cqTail = (util::ui32 *)(cq + params.cq_off.tail);
+            cqMask = *(util::ui32 *)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+            util::LockGuard<util::Mutex> guard (submitMutex);
+            ArmEventHandle ();
+        }
+
+        IOURing::~IOURing () {
+            close (eventHandle);
+            munmap (sqes, sqesLength);
+            if (cqRing != sqRing) {
+                munmap (cqRing, cqRingLength);
+            }
+            munmap (sqRing, sqRingLength);
+            close (handle);
+        }
+
+        void IOURing::Enqueue (
+                const io_uring_sqe &sqe,
+                Handler &handler,
+                util::ui32 op) {
+            if (op < MAX_OP) {
+                util::LockGuard<util::Mutex> guard (submitMutex);
+                Push (sqe, (util::ui64)(std::size_t)&handler | op);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void IOURing::Submit () {
+            Enter (0, -1);
+        }
+
+        std::size_t IOURing::Poll (int timeout) {
+            Enter (timeout != 0 ? 1 : 0, timeout);
+            std::size_t handled = 0;
+            util::ui32 head = *cqHead;
+            util::ui32 tail = LoadAcquire (cqTail);
+            while (head != tail) {
+                // Copy the entry and release it's slot before calling the
+                // handler, so that the kernel can reuse it right away.
+                io_uring_cqe cqe = cqes[head & cqMask];
+                StoreRelease (cqHead, ++head);
+                if (cqe.user_data != EVENT_USER_DATA) {
+                    Handler *handler = (Handler *)(std::size_t)(cqe.user_data & ~(util::ui64)(MAX_OP - 1));
+                    handler->HandleCompletion (
+                        (util::ui32)(cqe.user_data & (MAX_OP - 1)),
+                        cqe.res,
+                        cqe.flags);
+                    ++handled;
+                }
+                else {
+                    util::LockGuard<util::Mutex> guard (submitMutex);
+                    ArmEventHandle ();
+                }
+                if (head == tail) {
+                    tail = LoadAcquire (cqTail);
+                }
+            }
+            return handled;
+        }
+
+        void IOURing::Run () {
+            while (!done.load (std::memory_order_acquire)) {
+                Poll ();
+            }
+            done.store (false, std::memory_order_release);
+        }
+
+        void IOURing::Stop () {
+            done.store (true, std::memory_order_release);
+            util::ui64 value = 1;
+            if (write (eventHandle, &value, sizeof (value)) < 0) {
+                // The counter is saturated, so the loop
+                // is already due to wake up.
+            }
+        }
+
+        void IOURing::RegisterBuffers (
+                const iovec *iov,
+                std::size_t count) {
+            if (iov != 0 && count > 0) {
+                if (io_uring_register (handle, IORING_REGISTER_BUFFERS, iov, (util::ui32)count) < 0) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        util::ui16 IOURing::RegisterBufferRing (
+                io_uring_buf_ring *bufferRing,
+                util::ui32 entryCount) {
+            if (bufferRing != 0 && entryCount > 0 && (entryCount & (entryCount - 1)) == 0) {
+                io_uring_buf_reg reg;
+                memset (&reg, 0, sizeof (reg));
+                reg.ring_addr = (util::ui64)(std::size_t)bufferRing;
+                reg.ring_entries = entryCount;
+                reg.bgid = (util::ui16)nextBufferGroupId.fetch_add (1);
+                if (io_uring_register (handle, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+                }
+                return reg.bgid;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void IOURing::UnregisterBufferRing (util::ui16 bufferGroupId) {
+            io_uring_buf_reg reg;
+            memset (&reg, 0, sizeof (reg));
+            reg.bgid = bufferGroupId;
+            if (io_uring_register (handle, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+        void IOURing::Enter (
+                util::ui32 waitCount,
+                int timeout) {
+            // Submitters publish the tail as they go, so whatever lies
+            // between the kernel's head and our tail is ready to go.
+            // Concurrent callers may claim the same entries, the kernel
+            // only submits what's actually there.
+            util::ui32 toSubmit = LoadAcquire (sqTail) - LoadAcquire (sqHead);
+            if (toSubmit == 0 && waitCount == 0) {
+                return;
+            }
+            util::ui32 flags = waitCount > 0 ? IORING_ENTER_GETEVENTS : 0;
+            io_uring_getevents_arg arg;
+            __kernel_timespec timespec;
+            const void *argPtr = 0;
+            std::size_t argLength = 0;
+            if (waitCount > 0 && timeout > 0) {
+                timespec.tv_sec = timeout / 1000;
+                timespec.tv_nsec = (timeout % 1000) * 1000000;
+                memset (&arg, 0, sizeof (arg));
+                arg.ts = (util::ui64)(std::size_t)&timespec;
+                argPtr = &arg;
+                argLength = sizeof (arg);
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+            if (io_uring_enter (handle, toSubmit, waitCount, flags, argPtr, argLength) < 0) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                // EINTR and ETIME: nothing to do. EAGAIN and EBUSY: the
+                // completion queue is full, the submissions will go out
+                // on the next call (after Poll drains it).
+                if (errorCode != EINTR && errorCode != ETIME &&
+                        errorCode != EAGAIN && errorCode != EBUSY) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                }
+            }
+        }
+
+        void IOURing::ArmEventHandle () {
+            io_uring_sqe sqe;
+            memset (&sqe, 0, sizeof (sqe));
+            sqe.opcode = IORING_OP_READ;
+            sqe.fd = eventHandle;
+            sqe.addr = (util::ui64)(std::size_t)&eventValue;
+            sqe.len = sizeof (eventValue);
+            sqe.off = (util::ui64)-1;
+            Push (sqe, EVENT_USER_DATA);
+        }
+
+        void IOURing::Push (
+                const io_uring_sqe &sqe,
+                util::ui64 userData) {
+            util::ui32 tail = *sqTail;
+            if (tail - LoadAcquire (sqHead) == sqEntryCount) {
+                // Full, make room.
+                Enter (0, -1);
+                if (tail - LoadAcquire (sqHead) == sqEntryCount) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "io_uring submission queue is full (%u).",
+                        sqEntryCount);
+                }
+            }
+            util::ui32 index = tail & sqMask;
+            sqes[index] = sqe;
+            sqes[index].user_data = userData;
+            sqArray[index] = index;
+            StoreRelease (sqTail, tail + 1);
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
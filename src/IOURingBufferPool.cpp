@@ -0,0 +1,110 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/mman.h>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/NullAllocator.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/IOURingBufferPool.h"
+
+namespace thekogans {
+    namespace packet {
+
+        IOURingBufferPool::IOURingBufferPool (
+                IOURing &ring,
+                std::size_t bufferCount_,
+                std::size_t bufferLength_) :
+                data ((util::ui8 *)MAP_FAILED),
+                bufferCount (bufferCount_),
+                bufferLength (bufferLength_) {
+            if (bufferCount == 0 || bufferCount > UIO_MAXIOV || bufferLength == 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            data = (util::ui8 *)mmap (0, bufferCount * bufferLength,
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data == MAP_FAILED) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            std::vector<iovec> iov (bufferCount);
+            freeList.resize (bufferCount);
+            for (std::size_t i = 0; i < bufferCount; ++i) {
+                iov[i].iov_base = GetBufferData ((util::i32)i);
+                iov[i].iov_len = bufferLength;
+                // Hand out low indices first.
+                freeList[i] = (util::i32)(bufferCount - 1 - i);
+            }
+            THEKOGANS_UTIL_TRY {
+                ring.RegisterBuffers (&iov[0], bufferCount);
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                munmap (data, bufferCount * bufferLength);
+                THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+            }
+        }
+
+        IOURingBufferPool::~IOURingBufferPool () {
+            munmap (data, bufferCount * bufferLength);
+        }
+
+        util::i32 IOURingBufferPool::Acquire () {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            if (!freeList.empty ()) {
+                util::i32 index = freeList.back ();
+                freeList.pop_back ();
+                return index;
+            }
+            return NO_BUFFER;
+        }
+
+        void IOURingBufferPool::Release (util::i32 index) {
+            if (index >= 0 && (std::size_t)index < bufferCount) {
+                util::LockGuard<util::SpinLock> guard (spinLock);
+                freeList.push_back (index);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        util::Buffer::SharedPtr IOURingBufferPool::GetBuffer (
+                util::i32 index,
+                std::size_t readOffset,
+                std::size_t writeOffset) const {
+            if (index >= 0 && (std::size_t)index < bufferCount &&
+                    readOffset <= writeOffset && writeOffset <= bufferLength) {
+                return util::Buffer::SharedPtr (
+                    new util::Buffer (
+                        util::NetworkEndian,
+                        GetBufferData (index),
+                        bufferLength,
+                        readOffset,
+                        writeOffset,
+                        &util::NullAllocator::Global));
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
@@ -0,0 +1,474 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/NullAllocator.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/crypto/FrameHeader.h"
+#include "thekogans/packet/IOURingTunnel.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            // Encrypt the plaintext in to frame, if it's
+            // frame is guaranteed to fit.
+            bool EncryptAndFrame (
+                    crypto::Cipher &cipher,
+                    const util::Buffer &plaintext,
+                    util::Buffer &frame) {
+                if (crypto::FrameHeader::SIZE +
+                        crypto::Cipher::GetMaxBufferLength (
+                            plaintext.GetDataAvailableForReading ()) >
+                        frame.GetDataAvailableForWriting ()) {
+                    return false;
+                }
+                frame.AdvanceWriteOffset (
+                    cipher.EncryptAndFrame (
+                        plaintext.GetReadPtr (),
+                        plaintext.GetDataAvailableForReading (),
+                        0, 0,
+                        frame.GetWritePtr ()));
+                return true;
+            }
+        }
+
+        IOURingTunnel::IOURingTunnel (
+                IOURing &ring_,
+                IOURingBufferPool &bufferPool_,
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session,
+                std::size_t maxCiphertextLength,
+                std::size_t highWaterMark_,
+                std::size_t lowWaterMark_,
+                std::size_t receiveBufferCount_,
+                std::size_t receiveBufferLength_,
+                PaddingPolicy::SharedPtr paddingPolicy,
+                bool compress) :
+                Tunnel (keyRing, eventSink, session, paddingPolicy, compress),
+                ring (ring_),
+                bufferPool (bufferPool_),
+                handle (handle_),
+                frameParser (maxCiphertextLength),
+                receiveRing ((io_uring_buf_ring *)MAP_FAILED),
+                receiveBufferCount (receiveBufferCount_),
+                receiveBufferLength (receiveBufferLength_),
+                receiveRingTail (0),
+                bufferGroupId (0),
+                multishot (true),
+                receiving (false),
+                highWaterMark (highWaterMark_),
+                lowWaterMark (lowWaterMark_),
+                queuedBytes (0),
+                writeChunkCount (0),
+                backpressure (false),
+                closed (false),
+                finished (false) {
+            if (handle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    receiveBufferCount == 0 || receiveBufferCount > 32768 ||
+                    (receiveBufferCount & (receiveBufferCount - 1)) != 0 ||
+                    receiveBufferLength == 0 || lowWaterMark > highWaterMark) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            memset (&writeMessage, 0, sizeof (writeMessage));
+            // The provided buffer ring must be page aligned.
+            receiveRing = (io_uring_buf_ring *)mmap (0,
+                receiveBufferCount * sizeof (io_uring_buf),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (receiveRing == MAP_FAILED) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            THEKOGANS_UTIL_TRY {
+                bufferGroupId = ring.RegisterBufferRing (
+                    receiveRing, (util::ui32)receiveBufferCount);
+                receiveData.resize (receiveBufferCount * receiveBufferLength);
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                munmap (receiveRing, receiveBufferCount * sizeof (io_uring_buf));
+                THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+            }
+            for (std::size_t i = 0; i < receiveBufferCount; ++i) {
+                RecycleReceiveBuffer ((util::ui16)i);
+            }
+        }
+
+        IOURingTunnel::~IOURingTunnel () {
+            if (!finished) {
+                // Not supposed to happen (see the NOTE in the header).
+                // Best effort: no more completions can be delivered
+                // for a socket that's gone.
+                close (handle);
+                THEKOGANS_UTIL_TRY {
+                    ring.UnregisterBufferRing (bufferGroupId);
+                }
+                THEKOGANS_UTIL_CATCH_ANY {
+                }
+            }
+            for (std::size_t i = 0, count = sendQueue.size (); i < count; ++i) {
+                if (sendQueue[i].index != IOURingBufferPool::NO_BUFFER) {
+                    bufferPool.Release (sendQueue[i].index);
+                }
+            }
+            munmap (receiveRing, receiveBufferCount * sizeof (io_uring_buf));
+        }
+
+        void IOURingTunnel::Start () {
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed || receiving) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                        THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+                }
+                ArmReceive ();
+            }
+            ring.Submit ();
+        }
+
+        std::size_t IOURingTunnel::GetQueuedBytes () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return queuedBytes;
+        }
+
+        bool IOURingTunnel::IsBackpressured () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return backpressure && !closed;
+        }
+
+        void IOURingTunnel::Close () {
+            bool finish = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed.exchange (true)) {
+                    // Completes the armed receive (and fails the
+                    // in flight write). The completions finish up.
+                    shutdown (handle, SHUT_RDWR);
+                }
+                finish = IsFinished ();
+            }
+            ClearPendingPackets ();
+            if (finish) {
+                Finish ();
+            }
+        }
+
+        void IOURingTunnel::HandleCompletion (
+                util::ui32 op,
+                util::i32 result,
+                util::ui32 flags) throw () {
+            THEKOGANS_UTIL_TRY {
+                if (op == OP_RECEIVE) {
+                    HandleReceive (result, flags);
+                }
+                else {
+                    HandleWrite (result);
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+        }
+
+        bool IOURingTunnel::EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) {
+            bool result = true;
+            bool backpressureOn = false;
+            bool submit = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to send %s, tunnel is closed.",
+                        packet->Type ());
+                }
+                WriteFrame (*packet, *cipher);
+                // If a write is in flight, this frame will go
+                // out with the rest of the queue when it completes.
+                if (writeChunkCount == 0) {
+                    StartWrite ();
+                    submit = true;
+                }
+                if (!backpressure && queuedBytes >= highWaterMark) {
+                    backpressure = backpressureOn = true;
+                }
+                result = !backpressure;
+            }
+            if (submit) {
+                ring.Submit ();
+            }
+            if (backpressureOn) {
+                HandleBackpressure (true);
+            }
+            return result;
+        }
+
+        void IOURingTunnel::HandleReceive (
+                util::i32 result,
+                util::ui32 flags) {
+            if (result > 0 && (flags & IORING_CQE_F_BUFFER) != 0) {
+                util::ui16 bufferId = (util::ui16)(flags >> IORING_CQE_BUFFER_SHIFT);
+                // Parse straight out of the ring buffer. The parser
+                // is done with it when HandleBuffer returns.
+                THEKOGANS_UTIL_TRY {
+                    frameParser.HandleBuffer (
+                        util::Buffer::SharedPtr (
+                            new util::Buffer (
+                                util::NetworkEndian,
+                                &receiveData[bufferId * receiveBufferLength],
+                                receiveBufferLength,
+                                0,
+                                (std::size_t)result,
+                                &util::NullAllocator::Global)),
+                        *this);
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    eventSink.HandleTunnelError (*this, exception);
+                }
+                RecycleReceiveBuffer (bufferId);
+            }
+            if ((flags & IORING_CQE_F_MORE) == 0) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = 0;
+                bool finish = false;
+                {
+                    util::LockGuard<util::Mutex> guard (sendMutex);
+                    receiving = false;
+                    // Re-arm if a single shot receive completed, multishot
+                    // ran out of buffers (they've been recycled by now) or
+                    // the receive was interrupted.
+                    bool rearm = result > 0 || result == -ENOBUFS || result == -EINTR;
+                    if (result == -EINVAL && multishot) {
+                        // Kernel predates multishot receive.
+                        multishot = false;
+                        rearm = true;
+                    }
+                    if (!closed) {
+                        if (rearm) {
+                            ArmReceive ();
+                        }
+                        else if (result == 0) {
+                            // Peer closed the connection.
+                            closed = true;
+                            shutdown (handle, SHUT_RDWR);
+                        }
+                        else {
+                            errorCode = -result;
+                        }
+                    }
+                    finish = IsFinished ();
+                }
+                if (errorCode != 0) {
+                    HandleError (errorCode);
+                }
+                else if (finish) {
+                    Finish ();
+                }
+            }
+        }
+
+        void IOURingTunnel::HandleWrite (util::i32 result) {
+            THEKOGANS_UTIL_ERROR_CODE errorCode = 0;
+            bool backpressureOff = false;
+            bool finish = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                std::size_t written = result > 0 ? (std::size_t)result : 0;
+                // Retire written bytes. Writes can be short.
+                while (written > 0 && !sendQueue.empty ()) {
+                    Chunk &chunk = sendQueue.front ();
+                    std::size_t count = std::min (
+                        written, chunk.buffer->GetDataAvailableForReading ());
+                    chunk.buffer->AdvanceReadOffset (count);
+                    queuedBytes -= count;
+                    written -= count;
+                    if (chunk.buffer->IsEmpty ()) {
+                        if (chunk.index != IOURingBufferPool::NO_BUFFER) {
+                            bufferPool.Release (chunk.index);
+                        }
+                        sendQueue.pop_front ();
+                    }
+                }
+                writeChunkCount = 0;
+                if (!closed) {
+                    if (result < 0 && result != -EINTR && result != -EAGAIN) {
+                        errorCode = -result;
+                    }
+                    else {
+                        StartWrite ();
+                        if (backpressure && queuedBytes <= lowWaterMark) {
+                            backpressure = false;
+                            backpressureOff = true;
+                        }
+                    }
+                }
+                finish = IsFinished ();
+            }
+            if (backpressureOff) {
+                HandleBackpressure (false);
+            }
+            if (errorCode != 0) {
+                HandleError (errorCode);
+            }
+            else if (finish) {
+                Finish ();
+            }
+        }
+
+        void IOURingTunnel::ArmReceive () {
+            io_uring_sqe sqe;
+            memset (&sqe, 0, sizeof (sqe));
+            sqe.opcode = IORING_OP_RECV;
+            sqe.fd = handle;
+            sqe.flags = IOSQE_BUFFER_SELECT;
+            sqe.buf_group = bufferGroupId;
+            if (multishot) {
+                sqe.ioprio = IORING_RECV_MULTISHOT;
+            }
+            ring.Enqueue (sqe, *this, OP_RECEIVE);
+            receiving = true;
+        }
+
+        void IOURingTunnel::RecycleReceiveBuffer (util::ui16 bufferId) {
+            io_uring_buf &buf =
+                receiveRing->bufs[receiveRingTail & (receiveBufferCount - 1)];
+            buf.addr = (util::ui64)(std::size_t)&receiveData[bufferId * receiveBufferLength];
+            buf.len = (util::ui32)receiveBufferLength;
+            buf.bid = bufferId;
+            __atomic_store_n (&receiveRing->tail, ++receiveRingTail, __ATOMIC_RELEASE);
+        }
+
+        void IOURingTunnel::WriteFrame (
+                const Packet &packet,
+                crypto::Cipher &cipher) {
+            // Build (and compress) the plaintext once. Only
+            // where it's encrypted to depends on it's length.
+            util::Buffer plaintext (util::NetworkEndian);
+            packet.SerializePlaintext (plaintext, session, compress, paddingPolicy.Get ());
+            // Pack the frame behind the ones already in the last buffer.
+            // The bytes an in flight write covers are left alone.
+            if (!sendQueue.empty () &&
+                    sendQueue.back ().index != IOURingBufferPool::NO_BUFFER) {
+                util::Buffer &buffer = *sendQueue.back ().buffer;
+                std::size_t length = buffer.GetDataAvailableForReading ();
+                if (EncryptAndFrame (cipher, plaintext, buffer)) {
+                    queuedBytes += buffer.GetDataAvailableForReading () - length;
+                    return;
+                }
+            }
+            util::i32 index = bufferPool.Acquire ();
+            if (index != IOURingBufferPool::NO_BUFFER) {
+                Chunk chunk (index, bufferPool.GetBuffer (index));
+                if (EncryptAndFrame (cipher, plaintext, *chunk.buffer)) {
+                    queuedBytes += chunk.buffer->GetDataAvailableForReading ();
+                    sendQueue.push_back (chunk);
+                    return;
+                }
+                bufferPool.Release (index);
+            }
+            // Longer than a pool buffer, or the pool is exhausted.
+            util::Buffer::SharedPtr frame = cipher.EncryptAndFrame (
+                plaintext.GetReadPtr (),
+                plaintext.GetDataAvailableForReading ());
+            queuedBytes += frame->GetDataAvailableForReading ();
+            sendQueue.push_back (Chunk (IOURingBufferPool::NO_BUFFER, frame));
+        }
+
+        void IOURingTunnel::StartWrite () {
+            if (sendQueue.empty ()) {
+                return;
+            }
+            io_uring_sqe sqe;
+            memset (&sqe, 0, sizeof (sqe));
+            sqe.fd = handle;
+            std::size_t chunkCount = std::min (
+                sendQueue.size (), (std::size_t)MAX_GATHER_BUFFER_COUNT);
+            const Chunk &front = sendQueue.front ();
+            if (chunkCount == 1 && front.index != IOURingBufferPool::NO_BUFFER) {
+                sqe.opcode = IORING_OP_WRITE_FIXED;
+                sqe.addr = (util::ui64)(std::size_t)front.buffer->GetReadPtr ();
+                sqe.len = (util::ui32)front.buffer->GetDataAvailableForReading ();
+                sqe.buf_index = (util::ui16)front.index;
+                sqe.off = 0;
+            }
+            else {
+                for (std::size_t i = 0; i < chunkCount; ++i) {
+                    writeIov[i].iov_base = sendQueue[i].buffer->GetReadPtr ();
+                    writeIov[i].iov_len = sendQueue[i].buffer->GetDataAvailableForReading ();
+                }
+                writeMessage.msg_iov = writeIov;
+                writeMessage.msg_iovlen = chunkCount;
+                sqe.opcode = IORING_OP_SENDMSG;
+                sqe.addr = (util::ui64)(std::size_t)&writeMessage;
+                sqe.len = 1;
+                sqe.msg_flags = MSG_NOSIGNAL;
+            }
+            ring.Enqueue (sqe, *this, OP_WRITE);
+            writeChunkCount = chunkCount;
+        }
+
+        void IOURingTunnel::HandleError (THEKOGANS_UTIL_ERROR_CODE errorCode) {
+            THEKOGANS_UTIL_TRY {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+            Close ();
+        }
+
+        bool IOURingTunnel::IsFinished () {
+            if (closed && !receiving && writeChunkCount == 0 && !finished) {
+                finished = true;
+                return true;
+            }
+            return false;
+        }
+
+        void IOURingTunnel::Finish () {
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                close (handle);
+                for (std::size_t i = 0, count = sendQueue.size (); i < count; ++i) {
+                    if (sendQueue[i].index != IOURingBufferPool::NO_BUFFER) {
+                        bufferPool.Release (sendQueue[i].index);
+                    }
+                }
+                sendQueue.clear ();
+                queuedBytes = 0;
+            }
+            THEKOGANS_UTIL_TRY {
+                ring.UnregisterBufferRing (bufferGroupId);
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+            eventSink.HandleTunnelClosed (*this);
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
@@ -0,0 +1,145 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/TimeSpec.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/KeyExchangePool.h"
+
+namespace thekogans {
+    namespace packet {
+
+        KeyExchangePool::KeyExchangePool (
+                Factory::SharedPtr factory_,
+                const std::vector<std::string> &cipherSuites,
+                std::size_t poolSize_,
+                util::i32 priority) :
+                util::Thread ("KeyExchangePool"),
+                factory (factory_),
+                poolSize (poolSize_),
+                done (false),
+                condition (mutex) {
+            if (factory.Get () != 0 && !cipherSuites.empty () && poolSize > 0) {
+                for (std::size_t i = 0, count = cipherSuites.size (); i < count; ++i) {
+                    pools[cipherSuites[i]];
+                }
+                Create (priority);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        KeyExchangePool::~KeyExchangePool () {
+            Stop ();
+            Wait ();
+        }
+
+        crypto::KeyExchange::SharedPtr KeyExchangePool::GetKeyExchange (
+                const std::string &cipherSuite) {
+            {
+                util::LockGuard<util::Mutex> guard (mutex);
+                PoolMap::iterator it = pools.find (cipherSuite);
+                if (it != pools.end ()) {
+                    Pool &pool = it->second;
+                    if (!pool.keyExchanges.empty ()) {
+                        crypto::KeyExchange::SharedPtr keyExchange =
+                            pool.keyExchanges.front ();
+                        pool.keyExchanges.pop_front ();
+                        ++pool.stats.hits;
+                        condition.Signal ();
+                        return keyExchange;
+                    }
+                    ++pool.stats.misses;
+                    condition.Signal ();
+                }
+            }
+            // Pool miss. Generate inline (outside the lock).
+            return factory->CreateKeyExchange (cipherSuite);
+        }
+
+        KeyExchangePool::Stats KeyExchangePool::GetStats (const std::string &cipherSuite) {
+            util::LockGuard<util::Mutex> guard (mutex);
+            PoolMap::const_iterator it = pools.find (cipherSuite);
+            if (it != pools.end ()) {
+                Stats stats = it->second.stats;
+                stats.size = it->second.keyExchanges.size ();
+                return stats;
+            }
+            return Stats ();
+        }
+
+        void KeyExchangePool::Stop () {
+            util::LockGuard<util::Mutex> guard (mutex);
+            done = true;
+            for (PoolMap::iterator it = pools.begin (), end = pools.end (); it != end; ++it) {
+                it->second.keyExchanges.clear ();
+            }
+            condition.SignalAll ();
+        }
+
+        void KeyExchangePool::Run () throw () {
+            while (1) {
+                std::string cipherSuite;
+                {
+                    util::LockGuard<util::Mutex> guard (mutex);
+                    while (!done) {
+                        // Refill the emptiest pool first, so that one busy
+                        // cipher suite can't starve the others.
+                        std::size_t minSize = poolSize;
+                        for (PoolMap::const_iterator
+                                it = pools.begin (),
+                                end = pools.end (); it != end; ++it) {
+                            if (minSize > it->second.keyExchanges.size ()) {
+                                minSize = it->second.keyExchanges.size ();
+                                cipherSuite = it->first;
+                            }
+                        }
+                        if (minSize < poolSize) {
+                            break;
+                        }
+                        condition.Wait ();
+                    }
+                    if (done) {
+                        break;
+                    }
+                }
+                crypto::KeyExchange::SharedPtr keyExchange;
+                THEKOGANS_UTIL_TRY {
+                    keyExchange = factory->CreateKeyExchange (cipherSuite);
+                }
+                THEKOGANS_UTIL_CATCH_ANY {
+                }
+                util::LockGuard<util::Mutex> guard (mutex);
+                Pool &pool = pools[cipherSuite];
+                if (keyExchange.Get () != 0) {
+                    if (!done && pool.keyExchanges.size () < poolSize) {
+                        pool.keyExchanges.push_back (keyExchange);
+                    }
+                }
+                else {
+                    // Back off instead of spinning on a failing factory.
+                    ++pool.stats.failures;
+                    if (!done) {
+                        condition.Wait (util::TimeSpec::FromSeconds (1));
+                    }
+                }
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,190 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/KeyRing.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            struct EntryLess {
+                template<typename Entry>
+                inline bool operator () (
+                        const Entry &entry,
+                        const crypto::ID &keyId) const {
+                    return entry.first < keyId;
+                }
+            };
+        }
+
+        KeyRing::Key *KeyRing::Snapshot::Find (const crypto::ID &keyId) const {
+            std::vector<Entry>::const_iterator it =
+                std::lower_bound (entries.begin (), entries.end (), keyId, EntryLess ());
+            return it != entries.end () && it->first == keyId ? it->second.Get () : 0;
+        }
+
+        KeyRing::KeyRing (const Thresholds &thresholds_) :
+                thresholds (thresholds_),
+                rotationHandler (0),
+                snapshot (0) {
+            if (thresholds.packetLimit > 0 &&
+                    (thresholds.maxPackets == 0 ||
+                        thresholds.maxPackets >= thresholds.packetLimit)) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            snapshot.store (new Snapshot, std::memory_order_relaxed);
+        }
+
+        KeyRing::~KeyRing () {
+            delete snapshot.load (std::memory_order_relaxed);
+        }
+
+        bool KeyRing::AddCipher (
+                crypto::Cipher::SharedPtr cipher,
+                bool activate) {
+            if (cipher.Get () != 0) {
+                const crypto::ID &keyId = cipher->GetKey ()->GetId ();
+                util::LockGuard<util::Mutex> guard (mutex);
+                const Snapshot &oldSnapshot = *snapshot.load (std::memory_order_relaxed);
+                std::vector<Entry>::const_iterator it = std::lower_bound (
+                    oldSnapshot.entries.begin (), oldSnapshot.entries.end (), keyId, EntryLess ());
+                if (it == oldSnapshot.entries.end () || it->first != keyId) {
+                    Snapshot *newSnapshot = new Snapshot (oldSnapshot);
+                    Key::SharedPtr key (new Key (cipher));
+                    newSnapshot->entries.insert (
+                        newSnapshot->entries.begin () + (it - oldSnapshot.entries.begin ()),
+                        Entry (keyId, key));
+                    if (activate) {
+                        newSnapshot->activeKey = key.Get ();
+                    }
+                    Publish (newSnapshot);
+                    return true;
+                }
+                return false;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool KeyRing::SetActiveCipher (const crypto::ID &keyId) {
+            util::LockGuard<util::Mutex> guard (mutex);
+            const Snapshot &oldSnapshot = *snapshot.load (std::memory_order_relaxed);
+            Key *key = oldSnapshot.Find (keyId);
+            if (key != 0) {
+                if (oldSnapshot.activeKey != key) {
+                    Snapshot *newSnapshot = new Snapshot (oldSnapshot);
+                    newSnapshot->activeKey = key;
+                    Publish (newSnapshot);
+                }
+                return true;
+            }
+            return false;
+        }
+
+        bool KeyRing::DropCipher (const crypto::ID &keyId) {
+            util::LockGuard<util::Mutex> guard (mutex);
+            const Snapshot &oldSnapshot = *snapshot.load (std::memory_order_relaxed);
+            std::vector<Entry>::const_iterator it = std::lower_bound (
+                oldSnapshot.entries.begin (), oldSnapshot.entries.end (), keyId, EntryLess ());
+            if (it != oldSnapshot.entries.end () && it->first == keyId) {
+                Snapshot *newSnapshot = new Snapshot (oldSnapshot);
+                if (newSnapshot->activeKey == it->second.Get ()) {
+                    newSnapshot->activeKey = 0;
+                }
+                newSnapshot->entries.erase (
+                    newSnapshot->entries.begin () + (it - oldSnapshot.entries.begin ()));
+                Publish (newSnapshot);
+                return true;
+            }
+            return false;
+        }
+
+        crypto::Cipher::SharedPtr KeyRing::GetCipher (
+                const crypto::ID &keyId,
+                std::size_t byteCount) throw () {
+            EpochReclaimer::ReadGuard guard;
+            Key *key = snapshot.load (std::memory_order_acquire)->Find (keyId);
+            if (key != 0 && RecordUsage (*key, byteCount)) {
+                return key->cipher;
+            }
+            return crypto::Cipher::SharedPtr ();
+        }
+
+        crypto::Cipher::SharedPtr KeyRing::GetActiveCipher (
+                std::size_t byteCount,
+                std::size_t packetCount) throw () {
+            EpochReclaimer::ReadGuard guard;
+            Key *key = snapshot.load (std::memory_order_acquire)->activeKey;
+            if (key != 0 && RecordUsage (*key, byteCount, packetCount)) {
+                return key->cipher;
+            }
+            return crypto::Cipher::SharedPtr ();
+        }
+
+        bool KeyRing::GetUsage (
+                const crypto::ID &keyId,
+                Usage &usage) const {
+            EpochReclaimer::ReadGuard guard;
+            const Key *key = snapshot.load (std::memory_order_acquire)->Find (keyId);
+            if (key != 0) {
+                usage.packets = key->packets.load (std::memory_order_relaxed);
+                usage.bytes = key->bytes.load (std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+
+        std::size_t KeyRing::GetSize () const {
+            EpochReclaimer::ReadGuard guard;
+            return snapshot.load (std::memory_order_acquire)->entries.size ();
+        }
+
+        bool KeyRing::RecordUsage (
+                Key &key,
+                std::size_t byteCount,
+                std::size_t packetCount) throw () {
+            util::ui64 packets =
+                key.packets.fetch_add (packetCount, std::memory_order_relaxed) + packetCount;
+            util::ui64 bytes = byteCount > 0 ?
+                key.bytes.fetch_add (byteCount, std::memory_order_relaxed) + byteCount :
+                key.bytes.load (std::memory_order_relaxed);
+            if (((thresholds.maxPackets > 0 && packets >= thresholds.maxPackets) ||
+                    (thresholds.maxBytes > 0 && bytes >= thresholds.maxBytes)) &&
+                    // Cheap check first, so that an overused key costs
+                    // a load, not an exchange, per packet.
+                    !key.rotationRequested.load (std::memory_order_relaxed) &&
+                    !key.rotationRequested.exchange (true, std::memory_order_relaxed)) {
+                RotationHandler *handler = rotationHandler.load (std::memory_order_acquire);
+                if (handler != 0) {
+                    handler->RotateKey (*this, key.cipher);
+                }
+            }
+            return thresholds.packetLimit == 0 || packets <= thresholds.packetLimit;
+        }
+
+        void KeyRing::Publish (Snapshot *newSnapshot) {
+            EpochReclaimer::Retire (
+                snapshot.exchange (newSnapshot, std::memory_order_seq_cst));
+        }
+
+    } // namespace packet
+} // namespace thekogans
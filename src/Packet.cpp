@@ -15,114 +15,435 @@
 // You should have received a copy of the GNU General Public License
 // along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
 
+#include <string>
+#include <map>
+#include <limits>
+#include "thekogans/util/SpinLock.h"
+#include "thekogans/util/LockGuard.h"
 #include "thekogans/util/RandomSource.h"
 #include "thekogans/util/Exception.h"
 #include "thekogans/util/Flags.h"
+#include "thekogans/crypto/FrameHeader.h"
 #include "thekogans/packet/PlaintextHeader.h"
+#include "thekogans/packet/SessionTable.h"
 #include "thekogans/packet/Packet.h"
 
 namespace thekogans {
     namespace packet {
 
         namespace {
-            inline util::ui8 GetRandomLength () {
-                util::ui8 randomLength;
-                do {
-                    randomLength = (util::ui8)(
-                        util::RandomSource::Instance ()->Getui32 () %
-                        (PlaintextHeader::MAX_RANDOM_LENGTH + 1));
-                } while (randomLength == 0);
-                return randomLength;
+            struct TypeRegistry {
+                util::SpinLock spinLock;
+                typedef std::map<std::string, Packet::TypeId> Map;
+                Map map;
+            };
+
+            // Packet types register during static initialization.
+            // Construct on first use, and never destroy, so that
+            // the registry is available regardless of initialization
+            // (and destruction) order.
+            TypeRegistry &GetTypeRegistry () {
+                static TypeRegistry *typeRegistry = new TypeRegistry;
+                return *typeRegistry;
             }
         }
 
-        util::Buffer::SharedPtr Packet::Serialize (
-                crypto::Cipher &cipher,
-                Session *session,
-                bool compress) const {
-            util::ui8 randomLength = GetRandomLength ();
-            util::Buffer plaintext (
-                util::NetworkEndian,
-                PlaintextHeader::SIZE +
-                randomLength +
-                (session != 0 ? Session::Header::SIZE : 0) +
-                GetSize ());
-            util::ui8 flags = 0;
-            if (session != 0) {
-                flags |= PlaintextHeader::FLAGS_SESSION_HEADER;
+        Packet::TypeId Packet::RegisterType (const char *type) {
+            if (type != 0) {
+                TypeRegistry &typeRegistry = GetTypeRegistry ();
+                util::LockGuard<util::SpinLock> guard (typeRegistry.spinLock);
+                std::pair<TypeRegistry::Map::iterator, bool> result =
+                    typeRegistry.map.insert (
+                        TypeRegistry::Map::value_type (
+                            type, (TypeId)typeRegistry.map.size ()));
+                return result.first->second;
             }
-            if (compress) {
-                flags |= PlaintextHeader::FLAGS_COMPRESSED;
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
             }
-            plaintext << PlaintextHeader (randomLength, flags);
-            if (plaintext.AdvanceWriteOffset (
-                    util::RandomSource::Instance ()->GetBytes (
-                        plaintext.GetWritePtr (),
-                        randomLength)) == randomLength) {
+        }
+
+        std::size_t Packet::GetTypeCount () {
+            TypeRegistry &typeRegistry = GetTypeRegistry ();
+            util::LockGuard<util::SpinLock> guard (typeRegistry.spinLock);
+            return typeRegistry.map.size ();
+        }
+
+        namespace {
+            inline std::size_t GetPlaintextLength (
+                    Session *session,
+                    std::size_t packetLength) {
+                return PlaintextHeader::SIZE +
+                    (session != 0 ? (session->compactHeader ?
+                        Session::Header::COMPACT_SIZE : Session::Header::SIZE) : 0) +
+                    packetLength;
+            }
+
+            inline util::ui8 GetPlaintextFlags (
+                    Session *session,
+                    bool compress) {
+                util::ui8 flags = 0;
                 if (session != 0) {
-                    plaintext << session->GetOutboundHeader ();
+                    flags |= session->compactHeader ?
+                        PlaintextHeader::FLAGS_COMPACT_SESSION_HEADER :
+                        PlaintextHeader::FLAGS_SESSION_HEADER;
                 }
                 if (compress) {
-                    util::Buffer buffer (util::NetworkEndian, GetSize ());
-                    buffer << *this;
-                    util::Buffer::SharedPtr deflated = buffer.Deflate ();
+                    flags |= PlaintextHeader::FLAGS_COMPRESSED;
+                }
+                return flags;
+            }
+
+            // Write the session header (if any) and the packet
+            // (or it's deflated form) following the padding.
+            void WritePlaintextBody (
+                    util::Buffer &plaintext,
+                    const Packet &packet,
+                    const util::Buffer *deflated,
+                    Session *session) {
+                if (session != 0) {
+                    if (session->compactHeader) {
+                        plaintext << (util::ui32)session->GetOutboundHeader ().sequenceNumber;
+                    }
+                    else {
+                        plaintext << session->GetOutboundHeader ();
+                    }
+                }
+                if (deflated != 0) {
                     plaintext.Write (
                         deflated->GetReadPtr (), deflated->GetDataAvailableForReading ());
                 }
                 else {
-                    plaintext << *this;
+                    plaintext << packet;
                 }
-                return cipher.EncryptAndFrame (
-                    plaintext.GetReadPtr (),
-                    plaintext.GetDataAvailableForReading ());
             }
-            else {
-                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
-                    "Unable to get %u random bytes.",
-                    randomLength);
+
+            // Compress (if asked) and pad the packet in to a plaintext
+            // buffer ready to be encrypted. If the resulting frame would
+            // be longer than maxFrameLength, return false before touching
+            // the session (no sequence number is used up).
+            bool BuildPlaintext (
+                    const Packet &packet,
+                    Session *session,
+                    bool compress,
+                    const PaddingPolicy *paddingPolicy,
+                    std::size_t maxFrameLength,
+                    util::Buffer &plaintext) {
+                // Compress first, as the padding length
+                // (see BucketPaddingPolicy) can depend on
+                // the final plaintext length.
+                util::Buffer::SharedPtr deflated;
+                std::size_t packetLength = packet.GetSize ();
+                if (compress) {
+                    util::Buffer buffer (util::NetworkEndian, packetLength);
+                    buffer << packet;
+                    deflated = buffer.Deflate ();
+                    packetLength = deflated->GetDataAvailableForReading ();
+                }
+                std::size_t plaintextLength = GetPlaintextLength (session, packetLength);
+                util::ui8 randomLength = (paddingPolicy != 0 ?
+                    *paddingPolicy : PaddingPolicy::GetDefault ()).GetPaddingLength (plaintextLength);
+                plaintextLength += randomLength;
+                if (crypto::FrameHeader::SIZE +
+                        crypto::Cipher::GetMaxBufferLength (plaintextLength) > maxFrameLength) {
+                    return false;
+                }
+                plaintext.Resize (plaintextLength);
+                plaintext.readOffset = plaintext.writeOffset = 0;
+                plaintext << PlaintextHeader (randomLength, GetPlaintextFlags (session, compress));
+                if (plaintext.AdvanceWriteOffset (
+                        util::RandomSource::Instance ()->GetBytes (
+                            plaintext.GetWritePtr (),
+                            randomLength)) == randomLength) {
+                    WritePlaintextBody (plaintext, packet, deflated.Get (), session);
+                    return true;
+                }
+                else {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to get %u random bytes.",
+                        randomLength);
+                }
             }
         }
 
-        Packet::SharedPtr Packet::Deserialize (
-                util::Buffer &ciphertext,
+        util::Buffer::SharedPtr Packet::Serialize (
                 crypto::Cipher &cipher,
-                Session *session) {
-            util::Buffer::SharedPtr plaintext = cipher.Decrypt (
-                ciphertext.GetReadPtr (),
-                ciphertext.GetDataAvailableForReading ());
-            PlaintextHeader plaintextHeader;
-            *plaintext >> plaintextHeader;
-            plaintext->AdvanceReadOffset (plaintextHeader.randomLength);
-            if (util::Flags8 (plaintextHeader.flags).Test (
-                    PlaintextHeader::FLAGS_SESSION_HEADER)) {
-                Session::Header sessionHeader;
-                *plaintext >> sessionHeader;
-                if (session == 0) {
-                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
-                        "Unable to verify session header (%s, " THEKOGANS_UTIL_UI64_FORMAT ").",
-                        sessionHeader.id.ToString ().c_str (),
-                        sessionHeader.sequenceNumber);
+                Session *session,
+                bool compress,
+                const PaddingPolicy *paddingPolicy) const {
+            util::Buffer plaintext (util::NetworkEndian);
+            BuildPlaintext (
+                *this,
+                session,
+                compress,
+                paddingPolicy,
+                std::numeric_limits<std::size_t>::max (),
+                plaintext);
+            return cipher.EncryptAndFrame (
+                plaintext.GetReadPtr (),
+                plaintext.GetDataAvailableForReading ());
+        }
+
+        bool Packet::Serialize (
+                util::Buffer &frame,
+                crypto::Cipher &cipher,
+                Session *session,
+                bool compress,
+                const PaddingPolicy *paddingPolicy) const {
+            util::Buffer plaintext (util::NetworkEndian);
+            if (BuildPlaintext (
+                    *this,
+                    session,
+                    compress,
+                    paddingPolicy,
+                    frame.GetDataAvailableForWriting (),
+                    plaintext)) {
+                frame.AdvanceWriteOffset (
+                    cipher.EncryptAndFrame (
+                        plaintext.GetReadPtr (),
+                        plaintext.GetDataAvailableForReading (),
+                        0, 0,
+                        frame.GetWritePtr ()));
+                return true;
+            }
+            return false;
+        }
 
+        void Packet::SerializePlaintext (
+                util::Buffer &plaintext,
+                Session *session,
+                bool compress,
+                const PaddingPolicy *paddingPolicy) const {
+            BuildPlaintext (
+                *this,
+                session,
+                compress,
+                paddingPolicy,
+                std::numeric_limits<std::size_t>::max (),
+                plaintext);
+        }
+
+        util::Buffer::SharedPtr Packet::SerializeBatch (
+                const std::vector<SharedPtr> &packets,
+                crypto::Cipher &cipher,
+                Session *session,
+                bool compress,
+                const PaddingPolicy *paddingPolicy,
+                std::vector<std::size_t> *frameLengths) {
+            const PaddingPolicy &policy = paddingPolicy != 0 ?
+                *paddingPolicy : PaddingPolicy::GetDefault ();
+            std::size_t count = packets.size ();
+            // First pass: compress (if asked) and size everything,
+            // so that all allocations and the random draw happen
+            // once for the whole batch.
+            std::vector<util::Buffer::SharedPtr> deflated (compress ? count : 0);
+            std::vector<std::size_t> plaintextLengths (count);
+            std::vector<util::ui8> randomLengths (count);
+            std::size_t totalRandomLength = 0;
+            std::size_t maxPlaintextLength = 0;
+            std::size_t maxFramesLength = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                if (packets[i].Get () == 0) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                        THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
                 }
-                else if (!session->VerifyInboundHeader (sessionHeader)) {
-                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
-                        "Invalid session header (%s, " THEKOGANS_UTIL_UI64_FORMAT ") "
-                        "for sesson (%s, " THEKOGANS_UTIL_UI64_FORMAT ", " THEKOGANS_UTIL_UI64_FORMAT "), "
-                        "possible replay attack.",
-                        sessionHeader.id.ToString ().c_str (),
-                        sessionHeader.sequenceNumber,
-                        session->id.ToString ().c_str (),
-                        session->inboundSequenceNumber,
-                        session->outboundSequenceNumber);
+                std::size_t packetLength = packets[i]->GetSize ();
+                if (compress) {
+                    util::Buffer buffer (util::NetworkEndian, packetLength);
+                    buffer << *packets[i];
+                    deflated[i] = buffer.Deflate ();
+                    packetLength = deflated[i]->GetDataAvailableForReading ();
+                }
+                std::size_t plaintextLength = GetPlaintextLength (session, packetLength);
+                randomLengths[i] = policy.GetPaddingLength (plaintextLength);
+                plaintextLengths[i] = plaintextLength + randomLengths[i];
+                totalRandomLength += randomLengths[i];
+                if (maxPlaintextLength < plaintextLengths[i]) {
+                    maxPlaintextLength = plaintextLengths[i];
                 }
+                maxFramesLength += crypto::FrameHeader::SIZE +
+                    crypto::Cipher::GetMaxBufferLength (plaintextLengths[i]);
+            }
+            std::vector<util::ui8> random (totalRandomLength);
+            if (totalRandomLength > 0 &&
+                    util::RandomSource::Instance ()->GetBytes (
+                        &random[0], totalRandomLength) != totalRandomLength) {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "Unable to get " THEKOGANS_UTIL_SIZE_T_FORMAT " random bytes.",
+                    totalRandomLength);
             }
-            if (util::Flags8 (plaintextHeader.flags).Test (
-                    PlaintextHeader::FLAGS_COMPRESSED)) {
-                plaintext = plaintext->Inflate ();
+            // Second pass: build every plaintext in the same scratch
+            // buffer and encrypt it straight in to the output.
+            util::ui8 flags = GetPlaintextFlags (session, compress);
+            util::Buffer plaintext (util::NetworkEndian, maxPlaintextLength);
+            util::Buffer::SharedPtr frames (
+                new util::Buffer (util::NetworkEndian, maxFramesLength));
+            if (frameLengths != 0) {
+                frameLengths->clear ();
+                frameLengths->reserve (count);
             }
-            Packet::SharedPtr packet;
-            *plaintext >> packet;
-            return packet;
+            for (std::size_t i = 0, randomOffset = 0; i < count; ++i) {
+                plaintext.readOffset = plaintext.writeOffset = 0;
+                plaintext << PlaintextHeader (randomLengths[i], flags);
+                // NOTE: random is empty if no packet is padded.
+                if (randomLengths[i] > 0) {
+                    plaintext.Write (&random[randomOffset], randomLengths[i]);
+                    randomOffset += randomLengths[i];
+                }
+                WritePlaintextBody (
+                    plaintext, *packets[i], compress ? deflated[i].Get () : 0, session);
+                std::size_t frameLength = cipher.EncryptAndFrame (
+                    plaintext.GetReadPtr (),
+                    plaintext.GetDataAvailableForReading (),
+                    0, 0,
+                    frames->GetWritePtr ());
+                frames->AdvanceWriteOffset (frameLength);
+                if (frameLengths != 0) {
+                    frameLengths->push_back (frameLength);
+                }
+            }
+            return frames;
+        }
+
+        std::size_t Packet::GetMaxPacketSize (
+                const char *type,
+                std::size_t maxCiphertextLength,
+                bool session,
+                const PaddingPolicy *paddingPolicy) {
+            std::size_t overhead = GetFramingOverhead (session, (paddingPolicy != 0 ?
+                *paddingPolicy : PaddingPolicy::GetDefault ()).GetMaxPaddingLength ());
+            // The packet header encodes the packet size in a variable
+            // length field. Start with the header size for the largest
+            // possible packet (an upper bound), and grow the packet while
+            // it still fits.
+            std::size_t maxOverhead = overhead +
+                util::Serializable::BinHeader (type, 0, maxCiphertextLength).Size ();
+            if (maxOverhead >= maxCiphertextLength) {
+                return 0;
+            }
+            std::size_t packetSize = maxCiphertextLength - maxOverhead;
+            while (overhead +
+                    util::Serializable::BinHeader (type, 0, packetSize + 1).Size () +
+                    packetSize + 1 <= maxCiphertextLength) {
+                ++packetSize;
+            }
+            return packetSize;
+        }
+
+        namespace {
+            // Decrypt the ciphertext, skip the padding, validate the
+            // session header (if any) with verifySessionHeader, and
+            // extract the packet. verifySessionHeader has two overloads,
+            // one for full, and one for compact session headers.
+            template<typename VerifySessionHeader>
+            Packet::SharedPtr DeserializePacket (
+                    util::Buffer &ciphertext,
+                    crypto::Cipher &cipher,
+                    VerifySessionHeader verifySessionHeader) {
+                util::Buffer::SharedPtr plaintext = cipher.Decrypt (
+                    ciphertext.GetReadPtr (),
+                    ciphertext.GetDataAvailableForReading ());
+                PlaintextHeader plaintextHeader;
+                *plaintext >> plaintextHeader;
+                plaintext->AdvanceReadOffset (plaintextHeader.randomLength);
+                if (util::Flags8 (plaintextHeader.flags).Test (
+                        PlaintextHeader::FLAGS_SESSION_HEADER)) {
+                    Session::Header sessionHeader;
+                    *plaintext >> sessionHeader;
+                    verifySessionHeader (sessionHeader);
+                }
+                else if (util::Flags8 (plaintextHeader.flags).Test (
+                        PlaintextHeader::FLAGS_COMPACT_SESSION_HEADER)) {
+                    util::ui32 truncatedSequenceNumber;
+                    *plaintext >> truncatedSequenceNumber;
+                    verifySessionHeader (truncatedSequenceNumber);
+                }
+                if (util::Flags8 (plaintextHeader.flags).Test (
+                        PlaintextHeader::FLAGS_COMPRESSED)) {
+                    plaintext = plaintext->Inflate ();
+                }
+                Packet::SharedPtr packet;
+                *plaintext >> packet;
+                return packet;
+            }
+
+            struct VerifySession {
+                Session *session;
+
+                explicit VerifySession (Session *session_) :
+                    session (session_) {}
+
+                void operator () (const Session::Header &sessionHeader) const {
+                    if (session == 0) {
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                            "Unable to verify session header (%s, " THEKOGANS_UTIL_UI64_FORMAT ").",
+                            sessionHeader.id.ToString ().c_str (),
+                            sessionHeader.sequenceNumber);
+
+                    }
+                    else if (!session->VerifyInboundHeader (sessionHeader)) {
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                            "Invalid session header (%s, " THEKOGANS_UTIL_UI64_FORMAT ") "
+                            "for sesson (%s, " THEKOGANS_UTIL_UI64_FORMAT ", " THEKOGANS_UTIL_UI64_FORMAT "), "
+                            "possible replay attack.",
+                            sessionHeader.id.ToString ().c_str (),
+                            sessionHeader.sequenceNumber,
+                            session->id.ToString ().c_str (),
+                            session->inboundSequenceNumber,
+                            session->outboundSequenceNumber.load ());
+                    }
+                }
+
+                void operator () (util::ui32 truncatedSequenceNumber) const {
+                    // The session is implied by the key.
+                    if (session == 0) {
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                            "Unable to verify compact session header (%u).",
+                            truncatedSequenceNumber);
+                    }
+                    (*this) (session->GetInboundHeader (truncatedSequenceNumber));
+                }
+            };
+
+            struct VerifySessionTable {
+                SessionTable &sessionTable;
+
+                explicit VerifySessionTable (SessionTable &sessionTable_) :
+                    sessionTable (sessionTable_) {}
+
+                void operator () (const Session::Header &sessionHeader) const {
+                    if (!sessionTable.VerifyInboundHeader (sessionHeader)) {
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                            "Unknown session or invalid session header (%s, " THEKOGANS_UTIL_UI64_FORMAT "), "
+                            "possible replay attack.",
+                            sessionHeader.id.ToString ().c_str (),
+                            sessionHeader.sequenceNumber);
+                    }
+                }
+
+                void operator () (util::ui32 truncatedSequenceNumber) const {
+                    // Compact headers carry no session id to look up.
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to verify compact session header (%u) "
+                        "without a key bound session.",
+                        truncatedSequenceNumber);
+                }
+            };
+        }
+
+        Packet::SharedPtr Packet::Deserialize (
+                util::Buffer &ciphertext,
+                crypto::Cipher &cipher,
+                Session *session) {
+            return DeserializePacket (ciphertext, cipher, VerifySession (session));
+        }
+
+        Packet::SharedPtr Packet::Deserialize (
+                util::Buffer &ciphertext,
+                crypto::Cipher &cipher,
+                SessionTable &sessionTable) {
+            return DeserializePacket (ciphertext, cipher, VerifySessionTable (sessionTable));
         }
 
     } // namespace packet
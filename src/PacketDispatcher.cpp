@@ -0,0 +1,40 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/PacketDispatcher.h"
+
+namespace thekogans {
+    namespace packet {
+
+        void PacketDispatcher::RegisterHandler (
+                Packet::TypeId typeId,
+                Handler::SharedPtr handler) {
+            if (typeId < Packet::GetTypeCount ()) {
+                if (typeId >= handlers.size ()) {
+                    handlers.resize (Packet::GetTypeCount ());
+                }
+                handlers[typeId] = handler;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
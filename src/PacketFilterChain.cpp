@@ -0,0 +1,135 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/PacketFilterChain.h"
+
+namespace thekogans {
+    namespace packet {
+
+        PacketFilterChain::~PacketFilterChain () {
+            delete snapshot.load (std::memory_order_relaxed);
+        }
+
+        void PacketFilterChain::AddFilter (
+                PacketFilter::SharedPtr filter,
+                std::size_t index) {
+            if (filter.Get () != 0) {
+                util::LockGuard<util::Mutex> guard (mutex);
+                Snapshot *newSnapshot =
+                    new Snapshot (*snapshot.load (std::memory_order_relaxed));
+                newSnapshot->filters.insert (
+                    newSnapshot->filters.begin () +
+                        std::min (index, newSnapshot->filters.size ()),
+                    filter);
+                Publish (newSnapshot);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool PacketFilterChain::RemoveFilter (const PacketFilter &filter) {
+            util::LockGuard<util::Mutex> guard (mutex);
+            const std::vector<PacketFilter::SharedPtr> &filters =
+                snapshot.load (std::memory_order_relaxed)->filters;
+            for (std::size_t i = 0, count = filters.size (); i < count; ++i) {
+                if (filters[i].Get () == &filter) {
+                    Snapshot *newSnapshot = new Snapshot;
+                    newSnapshot->filters.reserve (count - 1);
+                    newSnapshot->filters.insert (
+                        newSnapshot->filters.end (), filters.begin (), filters.begin () + i);
+                    newSnapshot->filters.insert (
+                        newSnapshot->filters.end (), filters.begin () + i + 1, filters.end ());
+                    Publish (newSnapshot);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool PacketFilterChain::ReplaceFilter (
+                const PacketFilter &oldFilter,
+                PacketFilter::SharedPtr newFilter) {
+            if (newFilter.Get () != 0) {
+                util::LockGuard<util::Mutex> guard (mutex);
+                const std::vector<PacketFilter::SharedPtr> &filters =
+                    snapshot.load (std::memory_order_relaxed)->filters;
+                for (std::size_t i = 0, count = filters.size (); i < count; ++i) {
+                    if (filters[i].Get () == &oldFilter) {
+                        Snapshot *newSnapshot =
+                            new Snapshot (*snapshot.load (std::memory_order_relaxed));
+                        newSnapshot->filters[i] = newFilter;
+                        Publish (newSnapshot);
+                        return true;
+                    }
+                }
+                return false;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void PacketFilterChain::Clear () {
+            util::LockGuard<util::Mutex> guard (mutex);
+            Publish (new Snapshot);
+        }
+
+        std::vector<PacketFilter::SharedPtr> PacketFilterChain::GetFilters () const {
+            EpochReclaimer::ReadGuard guard;
+            return snapshot.load (std::memory_order_acquire)->filters;
+        }
+
+        Packet::SharedPtr PacketFilterChain::FilterPacket (Packet::SharedPtr packet) {
+            EpochReclaimer::ReadGuard guard;
+            const std::vector<PacketFilter::SharedPtr> &filters =
+                snapshot.load (std::memory_order_acquire)->filters;
+            for (std::size_t i = 0, count = filters.size ();
+                    i < count && packet.Get () != 0; ++i) {
+                packet = PacketFilter::CallFilterPacket (*filters[i], std::move (packet));
+            }
+            return packet;
+        }
+
+        void PacketFilterChain::FilterPackets (PacketBatch &packets) {
+            EpochReclaimer::ReadGuard guard;
+            const std::vector<PacketFilter::SharedPtr> &filters =
+                snapshot.load (std::memory_order_acquire)->filters;
+            for (std::size_t i = 0, count = filters.size ();
+                    i < count && !packets.empty (); ++i) {
+                PacketFilter::CallFilterPackets (*filters[i], packets);
+            }
+        }
+
+        void PacketFilterChain::HandleBackpressure (bool on) {
+            std::vector<PacketFilter::SharedPtr> filters = GetFilters ();
+            for (std::size_t i = 0, count = filters.size (); i < count; ++i) {
+                filters[i]->HandleBackpressure (on);
+            }
+        }
+
+        void PacketFilterChain::Publish (Snapshot *newSnapshot) {
+            EpochReclaimer::Retire (
+                snapshot.exchange (newSnapshot, std::memory_order_seq_cst));
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,243 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include "thekogans/packet/PacketFilter.h"
+#include "thekogans/packet/PacketFilterStats.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            inline util::ui64 Now () {
+                return (util::ui64)std::chrono::duration_cast<std::chrono::nanoseconds> (
+                    std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+            }
+
+            // Time spent in instrumented filters called from
+            // the currently executing instrumented filter.
+            thread_local util::ui64 childTime = 0;
+
+            // Times a filter call. Nested calls (through CallNextPacketFilter)
+            // add their inclusive time to the caller's childTime, which is how
+            // exclusive time is computed.
+            struct Timer {
+                util::ui64 savedChildTime;
+                util::ui64 start;
+                util::ui64 inclusiveTime;
+                util::ui64 exclusiveTime;
+                bool stopped;
+
+                Timer () :
+                        savedChildTime (childTime),
+                        start (0),
+                        inclusiveTime (0),
+                        exclusiveTime (0),
+                        stopped (false) {
+                    childTime = 0;
+                    start = Now ();
+                }
+                ~Timer () {
+                    if (!stopped) {
+                        Stop ();
+                    }
+                }
+
+                void Stop () {
+                    inclusiveTime = Now () - start;
+                    exclusiveTime = inclusiveTime - std::min (childTime, inclusiveTime);
+                    childTime = savedChildTime + inclusiveTime;
+                    stopped = true;
+                }
+            };
+
+            std::atomic<std::size_t> nextShardIndex (0);
+            thread_local std::size_t shardIndex =
+                nextShardIndex.fetch_add (1, std::memory_order_relaxed) %
+                    PacketFilterStats::SHARD_COUNT;
+
+            inline std::size_t GetBucket (util::ui64 time) {
+                std::size_t bucket = 0;
+                while (time > 1 && bucket < PacketFilterStats::HISTOGRAM_BUCKET_COUNT - 1) {
+                    time >>= 1;
+                    ++bucket;
+                }
+                return bucket;
+            }
+        }
+
+        PacketFilterStats::Snapshot::Snapshot () :
+                calls (0),
+                batchCalls (0),
+                packets (0),
+                forwarded (0),
+                dropped (0),
+                replaced (0),
+                exceptions (0),
+                inclusiveTime (0),
+                exclusiveTime (0) {
+            for (std::size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+                histogram[i] = 0;
+            }
+        }
+
+        util::ui64 PacketFilterStats::Snapshot::GetPercentile (util::f64 percentile) const {
+            util::ui64 total = 0;
+            for (std::size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+                total += histogram[i];
+            }
+            if (total > 0) {
+                util::ui64 target = (util::ui64)(percentile * total + 0.5);
+                util::ui64 count = 0;
+                for (std::size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+                    count += histogram[i];
+                    if (count >= target) {
+                        return (util::ui64)2 << i;
+                    }
+                }
+            }
+            return 0;
+        }
+
+        PacketFilterStats::Shard::Shard () :
+                calls (0),
+                batchCalls (0),
+                packets (0),
+                forwarded (0),
+                dropped (0),
+                replaced (0),
+                exceptions (0),
+                inclusiveTime (0),
+                exclusiveTime (0) {
+            for (std::size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; ++i) {
+                histogram[i].store (0, std::memory_order_relaxed);
+            }
+        }
+
+        PacketFilterStats::Snapshot PacketFilterStats::GetSnapshot () const {
+            Snapshot snapshot;
+            for (std::size_t i = 0; i < SHARD_COUNT; ++i) {
+                const Shard &shard = shards[i];
+                snapshot.calls += shard.calls.load (std::memory_order_relaxed);
+                snapshot.batchCalls += shard.batchCalls.load (std::memory_order_relaxed);
+                snapshot.packets += shard.packets.load (std::memory_order_relaxed);
+                snapshot.forwarded += shard.forwarded.load (std::memory_order_relaxed);
+                snapshot.dropped += shard.dropped.load (std::memory_order_relaxed);
+                snapshot.replaced += shard.replaced.load (std::memory_order_relaxed);
+                snapshot.exceptions += shard.exceptions.load (std::memory_order_relaxed);
+                snapshot.inclusiveTime += shard.inclusiveTime.load (std::memory_order_relaxed);
+                snapshot.exclusiveTime += shard.exclusiveTime.load (std::memory_order_relaxed);
+                for (std::size_t j = 0; j < HISTOGRAM_BUCKET_COUNT; ++j) {
+                    snapshot.histogram[j] += shard.histogram[j].load (std::memory_order_relaxed);
+                }
+            }
+            return snapshot;
+        }
+
+        void PacketFilterStats::Reset () {
+            for (std::size_t i = 0; i < SHARD_COUNT; ++i) {
+                Shard &shard = shards[i];
+                shard.calls.store (0, std::memory_order_relaxed);
+                shard.batchCalls.store (0, std::memory_order_relaxed);
+                shard.packets.store (0, std::memory_order_relaxed);
+                shard.forwarded.store (0, std::memory_order_relaxed);
+                shard.dropped.store (0, std::memory_order_relaxed);
+                shard.replaced.store (0, std::memory_order_relaxed);
+                shard.exceptions.store (0, std::memory_order_relaxed);
+                shard.inclusiveTime.store (0, std::memory_order_relaxed);
+                shard.exclusiveTime.store (0, std::memory_order_relaxed);
+                for (std::size_t j = 0; j < HISTOGRAM_BUCKET_COUNT; ++j) {
+                    shard.histogram[j].store (0, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        Packet::SharedPtr PacketFilterStats::FilterPacket (
+                PacketFilter &filter,
+                Packet::SharedPtr packet) {
+            Shard &shard = GetShard ();
+            shard.calls.fetch_add (1, std::memory_order_relaxed);
+            shard.packets.fetch_add (1, std::memory_order_relaxed);
+            const Packet *original = packet.Get ();
+            Packet::SharedPtr result;
+            {
+                Timer timer;
+                try {
+                    result = filter.FilterPacket (std::move (packet));
+                }
+                catch (...) {
+                    timer.Stop ();
+                    shard.exceptions.fetch_add (1, std::memory_order_relaxed);
+                    RecordTime (shard, timer.inclusiveTime, timer.exclusiveTime);
+                    throw;
+                }
+                timer.Stop ();
+                RecordTime (shard, timer.inclusiveTime, timer.exclusiveTime);
+            }
+            if (result.Get () == 0) {
+                shard.dropped.fetch_add (1, std::memory_order_relaxed);
+            }
+            else if (result.Get () != original) {
+                shard.replaced.fetch_add (1, std::memory_order_relaxed);
+            }
+            return result;
+        }
+
+        void PacketFilterStats::FilterPackets (
+                PacketFilter &filter,
+                std::vector<Packet::SharedPtr> &packets) {
+            Shard &shard = GetShard ();
+            std::size_t count = packets.size ();
+            shard.batchCalls.fetch_add (1, std::memory_order_relaxed);
+            shard.packets.fetch_add (count, std::memory_order_relaxed);
+            {
+                Timer timer;
+                try {
+                    filter.FilterPackets (packets);
+                }
+                catch (...) {
+                    timer.Stop ();
+                    shard.exceptions.fetch_add (1, std::memory_order_relaxed);
+                    RecordTime (shard, timer.inclusiveTime, timer.exclusiveTime);
+                    throw;
+                }
+                timer.Stop ();
+                RecordTime (shard, timer.inclusiveTime, timer.exclusiveTime);
+            }
+            // Batches can be compacted (dropped packets) and grown
+            // (ex: reassembly completing several packets).
+            if (packets.size () < count) {
+                shard.dropped.fetch_add (count - packets.size (), std::memory_order_relaxed);
+            }
+        }
+
+        PacketFilterStats::Shard &PacketFilterStats::GetShard () {
+            return shards[shardIndex];
+        }
+
+        void PacketFilterStats::RecordTime (
+                Shard &shard,
+                util::ui64 inclusiveTime,
+                util::ui64 exclusiveTime) {
+            shard.inclusiveTime.fetch_add (inclusiveTime, std::memory_order_relaxed);
+            shard.exclusiveTime.fetch_add (exclusiveTime, std::memory_order_relaxed);
+            shard.histogram[GetBucket (exclusiveTime)].fetch_add (1, std::memory_order_relaxed);
+        }
+
+    } // namespace packet
+} // namespace thekogans
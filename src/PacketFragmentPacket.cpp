@@ -22,24 +22,30 @@
 namespace thekogans {
     namespace packet {
 
-        THEKOGANS_UTIL_IMPLEMENT_SERIALIZABLE (PacketFragmentPacket, 1)
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (PacketFragmentPacket, 2)
 
         void PacketFragmentPacket::Read (
-                const BinHeader & /*header*/,
+                const BinHeader &header,
                 util::Serializer &serializer) {
+            streamId = 0;
+            if (header.version >= 2) {
+                serializer >> streamId;
+            }
             serializer >> fragmentNumber >> fragmentCount >> *fragment;
         }
 
         void PacketFragmentPacket::Write (util::Serializer &serializer) const {
-            serializer << fragmentNumber << fragmentCount << fragment;
+            serializer << streamId << fragmentNumber << fragmentCount << fragment;
         }
 
+        const char * const PacketFragmentPacket::ATTR_STREAM_ID = "StreamId";
         const char * const PacketFragmentPacket::ATTR_FRAGMENT_NUMBER = "FragmentNumber";
         const char * const PacketFragmentPacket::ATTR_FRAGMENT_COUNT = "FragmentCount";
 
         void PacketFragmentPacket::Read (
                 const TextHeader & /*header*/,
                 const pugi::xml_node &node) {
+            streamId = (util::ui32)util::stringToui64 (node.attribute (ATTR_STREAM_ID).value ());
             fragmentNumber = util::stringToui64 (node.attribute (ATTR_FRAGMENT_NUMBER).value ());
             fragmentCount = util::stringToui64 (node.attribute (ATTR_FRAGMENT_COUNT).value ());
             const char *encodedFragment = node.text ().get ();
@@ -47,6 +53,8 @@ namespace thekogans {
         }
 
         void PacketFragmentPacket::Write (pugi::xml_node &node) const {
+            node.append_attribute (ATTR_STREAM_ID).set_value (
+                util::ui64Tostring (streamId).c_str ());
             node.append_attribute (ATTR_FRAGMENT_NUMBER).set_value (
                 util::ui64Tostring (fragmentNumber).c_str ());
             node.append_attribute (ATTR_FRAGMENT_COUNT).set_value (
@@ -19,6 +19,9 @@
     #include "thekogans/packet/ClientKeyExchangePacket.h"
     #include "thekogans/packet/ServerKeyExchangePacket.h"
     #include "thekogans/packet/PacketFragmentPacket.h"
+    #include "thekogans/packet/FECPacketFragmentPacket.h"
+    #include "thekogans/packet/SessionTicketPacket.h"
+    #include "thekogans/packet/ResumeSessionPacket.h"
     #include "thekogans/packet/Packets.h"
 #endif // defined (THEKOGANS_PACKET_TYPE_Static)
 
@@ -30,6 +33,9 @@ namespace thekogans {
             ClientKeyExchangePacket::StaticInit ();
             ServerKeyExchangePacket::StaticInit ();
             PacketFragmentPacket::StaticInit ();
+            FECPacketFragmentPacket::StaticInit ();
+            SessionTicketPacket::StaticInit ();
+            ResumeSessionPacket::StaticInit ();
         }
     #endif // defined (THEKOGANS_PACKET_TYPE_Static)
 
@@ -0,0 +1,54 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include "thekogans/util/RandomSource.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/PaddingPolicy.h"
+
+namespace thekogans {
+    namespace packet {
+
+        const PaddingPolicy &PaddingPolicy::GetDefault () {
+            // The default policy is never released.
+            static const PaddingPolicy *paddingPolicy = new UniformRandomPaddingPolicy;
+            return *paddingPolicy;
+        }
+
+        UniformRandomPaddingPolicy::UniformRandomPaddingPolicy (util::ui8 maxLength_) :
+                maxLength (maxLength_) {
+            if (maxLength == 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        util::ui8 UniformRandomPaddingPolicy::GetPaddingLength (
+                std::size_t /*plaintextLength*/) const {
+            return (util::ui8)(
+                util::RandomSource::Instance ()->Getui32 () % maxLength + 1);
+        }
+
+        BucketPaddingPolicy::BucketPaddingPolicy (std::size_t bucketSize_) :
+                bucketSize (bucketSize_) {
+            if (bucketSize == 0 || bucketSize > 256) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -15,6 +15,8 @@
 // You should have received a copy of the GNU General Public License
 // along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include "thekogans/util/Exception.h"
 #include "thekogans/packet/PacketFragmentPacket.h"
 #include "thekogans/packet/ReassemblePacketFragmentsPacketFilter.h"
 
@@ -25,26 +27,8 @@ namespace thekogans {
                 Packet::SharedPtr packet) {
             if (packet.Get () != 0) {
                 if (packet->Type () == PacketFragmentPacket::TYPE) {
-                    PacketFragmentPacket *packetFragment =
-                        static_cast<PacketFragmentPacket *> (packet.Get ());
-                    // reassemble the fragmented packet.
-                    if (packetFragment->fragmentCount > 1) {
-                        if (packetFragment->fragmentNumber == 1) {
-                            packetFragmentBuffer->Resize (
-                                packetFragment->fragmentCount * maxCiphertextLength);
-                        }
-                        packetFragmentBuffer->Write (
-                            packetFragment->fragment->GetReadPtr (),
-                            packetFragment->fragment->GetDataAvailableForReading ());
-                        if (packetFragment->fragmentNumber == packetFragment->fragmentCount) {
-                            packetFragment->fragment = packetFragmentBuffer;
-                        }
-                    }
-                    Packet::SharedPtr packet;
-                    if (packetFragment->fragmentNumber == packetFragment->fragmentCount) {
-                        *packetFragment->fragment >> packet;
-                    }
-                    return packet;
+                    return ReassemblePacketFragment (
+                        *static_cast<PacketFragmentPacket *> (packet.Get ()));
                 }
                 return CallNextPacketFilter (packet);
             }
@@ -54,5 +38,125 @@ namespace thekogans {
             }
         }
 
+        void ReassemblePacketFragmentsPacketFilter::FilterPackets (PacketBatch &packets) {
+            PacketBatch results;
+            results.reserve (packets.size ());
+            // Consecutive packets that are not fragments.
+            PacketBatch run;
+            for (std::size_t i = 0, count = packets.size (); i < count; ++i) {
+                Packet::SharedPtr &packet = packets[i];
+                if (packet.Get () != 0) {
+                    if (packet->Type () == PacketFragmentPacket::TYPE) {
+                        if (!run.empty ()) {
+                            CallNextPacketFilters (run);
+                            results.insert (results.end (), run.begin (), run.end ());
+                            run.clear ();
+                        }
+                        Packet::SharedPtr reassembledPacket = ReassemblePacketFragment (
+                            *static_cast<PacketFragmentPacket *> (packet.Get ()));
+                        if (reassembledPacket.Get () != 0) {
+                            results.push_back (std::move (reassembledPacket));
+                        }
+                    }
+                    else {
+                        run.push_back (std::move (packet));
+                    }
+                }
+                else {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                        THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+                }
+            }
+            if (!run.empty ()) {
+                CallNextPacketFilters (run);
+                results.insert (results.end (), run.begin (), run.end ());
+            }
+            packets.swap (results);
+        }
+
+        Packet::SharedPtr ReassemblePacketFragmentsPacketFilter::ReassemblePacketFragment (
+                PacketFragmentPacket &packetFragment) {
+            // reassemble the fragmented packet.
+            if (packetFragment.fragmentCount > 1) {
+                std::list<PendingPacket>::iterator it = pendingPackets.begin ();
+                while (it != pendingPackets.end () && it->streamId != packetFragment.streamId) {
+                    ++it;
+                }
+                if (packetFragment.fragmentNumber == 1) {
+                    // The peer picks fragmentCount, so don't let it
+                    // make us reassemble more than maxPacketLength.
+                    if (maxPacketLength > 0 &&
+                            packetFragment.fragmentCount > maxPacketLength / maxCiphertextLength) {
+                        if (it != pendingPackets.end ()) {
+                            pendingPackets.erase (it);
+                        }
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                            "Packet of " THEKOGANS_UTIL_SIZE_T_FORMAT " fragments on stream %u "
+                            "exceeds the maximum packet length (" THEKOGANS_UTIL_SIZE_T_FORMAT ").",
+                            (std::size_t)packetFragment.fragmentCount,
+                            packetFragment.streamId,
+                            maxPacketLength);
+                    }
+                    // A new packet on a stream replaces the one in progress.
+                    if (it != pendingPackets.end ()) {
+                        pendingPackets.erase (it);
+                    }
+                    else if (pendingPackets.size () >= maxPendingPackets) {
+                        // Give up on the oldest.
+                        pendingPackets.pop_front ();
+                    }
+                    it = pendingPackets.insert (
+                        pendingPackets.end (),
+                        PendingPacket (
+                            packetFragment.streamId,
+                            packetFragment.fragmentCount,
+                            util::Buffer::SharedPtr (
+                                new util::Buffer (endianness, maxCiphertextLength))));
+                }
+                else if (it == pendingPackets.end ()) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Fragment " THEKOGANS_UTIL_SIZE_T_FORMAT " of stream %u "
+                        "arrived without the first one.",
+                        (std::size_t)packetFragment.fragmentNumber,
+                        packetFragment.streamId);
+                }
+                if (packetFragment.fragmentCount != it->fragmentCount ||
+                        packetFragment.fragmentNumber != it->nextFragmentNumber ||
+                        packetFragment.fragment->GetDataAvailableForReading () > maxCiphertextLength) {
+                    pendingPackets.erase (it);
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Fragment " THEKOGANS_UTIL_SIZE_T_FORMAT " of " THEKOGANS_UTIL_SIZE_T_FORMAT
+                        " on stream %u is out of sequence or too long.",
+                        (std::size_t)packetFragment.fragmentNumber,
+                        (std::size_t)packetFragment.fragmentCount,
+                        packetFragment.streamId);
+                }
+                if (it->buffer->GetDataAvailableForWriting () <
+                        packetFragment.fragment->GetDataAvailableForReading ()) {
+                    // Grow geometrically, up to what the packet can take.
+                    it->buffer->Resize (
+                        std::min (
+                            2 * it->buffer->GetLength (),
+                            it->fragmentCount * maxCiphertextLength));
+                }
+                it->buffer->Write (
+                    packetFragment.fragment->GetReadPtr (),
+                    packetFragment.fragment->GetDataAvailableForReading ());
+                ++it->nextFragmentNumber;
+                if (packetFragment.fragmentNumber == packetFragment.fragmentCount) {
+                    packetFragment.fragment = it->buffer;
+                    pendingPackets.erase (it);
+                }
+            }
+            Packet::SharedPtr packet;
+            if (packetFragment.fragmentNumber == packetFragment.fragmentCount) {
+                *packetFragment.fragment >> packet;
+                if (packet.Get () != 0) {
+                    packet->streamId = packetFragment.streamId;
+                }
+            }
+            return packet;
+        }
+
     } // namespace packet
 } // namespace thekogans
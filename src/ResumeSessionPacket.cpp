@@ -0,0 +1,81 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include "thekogans/util/StringUtils.h"
+#include "thekogans/util/Base64.h"
+#include "thekogans/packet/ResumeSessionPacket.h"
+
+namespace thekogans {
+    namespace packet {
+
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (ResumeSessionPacket, 1)
+
+        void ResumeSessionPacket::Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) {
+            ticket.Reset (new util::Buffer (serializer.endianness));
+            serializer >> *ticket >> session;
+        }
+
+        void ResumeSessionPacket::Write (util::Serializer &serializer) const {
+            serializer << *ticket << session;
+        }
+
+        const char * const ResumeSessionPacket::ATTR_SESSION_ID = "SessionId";
+        const char * const ResumeSessionPacket::ATTR_INBOUND_SEQUENCE_NUMBER =
+            "InboundSequenceNumber";
+        const char * const ResumeSessionPacket::ATTR_OUTBOUND_SEQUENCE_NUMBER =
+            "OutboundSequenceNumber";
+
+        void ResumeSessionPacket::Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) {
+            session = Session (
+                util::GUID::FromString (node.attribute (ATTR_SESSION_ID).value ()),
+                util::stringToui64 (node.attribute (ATTR_INBOUND_SEQUENCE_NUMBER).value ()),
+                util::stringToui64 (node.attribute (ATTR_OUTBOUND_SEQUENCE_NUMBER).value ()));
+            const char *encodedTicket = node.text ().get ();
+            ticket = util::Base64::Decode (encodedTicket, strlen (encodedTicket));
+        }
+
+        void ResumeSessionPacket::Write (pugi::xml_node &node) const {
+            node.append_attribute (ATTR_SESSION_ID).set_value (
+                session.id.ToString ().c_str ());
+            node.append_attribute (ATTR_INBOUND_SEQUENCE_NUMBER).set_value (
+                util::ui64Tostring (session.inboundSequenceNumber).c_str ());
+            node.append_attribute (ATTR_OUTBOUND_SEQUENCE_NUMBER).set_value (
+                util::ui64Tostring (session.outboundSequenceNumber.load ()).c_str ());
+            node.append_child (pugi::node_pcdata).set_value (
+                util::Base64::Encode (
+                    ticket->GetReadPtr (),
+                    ticket->GetDataAvailableForReading ())->Tostring ().c_str ());
+        }
+
+        void ResumeSessionPacket::Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object & /*object*/) {
+            // FIXME: implement
+            assert (0);
+        }
+
+        void ResumeSessionPacket::Write (util::JSON::Object & /*object*/) const {
+            // FIXME: implement
+            assert (0);
+        }
+
+    } // namespace packet
+} // namespace thekogans
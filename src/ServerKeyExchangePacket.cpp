@@ -20,7 +20,7 @@
 namespace thekogans {
     namespace packet {
 
-        THEKOGANS_UTIL_IMPLEMENT_SERIALIZABLE (ServerKeyExchangePacket, 1)
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (ServerKeyExchangePacket, 1)
 
         void ServerKeyExchangePacket::Read (
                 const BinHeader & /*header*/,
@@ -15,24 +15,151 @@
 // You should have received a copy of the GNU General Public License
 // along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
 
+#include <cstring>
 #include "thekogans/util/RandomSource.h"
+#include "thekogans/util/Exception.h"
 #include "thekogans/packet/Session.h"
 
 namespace thekogans {
     namespace packet {
 
+        namespace {
+            // Return the number of words (a power of 2) in the replay window
+            // ring. One word more than the window is needed, as the newest
+            // word is only partially filled (RFC 6479).
+            inline util::ui64 GetReplayWindowWordCount (util::ui32 replayWindowSize) {
+                util::ui64 wordCount = 2;
+                while ((wordCount - 1) * 64 < replayWindowSize) {
+                    wordCount <<= 1;
+                }
+                return wordCount;
+            }
+        }
+
+        Session::Session (const Session &session) :
+                id (session.id),
+                inboundSequenceNumber (session.inboundSequenceNumber),
+                outboundSequenceNumber (
+                    session.outboundSequenceNumber.load (std::memory_order_relaxed)),
+                replayWindowSize (session.replayWindowSize),
+                compactHeader (session.compactHeader) {
+            memcpy (replayWindow, session.replayWindow, sizeof (replayWindow));
+        }
+
+        Session &Session::operator = (const Session &session) {
+            if (&session != this) {
+                id = session.id;
+                inboundSequenceNumber = session.inboundSequenceNumber;
+                outboundSequenceNumber.store (
+                    session.outboundSequenceNumber.load (std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+                replayWindowSize = session.replayWindowSize;
+                compactHeader = session.compactHeader;
+                memcpy (replayWindow, session.replayWindow, sizeof (replayWindow));
+            }
+            return *this;
+        }
+
+        void Session::SetReplayWindowSize (util::ui32 replayWindowSize_) {
+            if (replayWindowSize_ <= MAX_REPLAY_WINDOW_SIZE) {
+                replayWindowSize = replayWindowSize_;
+                ResetReplayWindow ();
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void Session::ResetReplayWindow () {
+            // Everything up to and including the newest
+            // (inboundSequenceNumber - 1) counts as received.
+            for (std::size_t i = 0; i < MAX_REPLAY_WINDOW_WORD_COUNT; ++i) {
+                replayWindow[i] = ~(util::ui64)0;
+            }
+            if (replayWindowSize > 0) {
+                util::ui64 newest = inboundSequenceNumber - 1;
+                util::ui64 bit = newest & 63;
+                if (bit < 63) {
+                    replayWindow[(newest >> 6) &
+                        (GetReplayWindowWordCount (replayWindowSize) - 1)] =
+                            ((util::ui64)1 << (bit + 1)) - 1;
+                }
+            }
+        }
+
         bool Session::VerifyInboundHeader (const Header &header) {
-            if (header.id == id && header.sequenceNumber == inboundSequenceNumber) {
-                ++inboundSequenceNumber;
-                return true;
+            if (header.id == id) {
+                if (replayWindowSize == 0) {
+                    if (header.sequenceNumber == inboundSequenceNumber) {
+                        ++inboundSequenceNumber;
+                        return true;
+                    }
+                }
+                else {
+                    // Sequence numbers start at random, so all
+                    // arithmetic is modulo 2^64.
+                    util::ui64 wordMask = GetReplayWindowWordCount (replayWindowSize) - 1;
+                    util::ui64 newest = inboundSequenceNumber - 1;
+                    util::ui64 ahead = header.sequenceNumber - newest;
+                    if (ahead != 0 && ahead < (util::ui64)1 << 63) {
+                        // Newer than anything seen. Clear the words
+                        // the window slides in to.
+                        util::ui64 wordsAhead =
+                            ((header.sequenceNumber >> 6) - (newest >> 6)) &
+                                (((util::ui64)1 << 58) - 1);
+                        if (wordsAhead > wordMask) {
+                            wordsAhead = wordMask + 1;
+                        }
+                        for (util::ui64 i = 1; i <= wordsAhead; ++i) {
+                            replayWindow[((newest >> 6) + i) & wordMask] = 0;
+                        }
+                        inboundSequenceNumber = header.sequenceNumber + 1;
+                    }
+                    else if (newest - header.sequenceNumber >= replayWindowSize) {
+                        // Too old.
+                        return false;
+                    }
+                    util::ui64 &word = replayWindow[(header.sequenceNumber >> 6) & wordMask];
+                    util::ui64 bit = (util::ui64)1 << (header.sequenceNumber & 63);
+                    if ((word & bit) == 0) {
+                        word |= bit;
+                        return true;
+                    }
+                }
             }
             return false;
         }
 
+        Session::Header Session::GetInboundHeader (
+                util::ui32 truncatedSequenceNumber) const {
+            // RFC 4303, Appendix A2.2. T is the newest sequence number
+            // seen (strict mode: one before the next expected), W the
+            // window size.
+            util::ui64 newest = inboundSequenceNumber - 1;
+            util::ui32 Tl = (util::ui32)newest;
+            util::ui32 Th = (util::ui32)(newest >> 32);
+            util::ui32 W = replayWindowSize > 0 ? replayWindowSize : 1;
+            util::ui32 bottom = Tl - W + 1;
+            util::ui32 Seqh;
+            if (Tl >= W - 1) {
+                // Window is within one sequence number subspace.
+                Seqh = truncatedSequenceNumber >= bottom ? Th : Th + 1;
+            }
+            else {
+                // Window spans two sequence number subspaces.
+                Seqh = truncatedSequenceNumber >= bottom ? Th - 1 : Th;
+            }
+            return Header (id, ((util::ui64)Seqh << 32) | truncatedSequenceNumber);
+        }
+
         void Session::Reset () {
             id = util::GUID::FromRandom ();
             inboundSequenceNumber = util::RandomSource::Instance ()->Getui64 ();
-            outboundSequenceNumber = util::RandomSource::Instance ()->Getui64 ();
+            outboundSequenceNumber.store (
+                util::RandomSource::Instance ()->Getui64 (),
+                std::memory_order_relaxed);
+            ResetReplayWindow ();
         }
 
     } // namespace packet
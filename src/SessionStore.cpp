@@ -0,0 +1,292 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include "thekogans/util/Environment.h"
+
+#if !defined (TOOLCHAIN_OS_Windows)
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <atomic>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/SessionStore.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            enum {
+                MAGIC = 0x53535354, // 'SSST'
+                VERSION = 1,
+                CACHE_LINE_SIZE = 64
+            };
+
+            struct FileHeader {
+                util::ui32 magic;
+                util::ui32 version;
+                util::ui64 capacity;
+                util::ui32 slotSize;
+                util::ui32 clean;
+            };
+
+            enum {
+                SLOT_STATE_FREE,
+                SLOT_STATE_USED
+            };
+
+            struct Slot {
+                util::ui32 state;
+                // Odd while the slot is being written. A slot torn by
+                // a crash mid write is skipped on Load.
+                util::ui32 writeCount;
+                util::ui8 id[util::GUID_SIZE];
+                util::ui64 inboundSequenceNumber;
+                util::ui64 outboundSequenceNumber;
+                util::ui32 replayWindowSize;
+                util::ui32 compactHeader;
+            };
+
+            // Header and slots are padded to cache lines, so
+            // that concurrent saves don't share lines.
+            inline std::size_t RoundUp (std::size_t size) {
+                return (size + CACHE_LINE_SIZE - 1) & ~(std::size_t)(CACHE_LINE_SIZE - 1);
+            }
+
+            inline FileHeader &GetFileHeader (util::ui8 *data) {
+                return *reinterpret_cast<FileHeader *> (data);
+            }
+
+            inline Slot &GetSlot (
+                    util::ui8 *data,
+                    std::size_t index) {
+                return *reinterpret_cast<Slot *> (
+                    data + RoundUp (sizeof (FileHeader)) + index * RoundUp (sizeof (Slot)));
+            }
+        }
+
+        SessionStore::SessionStore (
+                const std::string &path_,
+                std::size_t capacity_,
+                util::ui64 outboundLeaseMargin_,
+                bool allowZeroLeaseMargin) :
+                path (path_),
+                handle (-1),
+                data (0),
+                size (0),
+                capacity (capacity_),
+                outboundLeaseMargin (outboundLeaseMargin_),
+                cleanShutdown (false) {
+            if (path.empty () || capacity == 0 ||
+                    (outboundLeaseMargin == 0 && !allowZeroLeaseMargin)) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            handle = open (path.c_str (), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+            if (handle == -1) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            struct stat buf;
+            if (fstat (handle, &buf) == -1) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (handle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            bool created = buf.st_size == 0;
+            if (!created) {
+                // Existing store. It keeps it's original capacity.
+                FileHeader fileHeader;
+                if ((std::size_t)buf.st_size < sizeof (fileHeader) ||
+                        pread (handle, &fileHeader, sizeof (fileHeader), 0) !=
+                            (ssize_t)sizeof (fileHeader) ||
+                        fileHeader.magic != MAGIC ||
+                        fileHeader.version != VERSION ||
+                        fileHeader.slotSize != RoundUp (sizeof (Slot)) ||
+                        (std::size_t)buf.st_size != RoundUp (sizeof (FileHeader)) +
+                            fileHeader.capacity * RoundUp (sizeof (Slot))) {
+                    close (handle);
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "%s is not a session store.", path.c_str ());
+                }
+                capacity = (std::size_t)fileHeader.capacity;
+            }
+            size = RoundUp (sizeof (FileHeader)) + capacity * RoundUp (sizeof (Slot));
+            if (created && ftruncate (handle, (off_t)size) == -1) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (handle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            void *address = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+            if (address == MAP_FAILED) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (handle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            data = (util::ui8 *)address;
+            FileHeader &fileHeader = GetFileHeader (data);
+            if (created) {
+                // ftruncate zero fills, so all slots are free.
+                fileHeader.magic = MAGIC;
+                fileHeader.version = VERSION;
+                fileHeader.capacity = capacity;
+                fileHeader.slotSize = RoundUp (sizeof (Slot));
+                cleanShutdown = true;
+            }
+            else {
+                cleanShutdown = fileHeader.clean != 0;
+            }
+            // Dirty until Close. Make sure the flag is on disk before any
+            // session is handed out, or a crash could leave the file looking
+            // clean with leases it never recorded.
+            fileHeader.clean = 0;
+            if (msync (data, RoundUp (sizeof (FileHeader)), MS_SYNC) == -1) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                munmap (data, size);
+                close (handle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            for (std::size_t i = capacity; i-- > 0;) {
+                Slot &slot = GetSlot (data, i);
+                if (slot.state == SLOT_STATE_USED && (slot.writeCount & 1) == 0) {
+                    util::GUID id;
+                    memcpy (id.data, slot.id, util::GUID_SIZE);
+                    slots[id] = i;
+                }
+                else {
+                    slot.state = SLOT_STATE_FREE;
+                    freeSlots.push_back (i);
+                }
+            }
+        }
+
+        SessionStore::~SessionStore () {
+            Close ();
+        }
+
+        bool SessionStore::Save (const Session &session) {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            if (data != 0) {
+                std::map<util::GUID, std::size_t>::const_iterator it = slots.find (session.id);
+                if (it != slots.end ()) {
+                    WriteSlot (it->second, session);
+                    return true;
+                }
+                if (!freeSlots.empty ()) {
+                    std::size_t index = freeSlots.back ();
+                    freeSlots.pop_back ();
+                    slots[session.id] = index;
+                    WriteSlot (index, session);
+                    return true;
+                }
+                return false;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool SessionStore::Erase (const util::GUID &id) {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            if (data != 0) {
+                std::map<util::GUID, std::size_t>::iterator it = slots.find (id);
+                if (it != slots.end ()) {
+                    GetSlot (data, it->second).state = SLOT_STATE_FREE;
+                    freeSlots.push_back (it->second);
+                    slots.erase (it);
+                    return true;
+                }
+                return false;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void SessionStore::Load (std::vector<Session> &sessions) const {
+            util::LockGuard<util::SpinLock> guard (const_cast<util::SpinLock &> (spinLock));
+            if (data != 0) {
+                sessions.reserve (sessions.size () + slots.size ());
+                for (std::map<util::GUID, std::size_t>::const_iterator
+                        it = slots.begin (),
+                        end = slots.end (); it != end; ++it) {
+                    const Slot &slot = GetSlot (data, it->second);
+                    Session session (
+                        it->first,
+                        slot.inboundSequenceNumber,
+                        slot.outboundSequenceNumber,
+                        slot.replayWindowSize);
+                    session.compactHeader = slot.compactHeader != 0;
+                    sessions.push_back (session);
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void SessionStore::Sync (bool wait) {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            if (data != 0) {
+                if (msync (data, size, wait ? MS_SYNC : MS_ASYNC) == -1) {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                        THEKOGANS_UTIL_OS_ERROR_CODE);
+                }
+            }
+        }
+
+        void SessionStore::Close () {
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            if (data != 0) {
+                msync (data, size, MS_SYNC);
+                GetFileHeader (data).clean = 1;
+                msync (data, size, MS_SYNC);
+                munmap (data, size);
+                data = 0;
+                close (handle);
+                handle = -1;
+            }
+        }
+
+        void SessionStore::WriteSlot (
+                std::size_t index,
+                const Session &session) {
+            Slot &slot = GetSlot (data, index);
+            ++slot.writeCount;
+            std::atomic_signal_fence (std::memory_order_seq_cst);
+            slot.state = SLOT_STATE_USED;
+            memcpy (slot.id, session.id.data, util::GUID_SIZE);
+            slot.inboundSequenceNumber = session.inboundSequenceNumber;
+            slot.outboundSequenceNumber =
+                session.outboundSequenceNumber.load (std::memory_order_relaxed) +
+                outboundLeaseMargin;
+            slot.replayWindowSize = session.replayWindowSize;
+            slot.compactHeader = session.compactHeader ? 1 : 0;
+            std::atomic_signal_fence (std::memory_order_seq_cst);
+            ++slot.writeCount;
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // !defined (TOOLCHAIN_OS_Windows)
@@ -0,0 +1,233 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include <new>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/RandomSource.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/SessionTable.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            inline std::size_t NextPowerOf2 (std::size_t value) {
+                std::size_t powerOf2 = 1;
+                while (powerOf2 < value) {
+                    powerOf2 <<= 1;
+                }
+                return powerOf2;
+            }
+        }
+
+        SessionTable::SessionTable (
+                std::size_t maxSessionCount,
+                std::size_t shardCount) :
+                seed (util::RandomSource::Instance ()->Getui64 ()),
+                maxShardSessionCount (0),
+                shards (NextPowerOf2 (shardCount)) {
+            if (maxSessionCount > 0 && shardCount > 0) {
+                // Keep the load factor at or below 3/4 so that
+                // linear probe sequences stay short. Add a little
+                // slack for uneven distribution between shards.
+                maxShardSessionCount =
+                    (maxSessionCount + shards.size () - 1) / shards.size ();
+                maxShardSessionCount += maxShardSessionCount / 8 + 1;
+                std::size_t shardEntryCount =
+                    NextPowerOf2 (maxShardSessionCount + maxShardSessionCount / 3 + 1);
+                storage.resize (
+                    shards.size () * shardEntryCount * ENTRY_SIZE + CACHE_LINE_SIZE);
+                util::ui8 *entries = &storage[0];
+                std::size_t misalignment = (std::size_t)entries & (CACHE_LINE_SIZE - 1);
+                if (misalignment != 0) {
+                    entries += CACHE_LINE_SIZE - misalignment;
+                }
+                for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                    Shard &shard = shards[i];
+                    shard.entries = entries;
+                    shard.mask = shardEntryCount - 1;
+                    for (std::size_t j = 0; j < shardEntryCount; ++j) {
+                        new (&shard.GetEntry (j)) Entry;
+                    }
+                    entries += shardEntryCount * ENTRY_SIZE;
+                }
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        SessionTable::~SessionTable () {
+            for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                Shard &shard = shards[i];
+                for (std::size_t j = 0; j <= shard.mask; ++j) {
+                    shard.GetEntry (j).~Entry ();
+                }
+            }
+        }
+
+        std::size_t SessionTable::GetMemorySize () const {
+            return sizeof (*this) +
+                shards.size () * sizeof (Shard) +
+                storage.size ();
+        }
+
+        std::size_t SessionTable::GetSize () const {
+            std::size_t size = 0;
+            for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                Shard &shard = const_cast<Shard &> (shards[i]);
+                util::LockGuard<util::SpinLock> guard (shard.spinLock);
+                size += shard.count;
+            }
+            return size;
+        }
+
+        bool SessionTable::Insert (const Session &session) {
+            util::ui64 hash = Hash (session.id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            if (shard.count < maxShardSessionCount) {
+                for (std::size_t index = GetHomeIndex (shard, hash);;
+                        index = (index + 1) & shard.mask) {
+                    Entry &entry = shard.GetEntry (index);
+                    if (!entry.occupied) {
+                        entry.occupied = true;
+                        entry.session = session;
+                        ++shard.count;
+                        return true;
+                    }
+                    if (entry.session.id == session.id) {
+                        break;
+                    }
+                }
+            }
+            return false;
+        }
+
+        bool SessionTable::Update (const Session &session) {
+            util::ui64 hash = Hash (session.id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            Entry *entry = FindEntry (shard, hash, session.id);
+            if (entry != 0) {
+                entry->session = session;
+                return true;
+            }
+            return false;
+        }
+
+        bool SessionTable::Erase (const util::GUID &id) {
+            util::ui64 hash = Hash (id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            Entry *entry = FindEntry (shard, hash, id);
+            if (entry != 0) {
+                // Backward shift deletion: move later entries of the
+                // probe sequence in to the hole, so that lookups never
+                // need to skip over deleted entries.
+                std::size_t hole = (std::size_t)(
+                    (reinterpret_cast<util::ui8 *> (entry) - shard.entries) / ENTRY_SIZE);
+                for (std::size_t index = (hole + 1) & shard.mask;;
+                        index = (index + 1) & shard.mask) {
+                    Entry &next = shard.GetEntry (index);
+                    if (!next.occupied) {
+                        break;
+                    }
+                    std::size_t home = GetHomeIndex (shard, Hash (next.session.id));
+                    // Can next move to hole without ending up before it's home?
+                    if (((index - home) & shard.mask) >= ((index - hole) & shard.mask)) {
+                        shard.GetEntry (hole).session = next.session;
+                        hole = index;
+                    }
+                }
+                shard.GetEntry (hole).occupied = false;
+                --shard.count;
+                return true;
+            }
+            return false;
+        }
+
+        bool SessionTable::Find (
+                const util::GUID &id,
+                Session &session) const {
+            util::ui64 hash = Hash (id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            Entry *entry = FindEntry (shard, hash, id);
+            if (entry != 0) {
+                session = entry->session;
+                return true;
+            }
+            return false;
+        }
+
+        bool SessionTable::VerifyInboundHeader (const Session::Header &header) {
+            util::ui64 hash = Hash (header.id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            Entry *entry = FindEntry (shard, hash, header.id);
+            return entry != 0 && entry->session.VerifyInboundHeader (header);
+        }
+
+        bool SessionTable::GetOutboundHeader (
+                const util::GUID &id,
+                Session::Header &header) {
+            util::ui64 hash = Hash (id);
+            Shard &shard = GetShard (hash);
+            util::LockGuard<util::SpinLock> guard (shard.spinLock);
+            Entry *entry = FindEntry (shard, hash, id);
+            if (entry != 0) {
+                header = entry->session.GetOutboundHeader ();
+                return true;
+            }
+            return false;
+        }
+
+        util::ui64 SessionTable::Hash (const util::GUID &id) const {
+            util::ui64 lo;
+            util::ui64 hi;
+            memcpy (&lo, id.data, sizeof (lo));
+            memcpy (&hi, id.data + sizeof (lo), sizeof (hi));
+            // MurmurHash3 fmix64.
+            util::ui64 hash = lo ^ (hi * 0x9e3779b97f4a7c15ULL) ^ seed;
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdULL;
+            hash ^= hash >> 33;
+            hash *= 0xc4ceb9fe1a85ec53ULL;
+            hash ^= hash >> 33;
+            return hash;
+        }
+
+        SessionTable::Entry *SessionTable::FindEntry (
+                const Shard &shard,
+                util::ui64 hash,
+                const util::GUID &id) {
+            for (std::size_t index = GetHomeIndex (shard, hash);;
+                    index = (index + 1) & shard.mask) {
+                Entry &entry = shard.GetEntry (index);
+                if (!entry.occupied) {
+                    return 0;
+                }
+                if (entry.session.id == id) {
+                    return &entry;
+                }
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,191 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <ctime>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/crypto/FrameHeader.h"
+#include "thekogans/packet/SessionTicket.h"
+
+namespace thekogans {
+    namespace packet {
+
+        std::size_t SessionTicket::Size () const {
+            return
+                util::UI16_SIZE + // VERSION
+                id.Size () +
+                util::Serializer::Size (expiration) +
+                util::Serializer::Size (cipherSuite) +
+                key->GetSize () +
+                session.Size ();
+        }
+
+        util::Buffer::SharedPtr SessionTicket::Seal (crypto::Cipher &ticketCipher) const {
+            util::Buffer plaintext (util::NetworkEndian, Size ());
+            plaintext << *this;
+            return ticketCipher.EncryptAndFrame (
+                plaintext.GetReadPtr (),
+                plaintext.GetDataAvailableForReading ());
+        }
+
+        void SessionTicket::Unseal (
+                util::Buffer &ciphertext,
+                crypto::Cipher &ticketCipher) {
+            util::Buffer::SharedPtr plaintext = ticketCipher.Decrypt (
+                ciphertext.GetReadPtr (),
+                ciphertext.GetDataAvailableForReading ());
+            *plaintext >> *this;
+        }
+
+        _LIB_THEKOGANS_PACKET_DECL util::Serializer & _LIB_THEKOGANS_PACKET_API operator << (
+                util::Serializer &serializer,
+                const SessionTicket &sessionTicket) {
+            serializer <<
+                (util::ui16)SessionTicket::VERSION <<
+                sessionTicket.id <<
+                sessionTicket.expiration <<
+                sessionTicket.cipherSuite <<
+                *sessionTicket.key <<
+                sessionTicket.session;
+            return serializer;
+        }
+
+        _LIB_THEKOGANS_PACKET_DECL util::Serializer & _LIB_THEKOGANS_PACKET_API operator >> (
+                util::Serializer &serializer,
+                SessionTicket &sessionTicket) {
+            util::ui16 version;
+            serializer >> version;
+            if (version == SessionTicket::VERSION) {
+                serializer >>
+                    sessionTicket.id >>
+                    sessionTicket.expiration >>
+                    sessionTicket.cipherSuite >>
+                    sessionTicket.key >>
+                    sessionTicket.session;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "Unsupported session ticket version: %u.",
+                    version);
+            }
+            return serializer;
+        }
+
+        SessionTicketManager::SessionTicketManager (
+                CipherPool::SharedPtr ticketCipher_,
+                util::ui32 ticketLifetime_,
+                std::size_t maxRedeemedTickets_) :
+                ticketCipher (ticketCipher_),
+                ticketLifetime (ticketLifetime_),
+                maxRedeemedTickets (maxRedeemedTickets_) {
+            if (ticketCipher.Get () == 0 || ticketLifetime == 0 || maxRedeemedTickets == 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void SessionTicketManager::RotateTicketCipher (
+                CipherPool::SharedPtr ticketCipher_) {
+            if (ticketCipher_.Get () != 0) {
+                util::LockGuard<util::SpinLock> guard (spinLock);
+                previousTicketCipher = ticketCipher;
+                ticketCipher = ticketCipher_;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        util::Buffer::SharedPtr SessionTicketManager::IssueTicket (
+                const std::string &cipherSuite,
+                crypto::SymmetricKey::SharedPtr key,
+                const Session &session) {
+            if (key.Get () != 0) {
+                CipherPool::SharedPtr cipherPool;
+                {
+                    util::LockGuard<util::SpinLock> guard (spinLock);
+                    cipherPool = ticketCipher;
+                }
+                CipherPool::Lease cipher (*cipherPool);
+                return SessionTicket (
+                    util::GUID::FromRandom (),
+                    (util::ui64)time (0) + ticketLifetime,
+                    cipherSuite,
+                    key,
+                    session).Seal (*cipher);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool SessionTicketManager::RedeemTicket (
+                const util::Buffer &sealedTicket,
+                SessionTicket &ticket) {
+            util::Buffer ciphertext (
+                util::NetworkEndian,
+                sealedTicket.GetReadPtr (),
+                sealedTicket.GetReadPtr () + sealedTicket.GetDataAvailableForReading ());
+            crypto::FrameHeader frameHeader;
+            ciphertext >> frameHeader;
+            if (frameHeader.ciphertextLength != ciphertext.GetDataAvailableForReading ()) {
+                return false;
+            }
+            CipherPool::SharedPtr cipherPool;
+            {
+                util::LockGuard<util::SpinLock> guard (spinLock);
+                if (ticketCipher->GetKey ()->GetId () == frameHeader.keyId) {
+                    cipherPool = ticketCipher;
+                }
+                else if (previousTicketCipher.Get () != 0 &&
+                        previousTicketCipher->GetKey ()->GetId () == frameHeader.keyId) {
+                    cipherPool = previousTicketCipher;
+                }
+            }
+            if (cipherPool.Get () == 0) {
+                return false;
+            }
+            {
+                // Decrypt outside the lock, with a context of our own.
+                CipherPool::Lease cipher (*cipherPool);
+                ticket.Unseal (ciphertext, *cipher);
+            }
+            util::ui64 now = (util::ui64)time (0);
+            if (ticket.expiration <= now) {
+                return false;
+            }
+            util::LockGuard<util::SpinLock> guard (spinLock);
+            // Forget tickets that have expired, as they can't
+            // be redeemed again anyway.
+            while (!redeemedTicketExpirations.empty () &&
+                    redeemedTicketExpirations.begin ()->first <= now) {
+                redeemedTickets.erase (redeemedTicketExpirations.begin ()->second);
+                redeemedTicketExpirations.erase (redeemedTicketExpirations.begin ());
+            }
+            if (redeemedTickets.size () < maxRedeemedTickets &&
+                    redeemedTickets.insert (ticket.id).second) {
+                redeemedTicketExpirations.insert (
+                    std::multimap<util::ui64, util::GUID>::value_type (
+                        ticket.expiration, ticket.id));
+                return true;
+            }
+            return false;
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,70 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include <cstring>
+#include "thekogans/util/StringUtils.h"
+#include "thekogans/util/Base64.h"
+#include "thekogans/packet/SessionTicketPacket.h"
+
+namespace thekogans {
+    namespace packet {
+
+        THEKOGANS_PACKET_IMPLEMENT_PACKET (SessionTicketPacket, 1)
+
+        void SessionTicketPacket::Read (
+                const BinHeader & /*header*/,
+                util::Serializer &serializer) {
+            ticket.Reset (new util::Buffer (serializer.endianness));
+            serializer >> *ticket >> lifetime;
+        }
+
+        void SessionTicketPacket::Write (util::Serializer &serializer) const {
+            serializer << *ticket << lifetime;
+        }
+
+        const char * const SessionTicketPacket::ATTR_LIFETIME = "Lifetime";
+
+        void SessionTicketPacket::Read (
+                const TextHeader & /*header*/,
+                const pugi::xml_node &node) {
+            lifetime = (util::ui32)util::stringToui64 (node.attribute (ATTR_LIFETIME).value ());
+            const char *encodedTicket = node.text ().get ();
+            ticket = util::Base64::Decode (encodedTicket, strlen (encodedTicket));
+        }
+
+        void SessionTicketPacket::Write (pugi::xml_node &node) const {
+            node.append_attribute (ATTR_LIFETIME).set_value (
+                util::ui64Tostring (lifetime).c_str ());
+            node.append_child (pugi::node_pcdata).set_value (
+                util::Base64::Encode (
+                    ticket->GetReadPtr (),
+                    ticket->GetDataAvailableForReading ())->Tostring ().c_str ());
+        }
+
+        void SessionTicketPacket::Read (
+                const TextHeader & /*header*/,
+                const util::JSON::Object & /*object*/) {
+            // FIXME: implement
+            assert (0);
+        }
+
+        void SessionTicketPacket::Write (util::JSON::Object & /*object*/) const {
+            // FIXME: implement
+            assert (0);
+        }
+
+    } // namespace packet
+} // namespace thekogans
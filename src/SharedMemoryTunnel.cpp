@@ -0,0 +1,525 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/NullAllocator.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/SharedMemoryTunnel.h"
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            // Channel memory layout:
+            // | header | ring 0 | ring 0 data | ring 1 | ring 1 data |
+            // End 0 produces ring 0 and consumes ring 1. End 1 the reverse.
+            struct ChannelHeader {
+                util::ui64 magic;
+                util::ui64 capacity;
+                util::ui8 pad[48];
+            };
+
+            const util::ui64 CHANNEL_MAGIC = 0x746b70736d656d31ULL;
+
+            inline std::size_t GetRingOffset (
+                    std::size_t index,
+                    std::size_t ringLength) {
+                return sizeof (ChannelHeader) + index * ringLength;
+            }
+
+            template<typename T>
+            inline T LoadAcquire (const T *value) {
+                return __atomic_load_n (value, __ATOMIC_ACQUIRE);
+            }
+
+            template<typename T>
+            inline void StoreRelease (
+                    T *value,
+                    T newValue) {
+                __atomic_store_n (value, newValue, __ATOMIC_RELEASE);
+            }
+
+            // Set a waiting flag (or publish an index) and look at the other
+            // side's state. The full fence keeps the store and the load from
+            // being reordered (the other side does the mirror image), so at
+            // least one side sees the other and no wakeup is lost.
+            inline void FullFence () {
+                __atomic_thread_fence (__ATOMIC_SEQ_CST);
+            }
+        }
+
+        SharedMemoryTunnel::Channel::Channel () :
+                memoryHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+            eventHandles[0] = eventHandles[1] = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+        }
+
+        SharedMemoryTunnel::Channel::Channel (std::size_t capacity) :
+                memoryHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+            eventHandles[0] = eventHandles[1] = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            std::size_t ringLength = sizeof (Ring) + capacity;
+            std::size_t memoryLength = GetRingOffset (2, ringLength);
+            memoryHandle = memfd_create ("thekogans_packet_channel", MFD_CLOEXEC);
+            void *memory = MAP_FAILED;
+            if (memoryHandle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE &&
+                    ftruncate (memoryHandle, (off_t)memoryLength) == 0) {
+                memory = mmap (0, memoryLength, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, memoryHandle, 0);
+            }
+            if (memory != MAP_FAILED) {
+                eventHandles[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+                eventHandles[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+            }
+            if (eventHandles[0] == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    eventHandles[1] == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                if (memory != MAP_FAILED) {
+                    munmap (memory, memoryLength);
+                }
+                Close ();
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            // The memfd comes zeroed. Both consumers start out waiting,
+            // so that the first frame produced wakes them up.
+            ChannelHeader *header = (ChannelHeader *)memory;
+            header->magic = CHANNEL_MAGIC;
+            header->capacity = capacity;
+            for (std::size_t i = 0; i < 2; ++i) {
+                ((Ring *)((util::ui8 *)memory + GetRingOffset (i, ringLength)))->readerWaiting = 1;
+            }
+            munmap (memory, memoryLength);
+        }
+
+        SharedMemoryTunnel::Channel::~Channel () {
+            Close ();
+        }
+
+        void SharedMemoryTunnel::Channel::Send (THEKOGANS_UTIL_HANDLE socket) const {
+            int handles[3] = {memoryHandle, eventHandles[0], eventHandles[1]};
+            char byte = 0;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = sizeof (byte);
+            union {
+                char buffer[CMSG_SPACE (sizeof (handles))];
+                cmsghdr align;
+            } control;
+            memset (&control, 0, sizeof (control));
+            msghdr message;
+            memset (&message, 0, sizeof (message));
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof (control.buffer);
+            cmsghdr *cmsg = CMSG_FIRSTHDR (&message);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN (sizeof (handles));
+            memcpy (CMSG_DATA (cmsg), handles, sizeof (handles));
+            if (sendmsg (socket, &message, MSG_NOSIGNAL) != sizeof (byte)) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+        void SharedMemoryTunnel::Channel::Receive (THEKOGANS_UTIL_HANDLE socket) {
+            int handles[3];
+            char byte;
+            iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = sizeof (byte);
+            union {
+                char buffer[CMSG_SPACE (sizeof (handles))];
+                cmsghdr align;
+            } control;
+            msghdr message;
+            memset (&message, 0, sizeof (message));
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof (control.buffer);
+            if (recvmsg (socket, &message, MSG_CMSG_CLOEXEC) != sizeof (byte)) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            cmsghdr *cmsg = CMSG_FIRSTHDR (&message);
+            if (cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS ||
+                    cmsg->cmsg_len != CMSG_LEN (sizeof (handles))) {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION ("%s", "Malformed channel message.");
+            }
+            memcpy (handles, CMSG_DATA (cmsg), sizeof (handles));
+            Close ();
+            memoryHandle = handles[0];
+            eventHandles[0] = handles[1];
+            eventHandles[1] = handles[2];
+        }
+
+        void SharedMemoryTunnel::Channel::Close () {
+            if (memoryHandle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                close (memoryHandle);
+                memoryHandle = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            }
+            for (std::size_t i = 0; i < 2; ++i) {
+                if (eventHandles[i] != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                    close (eventHandles[i]);
+                    eventHandles[i] = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+                }
+            }
+        }
+
+        SharedMemoryTunnel::SharedMemoryTunnel (
+                const Channel &channel,
+                std::size_t end,
+                TunnelEventLoop &eventLoop_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session,
+                std::size_t maxCiphertextLength,
+                std::size_t highWaterMark_,
+                std::size_t lowWaterMark_,
+                PaddingPolicy::SharedPtr paddingPolicy,
+                bool compress) :
+                Tunnel (keyRing, eventSink, session, paddingPolicy, compress),
+                eventLoop (eventLoop_),
+                started (false),
+                localEventHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE),
+                remoteEventHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE),
+                memory ((util::ui8 *)MAP_FAILED),
+                memoryLength (0),
+                capacity (0),
+                incoming (0),
+                incomingData (0),
+                outgoing (0),
+                outgoingData (0),
+                frameParser (maxCiphertextLength),
+                highWaterMark (highWaterMark_),
+                lowWaterMark (lowWaterMark_),
+                queuedBytes (0),
+                backpressure (false),
+                closed (false) {
+            if (channel.memoryHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    end > 1 || lowWaterMark > highWaterMark) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            struct stat status;
+            if (fstat (channel.memoryHandle, &status) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            memoryLength = (std::size_t)status.st_size;
+            if (memoryLength < sizeof (ChannelHeader)) {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION ("%s", "Invalid channel.");
+            }
+            memory = (util::ui8 *)mmap (0, memoryLength, PROT_READ | PROT_WRITE,
+                MAP_SHARED, channel.memoryHandle, 0);
+            if (memory == MAP_FAILED) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            const ChannelHeader *header = (const ChannelHeader *)memory;
+            capacity = (std::size_t)header->capacity;
+            std::size_t ringLength = sizeof (Ring) + capacity;
+            if (header->magic != CHANNEL_MAGIC ||
+                    capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+                    GetRingOffset (2, ringLength) != memoryLength) {
+                munmap (memory, memoryLength);
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION ("%s", "Invalid channel.");
+            }
+            outgoing = (Ring *)(memory + GetRingOffset (end, ringLength));
+            outgoingData = (util::ui8 *)(outgoing + 1);
+            incoming = (Ring *)(memory + GetRingOffset (1 - end, ringLength));
+            incomingData = (util::ui8 *)(incoming + 1);
+            localEventHandle = dup (channel.eventHandles[end]);
+            remoteEventHandle = dup (channel.eventHandles[1 - end]);
+            if (localEventHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    remoteEventHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                if (localEventHandle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                    close (localEventHandle);
+                }
+                munmap (memory, memoryLength);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+        }
+
+        SharedMemoryTunnel::~SharedMemoryTunnel () {
+            Close ();
+            CloseHandles ();
+            munmap (memory, memoryLength);
+        }
+
+        void SharedMemoryTunnel::Start () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            if (!closed && !started) {
+                eventLoop.AddHandler (*this);
+                started = true;
+            }
+        }
+
+        std::size_t SharedMemoryTunnel::GetQueuedBytes () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return queuedBytes;
+        }
+
+        bool SharedMemoryTunnel::IsBackpressured () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return backpressure && !closed;
+        }
+
+        void SharedMemoryTunnel::Close () {
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed.exchange (true)) {
+                    // The peer (and the Channel) hold the same eventfds, so
+                    // closing ours doesn't take it out of the epoll set.
+                    if (started) {
+                        started = false;
+                        THEKOGANS_UTIL_TRY {
+                            eventLoop.DeleteHandler (*this);
+                        }
+                        THEKOGANS_UTIL_CATCH (util::Exception) {
+                            eventSink.HandleTunnelError (*this, exception);
+                        }
+                    }
+                    StoreRelease (&outgoing->writerClosed, (util::ui32)1);
+                    StoreRelease (&incoming->readerClosed, (util::ui32)1);
+                    Signal ();
+                    sendQueue.clear ();
+                    queuedBytes = 0;
+                }
+            }
+            ClearPendingPackets ();
+        }
+
+        void SharedMemoryTunnel::CloseHandles () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            if (localEventHandle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                close (localEventHandle);
+                localEventHandle = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            }
+            if (remoteEventHandle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                close (remoteEventHandle);
+                remoteEventHandle = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            }
+        }
+
+        void SharedMemoryTunnel::HandleEvents (util::ui32 /*events*/) throw () {
+            THEKOGANS_UTIL_TRY {
+                util::ui64 value;
+                while (read (localEventHandle, &value, sizeof (value)) == sizeof (value)) {
+                }
+                bool peerClosed = HandleReadable ();
+                bool backpressureOff = false;
+                {
+                    util::LockGuard<util::Mutex> guard (sendMutex);
+                    if (!closed) {
+                        if (LoadAcquire (&outgoing->readerClosed) != 0) {
+                            peerClosed = true;
+                        }
+                        else {
+                            Flush ();
+                            if (backpressure && queuedBytes <= lowWaterMark) {
+                                backpressure = false;
+                                backpressureOff = true;
+                            }
+                        }
+                    }
+                }
+                if (backpressureOff) {
+                    HandleBackpressure (false);
+                }
+                if (peerClosed && !closed) {
+                    Close ();
+                    eventSink.HandleTunnelClosed (*this);
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+            // Close was called (here, or on another thread).
+            if (closed) {
+                CloseHandles ();
+            }
+        }
+
+        bool SharedMemoryTunnel::EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) {
+            bool backpressureOn = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to send %s, tunnel is closed.",
+                        packet->Type ());
+                }
+                if (sendQueue.empty ()) {
+                    // Encrypt straight in to the ring if the frame fits
+                    // in the contiguous room after the tail.
+                    util::ui64 tail = outgoing->tail;
+                    std::size_t room = capacity -
+                        (std::size_t)(tail - LoadAcquire (&outgoing->head));
+                    std::size_t offset = (std::size_t)tail & (capacity - 1);
+                    util::Buffer buffer (
+                        util::NetworkEndian,
+                        outgoingData + offset,
+                        std::min (room, capacity - offset),
+                        0,
+                        0,
+                        &util::NullAllocator::Global);
+                    if (packet->Serialize (
+                            buffer, *cipher, session, compress, paddingPolicy.Get ())) {
+                        Produce (tail + buffer.GetDataAvailableForReading ());
+                        return true;
+                    }
+                }
+                util::Buffer::SharedPtr frame =
+                    packet->Serialize (*cipher, session, compress, paddingPolicy.Get ());
+                sendQueue.push_back (frame);
+                queuedBytes += frame->GetDataAvailableForReading ();
+                Flush ();
+                if (!backpressure && queuedBytes >= highWaterMark) {
+                    backpressure = backpressureOn = true;
+                }
+                if (!backpressure) {
+                    return true;
+                }
+            }
+            if (backpressureOn) {
+                HandleBackpressure (true);
+            }
+            return false;
+        }
+
+        bool SharedMemoryTunnel::HandleReadable () {
+            while (!closed) {
+                util::ui64 head = incoming->head;
+                util::ui64 tail = LoadAcquire (&incoming->tail);
+                while (head != tail) {
+                    if (tail - head > capacity) {
+                        THEKOGANS_UTIL_THROW_STRING_EXCEPTION ("%s", "Corrupt incoming ring.");
+                    }
+                    // Parse in place. The parser copies what it keeps.
+                    std::size_t offset = (std::size_t)head & (capacity - 1);
+                    std::size_t length = std::min ((std::size_t)(tail - head), capacity - offset);
+                    THEKOGANS_UTIL_TRY {
+                        frameParser.HandleBuffer (
+                            util::Buffer::SharedPtr (
+                                new util::Buffer (
+                                    util::NetworkEndian,
+                                    incomingData + offset,
+                                    length,
+                                    0,
+                                    length,
+                                    &util::NullAllocator::Global)),
+                            *this);
+                    }
+                    THEKOGANS_UTIL_CATCH (util::Exception) {
+                        eventSink.HandleTunnelError (*this, exception);
+                    }
+                    head += length;
+                    StoreRelease (&incoming->head, head);
+                    FullFence ();
+                    if (LoadAcquire (&incoming->writerWaiting) != 0 &&
+                            __atomic_exchange_n (&incoming->writerWaiting, 0, __ATOMIC_ACQ_REL) != 0) {
+                        Signal ();
+                    }
+                    tail = LoadAcquire (&incoming->tail);
+                }
+                if (LoadAcquire (&incoming->writerClosed) != 0) {
+                    return true;
+                }
+                // Tell the producer to wake us up, and make sure
+                // nothing slipped in before it could see that.
+                StoreRelease (&incoming->readerWaiting, (util::ui32)1);
+                FullFence ();
+                if (LoadAcquire (&incoming->tail) == tail) {
+                    break;
+                }
+                StoreRelease (&incoming->readerWaiting, (util::ui32)0);
+            }
+            return false;
+        }
+
+        void SharedMemoryTunnel::Flush () {
+            while (1) {
+                util::ui64 tail = outgoing->tail;
+                util::ui64 head = LoadAcquire (&outgoing->head);
+                util::ui64 newTail = tail;
+                while (!sendQueue.empty () && newTail - head < capacity) {
+                    util::Buffer &frame = *sendQueue.front ();
+                    std::size_t offset = (std::size_t)newTail & (capacity - 1);
+                    std::size_t length = std::min (
+                        std::min (frame.GetDataAvailableForReading (),
+                            capacity - (std::size_t)(newTail - head)),
+                        capacity - offset);
+                    memcpy (outgoingData + offset, frame.GetReadPtr (), length);
+                    frame.AdvanceReadOffset (length);
+                    queuedBytes -= length;
+                    newTail += length;
+                    if (frame.IsEmpty ()) {
+                        sendQueue.pop_front ();
+                    }
+                }
+                if (newTail != tail) {
+                    Produce (newTail);
+                }
+                if (sendQueue.empty ()) {
+                    break;
+                }
+                // Ring is full. Ask the consumer to wake us up when it makes
+                // room, and make sure it didn't before it could see that.
+                StoreRelease (&outgoing->writerWaiting, (util::ui32)1);
+                FullFence ();
+                if (LoadAcquire (&outgoing->head) == head) {
+                    break;
+                }
+                StoreRelease (&outgoing->writerWaiting, (util::ui32)0);
+            }
+        }
+
+        void SharedMemoryTunnel::Produce (util::ui64 tail) {
+            StoreRelease (&outgoing->tail, tail);
+            FullFence ();
+            if (LoadAcquire (&outgoing->readerWaiting) != 0 &&
+                    __atomic_exchange_n (&outgoing->readerWaiting, 0, __ATOMIC_ACQ_REL) != 0) {
+                Signal ();
+            }
+        }
+
+        void SharedMemoryTunnel::Signal () {
+            util::ui64 value = 1;
+            if (write (remoteEventHandle, &value, sizeof (value)) < 0) {
+                // The counter is saturated, so the peer
+                // is already due to wake up.
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
@@ -0,0 +1,244 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/TCPTunnel.h"
+
+namespace thekogans {
+    namespace packet {
+
+        TCPTunnel::TCPTunnel (
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session,
+                std::size_t maxCiphertextLength,
+                std::size_t highWaterMark_,
+                std::size_t lowWaterMark_,
+                std::size_t readBufferLength,
+                PaddingPolicy::SharedPtr paddingPolicy,
+                bool compress) :
+                Tunnel (keyRing, eventSink, session, paddingPolicy, compress),
+                handle (handle_),
+                frameParser (maxCiphertextLength),
+                readBuffer (new util::Buffer (util::NetworkEndian, readBufferLength)),
+                highWaterMark (highWaterMark_),
+                lowWaterMark (lowWaterMark_),
+                queuedBytes (0),
+                backpressure (false),
+                closed (false) {
+            if (handle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    readBufferLength == 0 || lowWaterMark > highWaterMark) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            int flags = fcntl (handle, F_GETFL, 0);
+            if (flags < 0 || fcntl (handle, F_SETFL, flags | O_NONBLOCK) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+        TCPTunnel::~TCPTunnel () {
+            Close ();
+            CloseHandle ();
+        }
+
+        std::size_t TCPTunnel::GetQueuedBytes () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return queuedBytes;
+        }
+
+        bool TCPTunnel::IsBackpressured () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return backpressure && !closed;
+        }
+
+        void TCPTunnel::Close () {
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed.exchange (true)) {
+                    // The event loop thread might be reading from, or
+                    // flushing to, the socket. Closing it here would let
+                    // the descriptor be reused under it. Wake it up
+                    // instead, and let it close the socket.
+                    shutdown (handle, SHUT_RDWR);
+                    sendQueue.clear ();
+                    queuedBytes = 0;
+                }
+            }
+            ClearPendingPackets ();
+        }
+
+        void TCPTunnel::CloseHandle () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            if (handle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                close (handle);
+                handle = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            }
+        }
+
+        void TCPTunnel::HandleEvents (util::ui32 events) throw () {
+            THEKOGANS_UTIL_TRY {
+                if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+                    HandleReadable ();
+                }
+                if ((events & EPOLLOUT) != 0) {
+                    HandleWritable ();
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+            // Close was called (here, or on another thread).
+            if (closed) {
+                CloseHandle ();
+            }
+        }
+
+        bool TCPTunnel::EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) {
+            bool backpressureOn = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to send %s, tunnel is closed.",
+                        packet->Type ());
+                }
+                util::Buffer::SharedPtr frame = SerializePacket (*packet, *cipher);
+                sendQueue.push_back (frame);
+                queuedBytes += frame->GetDataAvailableForReading ();
+                // If frames are already queued, the socket is full
+                // and the next EPOLLOUT edge will flush this one too.
+                if (sendQueue.size () == 1) {
+                    Flush ();
+                }
+                if (!backpressure && queuedBytes >= highWaterMark) {
+                    backpressure = backpressureOn = true;
+                }
+                if (!backpressure) {
+                    return true;
+                }
+            }
+            if (backpressureOn) {
+                HandleBackpressure (true);
+            }
+            return false;
+        }
+
+        void TCPTunnel::HandleReadable () {
+            while (!closed) {
+                readBuffer->readOffset = readBuffer->writeOffset = 0;
+                ssize_t count = read (
+                    handle,
+                    readBuffer->GetWritePtr (),
+                    readBuffer->GetDataAvailableForWriting ());
+                if (count > 0) {
+                    readBuffer->AdvanceWriteOffset ((std::size_t)count);
+                    frameParser.HandleBuffer (readBuffer, *this);
+                }
+                else if (count == 0) {
+                    Close ();
+                    eventSink.HandleTunnelClosed (*this);
+                }
+                else {
+                    THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                    if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+                        break;
+                    }
+                    if (errorCode != EINTR) {
+                        THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                    }
+                }
+            }
+        }
+
+        void TCPTunnel::HandleWritable () {
+            bool backpressureOff = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed) {
+                    Flush ();
+                    if (backpressure && queuedBytes <= lowWaterMark) {
+                        backpressure = false;
+                        backpressureOff = true;
+                    }
+                }
+            }
+            if (backpressureOff) {
+                HandleBackpressure (false);
+            }
+        }
+
+        void TCPTunnel::Flush () {
+            while (!sendQueue.empty ()) {
+                iovec iov[MAX_GATHER_FRAME_COUNT];
+                std::size_t iovCount = 0;
+                for (std::deque<util::Buffer::SharedPtr>::const_iterator
+                        it = sendQueue.begin (),
+                        end = sendQueue.end ();
+                        it != end && iovCount < MAX_GATHER_FRAME_COUNT; ++it, ++iovCount) {
+                    iov[iovCount].iov_base = (*it)->GetReadPtr ();
+                    iov[iovCount].iov_len = (*it)->GetDataAvailableForReading ();
+                }
+                msghdr message;
+                memset (&message, 0, sizeof (message));
+                message.msg_iov = iov;
+                message.msg_iovlen = iovCount;
+                ssize_t count = sendmsg (handle, &message, MSG_NOSIGNAL);
+                if (count < 0) {
+                    THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                    if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+                        // Wait for the next EPOLLOUT edge.
+                        break;
+                    }
+                    if (errorCode != EINTR) {
+                        THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                    }
+                    continue;
+                }
+                // Drop the frames that went out. The last
+                // one might have gone out only in part.
+                std::size_t sent = (std::size_t)count;
+                queuedBytes -= sent;
+                while (sent > 0) {
+                    util::Buffer &frame = *sendQueue.front ();
+                    std::size_t length = frame.GetDataAvailableForReading ();
+                    if (sent < length) {
+                        frame.AdvanceReadOffset (sent);
+                        break;
+                    }
+                    sent -= length;
+                    sendQueue.pop_front ();
+                }
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
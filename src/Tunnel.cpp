@@ -0,0 +1,333 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/packet/Tunnel.h"
+
+namespace thekogans {
+    namespace packet {
+
+        Tunnel::Tunnel (
+                KeyRing &keyRing_,
+                EventSink &eventSink_,
+                Session *session_,
+                PaddingPolicy::SharedPtr paddingPolicy_,
+                bool compress_) :
+                keyRing (keyRing_),
+                eventSink (eventSink_),
+                session (session_),
+                paddingPolicy (paddingPolicy_),
+                compress (compress_),
+                pendingPacketCount (0),
+                currentPriority (Packet::PRIORITY_BULK),
+                releasing (false),
+                backpressureReported (false) {
+            priorityQueues[Packet::PRIORITY_BULK].weight = DEFAULT_BULK_WEIGHT;
+            priorityQueues[Packet::PRIORITY_NORMAL].weight = DEFAULT_NORMAL_WEIGHT;
+            priorityQueues[Packet::PRIORITY_INTERACTIVE].weight = DEFAULT_INTERACTIVE_WEIGHT;
+            // The high bits of compact header sequence numbers are not
+            // authenticated, so the keys must be retired before they wrap.
+            if (session != 0 && session->compactHeader) {
+                util::ui64 packetLimit = keyRing.GetThresholds ().packetLimit;
+                if (packetLimit == 0 ||
+                        packetLimit > (util::ui64)Session::COMPACT_HEADER_KEY_PACKET_LIMIT) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Compact session headers require a KeyRing packetLimit "
+                        "(" THEKOGANS_UTIL_UI64_FORMAT ") in (0, " THEKOGANS_UTIL_UI64_FORMAT "].",
+                        packetLimit,
+                        (util::ui64)Session::COMPACT_HEADER_KEY_PACKET_LIMIT);
+                }
+            }
+        }
+
+        void Tunnel::SetPriorityWeight (
+                Packet::Priority priority,
+                std::size_t weight) {
+            if (priority < Packet::PRIORITY_CONTROL && weight > 0) {
+                util::LockGuard<util::Mutex> guard (scheduleMutex);
+                priorityQueues[priority].weight = weight;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        std::size_t Tunnel::GetPendingPacketCount () {
+            util::LockGuard<util::Mutex> guard (scheduleMutex);
+            return pendingPacketCount;
+        }
+
+        bool Tunnel::SendPacket (Packet::SharedPtr packet) {
+            if (packet.Get () != 0) {
+                // NOTE: Filters (ex: FragmentPacketPacketFilter) can call
+                // SendPacket recursively to inject packets of their own.
+                packet = outgoingFilters.FilterPacket (std::move (packet));
+                if (packet.Get () != 0) {
+                    {
+                        // If the transport is pushing back, wait in line, so
+                        // that higher priority packets can get ahead of us.
+                        util::LockGuard<util::Mutex> guard (scheduleMutex);
+                        if (releasing || pendingPacketCount > 0 || IsBackpressured ()) {
+                            QueuePacket (packet);
+                            return !IsBackpressured ();
+                        }
+                        releasing = true;
+                    }
+                    return ReleasePackets (std::move (packet));
+                }
+                return true;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        bool Tunnel::SendPackets (PacketBatch &packets) {
+            outgoingFilters.FilterPackets (packets);
+            if (!packets.empty ()) {
+                {
+                    util::LockGuard<util::Mutex> guard (scheduleMutex);
+                    if (releasing || pendingPacketCount > 0 || IsBackpressured ()) {
+                        for (std::size_t i = 0, count = packets.size (); i < count; ++i) {
+                            QueuePacket (packets[i]);
+                        }
+                        return !IsBackpressured ();
+                    }
+                    releasing = true;
+                }
+                // Nothing is waiting, so the transport gets the batch as a whole.
+                bool enqueued = false;
+                THEKOGANS_UTIL_TRY {
+                    // No locks are held here, so a key rotation triggered by
+                    // this batch can send it's key exchange (it will wait in
+                    // line until we are done with the batch).
+                    enqueued = EnqueuePackets (packets, GetActiveCipher (packets));
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    util::LockGuard<util::Mutex> guard (scheduleMutex);
+                    releasing = false;
+                    THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+                }
+                return ReleasePackets (Packet::SharedPtr (), enqueued);
+            }
+            return true;
+        }
+
+        bool Tunnel::EnqueuePackets (
+                const PacketBatch &packets,
+                crypto::Cipher::SharedPtr cipher) {
+            bool result = true;
+            for (std::size_t i = 0, count = packets.size (); i < count; ++i) {
+                if (!EnqueuePacket (packets[i], cipher)) {
+                    result = false;
+                }
+            }
+            return result;
+        }
+
+        util::Buffer::SharedPtr Tunnel::SerializePacket (
+                const Packet &packet,
+                crypto::Cipher &cipher) {
+            return packet.Serialize (cipher, session, compress, paddingPolicy.Get ());
+        }
+
+        util::Buffer::SharedPtr Tunnel::SerializePackets (
+                const PacketBatch &packets,
+                crypto::Cipher &cipher,
+                std::vector<std::size_t> &frameLengths) {
+            return Packet::SerializeBatch (
+                packets, cipher, session, compress, paddingPolicy.Get (), &frameLengths);
+        }
+
+        void Tunnel::ClearPendingPackets () {
+            util::LockGuard<util::Mutex> guard (scheduleMutex);
+            for (std::size_t i = 0; i < Packet::PRIORITY_COUNT; ++i) {
+                priorityQueues[i].packets.clear ();
+                priorityQueues[i].deficit = 0;
+            }
+            pendingPacketCount = 0;
+        }
+
+        void Tunnel::HandleBackpressure (bool on) throw () {
+            THEKOGANS_UTIL_TRY {
+                if (!on) {
+                    bool release = false;
+                    {
+                        util::LockGuard<util::Mutex> guard (scheduleMutex);
+                        if (!releasing && pendingPacketCount > 0) {
+                            releasing = release = true;
+                        }
+                    }
+                    // If the waiting packets filled the transport back
+                    // up, backpressure stays on as far as anyone knows.
+                    if (release && !ReleasePackets (Packet::SharedPtr ())) {
+                        return;
+                    }
+                }
+                ReportBackpressure (on);
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+        }
+
+        crypto::Cipher::SharedPtr Tunnel::GetActiveCipher (const Packet &packet) {
+            crypto::Cipher::SharedPtr cipher =
+                keyRing.GetActiveCipher (util::Serializable::Size (packet));
+            if (cipher.Get () != 0) {
+                return cipher;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "Unable to send %s, no active key (or it's past it's packetLimit).",
+                    packet.Type ());
+            }
+        }
+
+        crypto::Cipher::SharedPtr Tunnel::GetActiveCipher (const PacketBatch &packets) {
+            std::size_t byteCount = 0;
+            for (std::size_t i = 0, count = packets.size (); i < count; ++i) {
+                byteCount += util::Serializable::Size (*packets[i]);
+            }
+            crypto::Cipher::SharedPtr cipher =
+                keyRing.GetActiveCipher (byteCount, packets.size ());
+            if (cipher.Get () != 0) {
+                return cipher;
+            }
+            else {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "Unable to send " THEKOGANS_UTIL_SIZE_T_FORMAT " packets, "
+                    "no active key (or it's past it's packetLimit).",
+                    packets.size ());
+            }
+        }
+
+        bool Tunnel::ReleasePackets (
+                Packet::SharedPtr packet,
+                bool enqueued) {
+            while (1) {
+                if (packet.Get () != 0) {
+                    THEKOGANS_UTIL_TRY {
+                        // Charge the key before the transport takes it's send
+                        // lock (see GetActiveCipher).
+                        crypto::Cipher::SharedPtr cipher = GetActiveCipher (*packet);
+                        enqueued = EnqueuePacket (std::move (packet), cipher);
+                    }
+                    THEKOGANS_UTIL_CATCH (util::Exception) {
+                        util::LockGuard<util::Mutex> guard (scheduleMutex);
+                        releasing = false;
+                        THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+                    }
+                }
+                util::LockGuard<util::Mutex> guard (scheduleMutex);
+                // The transport might have drained since it pushed back. If it
+                // hasn't, it's HandleBackpressure (false) can only get to the
+                // waiting packets after we let go of them below.
+                if (!enqueued && IsBackpressured ()) {
+                    releasing = false;
+                    return false;
+                }
+                packet = DequeuePacket ();
+                if (packet.Get () == 0) {
+                    releasing = false;
+                    return true;
+                }
+                enqueued = true;
+            }
+        }
+
+        void Tunnel::QueuePacket (Packet::SharedPtr packet) {
+            // Don't let a bogus priority jump the line.
+            util::ui8 priority = packet->priority < Packet::PRIORITY_COUNT ?
+                packet->priority : (util::ui8)Packet::PRIORITY_NORMAL;
+            priorityQueues[priority].packets.push_back (std::move (packet));
+            ++pendingPacketCount;
+        }
+
+        Packet::SharedPtr Tunnel::DequeuePacket () {
+            Packet::SharedPtr packet;
+            if (pendingPacketCount > 0) {
+                PriorityQueue &control = priorityQueues[Packet::PRIORITY_CONTROL];
+                if (!control.packets.empty ()) {
+                    packet = std::move (control.packets.front ());
+                    control.packets.pop_front ();
+                }
+                else {
+                    // Deficit round robin between the weighted classes. A class
+                    // is topped up when it's turn comes, and sends for as long as
+                    // it's deficit covers the packet at the head of it's queue.
+                    while (packet.Get () == 0) {
+                        PriorityQueue &queue = priorityQueues[currentPriority];
+                        if (!queue.packets.empty ()) {
+                            std::size_t packetSize =
+                                util::Serializable::Size (*queue.packets.front ());
+                            if (queue.deficit >= packetSize) {
+                                queue.deficit -= packetSize;
+                                packet = std::move (queue.packets.front ());
+                                queue.packets.pop_front ();
+                                if (queue.packets.empty ()) {
+                                    queue.deficit = 0;
+                                }
+                                break;
+                            }
+                        }
+                        currentPriority = (currentPriority + 1) % Packet::PRIORITY_CONTROL;
+                        PriorityQueue &next = priorityQueues[currentPriority];
+                        if (!next.packets.empty ()) {
+                            next.deficit += next.weight * PRIORITY_QUANTUM;
+                        }
+                    }
+                }
+                --pendingPacketCount;
+            }
+            return packet;
+        }
+
+        void Tunnel::ReportBackpressure (bool on) {
+            {
+                util::LockGuard<util::Mutex> guard (scheduleMutex);
+                if (backpressureReported == on) {
+                    return;
+                }
+                backpressureReported = on;
+            }
+            eventSink.HandleTunnelBackpressure (*this, on);
+            outgoingFilters.HandleBackpressure (on);
+        }
+
+        crypto::Cipher::SharedPtr Tunnel::GetCipherForKeyId (
+                const crypto::ID &keyId) throw () {
+            return keyRing.GetCipher (keyId);
+        }
+
+        void Tunnel::HandlePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) throw () {
+            THEKOGANS_UTIL_TRY {
+                packet = incomingFilters.FilterPacket (std::move (packet));
+                if (packet.Get () != 0) {
+                    eventSink.HandleTunnelPacket (*this, packet, cipher);
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
@@ -0,0 +1,122 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <vector>
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/TunnelEventLoop.h"
+
+namespace thekogans {
+    namespace packet {
+
+        TunnelEventLoop::TunnelEventLoop (std::size_t maxEventsPerWait_) :
+                epollHandle (epoll_create1 (EPOLL_CLOEXEC)),
+                eventHandle (THEKOGANS_UTIL_INVALID_HANDLE_VALUE),
+                maxEventsPerWait (maxEventsPerWait_ > 0 ?
+                    maxEventsPerWait_ : (std::size_t)DEFAULT_MAX_EVENTS_PER_WAIT),
+                done (false) {
+            if (epollHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            eventHandle = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (eventHandle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (epollHandle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            // The eventfd is level triggered and identified by a null handler.
+            epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = 0;
+            if (epoll_ctl (epollHandle, EPOLL_CTL_ADD, eventHandle, &event) < 0) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (eventHandle);
+                close (epollHandle);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+        }
+
+        TunnelEventLoop::~TunnelEventLoop () {
+            close (eventHandle);
+            close (epollHandle);
+        }
+
+        void TunnelEventLoop::AddHandler (Handler &handler) {
+            epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = &handler;
+            if (epoll_ctl (epollHandle, EPOLL_CTL_ADD, handler.GetHandle (), &event) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+        void TunnelEventLoop::DeleteHandler (Handler &handler) {
+            epoll_event event;
+            if (epoll_ctl (epollHandle, EPOLL_CTL_DEL, handler.GetHandle (), &event) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+        std::size_t TunnelEventLoop::Poll (int timeout) {
+            std::vector<epoll_event> events (maxEventsPerWait);
+            int count = epoll_wait (epollHandle, &events[0], (int)events.size (), timeout);
+            if (count < 0) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                if (errorCode == EINTR) {
+                    return 0;
+                }
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            std::size_t handled = 0;
+            for (int i = 0; i < count; ++i) {
+                Handler *handler = static_cast<Handler *> (events[i].data.ptr);
+                if (handler != 0) {
+                    handler->HandleEvents (events[i].events);
+                    ++handled;
+                }
+                else {
+                    util::ui64 value;
+                    while (read (eventHandle, &value, sizeof (value)) == sizeof (value)) {
+                    }
+                }
+            }
+            return handled;
+        }
+
+        void TunnelEventLoop::Run () {
+            while (!done.load (std::memory_order_acquire)) {
+                Poll ();
+            }
+            done.store (false, std::memory_order_release);
+        }
+
+        void TunnelEventLoop::Stop () {
+            done.store (true, std::memory_order_release);
+            util::ui64 value = 1;
+            if (write (eventHandle, &value, sizeof (value)) < 0) {
+                // The counter is saturated, so the loop
+                // is already due to wake up.
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
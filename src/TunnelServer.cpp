@@ -0,0 +1,271 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <unistd.h>
+#include <cstring>
+#include "thekogans/util/Exception.h"
+#include "thekogans/packet/TunnelServer.h"
+
+#if !defined (SO_REUSEPORT)
+    #define SO_REUSEPORT 15
+#endif // !defined (SO_REUSEPORT)
+#if !defined (SO_ATTACH_REUSEPORT_CBPF)
+    #define SO_ATTACH_REUSEPORT_CBPF 51
+#endif // !defined (SO_ATTACH_REUSEPORT_CBPF)
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            thread_local TunnelServer::Shard *currentShard = 0;
+        }
+
+        TunnelServer::Shard::Shard (
+                TunnelServer &server_,
+                std::size_t index_,
+                THEKOGANS_UTIL_HANDLE listener_) :
+                server (server_),
+                index (index_),
+                listener (listener_),
+                done (false) {}
+
+        TunnelServer::Shard::~Shard () {
+            close (listener);
+        }
+
+        TunnelServer::Shard *TunnelServer::Shard::GetCurrentShard () {
+            return currentShard;
+        }
+
+        void TunnelServer::Shard::DeleteTunnel (TCPTunnel &tunnel) {
+            std::set<TCPTunnel *>::iterator it = tunnels.find (&tunnel);
+            if (it != tunnels.end ()) {
+                tunnels.erase (it);
+                // The socket is closed (and taken out of the event loop)
+                // when the tunnel is deleted after this Poll, as events
+                // for it might still be pending in it.
+                tunnel.Close ();
+                deletedTunnels.push_back (&tunnel);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+        }
+
+        void TunnelServer::Shard::Stop () {
+            done.store (true, std::memory_order_release);
+            eventLoop.Stop ();
+        }
+
+        void TunnelServer::Shard::HandleEvents (util::ui32 /*events*/) throw () {
+            while (!done.load (std::memory_order_acquire)) {
+                THEKOGANS_UTIL_HANDLE handle =
+                    accept4 (listener, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (handle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                    THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                    if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+                        break;
+                    }
+                    // The connection was reset before we got to it.
+                    if (errorCode == EINTR || errorCode == ECONNABORTED) {
+                        continue;
+                    }
+                    THEKOGANS_UTIL_TRY {
+                        THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                    }
+                    THEKOGANS_UTIL_CATCH (util::Exception) {
+                        server.handler.HandleShardError (*this, exception);
+                    }
+                    break;
+                }
+                TCPTunnel *tunnel = 0;
+                THEKOGANS_UTIL_TRY {
+                    tunnel = server.handler.CreateTunnel (*this, handle);
+                    if (tunnel != 0) {
+                        tunnels.insert (tunnel);
+                        eventLoop.AddHandler (*tunnel);
+                    }
+                    else {
+                        close (handle);
+                    }
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    if (tunnel != 0) {
+                        tunnels.erase (tunnel);
+                        // The tunnel owns the socket.
+                        delete tunnel;
+                    }
+                    else {
+                        close (handle);
+                    }
+                    server.handler.HandleShardError (*this, exception);
+                }
+            }
+        }
+
+        void TunnelServer::Shard::Run () throw () {
+            currentShard = this;
+            THEKOGANS_UTIL_TRY {
+                context = server.handler.CreateShardContext (*this);
+                eventLoop.AddHandler (*this);
+                while (!done.load (std::memory_order_acquire)) {
+                    eventLoop.Poll ();
+                    for (std::size_t i = 0, count = deletedTunnels.size (); i < count; ++i) {
+                        delete deletedTunnels[i];
+                    }
+                    deletedTunnels.clear ();
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                server.handler.HandleShardError (*this, exception);
+            }
+            for (std::size_t i = 0, count = deletedTunnels.size (); i < count; ++i) {
+                delete deletedTunnels[i];
+            }
+            deletedTunnels.clear ();
+            for (std::set<TCPTunnel *>::iterator
+                    it = tunnels.begin (),
+                    end = tunnels.end (); it != end; ++it) {
+                delete *it;
+            }
+            tunnels.clear ();
+            server.handler.HandleShardStopped (*this);
+            context.Reset ();
+            currentShard = 0;
+        }
+
+        TunnelServer::TunnelServer (
+                Handler &handler_,
+                const sockaddr *address_,
+                socklen_t addressLength_,
+                std::size_t shardCount_,
+                Affinity affinity_,
+                bool pinThreads_,
+                int backlog_) :
+                handler (handler_),
+                addressLength (addressLength_),
+                shardCount (shardCount_ > 0 ?
+                    shardCount_ : (std::size_t)sysconf (_SC_NPROCESSORS_ONLN)),
+                affinity (affinity_),
+                pinThreads (pinThreads_),
+                backlog (backlog_) {
+            if (address_ == 0 || addressLength == 0 ||
+                    addressLength > sizeof (address) || shardCount == 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            memset (&address, 0, sizeof (address));
+            memcpy (&address, address_, addressLength);
+        }
+
+        TunnelServer::~TunnelServer () {
+            Stop ();
+        }
+
+        void TunnelServer::Start () {
+            if (!shards.empty ()) {
+                return;
+            }
+            THEKOGANS_UTIL_TRY {
+                // Listeners join the SO_REUSEPORT group in bind order, and
+                // the BPF program returns an index in to the group, so
+                // shard i must own the i'th listener.
+                for (std::size_t i = 0; i < shardCount; ++i) {
+                    THEKOGANS_UTIL_HANDLE listener = CreateListener ();
+                    THEKOGANS_UTIL_TRY {
+                        shards.push_back (new Shard (*this, i, listener));
+                    }
+                    THEKOGANS_UTIL_CATCH (util::Exception) {
+                        close (listener);
+                        THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+                    }
+                    if (i == 0 && affinity == AFFINITY_INCOMING_CPU) {
+                        AttachIncomingCPUFilter (listener);
+                    }
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                // None of the shards are running yet.
+                for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                    delete shards[i];
+                }
+                shards.clear ();
+                THEKOGANS_UTIL_RETHROW_EXCEPTION (exception);
+            }
+            std::size_t cpuCount = (std::size_t)sysconf (_SC_NPROCESSORS_ONLN);
+            for (std::size_t i = 0; i < shardCount; ++i) {
+                shards[i]->Create (
+                    THEKOGANS_UTIL_NORMAL_THREAD_PRIORITY,
+                    pinThreads && cpuCount > 0 ?
+                        (util::ui32)(i % cpuCount) : THEKOGANS_UTIL_MAX_THREAD_AFFINITY);
+            }
+        }
+
+        void TunnelServer::Stop () {
+            for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                shards[i]->Stop ();
+            }
+            for (std::size_t i = 0, count = shards.size (); i < count; ++i) {
+                shards[i]->Wait ();
+                delete shards[i];
+            }
+            shards.clear ();
+        }
+
+        THEKOGANS_UTIL_HANDLE TunnelServer::CreateListener () {
+            THEKOGANS_UTIL_HANDLE listener = socket (
+                address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listener == THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            int on = 1;
+            if (setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) < 0 ||
+                    setsockopt (listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0 ||
+                    bind (listener, (const sockaddr *)&address, addressLength) < 0 ||
+                    listen (listener, backlog) < 0) {
+                THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                close (listener);
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+            }
+            return listener;
+        }
+
+        void TunnelServer::AttachIncomingCPUFilter (THEKOGANS_UTIL_HANDLE listener) {
+            // A = receiving CPU; A %= shardCount; return A.
+            sock_filter code[] = {
+                {BPF_LD | BPF_W | BPF_ABS, 0, 0, (util::ui32)(SKF_AD_OFF + SKF_AD_CPU)},
+                {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (util::ui32)shardCount},
+                {BPF_RET | BPF_A, 0, 0, 0}
+            };
+            sock_fprog program;
+            program.len = sizeof (code) / sizeof (code[0]);
+            program.filter = code;
+            if (setsockopt (listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                    &program, sizeof (program)) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
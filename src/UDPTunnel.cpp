@@ -0,0 +1,500 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+#if defined (TOOLCHAIN_OS_Linux)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include "thekogans/util/LockGuard.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/crypto/FrameHeader.h"
+#include "thekogans/packet/UDPTunnel.h"
+
+// Older C libraries don't know about UDP GSO/GRO (the kernel might).
+#if !defined (SOL_UDP)
+    #define SOL_UDP 17
+#endif // !defined (SOL_UDP)
+#if !defined (UDP_SEGMENT)
+    #define UDP_SEGMENT 103
+#endif // !defined (UDP_SEGMENT)
+#if !defined (UDP_GRO)
+    #define UDP_GRO 104
+#endif // !defined (UDP_GRO)
+
+namespace thekogans {
+    namespace packet {
+
+        namespace {
+            enum {
+                // Maximum number of frames gathered in to one sendmmsg call.
+                MAX_SEND_IOV_COUNT = 256
+            };
+
+            // Room for one UDP_SEGMENT (ui16) or UDP_GRO (int) control message.
+            union Control {
+                char buffer[CMSG_SPACE (sizeof (int))];
+                cmsghdr align;
+            };
+
+            // ICMP errors reported on a connected UDP socket. They
+            // concern an earlier datagram, not the socket.
+            inline bool IsTransientError (THEKOGANS_UTIL_ERROR_CODE errorCode) {
+                return errorCode == ECONNREFUSED ||
+                    errorCode == EHOSTUNREACH ||
+                    errorCode == ENETUNREACH;
+            }
+        }
+
+        UDPTunnel::UDPTunnel (
+                THEKOGANS_UTIL_HANDLE handle_,
+                KeyRing &keyRing,
+                EventSink &eventSink,
+                Session *session,
+                std::size_t maxDatagramLength_,
+                std::size_t receiveBatchSize,
+                std::size_t highWaterMark_,
+                std::size_t lowWaterMark_,
+                PaddingPolicy::SharedPtr paddingPolicy,
+                bool compress) :
+                Tunnel (keyRing, eventSink, session, paddingPolicy, compress),
+                handle (handle_),
+                maxDatagramLength (maxDatagramLength_),
+                highWaterMark (highWaterMark_),
+                lowWaterMark (lowWaterMark_),
+                gso (false),
+                gro (false),
+                queuedBytes (0),
+                backpressure (false),
+                transientErrorCode (0),
+                closed (false) {
+            if (handle == THEKOGANS_UTIL_INVALID_HANDLE_VALUE ||
+                    maxDatagramLength == 0 || maxDatagramLength > MAX_GSO_LENGTH ||
+                    receiveBatchSize == 0 || lowWaterMark > highWaterMark) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (
+                    THEKOGANS_UTIL_OS_ERROR_CODE_EINVAL);
+            }
+            int flags = fcntl (handle, F_GETFL, 0);
+            if (flags < 0 || fcntl (handle, F_SETFL, flags | O_NONBLOCK) < 0) {
+                THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (THEKOGANS_UTIL_OS_ERROR_CODE);
+            }
+            // The kernel supports GSO if it knows the option.
+            int value = 0;
+            socklen_t valueLength = sizeof (value);
+            gso = getsockopt (handle, SOL_UDP, UDP_SEGMENT, &value, &valueLength) == 0;
+            value = 1;
+            gro = setsockopt (handle, SOL_UDP, UDP_GRO, &value, sizeof (value)) == 0;
+            // With GRO on, one receive can return up to 64K of coalesced datagrams.
+            std::size_t receiveBufferLength = gro ? 65535 : maxDatagramLength;
+            receiveBuffers.resize (receiveBatchSize);
+            for (std::size_t i = 0; i < receiveBatchSize; ++i) {
+                receiveBuffers[i].Reset (
+                    new util::Buffer (util::NetworkEndian, receiveBufferLength));
+            }
+        }
+
+        UDPTunnel::~UDPTunnel () {
+            Close ();
+            CloseHandle ();
+        }
+
+        std::size_t UDPTunnel::GetQueuedBytes () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return queuedBytes;
+        }
+
+        bool UDPTunnel::IsBackpressured () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            return backpressure && !closed;
+        }
+
+        void UDPTunnel::Close () {
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed.exchange (true)) {
+                    // HandleEvents uses the socket unlocked. Shutting it
+                    // down wakes the event loop, which closes it there.
+                    shutdown (handle, SHUT_RDWR);
+                    sendQueue.clear ();
+                    queuedBytes = 0;
+                }
+            }
+            ClearPendingPackets ();
+        }
+
+        void UDPTunnel::CloseHandle () {
+            util::LockGuard<util::Mutex> guard (sendMutex);
+            if (handle != THEKOGANS_UTIL_INVALID_HANDLE_VALUE) {
+                close (handle);
+                handle = THEKOGANS_UTIL_INVALID_HANDLE_VALUE;
+            }
+        }
+
+        void UDPTunnel::HandleEvents (util::ui32 events) throw () {
+            THEKOGANS_UTIL_TRY {
+                if ((events & (EPOLLIN | EPOLLERR)) != 0) {
+                    HandleReadable ();
+                }
+                if ((events & EPOLLOUT) != 0) {
+                    HandleWritable ();
+                }
+            }
+            THEKOGANS_UTIL_CATCH (util::Exception) {
+                eventSink.HandleTunnelError (*this, exception);
+            }
+            if (closed) {
+                CloseHandle ();
+            }
+        }
+
+        bool UDPTunnel::EnqueuePacket (
+                Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr cipher) {
+            bool backpressureOn = false;
+            bool enqueued = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to send %s, tunnel is closed.",
+                        packet->Type ());
+                }
+                util::Buffer::SharedPtr frame = SerializePacket (*packet, *cipher);
+                backpressureOn = QueueFrames (
+                    frame,
+                    std::vector<std::size_t> (1, frame->GetDataAvailableForReading ()));
+                enqueued = !backpressure;
+            }
+            ReportTransientError ();
+            if (backpressureOn) {
+                HandleBackpressure (true);
+            }
+            return enqueued;
+        }
+
+        bool UDPTunnel::EnqueuePackets (
+                const PacketBatch &packets,
+                crypto::Cipher::SharedPtr cipher) {
+            bool backpressureOn = false;
+            bool enqueued = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (closed) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Unable to send " THEKOGANS_UTIL_SIZE_T_FORMAT
+                        " packets, tunnel is closed.",
+                        packets.size ());
+                }
+                std::vector<std::size_t> frameLengths;
+                util::Buffer::SharedPtr frames = SerializePackets (packets, *cipher, frameLengths);
+                backpressureOn = QueueFrames (frames, frameLengths);
+                enqueued = !backpressure;
+            }
+            ReportTransientError ();
+            if (backpressureOn) {
+                HandleBackpressure (true);
+            }
+            return enqueued;
+        }
+
+        bool UDPTunnel::QueueFrames (
+                util::Buffer::SharedPtr frames,
+                const std::vector<std::size_t> &frameLengths) {
+            for (std::size_t i = 0, count = frameLengths.size (); i < count; ++i) {
+                if (frameLengths[i] > maxDatagramLength) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Frame (" THEKOGANS_UTIL_SIZE_T_FORMAT ") does not fit in a datagram ("
+                        THEKOGANS_UTIL_SIZE_T_FORMAT "), fragment large packets.",
+                        frameLengths[i],
+                        maxDatagramLength);
+                }
+            }
+            // If frames are already queued, the socket is full
+            // and the next EPOLLOUT edge will flush these too.
+            bool flush = sendQueue.empty ();
+            util::ui8 *data = frames->GetReadPtr ();
+            for (std::size_t i = 0, count = frameLengths.size (); i < count; ++i) {
+                sendQueue.push_back (Frame (frames, data, frameLengths[i]));
+                queuedBytes += frameLengths[i];
+                data += frameLengths[i];
+            }
+            if (flush) {
+                Flush ();
+            }
+            if (!backpressure && queuedBytes >= highWaterMark) {
+                backpressure = true;
+                return true;
+            }
+            return false;
+        }
+
+        void UDPTunnel::HandleReadable () {
+            std::size_t batchSize = receiveBuffers.size ();
+            std::vector<mmsghdr> messages (batchSize);
+            std::vector<iovec> iov (batchSize);
+            std::vector<Control> controls (batchSize);
+            while (!closed) {
+                for (std::size_t i = 0; i < batchSize; ++i) {
+                    util::Buffer &buffer = *receiveBuffers[i];
+                    buffer.readOffset = buffer.writeOffset = 0;
+                    iov[i].iov_base = buffer.GetWritePtr ();
+                    iov[i].iov_len = buffer.GetDataAvailableForWriting ();
+                    memset (&messages[i], 0, sizeof (mmsghdr));
+                    messages[i].msg_hdr.msg_iov = &iov[i];
+                    messages[i].msg_hdr.msg_iovlen = 1;
+                    if (gro) {
+                        messages[i].msg_hdr.msg_control = controls[i].buffer;
+                        messages[i].msg_hdr.msg_controllen = sizeof (controls[i].buffer);
+                    }
+                }
+                int count = recvmmsg (handle, &messages[0], (unsigned int)batchSize, MSG_DONTWAIT, 0);
+                if (count < 0) {
+                    THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                    if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+                        break;
+                    }
+                    if (IsTransientError (errorCode)) {
+                        // Report it and keep reading, as the
+                        // edge won't fire again for queued datagrams.
+                        THEKOGANS_UTIL_TRY {
+                            THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                        }
+                        THEKOGANS_UTIL_CATCH (util::Exception) {
+                            eventSink.HandleTunnelError (*this, exception);
+                        }
+                    }
+                    else if (errorCode != EINTR) {
+                        THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                    }
+                    continue;
+                }
+                for (int i = 0; i < count && !closed; ++i) {
+                    util::Buffer &buffer = *receiveBuffers[i];
+                    std::size_t length = messages[i].msg_len;
+                    std::size_t segmentLength = length;
+                    if (gro) {
+                        for (cmsghdr *cmsg = CMSG_FIRSTHDR (&messages[i].msg_hdr);
+                                cmsg != 0; cmsg = CMSG_NXTHDR (&messages[i].msg_hdr, cmsg)) {
+                            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                                int gsoSize;
+                                memcpy (&gsoSize, CMSG_DATA (cmsg), sizeof (gsoSize));
+                                if (gsoSize > 0) {
+                                    segmentLength = (std::size_t)gsoSize;
+                                }
+                                break;
+                            }
+                        }
+                    }
+                    // Every datagram is a frame. Decrypt them straight
+                    // out of the receive buffer.
+                    for (std::size_t offset = 0; offset < length; offset += segmentLength) {
+                        buffer.readOffset = offset;
+                        buffer.writeOffset = std::min (offset + segmentLength, length);
+                        THEKOGANS_UTIL_TRY {
+                            if ((messages[i].msg_hdr.msg_flags & MSG_TRUNC) != 0) {
+                                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                                    "Truncated datagram (" THEKOGANS_UTIL_SIZE_T_FORMAT ").",
+                                    length);
+                            }
+                            HandleFrame (buffer);
+                        }
+                        THEKOGANS_UTIL_CATCH (util::Exception) {
+                            eventSink.HandleTunnelError (*this, exception);
+                        }
+                    }
+                }
+                // A short batch means the socket was drained. New
+                // datagrams will fire a new edge.
+                if ((std::size_t)count < batchSize) {
+                    break;
+                }
+            }
+        }
+
+        void UDPTunnel::HandleFrame (util::Buffer &frame) {
+            if (frame.GetDataAvailableForReading () > crypto::FrameHeader::SIZE) {
+                crypto::FrameHeader frameHeader;
+                frame >> frameHeader;
+                if (frameHeader.ciphertextLength != frame.GetDataAvailableForReading ()) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Invalid ciphertext length: %u.",
+                        frameHeader.ciphertextLength);
+                }
+                crypto::Cipher::SharedPtr cipher = GetCipherForKeyId (frameHeader.keyId);
+                if (cipher.Get () == 0) {
+                    THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                        "Invalid key id: %s.",
+                        frameHeader.keyId.ToHexString ().c_str ());
+                }
+                HandlePacket (
+                    Packet::Deserialize (frame, *cipher, GetCurrentSession ()),
+                    cipher);
+            }
+            else {
+                THEKOGANS_UTIL_THROW_STRING_EXCEPTION (
+                    "Runt datagram (" THEKOGANS_UTIL_SIZE_T_FORMAT ").",
+                    frame.GetDataAvailableForReading ());
+            }
+        }
+
+        void UDPTunnel::HandleWritable () {
+            bool backpressureOff = false;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                if (!closed) {
+                    Flush ();
+                    if (backpressure && queuedBytes <= lowWaterMark) {
+                        backpressure = false;
+                        backpressureOff = true;
+                    }
+                }
+            }
+            ReportTransientError ();
+            if (backpressureOff) {
+                HandleBackpressure (false);
+            }
+        }
+
+        void UDPTunnel::Flush () {
+            bool retried = false;
+            while (!sendQueue.empty ()) {
+                mmsghdr messages[MAX_SEND_MESSAGE_COUNT];
+                std::size_t frameCounts[MAX_SEND_MESSAGE_COUNT];
+                Control controls[MAX_SEND_MESSAGE_COUNT];
+                iovec iov[MAX_SEND_IOV_COUNT];
+                memset (messages, 0, sizeof (messages));
+                std::size_t messageCount = 0;
+                std::size_t iovCount = 0;
+                std::deque<Frame>::const_iterator it = sendQueue.begin ();
+                std::deque<Frame>::const_iterator end = sendQueue.end ();
+                while (it != end &&
+                        messageCount < MAX_SEND_MESSAGE_COUNT &&
+                        iovCount < MAX_SEND_IOV_COUNT) {
+                    // With GSO, gather a run of equal length frames (the last
+                    // one can be shorter) in to one message. The stack will
+                    // cut it back in to segmentLength datagrams.
+                    msghdr &message = messages[messageCount].msg_hdr;
+                    message.msg_iov = &iov[iovCount];
+                    std::size_t segmentLength = it->length;
+                    std::size_t length = 0;
+                    std::size_t frameCount = 0;
+                    while (1) {
+                        iov[iovCount].iov_base = it->data;
+                        iov[iovCount].iov_len = it->length;
+                        ++iovCount;
+                        ++frameCount;
+                        length += it->length;
+                        bool last = it->length < segmentLength;
+                        ++it;
+                        if (last || !gso || it == end ||
+                                frameCount == MAX_GSO_SEGMENT_COUNT ||
+                                iovCount == MAX_SEND_IOV_COUNT ||
+                                it->length > segmentLength ||
+                                length + it->length > MAX_GSO_LENGTH) {
+                            break;
+                        }
+                    }
+                    message.msg_iovlen = frameCount;
+                    if (frameCount > 1) {
+                        message.msg_control = controls[messageCount].buffer;
+                        message.msg_controllen = CMSG_SPACE (sizeof (util::ui16));
+                        cmsghdr *cmsg = CMSG_FIRSTHDR (&message);
+                        cmsg->cmsg_level = SOL_UDP;
+                        cmsg->cmsg_type = UDP_SEGMENT;
+                        cmsg->cmsg_len = CMSG_LEN (sizeof (util::ui16));
+                        util::ui16 gsoSize = (util::ui16)segmentLength;
+                        memcpy (CMSG_DATA (cmsg), &gsoSize, sizeof (gsoSize));
+                    }
+                    frameCounts[messageCount++] = frameCount;
+                }
+                int count = sendmmsg (handle, messages, (unsigned int)messageCount, MSG_NOSIGNAL);
+                if (count < 0) {
+                    THEKOGANS_UTIL_ERROR_CODE errorCode = THEKOGANS_UTIL_OS_ERROR_CODE;
+                    if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+                        // Wait for the next EPOLLOUT edge.
+                        break;
+                    }
+                    if (errorCode == EINTR) {
+                        continue;
+                    }
+                    if (gso && (errorCode == EIO || errorCode == EINVAL)) {
+                        // The device can't segment (no checksum offload).
+                        // Fall back to one datagram per message.
+                        gso = false;
+                        continue;
+                    }
+                    bool transient = IsTransientError (errorCode);
+                    if (transient) {
+                        // An ICMP error left over from an earlier datagram.
+                        // Note it (it's reported after sendMutex is released)
+                        // and keep flushing. Retry the message once, as the
+                        // error was consumed before it was sent.
+                        transientErrorCode = errorCode;
+                        if (!retried) {
+                            retried = true;
+                            continue;
+                        }
+                    }
+                    // Drop the first message, so that one
+                    // bad message can't wedge the queue.
+                    retried = false;
+                    for (std::size_t i = 0; i < frameCounts[0]; ++i) {
+                        queuedBytes -= sendQueue.front ().length;
+                        sendQueue.pop_front ();
+                    }
+                    if (transient) {
+                        continue;
+                    }
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                }
+                retried = false;
+                for (int i = 0; i < count; ++i) {
+                    for (std::size_t j = 0; j < frameCounts[i]; ++j) {
+                        queuedBytes -= sendQueue.front ().length;
+                        sendQueue.pop_front ();
+                    }
+                }
+            }
+        }
+
+        void UDPTunnel::ReportTransientError () {
+            THEKOGANS_UTIL_ERROR_CODE errorCode;
+            {
+                util::LockGuard<util::Mutex> guard (sendMutex);
+                errorCode = transientErrorCode;
+                transientErrorCode = 0;
+            }
+            if (errorCode != 0) {
+                THEKOGANS_UTIL_TRY {
+                    THEKOGANS_UTIL_THROW_ERROR_CODE_EXCEPTION (errorCode);
+                }
+                THEKOGANS_UTIL_CATCH (util::Exception) {
+                    eventSink.HandleTunnelError (*this, exception);
+                }
+            }
+        }
+
+    } // namespace packet
+} // namespace thekogans
+
+#endif // defined (TOOLCHAIN_OS_Linux)
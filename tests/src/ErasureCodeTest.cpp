@@ -0,0 +1,205 @@
+// Copyright 2016 Boris Kogan (boris@thekogans.net)
+//
+// This file is part of libthekogans_packet.
+//
+// libthekogans_packet is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// libthekogans_packet is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with libthekogans_packet. If not, see <http://www.gnu.org/licenses/>.
+
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include "thekogans/util/Types.h"
+#include "thekogans/util/Buffer.h"
+#include "thekogans/util/RandomSource.h"
+#include "thekogans/util/Exception.h"
+#include "thekogans/crypto/OpenSSLInit.h"
+#include "thekogans/crypto/SymmetricKey.h"
+#include "thekogans/crypto/Cipher.h"
+#include "thekogans/packet/ErasureCode.h"
+#include "thekogans/packet/KeyRing.h"
+#include "thekogans/packet/Tunnel.h"
+#include "thekogans/packet/PacketFragmentPacket.h"
+#include "thekogans/packet/FECPacketFragmentPacket.h"
+#include "thekogans/packet/FECFragmentPacketPacketFilter.h"
+#include "thekogans/packet/FECReassemblePacketFragmentsPacketFilter.h"
+
+using namespace thekogans;
+
+namespace {
+    #define CHECK(condition)\
+        if (!(condition)) {\
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition " failed." << std::endl;\
+            return false;\
+        }
+
+    std::size_t GetBitCount (util::ui32 value) {
+        std::size_t count = 0;
+        for (; value != 0; value &= value - 1) {
+            ++count;
+        }
+        return count;
+    }
+
+    // Encode random data shards, then lose every combination of up to
+    // parityShardCount + 1 shards. Decode must rebuild the data shards
+    // as long as no more than parityShardCount of them are lost.
+    bool TestErasureCode (
+            std::size_t dataShardCount,
+            std::size_t parityShardCount,
+            std::size_t shardLength) {
+        packet::ErasureCode erasureCode (dataShardCount, parityShardCount);
+        std::size_t shardCount = dataShardCount + parityShardCount;
+        std::vector<std::vector<util::ui8> > originalShards (
+            shardCount, std::vector<util::ui8> (shardLength));
+        std::vector<const util::ui8 *> dataShards (dataShardCount);
+        for (std::size_t i = 0; i < dataShardCount; ++i) {
+            util::RandomSource::Instance ()->GetBytes (&originalShards[i][0], shardLength);
+            dataShards[i] = &originalShards[i][0];
+        }
+        std::vector<util::ui8 *> parityShards (parityShardCount);
+        for (std::size_t i = 0; i < parityShardCount; ++i) {
+            parityShards[i] = &originalShards[dataShardCount + i][0];
+        }
+        erasureCode.Encode (&dataShards[0], &parityShards[0], shardLength);
+        for (util::ui32 lost = 0; lost < (1u << shardCount); ++lost) {
+            std::size_t lostCount = GetBitCount (lost);
+            if (lostCount <= parityShardCount + 1) {
+                std::vector<std::vector<util::ui8> > shards (originalShards);
+                std::vector<util::ui8 *> shardPtrs (shardCount);
+                bool present[packet::ErasureCode::MAX_SHARD_COUNT];
+                for (std::size_t i = 0; i < shardCount; ++i) {
+                    present[i] = (lost & (1u << i)) == 0;
+                    if (!present[i]) {
+                        memset (&shards[i][0], 0, shardLength);
+                    }
+                    shardPtrs[i] = &shards[i][0];
+                }
+                bool decoded = erasureCode.Decode (&shardPtrs[0], present, shardLength);
+                if (lostCount > parityShardCount) {
+                    CHECK (!decoded);
+                }
+                else {
+                    CHECK (decoded);
+                    for (std::size_t i = 0; i < dataShardCount; ++i) {
+                        CHECK (shards[i] == originalShards[i]);
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Collects the shards FECFragmentPacketPacketFilter sends.
+    struct LoopbackTunnel : public packet::Tunnel {
+        packet::PacketBatch packets;
+
+        LoopbackTunnel (
+            packet::KeyRing &keyRing,
+            EventSink &eventSink) :
+            packet::Tunnel (keyRing, eventSink) {}
+
+        virtual bool IsBackpressured () override {
+            return false;
+        }
+
+    protected:
+        virtual bool EnqueuePacket (
+                packet::Packet::SharedPtr packet,
+                crypto::Cipher::SharedPtr /*cipher*/) override {
+            packets.push_back (packet);
+            return true;
+        }
+    };
+
+    enum {
+        MAX_CIPHERTEXT_LENGTH = 1500,
+        PAYLOAD_LENGTH = 64 * 1024
+    };
+
+    // Fragment a large packet, lose lostShardCount shards in every group
+    // (data shards first, as they are the ones that need rebuilding), and
+    // feed the rest to the reassembler in reverse order.
+    bool TestFECFilters (
+            std::size_t groupSize,
+            std::size_t parityShardCount,
+            std::size_t lostShardCount) {
+        packet::KeyRing keyRing;
+        keyRing.AddCipher (
+            crypto::Cipher::SharedPtr (
+                new crypto::Cipher (crypto::SymmetricKey::FromRandom ())));
+        packet::Tunnel::EventSink eventSink;
+        LoopbackTunnel tunnel (keyRing, eventSink);
+        tunnel.outgoingFilters.AddFilter (
+            packet::PacketFilter::SharedPtr (
+                new packet::FECFragmentPacketPacketFilter (
+                    tunnel, MAX_CIPHERTEXT_LENGTH, groupSize, parityShardCount)));
+        std::vector<util::ui8> payload (PAYLOAD_LENGTH);
+        util::RandomSource::Instance ()->GetBytes (&payload[0], PAYLOAD_LENGTH);
+        util::Buffer::SharedPtr fragment (new util::Buffer (util::NetworkEndian, PAYLOAD_LENGTH));
+        fragment->Write (&payload[0], PAYLOAD_LENGTH);
+        tunnel.SendPacket (
+            packet::Packet::SharedPtr (new packet::PacketFragmentPacket (1, 1, fragment)));
+        CHECK (tunnel.packets.size () > groupSize + parityShardCount);
+        packet::FECReassemblePacketFragmentsPacketFilter reassembler;
+        packet::Packet::SharedPtr reassembledPacket;
+        for (std::size_t i = tunnel.packets.size (); i-- > 0;) {
+            CHECK (tunnel.packets[i]->Type () == packet::FECPacketFragmentPacket::TYPE);
+            const packet::FECPacketFragmentPacket &shard =
+                *static_cast<const packet::FECPacketFragmentPacket *> (tunnel.packets[i].Get ());
+            if (shard.shardIndex >= lostShardCount) {
+                packet::Packet::SharedPtr packet =
+                    packet::PacketFilter::CallFilterPacket (reassembler, tunnel.packets[i]);
+                if (packet.Get () != 0) {
+                    CHECK (reassembledPacket.Get () == 0);
+                    reassembledPacket = packet;
+                }
+            }
+        }
+        if (lostShardCount > parityShardCount) {
+            CHECK (reassembledPacket.Get () == 0);
+        }
+        else {
+            CHECK (reassembledPacket.Get () != 0);
+            CHECK (reassembledPacket->Type () == packet::PacketFragmentPacket::TYPE);
+            const util::Buffer &reassembledFragment =
+                *static_cast<const packet::PacketFragmentPacket *> (
+                    reassembledPacket.Get ())->fragment;
+            CHECK (reassembledFragment.GetDataAvailableForReading () == PAYLOAD_LENGTH);
+            CHECK (memcmp (reassembledFragment.GetReadPtr (), &payload[0], PAYLOAD_LENGTH) == 0);
+        }
+        return true;
+    }
+}
+
+int main (
+        int /*argc*/,
+        const char * /*argv*/ []) {
+    crypto::OpenSSLInit openSSLInit;
+    bool passed = false;
+    THEKOGANS_UTIL_TRY {
+        passed =
+            TestErasureCode (1, 1, 64) &&
+            TestErasureCode (8, 1, 256) &&
+            TestErasureCode (10, 4, 256) &&
+            TestFECFilters (8, 1, 0) &&
+            TestFECFilters (8, 1, 1) &&
+            TestFECFilters (8, 1, 2) &&
+            TestFECFilters (6, 3, 3) &&
+            TestFECFilters (6, 3, 4);
+    }
+    THEKOGANS_UTIL_CATCH (util::Exception) {
+        std::cerr << exception.Report () << std::endl;
+    }
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed ? 0 : 1;
+}